@@ -2,36 +2,58 @@
 #define APP_H
 
 #include <Application.h>
-#include <List.h>
-#include <Directory.h>
-#include <Entry.h>
-#include <Node.h>
 #include <MessageRunner.h>
 
-class App: public BApplication
+#include "NodeMonitorWatch.h"
+#include "SyncEngine.h"
+#include "SyncStatus.h"
+#include "SyncTransport.h"
+#include "TransferQueue.h"
+
+/*
+* Runs the SyncEngine on Haiku: node monitor messages and
+* the transfers' replies come in as messages, and go to
+* the engine, whose requests go to the TransferQueue.
+*/
+class App: public BApplication, public SyncTransport
 {
 public:
   App(void);
+  ~App(void);
   void MessageReceived(BMessage *msg);
+  bool QuitRequested(void);
+
+  void Send(const SyncRequest *request);
+  void DeltaFinished(bool ok, bool changed);
 private:
-  BList tracked_files; // BFile*
-  BList tracked_filepaths; //BPath*
-
-  //Lists for ignoring messages
-  BList removed_paths; //BPath*
-  bool ignore_removed(BPath *path);
-  BList edited_paths; //BPath*
-  bool ignore_edited(BPath *path);
-  BList new_paths; //BPath*
-  bool ignore_created(BPath *path);
-
-  BMessageRunner *msg_runner;
-  int32 find_nref_in_tracked_files(node_ref target);
-  void recursive_watch(BDirectory *dir);
-  void track_file(BEntry *new_file);
-  int parse_command(BString command);
-  void pull_and_apply_deltas();
+  NodeMonitorWatch node_monitor;
+  SyncEngine *engine;
+
+  void schedule_echo_sweep();
+
+  bool quiet_check_due;
+  void schedule_quiet_check();
+
+  TransferQueue *transfers;
+  void upload_done(BMessage *reply);
+  void delta_page_done(BMessage *reply);
+  void download_done(BMessage *reply);
+
+  //what hdbstatus would say, for a 'DBST' message
+  bigtime_t started;
+  bigtime_t delta_finished; //when the delta was last pulled in full, -1 if never
+  RateMeter uploaded;
+  RateMeter downloaded;
+  void answer_status(BMessage *msg);
+
+  //waiting to hear from Dropbox that there's more
+  TransferLane *notify_lane; //its own worker, for the long poll
+  bool longpoll_waiting;
+  bigtime_t longpoll_after; //not before then, if Dropbox said to back off
+  bigtime_t poll_interval; //for when long polls don't work
+  void wait_for_changes();
+  void longpoll_done(BMessage *reply);
+  void schedule_poll();
 };
 
 #endif
-
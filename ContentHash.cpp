@@ -0,0 +1,363 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ContentHash.h"
+#include "Trace.h"
+
+//the SHA instructions need a compiler that knows them
+#if defined(__GNUC__) && __GNUC__ >= 5 && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SHA_NI 1
+#include <immintrin.h>
+#endif
+
+const int MAX_HASH_THREADS = 64;
+
+static const uint32_t K[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t
+ror(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+/*
+* Run the compression function over whole 64 byte blocks.
+*/
+static void
+sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+  uint32_t w[64];
+  while(blocks-- > 0)
+  {
+    for(int i = 0; i < 16; i++)
+      w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16
+        | (uint32_t)data[i * 4 + 2] << 8 | (uint32_t)data[i * 4 + 3];
+    for(int i = 16; i < 64; i++)
+    {
+      uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for(int i = 0; i < 64; i++)
+    {
+      uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+      uint32_t ch = (e & f) ^ (~e & g);
+      uint32_t t1 = h + s1 + ch + K[i] + w[i];
+      uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+      uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      uint32_t t2 = s0 + maj;
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    data += 64;
+  }
+}
+
+#ifdef HAVE_SHA_NI
+/*
+* The same with the SHA extensions, four rounds per
+* pair of sha256rnds2, the state kept as ABEF and CDGH.
+*/
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+  const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); //ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0); //CDGH
+
+  while(blocks-- > 0)
+  {
+    __m128i abef = state0, cdgh = state1;
+    __m128i w[4];
+    for(int i = 0; i < 16; i++)
+    {
+      __m128i msg;
+      if(i < 4)
+        msg = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i * 16)), swap);
+      else
+      {
+        msg = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+        msg = _mm_add_epi32(msg, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+        msg = _mm_sha256msg2_epu32(msg, w[(i + 3) & 3]);
+      }
+      w[i & 3] = msg;
+      msg = _mm_add_epi32(msg, _mm_loadu_si128((const __m128i*)&K[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B); //FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1); //DCHG
+  _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0)); //DCBA
+  _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8)); //HGFE
+}
+#endif
+
+typedef void (*blocks_function)(uint32_t state[8], const uint8_t *data, size_t blocks);
+
+static bool
+cpu_has_sha(void)
+{
+#ifdef HAVE_SHA_NI
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#else
+  return false;
+#endif
+}
+
+static blocks_function
+pick_blocks_function(bool simd)
+{
+#ifdef HAVE_SHA_NI
+  if(simd && cpu_has_sha())
+    return sha256_blocks_shani;
+#endif
+  return sha256_blocks_generic;
+}
+
+static blocks_function sha256_blocks = pick_blocks_function(true);
+
+bool
+sha256_simd_available(void)
+{
+  return cpu_has_sha();
+}
+
+/*
+* For comparing the two, the SHA instructions are used
+* (when the CPU has them) unless this says not to.
+*/
+void
+sha256_use_simd(bool use)
+{
+  sha256_blocks = pick_blocks_function(use);
+}
+
+void
+sha256_init(Sha256 *sha)
+{
+  static const uint32_t initial[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(sha->state, initial, sizeof(initial));
+  sha->length = 0;
+  sha->used = 0;
+}
+
+void
+sha256_update(Sha256 *sha, const void *data, size_t size)
+{
+  const uint8_t *pos = (const uint8_t*)data;
+  sha->length += size;
+  if(sha->used > 0)
+  {
+    size_t take = 64 - sha->used;
+    if(take > size)
+      take = size;
+    memcpy(sha->buffer + sha->used, pos, take);
+    sha->used += take;
+    pos += take;
+    size -= take;
+    if(sha->used < 64)
+      return;
+    sha256_blocks(sha->state, sha->buffer, 1);
+    sha->used = 0;
+  }
+  if(size >= 64)
+  {
+    sha256_blocks(sha->state, pos, size / 64);
+    pos += size & ~(size_t)63;
+    size &= 63;
+  }
+  memcpy(sha->buffer, pos, size);
+  sha->used = size;
+}
+
+void
+sha256_final(Sha256 *sha, uint8_t digest[32])
+{
+  uint64_t bits = sha->length * 8;
+  uint8_t pad[72];
+  size_t pad_size = (sha->used < 56 ? 56 : 120) - sha->used;
+  memset(pad, 0, sizeof(pad));
+  pad[0] = 0x80;
+  for(int i = 0; i < 8; i++)
+    pad[pad_size + i] = (uint8_t)(bits >> (56 - i * 8));
+  sha256_update(sha, pad, pad_size + 8);
+  for(int i = 0; i < 8; i++)
+  {
+    digest[i * 4] = (uint8_t)(sha->state[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(sha->state[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(sha->state[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)sha->state[i];
+  }
+}
+
+//shared by the threads hashing one file
+struct HashJob
+{
+  int fd;
+  off_t size;
+  size_t block_count;
+  size_t next_block;
+  pthread_mutex_t lock;
+  uint8_t (*digests)[32];
+  int error;
+};
+
+/*
+* Take the next block nobody has started on,
+* read and hash it, until there are none left.
+*/
+static void *
+hash_blocks(void *data)
+{
+  HashJob *job = (HashJob*)data;
+  uint8_t *buffer = (uint8_t*)malloc(CONTENT_HASH_BLOCK);
+  if(buffer == NULL)
+  {
+    pthread_mutex_lock(&job->lock);
+    job->error = ENOMEM;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+  }
+
+  while(true)
+  {
+    pthread_mutex_lock(&job->lock);
+    size_t block = job->next_block++;
+    bool stop = job->error != 0 || block >= job->block_count;
+    pthread_mutex_unlock(&job->lock);
+    if(stop)
+      break;
+
+    off_t offset = (off_t)block * CONTENT_HASH_BLOCK;
+    size_t want = CONTENT_HASH_BLOCK;
+    if(job->size - offset < (off_t)want)
+      want = (size_t)(job->size - offset);
+    size_t got = 0;
+    int err = 0;
+    while(got < want)
+    {
+      ssize_t len = pread(job->fd, buffer + got, want - got, offset + got);
+      if(len < 0 && errno == EINTR)
+        continue;
+      if(len <= 0)
+      {
+        err = len < 0 ? errno : EIO; //shrank under us
+        break;
+      }
+      got += len;
+    }
+    if(err != 0)
+    {
+      pthread_mutex_lock(&job->lock);
+      job->error = err;
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+
+    Sha256 sha;
+    sha256_init(&sha);
+    sha256_update(&sha, buffer, got);
+    sha256_final(&sha, job->digests[block]);
+  }
+  free(buffer);
+  return NULL;
+}
+
+int
+content_hash_fd(int fd, char *hex, int threads)
+{
+  TraceSpan span(TRACE_HASH);
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+    return errno;
+
+  HashJob job;
+  job.fd = fd;
+  job.size = st.st_size;
+  job.block_count = (size_t)((st.st_size + CONTENT_HASH_BLOCK - 1) / CONTENT_HASH_BLOCK);
+  job.next_block = 0;
+  job.error = 0;
+  job.digests = (uint8_t(*)[32])malloc(job.block_count * 32 + 1);
+  if(job.digests == NULL)
+    return ENOMEM;
+  pthread_mutex_init(&job.lock, NULL);
+
+  if(threads <= 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > MAX_HASH_THREADS)
+    threads = MAX_HASH_THREADS;
+  if((size_t)threads > job.block_count)
+    threads = (int)job.block_count;
+
+  //this thread does its share too
+  pthread_t helpers[MAX_HASH_THREADS];
+  int started = 0;
+  for(int i = 1; i < threads; i++)
+  {
+    if(pthread_create(&helpers[started], NULL, hash_blocks, &job) == 0)
+      started++;
+  }
+  hash_blocks(&job);
+  for(int i = 0; i < started; i++)
+    pthread_join(helpers[i], NULL);
+  pthread_mutex_destroy(&job.lock);
+
+  int err = job.error;
+  if(err == 0)
+  {
+    Sha256 sha;
+    uint8_t digest[32];
+    sha256_init(&sha);
+    sha256_update(&sha, job.digests, job.block_count * 32);
+    sha256_final(&sha, digest);
+    for(int i = 0; i < 32; i++)
+      sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+  free(job.digests);
+  return err;
+}
+
+int
+content_hash_file(const char *path, char *hex, int threads)
+{
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return errno;
+  int err = content_hash_fd(fd, hex, threads);
+  close(fd);
+  return err;
+}
@@ -0,0 +1,41 @@
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Dropbox's content_hash of a file: the SHA-256 of the
+* SHA-256s of each 4 MiB block, in hex. Two files with the
+* same content_hash have the same contents, so it tells us
+* when an upload or download wouldn't change anything.
+*
+* The blocks are hashed in parallel, each thread reading
+* its own with pread(), and with the SHA instructions
+* on x86 CPUs that have them.
+*/
+
+const size_t CONTENT_HASH_BLOCK = 4 * 1024 * 1024;
+const size_t CONTENT_HASH_LENGTH = 64; //hex digits, not counting the NUL
+
+struct Sha256
+{
+  uint32_t state[8];
+  uint64_t length; //bytes so far
+  uint8_t buffer[64];
+  size_t used; //bytes in buffer
+};
+
+void sha256_init(Sha256 *sha);
+void sha256_update(Sha256 *sha, const void *data, size_t size);
+void sha256_final(Sha256 *sha, uint8_t digest[32]);
+
+bool sha256_simd_available(void);
+void sha256_use_simd(bool use);
+
+//threads 0 means one per CPU, hex gets CONTENT_HASH_LENGTH + 1 chars
+//both return 0 or an errno
+int content_hash_fd(int fd, char *hex, int threads = 0);
+int content_hash_file(const char *path, char *hex, int threads = 0);
+
+#endif
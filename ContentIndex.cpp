@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "ContentIndex.h"
+
+#if defined(__linux__) && defined(__GLIBC__) \
+  && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+const size_t CONTENT_INITIAL_BUCKETS = 64;
+//what clone_file() copies at a time when it has to
+const size_t CLONE_PIECE = 1024 * 1024;
+
+struct ContentEntry
+{
+  ContentEntry *next; //hash chain
+  uint64_t key; //the start of the hash
+  dev_t device;
+  ino_t node;
+};
+
+static bool
+parse_hash(const char *hex, uint8_t *hash)
+{
+  if(hex == NULL || strlen(hex) != NODE_HASH_SIZE * 2)
+    return false;
+  for(size_t i = 0; i < NODE_HASH_SIZE * 2; i++)
+  {
+    char c = hex[i];
+    int digit = c >= '0' && c <= '9' ? c - '0'
+      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if(digit < 0)
+      return false;
+    if(i % 2 == 0)
+      hash[i / 2] = (uint8_t)(digit << 4);
+    else
+      hash[i / 2] |= (uint8_t)digit;
+  }
+  return true;
+}
+
+ContentIndex::ContentIndex(const NodeTable *table)
+  : table(table), buckets(NULL), bucket_count(CONTENT_INITIAL_BUCKETS),
+    count(0)
+{
+  buckets = (ContentEntry**)calloc(bucket_count, sizeof(ContentEntry*));
+}
+
+ContentIndex::~ContentIndex(void)
+{
+  MakeEmpty();
+  free(buckets);
+}
+
+//the hash is already as good as random, so its start will do
+uint64_t
+ContentIndex::key_of(const uint8_t *hash)
+{
+  uint64_t key;
+  memcpy(&key, hash, sizeof(key));
+  return key;
+}
+
+void
+ContentIndex::MakeEmpty(void)
+{
+  for(size_t b = 0; buckets != NULL && b < bucket_count; b++)
+  {
+    while(buckets[b] != NULL)
+    {
+      ContentEntry *entry = buckets[b];
+      buckets[b] = entry->next;
+      free(entry);
+    }
+  }
+  count = 0;
+}
+
+void
+ContentIndex::grow(void)
+{
+  size_t old_count = bucket_count;
+  ContentEntry **new_buckets = (ContentEntry**)calloc(old_count * 2,
+    sizeof(ContentEntry*));
+  if(new_buckets == NULL)
+    return;
+  bucket_count = old_count * 2;
+  for(size_t b = 0; b < old_count; b++)
+  {
+    while(buckets[b] != NULL)
+    {
+      ContentEntry *entry = buckets[b];
+      buckets[b] = entry->next;
+      size_t to = bucket_for(entry->key);
+      entry->next = new_buckets[to];
+      new_buckets[to] = entry;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+}
+
+/*
+* The record an entry is for, if it's still a file with
+* the hash (or with NULL, any hash starting with the key).
+*/
+NodeRecord *
+ContentIndex::record_of(const ContentEntry *entry, const uint8_t *hash) const
+{
+  NodeRecord *record = table->Find(entry->device, entry->node);
+  if(record == NULL || record->directory || record->sync == NULL
+    || !record->sync->has_hash)
+    return NULL;
+  if(hash != NULL)
+    return memcmp(record->sync->hash, hash, NODE_HASH_SIZE) == 0 ? record
+      : NULL;
+  return key_of(record->sync->hash) == entry->key ? record : NULL;
+}
+
+//drop every entry that's gone stale
+void
+ContentIndex::prune(void)
+{
+  for(size_t b = 0; buckets != NULL && b < bucket_count; b++)
+  {
+    ContentEntry **link = &buckets[b];
+    while(*link != NULL)
+    {
+      ContentEntry *entry = *link;
+      if(record_of(entry, NULL) != NULL)
+      {
+        link = &entry->next;
+        continue;
+      }
+      *link = entry->next;
+      free(entry);
+      count--;
+    }
+  }
+}
+
+void
+ContentIndex::Add(const NodeRecord *record)
+{
+  if(buckets == NULL || record->directory || record->sync == NULL
+    || !record->sync->has_hash)
+    return;
+  uint64_t key = key_of(record->sync->hash);
+  for(ContentEntry *entry = buckets[bucket_for(key)]; entry != NULL;
+    entry = entry->next)
+  {
+    if(entry->key == key && entry->node == record->node
+      && entry->device == record->device)
+      return;
+  }
+  if(count >= table->CountItems() * 2 + CONTENT_INITIAL_BUCKETS)
+    prune();
+  ContentEntry *entry = (ContentEntry*)malloc(sizeof(ContentEntry));
+  if(entry == NULL)
+    return;
+  entry->key = key;
+  entry->device = record->device;
+  entry->node = record->node;
+  size_t b = bucket_for(key);
+  entry->next = buckets[b];
+  buckets[b] = entry;
+  if(++count > bucket_count)
+    grow();
+}
+
+void
+ContentIndex::Rebuild(void)
+{
+  MakeEmpty();
+  size_t bucket;
+  for(NodeRecord *record = table->First(&bucket); record != NULL;
+    record = table->Next(&bucket, record))
+    Add(record);
+}
+
+NodeRecord *
+ContentIndex::Find(const char *hex)
+{
+  uint8_t hash[NODE_HASH_SIZE];
+  if(buckets == NULL || !parse_hash(hex, hash))
+    return NULL;
+  uint64_t key = key_of(hash);
+  ContentEntry **link = &buckets[bucket_for(key)];
+  while(*link != NULL)
+  {
+    ContentEntry *entry = *link;
+    if(entry->key != key)
+    {
+      link = &entry->next;
+      continue;
+    }
+    NodeRecord *record = record_of(entry, hash);
+    if(record != NULL)
+      return record;
+    //removed, or changed since
+    *link = entry->next;
+    free(entry);
+    count--;
+  }
+  return NULL;
+}
+
+void
+ContentIndex::Forget(const NodeRecord *record, const char *hex)
+{
+  uint8_t hash[NODE_HASH_SIZE];
+  if(buckets == NULL || !parse_hash(hex, hash))
+    return;
+  uint64_t key = key_of(hash);
+  for(ContentEntry **link = &buckets[bucket_for(key)]; *link != NULL;
+    link = &(*link)->next)
+  {
+    ContentEntry *entry = *link;
+    if(entry->key == key && entry->node == record->node
+      && entry->device == record->device)
+    {
+      *link = entry->next;
+      free(entry);
+      count--;
+      return;
+    }
+  }
+}
+
+/*
+* The new file shares the old one's blocks if the
+* filesystem can do that (FICLONE, on btrfs or xfs say),
+* or is copied in the kernel with copy_file_range(), or
+* failing both, read and written a piece at a time.
+*/
+int
+clone_file(const char *from, const char *to, int64_t *size, bool *cloned)
+{
+  *size = 0;
+  *cloned = false;
+  int in = open(from, O_RDONLY);
+  if(in < 0)
+    return errno;
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out < 0)
+  {
+    int err = errno;
+    close(in);
+    return err;
+  }
+
+  int err = 0;
+#ifdef FICLONE
+  if(ioctl(out, FICLONE, in) == 0)
+  {
+    struct stat st;
+    *cloned = true;
+    if(fstat(out, &st) == 0)
+      *size = st.st_size;
+    else
+      err = errno;
+    close(in);
+    if(close(out) != 0 && err == 0)
+      err = errno;
+    return err;
+  }
+#endif
+
+  bool in_kernel = false;
+#ifdef HAVE_COPY_FILE_RANGE
+  in_kernel = true;
+  while(true)
+  {
+    ssize_t copied = copy_file_range(in, NULL, out, NULL, CLONE_PIECE * 64, 0);
+    if(copied < 0 && errno == EINTR)
+      continue;
+    if(copied < 0 && *size == 0 && (errno == ENOSYS || errno == EXDEV
+      || errno == EINVAL || errno == EOPNOTSUPP))
+    {
+      in_kernel = false; //not between these two
+      break;
+    }
+    if(copied < 0)
+      err = errno;
+    if(copied <= 0)
+      break;
+    *size += copied;
+  }
+#endif
+
+  char *buffer = in_kernel ? NULL : (char*)malloc(CLONE_PIECE);
+  if(!in_kernel && buffer == NULL)
+    err = ENOMEM;
+  while(!in_kernel && err == 0)
+  {
+    ssize_t got = read(in, buffer, CLONE_PIECE);
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got < 0)
+      err = errno;
+    if(got <= 0)
+      break;
+    for(ssize_t written = 0; written < got && err == 0; )
+    {
+      ssize_t put = write(out, buffer + written, got - written);
+      if(put < 0 && errno == EINTR)
+        continue;
+      if(put <= 0)
+        err = put < 0 ? errno : EIO;
+      else
+        written += put;
+    }
+    *size += got;
+  }
+  free(buffer);
+  close(in);
+  if(close(out) != 0 && err == 0)
+    err = errno;
+  return err;
+}
@@ -0,0 +1,66 @@
+#ifndef CONTENT_INDEX_H
+#define CONTENT_INDEX_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "NodeTable.h"
+
+struct ContentEntry;
+
+/*
+* The tracked files, found by content_hash, so a file
+* Dropbox sends that we already have a copy of somewhere
+* else in the folder (the same jingle in every station's
+* folder, say) can be copied rather than downloaded.
+*
+* Entries only hold the (device, node) of a record in the
+* NodeTable and the start of its hash. Nothing has to be
+* told when a record is removed or its hash changes: Find()
+* checks the record still has the hash, dropping entries
+* that have gone stale, and Add() clears them all out once
+* there are as many again as there are records. Whether
+* the file itself is still what the record says is for the
+* caller to check.
+*/
+class ContentIndex
+{
+public:
+  ContentIndex(const NodeTable *table);
+  ~ContentIndex(void);
+
+  //index a file record under its content_hash, if it has one
+  void Add(const NodeRecord *record);
+  //every file record in the table
+  void Rebuild(void);
+  void MakeEmpty(void);
+  //a record with the content_hash (in hex), NULL if none
+  NodeRecord *Find(const char *hex);
+  //takes the record out from under the hash, so Find() gives
+  //the next one with it
+  void Forget(const NodeRecord *record, const char *hex);
+
+  size_t CountItems(void) const { return count; }
+
+private:
+  static uint64_t key_of(const uint8_t *hash);
+  size_t bucket_for(uint64_t key) const
+    { return (size_t)key & (bucket_count - 1); }
+  void grow(void);
+  void prune(void);
+  NodeRecord *record_of(const ContentEntry *entry, const uint8_t *hash) const;
+
+  const NodeTable *table;
+  ContentEntry **buckets;
+  size_t bucket_count; //always a power of two
+  size_t count;
+};
+
+//copy a file's contents to a new file at to, sharing its
+//blocks where the filesystem can; returns 0 or an errno,
+//with the bytes copied in size
+int clone_file(const char *from, const char *to, int64_t *size,
+  bool *cloned);
+
+#endif
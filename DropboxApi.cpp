@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "DropboxApi.h"
+#include "Throttle.h"
+
+static const char *const HOST_NAMES[DROPBOX_HOSTS] =
+  { "api.dropboxapi.com", "content.dropboxapi.com", "notify.dropboxapi.com" };
+
+//a long poll can be held open for up to 480 seconds plus up
+//to 90 that Dropbox adds, so the notify host gets longer
+const int API_TIMEOUT = 120;
+const int NOTIFY_TIMEOUT = 600;
+
+struct ApiServer
+{
+  bool secure;
+  char host[256];
+  int port;
+};
+
+/*
+* Where a host's endpoints are: on Dropbox, or all on the
+* server DBFORHAIKU_SERVER names, like http://127.0.0.1:8765.
+*/
+static void
+find_server(int host, ApiServer *server)
+{
+  const char *url = getenv("DBFORHAIKU_SERVER");
+  if(url == NULL || url[0] == '\0')
+  {
+    server->secure = true;
+    snprintf(server->host, sizeof(server->host), "%s", HOST_NAMES[host]);
+    server->port = 443;
+    return;
+  }
+  server->secure = strncmp(url, "https://", 8) == 0;
+  const char *start = strstr(url, "://");
+  start = start != NULL ? start + 3 : url;
+  size_t length = strcspn(start, ":/");
+  if(length >= sizeof(server->host))
+    length = sizeof(server->host) - 1;
+  memcpy(server->host, start, length);
+  server->host[length] = '\0';
+  server->port = start[length] == ':' ? atoi(start + length + 1)
+    : server->secure ? 443 : 80;
+}
+
+bool
+DropboxApi::Reachable(void)
+{
+#ifdef HTTP_TLS
+  return true;
+#else
+  ApiServer server;
+  find_server(DROPBOX_API_HOST, &server);
+  return !server.secure;
+#endif
+}
+
+DropboxApi::DropboxApi(const char *token, Throttle *throttle)
+  : throttle(throttle),
+    error_status(0),
+    error_message(NULL),
+    error(NULL)
+{
+  size_t size = strlen(token) + 32;
+  this->authorization = (char*)malloc(size);
+  if(this->authorization != NULL)
+    snprintf(this->authorization, size, "Authorization: Bearer %s\r\n",
+      token);
+}
+
+DropboxApi::~DropboxApi(void)
+{
+  free(this->authorization);
+  free(this->error_message);
+  json_free(this->error);
+}
+
+void
+DropboxApi::Close(void)
+{
+  for(int host = 0; host < DROPBOX_HOSTS; host++)
+    this->connections[host].Close();
+}
+
+const char *
+DropboxApi::Message(void) const
+{
+  return this->error_message != NULL ? this->error_message : "out of memory";
+}
+
+//"HTTP <status>: <body>", and the error a 409 carries
+void
+DropboxApi::set_error(int status, const char *body, size_t length)
+{
+  free(this->error_message);
+  json_free(this->error);
+  this->error = NULL;
+  this->error_status = status;
+  this->error_message = (char*)malloc(length + 32);
+  if(this->error_message != NULL)
+    snprintf(this->error_message, length + 32, "HTTP %d: %.*s", status,
+      (int)length, body);
+  if(status != 409)
+    return;
+  JsonValue *value = json_parse(body, length);
+  JsonValue **member = value != NULL ? &value->first : NULL;
+  while(member != NULL && *member != NULL)
+  {
+    if(strcmp((*member)->key, "error") == 0)
+    {
+      //taken out of the body, which is freed
+      this->error = *member;
+      *member = this->error->next;
+      this->error->next = NULL;
+      break;
+    }
+    member = &(*member)->next;
+  }
+  json_free(value);
+}
+
+//"HTTP 0: <host>: <what went wrong>", as db_api.py has it
+void
+DropboxApi::network_error(int host, const char *what)
+{
+  json_free(this->error);
+  this->error = NULL;
+  this->error_status = 0;
+  free(this->error_message);
+  size_t size = strlen(HOST_NAMES[host]) + strlen(what) + 16;
+  this->error_message = (char*)malloc(size);
+  if(this->error_message != NULL)
+    snprintf(this->error_message, size, "HTTP 0: %s: %s", HOST_NAMES[host],
+      what);
+}
+
+/*
+* Send one request and read the status and headers of its
+* answer. A kept-alive connection the server has since
+* closed shows up as an error on first use, so it's tried
+* once more on a new one. A file body is sent again from
+* the same offset.
+*/
+int
+DropboxApi::request(int host, const char *route, const char *headers,
+  const char *body, size_t length, int file, off_t offset, int64_t file_length)
+{
+  HttpConnection *connection = &this->connections[host];
+  char path[256];
+  snprintf(path, sizeof(path), "/2/%s", route);
+  int err = 0;
+  for(int attempts = 2; attempts > 0; attempts--)
+  {
+    if(!connection->Connected())
+    {
+      ApiServer server;
+      find_server(host, &server);
+      err = connection->Connect(server.host, server.port, server.secure,
+        host == DROPBOX_NOTIFY_HOST ? NOTIFY_TIMEOUT : API_TIMEOUT);
+      if(err != 0)
+        break;
+    }
+    if(file >= 0)
+      err = connection->SendFile(path, headers, file, offset, file_length,
+        this->throttle);
+    else
+      err = connection->Send(path, headers, body, length);
+    if(err == 0)
+      err = connection->ReadHeaders();
+    if(err == 0)
+      return API_OK;
+    connection->Close();
+    if(err == EIO || err == ENOMEM)
+      break; //the file, not the connection
+  }
+  network_error(host, strerror(err));
+  return API_FAILED;
+}
+
+//the whole body of the answer, failing if it isn't a 200
+int
+DropboxApi::finish(int host, char **body, size_t *length)
+{
+  HttpConnection *connection = &this->connections[host];
+  int err = connection->ReadBody(body, length);
+  if(err != 0)
+  {
+    network_error(host, strerror(err));
+    return API_FAILED;
+  }
+  if(connection->Status() != 200)
+  {
+    set_error(connection->Status(), *body, *length);
+    free(*body);
+    *body = NULL;
+    return API_FAILED;
+  }
+  return API_OK;
+}
+
+//an endpoint taking and answering JSON in the body
+int
+DropboxApi::call(int host, const char *route, const char *arg, bool authorize,
+  JsonValue **result)
+{
+  *result = NULL;
+  char headers[4096];
+  snprintf(headers, sizeof(headers), "%sContent-Type: application/json\r\n",
+    authorize && this->authorization != NULL ? this->authorization : "");
+  if(request(host, route, headers, arg, strlen(arg), -1, 0, 0) != API_OK)
+    return API_FAILED;
+  char *body;
+  size_t length;
+  if(finish(host, &body, &length) != API_OK)
+    return API_FAILED;
+  if(length > 0 && (*result = json_parse(body, length)) == NULL)
+  {
+    set_error(200, body, length);
+    free(body);
+    return API_FAILED;
+  }
+  free(body);
+  return API_OK;
+}
+
+int
+DropboxApi::Rpc(const char *route, const char *arg, JsonValue **result)
+{
+  return call(DROPBOX_API_HOST, route, arg, true, result);
+}
+
+int
+DropboxApi::Notify(const char *route, const char *arg, JsonValue **result)
+{
+  return call(DROPBOX_NOTIFY_HOST, route, arg, false, result);
+}
+
+//the headers of a content endpoint, arg in Dropbox-API-Arg
+static char *
+content_headers(const char *authorization, const char *arg, const char *more)
+{
+  if(authorization == NULL)
+    return NULL;
+  size_t size = strlen(authorization) + strlen(arg) + strlen(more) + 128;
+  char *headers = (char*)malloc(size);
+  if(headers != NULL)
+    snprintf(headers, size, "%sDropbox-API-Arg: %s\r\n%s", authorization,
+      arg, more);
+  return headers;
+}
+
+int
+DropboxApi::Upload(const char *route, const char *arg, int file,
+  off_t offset, int64_t length, JsonValue **result)
+{
+  *result = NULL;
+  char *headers = content_headers(this->authorization, arg,
+    "Content-Type: application/octet-stream\r\n");
+  if(headers == NULL)
+  {
+    network_error(DROPBOX_CONTENT_HOST, strerror(ENOMEM));
+    return API_FAILED;
+  }
+  int status = request(DROPBOX_CONTENT_HOST, route, headers, NULL, 0, file,
+    offset, length);
+  free(headers);
+  if(status != API_OK)
+    return status;
+  char *body;
+  size_t body_length;
+  if(finish(DROPBOX_CONTENT_HOST, &body, &body_length) != API_OK)
+    return API_FAILED;
+  *result = json_parse(body, body_length);
+  if(*result == NULL)
+  {
+    set_error(200, body, body_length);
+    free(body);
+    return API_FAILED;
+  }
+  free(body);
+  return API_OK;
+}
+
+int
+DropboxApi::Download(const char *route, const char *arg, int file,
+  int64_t start, volatile int *stop, JsonValue **result)
+{
+  *result = NULL;
+  char range[64] = "";
+  if(start > 0)
+    snprintf(range, sizeof(range), "Range: bytes=%lld-\r\n",
+      (long long)start);
+  char *headers = content_headers(this->authorization, arg, range);
+  if(headers == NULL)
+  {
+    network_error(DROPBOX_CONTENT_HOST, strerror(ENOMEM));
+    return API_FAILED;
+  }
+  int status = request(DROPBOX_CONTENT_HOST, route, headers, "", 0, -1, 0, 0);
+  free(headers);
+  if(status != API_OK)
+    return status;
+
+  HttpConnection *connection = &this->connections[DROPBOX_CONTENT_HOST];
+  char *body;
+  size_t length;
+  if(connection->Status() != 200 && connection->Status() != 206)
+  {
+    finish(DROPBOX_CONTENT_HOST, &body, &length);
+    return API_FAILED;
+  }
+  const char *metadata = connection->Header("dropbox-api-result");
+  if(metadata == NULL
+    || (*result = json_parse(metadata, strlen(metadata))) == NULL)
+  {
+    connection->Close();
+    set_error(connection->Status(), "no Dropbox-API-Result", 21);
+    return API_FAILED;
+  }
+  //all of it came, from the start
+  if(connection->Status() == 200 && ftruncate(file, 0) != 0)
+  {
+    connection->Close();
+    network_error(DROPBOX_CONTENT_HOST, strerror(errno));
+    return API_FAILED;
+  }
+  lseek(file, 0, SEEK_END);
+
+  int64_t expected = connection->ContentLength();
+  int64_t received;
+  int err = connection->CopyBody(file, &received, this->throttle, stop);
+  if(err == 0 && expected >= 0 && received < expected)
+  {
+    connection->Close();
+    char message[128];
+    snprintf(message, sizeof(message), "cut off after %lld of %lld bytes",
+      (long long)received, (long long)expected);
+    network_error(DROPBOX_CONTENT_HOST, message);
+    err = EPIPE;
+  }
+  else if(err != 0)
+    network_error(DROPBOX_CONTENT_HOST, strerror(err));
+  if(err == 0)
+    return API_OK;
+  json_free(*result);
+  *result = NULL;
+  return err == ECANCELED ? API_STOPPED : API_FAILED;
+}
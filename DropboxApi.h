@@ -0,0 +1,94 @@
+#ifndef DROPBOX_API_H
+#define DROPBOX_API_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "HttpConnection.h"
+#include "Json.h"
+
+class Throttle;
+
+//which host an endpoint is on
+enum
+{
+  DROPBOX_API_HOST = 0,
+  DROPBOX_CONTENT_HOST,
+  DROPBOX_NOTIFY_HOST,
+  DROPBOX_HOSTS
+};
+
+//what the calls return
+enum
+{
+  API_OK = 0,
+  API_FAILED, //Status() and Message() say why
+  API_STOPPED //a download stopped part way, as asked
+};
+
+/*
+* db_api.py in C++, for NativeWorker: a Dropbox API v2
+* client keeping one connection open to each host, whose
+* endpoints take their argument as JSON (see JsonWriter)
+* and answer with a tree of JsonValues (json_free() it).
+* File bodies go between the connection and the file
+* without coming through here (see HttpConnection).
+*
+* DBFORHAIKU_SERVER points every endpoint at one stand-in
+* server instead, as it does for db_api.py. Given a
+* Throttle, uploads and downloads keep to its limits.
+*
+* A failed call leaves its HTTP status (0 for network
+* problems) and message, "HTTP 409: <body>" say, as
+* db_api.py's ApiError has them, and for a 409 the error
+* the endpoint gave.
+*/
+class DropboxApi
+{
+public:
+  DropboxApi(const char *token, Throttle *throttle);
+  ~DropboxApi(void);
+
+  //whether this build can talk to the server (https
+  //takes TLS, see HttpConnection.h)
+  static bool Reachable(void);
+
+  int Rpc(const char *route, const char *arg, JsonValue **result);
+  //no access token, and it may not answer for minutes
+  int Notify(const char *route, const char *arg, JsonValue **result);
+  //sends length bytes of file from offset
+  int Upload(const char *route, const char *arg, int file, off_t offset,
+    int64_t length, JsonValue **result);
+  //writes the file, or given a start, only asks for what's
+  //after it and writes it after what file has; the result
+  //is the metadata from the Dropbox-API-Result header
+  int Download(const char *route, const char *arg, int file, int64_t start,
+    volatile int *stop, JsonValue **result);
+  void Close(void);
+
+  int Status(void) const { return error_status; }
+  const char *Message(void) const;
+  //the ".tag" of the endpoint's error, NULL if none
+  const char *Tag(void) const { return json_tag(error); }
+  const JsonValue *Error(void) const { return error; }
+
+private:
+  int request(int host, const char *route, const char *headers,
+    const char *body, size_t length, int file, off_t offset,
+    int64_t file_length);
+  int finish(int host, char **body, size_t *length);
+  int call(int host, const char *route, const char *arg, bool authorize,
+    JsonValue **result);
+  void set_error(int status, const char *body, size_t length);
+  void network_error(int host, const char *what);
+
+  char *authorization; //the header
+  Throttle *throttle;
+  HttpConnection connections[DROPBOX_HOSTS];
+  int error_status;
+  char *error_message;
+  JsonValue *error;
+};
+
+#endif
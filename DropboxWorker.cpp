@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "DropboxWorker.h"
+#include "Trace.h"
+#include <ByteOrder.h>
+
+const char * WORKER_OK = "OK";
+const char * WORKER_ERROR = "ERROR";
+const char * WORKER_PAUSED = "PAUSED";
+
+DropboxWorker::DropboxWorker(void)
+  : pid(-1), native(NULL), to_worker(-1), from_worker(-1)
+{
+}
+
+DropboxWorker::~DropboxWorker(void)
+{
+  Stop();
+}
+
+/*
+* Fork and exec `python db_worker.py` with pipes
+* on its stdin and stdout. Its stderr is shared with ours,
+* that's where its log messages go.
+*/
+status_t
+DropboxWorker::Start(void)
+{
+  if(pid >= 0 || native != NULL)
+    return B_OK;
+
+  //a dead worker shouldn't kill us when we write to it
+  signal(SIGPIPE, SIG_IGN);
+  if(native_transport())
+    return start_native();
+
+  int in_fd[2], out_fd[2];
+  if(pipe(in_fd) != 0)
+    return errno;
+  if(pipe(out_fd) != 0)
+  {
+    close(in_fd[0]);
+    close(in_fd[1]);
+    return errno;
+  }
+
+  pid = fork();
+  if(pid < 0)
+  {
+    status_t err = errno;
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+    return err;
+  }
+  if(pid == 0)
+  {
+    dup2(in_fd[0],STDIN_FILENO);
+    dup2(out_fd[1],STDOUT_FILENO);
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+
+    char * argv[3];
+    argv[0] = (char*)"python";
+    argv[1] = (char*)"db_worker.py";
+    argv[2] = NULL;
+    execvp("python",argv);
+    _exit(127);
+  }
+
+  close(in_fd[0]);
+  close(out_fd[1]);
+  to_worker = in_fd[1];
+  from_worker = out_fd[0];
+  //keep our ends out of workers started later, or
+  //closing its stdin wouldn't be enough to stop this one
+  fcntl(to_worker, F_SETFD, FD_CLOEXEC);
+  fcntl(from_worker, F_SETFD, FD_CLOEXEC);
+  TRACE(TRACE_INFO,"Started Dropbox worker, pid %d",pid);
+  return B_OK;
+}
+
+//the same pipes, with a NativeWorker's thread on the far ends
+status_t
+DropboxWorker::start_native(void)
+{
+  int in_fd[2], out_fd[2];
+  if(pipe(in_fd) != 0)
+    return errno;
+  if(pipe(out_fd) != 0)
+  {
+    status_t err = errno;
+    close(in_fd[0]);
+    close(in_fd[1]);
+    return err;
+  }
+  for(int i = 0; i < 2; i++)
+  {
+    fcntl(in_fd[i], F_SETFD, FD_CLOEXEC);
+    fcntl(out_fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  native = new NativeWorker();
+  status_t err = native->Start(in_fd[0],out_fd[1]);
+  if(err != 0)
+  {
+    delete native;
+    native = NULL;
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+    return err;
+  }
+  to_worker = in_fd[1];
+  from_worker = out_fd[0];
+  TRACE(TRACE_INFO,"Started Dropbox worker, native");
+  return B_OK;
+}
+
+/*
+* Close the worker's stdin, which makes it exit,
+* and wait for it to go away.
+*/
+void
+DropboxWorker::Stop(void)
+{
+  if(native != NULL)
+  {
+    close(to_worker);
+    close(from_worker);
+    delete native; //joins it
+    native = NULL;
+    to_worker = from_worker = -1;
+    return;
+  }
+  if(pid < 0)
+    return;
+  close(to_worker);
+  close(from_worker);
+  int status;
+  waitpid(pid, &status, 0);
+  pid = -1;
+  to_worker = from_worker = -1;
+}
+
+void
+DropboxWorker::Pause(void)
+{
+  if(native != NULL)
+    native->Pause();
+  else if(pid >= 0)
+    kill(pid,SIGUSR1);
+}
+
+status_t
+DropboxWorker::write_all(const void *buf, size_t size)
+{
+  const char *pos = (const char*)buf;
+  while(size > 0)
+  {
+    ssize_t written = write(to_worker,pos,size);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return B_IO_ERROR;
+    pos += written;
+    size -= written;
+  }
+  return B_OK;
+}
+
+status_t
+DropboxWorker::read_all(void *buf, size_t size)
+{
+  char *pos = (char*)buf;
+  while(size > 0)
+  {
+    ssize_t len = read(from_worker,pos,size);
+    if(len < 0 && errno == EINTR)
+      continue;
+    if(len <= 0)
+      return B_IO_ERROR;
+    pos += len;
+    size -= len;
+  }
+  return B_OK;
+}
+
+/*
+* Send a request (operation name followed by its arguments)
+* as one frame. Starts the worker if it isn't running.
+*/
+status_t
+DropboxWorker::Send(const char * argv[], int32 length)
+{
+  status_t err = Start();
+  if(err != B_OK)
+    return err;
+
+  //BString stops at NULs, so build the payload by hand
+  size_t total = 0;
+  for(int32 i = 0; i < length; i++)
+    total += strlen(argv[i]) + 1;
+  char *payload = (char*)malloc(total);
+  if(payload == NULL)
+    return B_NO_MEMORY;
+  char *pos = payload;
+  for(int32 i = 0; i < length; i++)
+  {
+    strcpy(pos,argv[i]);
+    pos += strlen(argv[i]) + 1;
+  }
+  total--; //no separator after the last field
+
+  uint32 size = B_HOST_TO_BENDIAN_INT32(total);
+  err = write_all(&size,4);
+  if(err == B_OK)
+    err = write_all(payload,total);
+  free(payload);
+  if(err != B_OK)
+  {
+    TRACE(TRACE_ERROR,"Dropbox worker went away, will restart it.");
+    Stop();
+  }
+  return err;
+}
+
+/*
+* Read the next frame from the worker.
+* Its first field goes in "tag", the rest in "field".
+*/
+status_t
+DropboxWorker::Receive(BMessage *frame)
+{
+  frame->MakeEmpty();
+  if(pid < 0 && native == NULL)
+    return B_NO_INIT;
+
+  uint32 size;
+  status_t err = read_all(&size,4);
+  size = B_BENDIAN_TO_HOST_INT32(size);
+  char *payload = NULL;
+  if(err == B_OK)
+  {
+    payload = (char*)malloc(size + 1);
+    if(payload == NULL)
+      err = B_NO_MEMORY;
+    else
+      err = read_all(payload,size);
+  }
+  if(err != B_OK)
+  {
+    free(payload);
+    TRACE(TRACE_ERROR,"Lost the Dropbox worker, will restart it.");
+    Stop();
+    return err;
+  }
+  payload[size] = '\0';
+
+  //fields are separated by NULs, and the end is a NUL too
+  const char *field = payload;
+  const char *end = payload + size;
+  frame->AddString("tag",field);
+  field += strlen(field) + 1;
+  while(field <= end)
+  {
+    frame->AddString("field",field);
+    field += strlen(field) + 1;
+  }
+  free(payload);
+  return B_OK;
+}
+
+/*
+* Send a request and wait for its final OK or ERROR frame,
+* which is left in reply. Item frames are skipped.
+* Returns B_OK only if the worker said OK.
+*/
+status_t
+DropboxWorker::Call(const char * argv[], int32 length, BMessage *reply)
+{
+  status_t err = Send(argv,length);
+  while(err == B_OK)
+  {
+    err = Receive(reply);
+    if(err != B_OK)
+      break;
+    BString tag;
+    reply->FindString("tag",&tag);
+    if(tag == WORKER_OK)
+      return B_OK;
+    if(tag == WORKER_ERROR)
+    {
+      TRACE(TRACE_ERROR,"%s failed: %s",argv[0],reply->GetString("field",""));
+      return B_ERROR;
+    }
+  }
+  reply->MakeEmpty();
+  return err;
+}
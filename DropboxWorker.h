@@ -0,0 +1,59 @@
+#ifndef DROPBOX_WORKER_H
+#define DROPBOX_WORKER_H
+
+#include <Message.h>
+#include <String.h>
+
+#include "NativeWorker.h"
+
+/*
+* Frame tags sent back by db_worker.py.
+* An item frame carries one piece of a longer answer
+* (a line of a delta), the OK or ERROR frame ends it.
+*/
+extern const char * WORKER_OK;
+extern const char * WORKER_ERROR;
+extern const char * WORKER_PAUSED;
+
+/*
+* The long-lived Python helper that talks to Dropbox.
+* Started once, then fed requests over a pipe,
+* so we don't pay for a new interpreter and
+* a new connection to Dropbox on every operation.
+*
+* Requests are an array of strings, the first being
+* the operation (put, get, rm, mv, mkdir, rm_batch,
+* mv_batch, mkdir_batch, delta_page, longpoll).
+* Replies are returned as a BMessage with the frame
+* tag in "tag" and the rest in the "field" strings.
+*
+* With DBFORHAIKU_TRANSPORT set to "native", a
+* NativeWorker thread answers on the pipes instead.
+*/
+class DropboxWorker
+{
+public:
+  DropboxWorker(void);
+  ~DropboxWorker(void);
+  status_t Start(void);
+  void Stop(void);
+
+  status_t Send(const char * argv[], int32 length);
+  status_t Receive(BMessage *frame);
+  status_t Call(const char * argv[], int32 length, BMessage *reply);
+  //ask it to stop what it's running once it can carry
+  //on later, which it answers with WORKER_PAUSED
+  void Pause(void);
+
+private:
+  status_t start_native(void);
+  status_t write_all(const void *buf, size_t size);
+  status_t read_all(void *buf, size_t size);
+
+  pid_t pid;
+  NativeWorker *native; //in place of the process, if not NULL
+  int to_worker; //write end of the worker's stdin
+  int from_worker; //read end of the worker's stdout
+};
+
+#endif
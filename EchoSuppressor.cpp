@@ -0,0 +1,173 @@
+#include <stdlib.h>
+
+#include "EchoSuppressor.h"
+#include "NodeTable.h"
+
+const size_t ECHO_INITIAL_BUCKETS = 64;
+
+struct EchoEntry
+{
+  dev_t device;
+  ino_t node;
+  int32_t op;
+  bool repeats; //stays until expired, rather than used up by one event
+  uint32_t generation;
+  int64_t added;
+  EchoEntry *next; //hash chain
+  EchoEntry *older; //age list
+  EchoEntry *newer;
+};
+
+EchoSuppressor::EchoSuppressor(void)
+  : buckets(NULL), bucket_count(ECHO_INITIAL_BUCKETS), count(0),
+    oldest(NULL), newest(NULL), generation(0), suppressed(0), expired(0)
+{
+  buckets = (EchoEntry**)calloc(bucket_count, sizeof(EchoEntry*));
+}
+
+EchoSuppressor::~EchoSuppressor(void)
+{
+  while(oldest != NULL)
+    remove(oldest);
+  free(buckets);
+}
+
+size_t
+EchoSuppressor::bucket_for(dev_t device, ino_t node, int32_t op) const
+{
+  return (hash_node(device, node) + op) & (bucket_count - 1);
+}
+
+EchoEntry *
+EchoSuppressor::find(dev_t device, ino_t node, int32_t op) const
+{
+  EchoEntry *entry = buckets[bucket_for(device, node, op)];
+  while(entry != NULL)
+  {
+    if(entry->node == node && entry->device == device && entry->op == op)
+      return entry;
+    entry = entry->next;
+  }
+  return NULL;
+}
+
+void
+EchoSuppressor::grow(void)
+{
+  size_t old_count = bucket_count;
+  EchoEntry **new_buckets = (EchoEntry**)calloc(old_count * 2, sizeof(EchoEntry*));
+  if(new_buckets == NULL)
+    return;
+  free(buckets);
+  buckets = new_buckets;
+  bucket_count = old_count * 2;
+  for(EchoEntry *entry = oldest; entry != NULL; entry = entry->newer)
+  {
+    size_t b = bucket_for(entry->device, entry->node, entry->op);
+    entry->next = buckets[b];
+    buckets[b] = entry;
+  }
+}
+
+/*
+* Unlink an entry from its hash chain and the age list, and free it.
+*/
+void
+EchoSuppressor::remove(EchoEntry *entry)
+{
+  EchoEntry **link = &buckets[bucket_for(entry->device, entry->node, entry->op)];
+  while(*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+
+  if(entry->older != NULL)
+    entry->older->newer = entry->newer;
+  else
+    oldest = entry->newer;
+  if(entry->newer != NULL)
+    entry->newer->older = entry->older;
+  else
+    newest = entry->older;
+
+  free(entry);
+  count--;
+}
+
+/*
+* Say that we are about to cause (or just caused) the
+* given node monitor opcode on a node. Expecting the
+* same thing again moves it into the current generation.
+*/
+void
+EchoSuppressor::Expect(dev_t device, ino_t node, int32_t op, bool repeats, int64_t now)
+{
+  EchoEntry *entry = find(device, node, op);
+  if(entry != NULL)
+    remove(entry);
+
+  entry = (EchoEntry*)malloc(sizeof(EchoEntry));
+  if(entry == NULL)
+    return;
+  entry->device = device;
+  entry->node = node;
+  entry->op = op;
+  entry->repeats = repeats;
+  entry->generation = generation;
+  entry->added = now;
+
+  if(count >= bucket_count)
+    grow();
+  size_t b = bucket_for(device, node, op);
+  entry->next = buckets[b];
+  buckets[b] = entry;
+
+  entry->newer = NULL;
+  entry->older = newest;
+  if(newest != NULL)
+    newest->newer = entry;
+  else
+    oldest = entry;
+  newest = entry;
+  count++;
+}
+
+/*
+* Returns true if the event is one we caused,
+* and so should not be passed on to Dropbox.
+*/
+bool
+EchoSuppressor::Suppress(dev_t device, ino_t node, int32_t op)
+{
+  EchoEntry *entry = find(device, node, op);
+  if(entry == NULL)
+    return false;
+  if(!entry->repeats)
+    remove(entry);
+  suppressed++;
+  return true;
+}
+
+/*
+* Drop everything from last_generation and before.
+* Entries are added in generation order, so this
+* only looks at the ones it removes.
+*/
+void
+EchoSuppressor::Expire(uint32_t last_generation)
+{
+  while(oldest != NULL && (int32_t)(oldest->generation - last_generation) <= 0)
+  {
+    remove(oldest);
+    expired++;
+  }
+}
+
+void
+EchoSuppressor::ExpireBefore(int64_t when)
+{
+  while(oldest != NULL && oldest->added < when)
+  {
+    remove(oldest);
+    expired++;
+  }
+}
@@ -0,0 +1,58 @@
+#ifndef ECHO_SUPPRESSOR_H
+#define ECHO_SUPPRESSOR_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct EchoEntry;
+
+/*
+* Remembers the changes we made to local files ourselves
+* (while applying a delta, or renaming after a conflict)
+* so that the node monitor messages they cause don't get
+* sent straight back to Dropbox.
+*
+* Entries are keyed by (device, node, opcode). A
+* B_STAT_CHANGED style entry can swallow several events
+* (a download writes in pieces), the others just one.
+* Entries belong to a generation, and Expire() drops the
+* ones from finished generations, matched or not, so
+* nothing sits in the table forever. ExpireBefore() is a
+* backstop based on when the entry was added.
+*/
+class EchoSuppressor
+{
+public:
+  EchoSuppressor(void);
+  ~EchoSuppressor(void);
+
+  void Expect(dev_t device, ino_t node, int32_t op, bool repeats, int64_t now);
+  bool Suppress(dev_t device, ino_t node, int32_t op);
+
+  uint32_t Generation(void) const { return generation; }
+  uint32_t NextGeneration(void) { return ++generation; }
+  void Expire(uint32_t last_generation);
+  void ExpireBefore(int64_t when);
+
+  size_t CountItems(void) const { return count; }
+  uint64_t CountSuppressed(void) const { return suppressed; }
+  uint64_t CountExpired(void) const { return expired; }
+
+private:
+  size_t bucket_for(dev_t device, ino_t node, int32_t op) const;
+  EchoEntry *find(dev_t device, ino_t node, int32_t op) const;
+  void remove(EchoEntry *entry);
+  void grow(void);
+
+  EchoEntry **buckets;
+  size_t bucket_count; //always a power of two
+  size_t count;
+  EchoEntry *oldest; //entries in the order they were added
+  EchoEntry *newest;
+  uint32_t generation;
+  uint64_t suppressed;
+  uint64_t expired;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef FS_WATCH_H
+#define FS_WATCH_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+* What SyncEngine needs from the filesystem's change
+* notifications, so the same engine runs on Haiku's node
+* monitor (NodeMonitorWatch) and on Linux's inotify
+* (InotifyWatch).
+*
+* Everything is named by its (device, node) pair, as the
+* node monitor does it. A backend that only has names has
+* to work the nodes out before handing events over.
+*/
+
+//what happened, the values EchoSuppressor keys on too
+enum
+{
+  FS_CREATED = 1,
+  FS_REMOVED,
+  FS_MOVED,
+  FS_CHANGED //its contents or stat
+};
+
+struct FsEvent
+{
+  int kind;
+  dev_t device;
+  ino_t node;
+  //the directory it's in now, 0 (or one that isn't in
+  //the folder) if it was moved somewhere that isn't watched
+  ino_t directory;
+  //for FS_MOVED, where it was, 0 if that isn't watched
+  ino_t from_directory;
+  //its name in directory, for FS_CREATED and FS_MOVED
+  const char *name;
+};
+
+class FsWatch
+{
+public:
+  virtual ~FsWatch(void) {}
+
+  //a directory reports what's created, removed and moved
+  //in it, a file changes to it; returns 0 or an errno
+  //(ENOENT if the node isn't at path any more)
+  virtual int Watch(const char *path, dev_t device, ino_t node,
+    bool directory) = 0;
+
+  //the parent_rev and content_hash older versions kept
+  //with a file, false if there aren't any
+  virtual bool ReadOldRev(const char *path, char *rev, size_t rev_size,
+    char *hash, size_t hash_size)
+    { return false; }
+};
+
+#endif
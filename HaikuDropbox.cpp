@@ -1,632 +1,341 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/wait.h>
 #include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "App.h"
+#include "SyncEngine.h"
+#include "Trace.h"
+#include "TransferQueue.h"
+#include <Entry.h>
 #include <NodeMonitor.h>
-#include <Path.h>
 #include <String.h>
 #include <File.h>
 
-const char * local_path_string = "/boot/home/Dropbox/";
 const char * local_path_string_noslash = "/boot/home/Dropbox";
 const int32 MY_DELTA_CONST = 'DBDL';
-const bigtime_t HOW_OFTEN_TO_POLL = 10000000;
+const int32 MY_LONGPOLL_DONE = 'DBLP';
+const int32 MY_LONGPOLL_AGAIN = 'DBLA';
+//when long polls aren't working, how long to wait before
+//pulling the delta, doubled each time nothing's changed
+const bigtime_t MIN_POLL = 10000000;
+const bigtime_t MAX_POLL = 300000000;
+const int32 MY_ECHO_SWEEP = 'DBEX';
+const int32 MY_PUT_DONE = 'DBPU';
+const int32 MY_GET_DONE = 'DBGE';
+const int32 MY_DELTA_PAGE = 'DBPG';
+const int32 MY_QUIET_CHECK = 'DBQC';
+//prints the span times and the last lines logged, send it
+//with hey application/x-vnd.lh-MyDropboxClient DBTD
+const int32 MY_TRACE_DUMP = 'DBTD';
+const int TRACE_DUMP_LINES = 50;
+//answered with what the client's doing, as hdbstatus
+//prints it for hdbsync, in "text" (and the numbers in
+//fields of their own), so
+//  hey application/x-vnd.lh-MyDropboxClient DBST
+//shows it
+const int32 MY_STATUS = 'DBST';
+//downloads land here, then get moved into ~/Dropbox
+//(it has to be on the same volume)
+const char * download_dir_string = "/boot/home/.Dropbox-downloads";
+//how many transfers to run at once,
+//DBFORHAIKU_TRANSFERS in the environment overrides it
+const int32 DEFAULT_TRANSFERS = 4;
+const int32 MAX_TRANSFERS = 32;
+//what we know about ~/Dropbox, and the delta cursor
+const char * STATE_FILE = "sync_state";
+//where older versions kept the cursor
+const char * CURSOR_FILE = "delta.txt";
+const bigtime_t ECHO_MAX_AGE = 60000000;
+//how long a changed file has to be left alone before
+//it's uploaded, DBFORHAIKU_QUIET_MS overrides it
+const bigtime_t DEFAULT_QUIET_TIME = 2000000;
 
-// String modification helper functions
+// Talk to Dropbox
 
-/*
-* Convert a Dropbox path to a local absolute filepath
-* by adding the <path to Dropbox> to the beginning
-*/
-BString db_to_local_filepath(const char * local_path)
+bigtime_t
+quiet_setting()
 {
-  BString s;
-  s << local_path_string << local_path;
-  return s;
+  const char * setting = getenv("DBFORHAIKU_QUIET_MS");
+  if(setting == NULL)
+    return DEFAULT_QUIET_TIME;
+  bigtime_t quiet = (bigtime_t)atoi(setting) * 1000;
+  return quiet < 0 ? 0 : quiet;
 }
 
-/*
-* Convert a local absolute filepath to a Dropbox one
-* by removing the <path to Dropbox> from the beginning
-*/
-BString local_to_db_filepath(const char * local_path)
+//DBFORHAIKU_REUSE=0 downloads every file, even one
+//that's already here somewhere else
+bool
+reuse_setting()
 {
-  BString s;
-  s = BString(local_path);
-  s.RemoveFirst(local_path_string);
-  return s;
+  const char * setting = getenv("DBFORHAIKU_REUSE");
+  return setting == NULL || strcmp(setting,"0") != 0;
 }
 
-/*
-* Moves the first line in src to dest.
-* Destructively alters src.
-* newline is included in the move.
-*/
 int32
-get_next_line(BString *src, BString *dest)
-{
-  const int32 eol = src->FindFirst('\n');
-  if(eol == B_ERROR)
-    return B_ERROR;
-
-  src->MoveInto(*dest,0,eol+1);
-  return B_OK;
-}
-
-/*
-* Runs a python script given the name and args
-*
-* Takes an array of strings and its length.
-* The strings must be null terminated.
-*/
-BString *
-run_python_script(char * argv[],int length)
+transfer_count()
 {
-  BString *output = new BString;
-  char buf[BUFSIZ];
-
-  int fd[2];
-  pipe(fd);
-  pid_t pid = fork();
-
-  if(pid < 0)
-    return output; //error
-  if(pid == 0)
-  {
-    close(fd[0]);
-    dup2(fd[1],STDOUT_FILENO);
-
-    char * real_argv[length + 2];
-    real_argv[0] = "python";
-    real_argv[length+1] = NULL;
-    for(int i=0; i<length;i++)
-      real_argv[i+1]=argv[i];
-
-    execvp("python",real_argv);
-  }
-  else //parent
-  {
-    close(fd[1]);
-    dup2(fd[0],STDIN_FILENO);
-
-    int status;
-    waitpid(pid, &status, 0);
-
-    int len = read(fd[0],buf,BUFSIZ);
-    while(len > 0)
-    {
-      output->Append(buf,len);
-      len = read(fd[0],buf,BUFSIZ);
-    } 
-  }
-  printf("output:|%s|\n",output->String());
-  return output;
+  const char * setting = getenv("DBFORHAIKU_TRANSFERS");
+  int32 count = DEFAULT_TRANSFERS;
+  if(setting != NULL)
+    count = atoi(setting);
+  if(count < 1)
+    count = 1;
+  if(count > MAX_TRANSFERS)
+    count = MAX_TRANSFERS;
+  return count;
 }
 
-// Talk to Dropbox
-
 /*
-* Given a local file path,
-* call the script to delete the corresponding Dropbox file
+* The delta cursor as older versions saved it,
+* empty if there isn't one.
 */
-void
-delete_file_on_dropbox(const char * filepath)
+BString
+read_delta_cursor()
 {
-  printf("Telling Dropbox to Delete: %s\n",local_to_db_filepath(filepath).String());
-  char * argv[2];
-  argv[0] = "db_rm.py";
-  BString db_filepath = local_to_db_filepath(filepath);
-  const char * tmp = db_filepath.String();
-  char not_const[db_filepath.CountChars()];
-  strcpy(not_const,tmp);
-  argv[1] = not_const;
-  run_python_script(argv,2);
+  BString cursor;
+  BFile file = BFile(CURSOR_FILE, B_READ_ONLY);
+  off_t size;
+  if(file.InitCheck() != B_OK || file.GetSize(&size) != B_OK)
+    return cursor;
+  char *buf = cursor.LockBuffer(size + 1);
+  ssize_t len = file.Read(buf,size);
+  cursor.UnlockBuffer(len > 0 ? len : 0);
+  cursor.RemoveAll("\n");
+  return cursor;
 }
 
-/*
-* Given the local file path of a new file,
-* run the script to upload it to Dropbox
-*/
-BString *
-add_file_to_dropbox(const char * filepath)
-{
-  //return get_or_put("db_put.py",filepath, local_to_db_filepath(filepath));
-  char * argv[3];
-  argv[0] = "db_put.py";
-
-  BString db_filepath = local_to_db_filepath(filepath);
-  const char * tmp = db_filepath.String();
-  char not_const[db_filepath.CountChars()];
-  strcpy(not_const,tmp);
-  argv[2] = not_const;
-
-  char not_const2[strlen(filepath)];
-  strcpy(not_const2,filepath);
-  argv[1] = not_const2;
-
-  BString *result = run_python_script(argv,3);
-  result->RemoveAll("\n"); //trim trailing new lines
-  return result;
-}
 
 /*
-* Given the local file path of a new folder,
-* run the script to mkdir on Dropbox
+* Hand a request from the engine to the transfers,
+* with the reply it wants coming back here.
 */
 void
-add_folder_to_dropbox(const char * filepath)
-{
-  //one_path_arg("db_mkdir.py",local_to_db_filepath(filepath));
-  char * argv[2];
-  argv[0] = "db_mkdir.py";
-
-  char not_const[strlen(filepath)];
-  strcpy(not_const,filepath);
-  argv[1] = not_const;
-
-  run_python_script(argv,2);
-}
-
-/*
-* For use with the return value of db_put.py
-*  Get the real Dropbox path of the pushed file.
-*/
-BString*
-parse_path(const BString *result)
+App::Send(const SyncRequest *request)
 {
-  BString *path = new BString;
-  int32 eol = result->FindFirst('\n');
-  int32 last_space_in_first_line;
-  if(eol != B_ERROR){
-    last_space_in_first_line = result->FindLast(' ',eol);
-  } else {
-    last_space_in_first_line = result->FindLast(' ');
+  uint32 reply_what = 0;
+  switch(request->reply)
+  {
+    case SYNC_PUT_DONE: reply_what = MY_PUT_DONE; break;
+    case SYNC_GET_DONE: reply_what = MY_GET_DONE; break;
+    case SYNC_DELTA_PAGE: reply_what = MY_DELTA_PAGE; break;
   }
-  result->CopyInto(*path,0,last_space_in_first_line);
-  return path;
-}
-
-/*
-* For use with the return value of db_put.py
-*  Get the parent_rev of the pushed file.
-*/
-BString*
-parse_parent_rev(const BString *result)
-{
-  BString *parent_rev = new BString;
-  int32 eol = result->FindFirst('\n');
-  int32 last_space_in_first_line;
-  if(eol != B_ERROR){
-    last_space_in_first_line = result->FindLast(' ',eol);
-  } else {
-    last_space_in_first_line = result->FindLast(' ');
+  BMessage transfer = new_transfer(reply_what,request->args[0]);
+  for(int32 i = 1; i < request->argc; i++)
+    transfer.AddString("arg",request->args[i]);
+  if(request->compare_path != NULL)
+  {
+    transfer.AddString("compare path",request->compare_path);
+    transfer.AddString("compare hash",request->compare_hash);
+  }
+  if(request->verify_path != NULL)
+  {
+    transfer.AddString("content hash",request->verify_hash);
+    transfer.AddString("verify path",request->verify_path);
+    transfer.AddString("verify hash",request->verify_hash);
+  }
+  if(request->reply == SYNC_PUT_DONE)
+  {
+    transfer.AddInt32("device",request->device);
+    transfer.AddInt64("node",request->node);
+    transfer.AddInt64("mtime",request->mtime);
   }
-  result->CopyInto(*parent_rev,last_space_in_first_line + 1, eol - last_space_in_first_line - 1);
-  return parent_rev;
+  //what the transfers are ordered by
+  transfer.AddInt64("size",request->size);
+  transfer.AddInt64("modified",request->modified);
+  this->transfers->PostMessage(&transfer);
 }
 
-/*
-* Given the BNode of a local file,
-* return the parent_rev as stored in an attribute
-*/
-BString *
-get_parent_rev(BNode *node)
+int
+sync_status(BMessage *reply)
 {
-  int32 len;
-  ssize_t bytes = node->ReadAttr("parent_rev_len",B_INT32_TYPE,0,(void*)&len,4);
-  if(bytes != 4) {
-   printf("tried to read parent_rev_len, but only read %d bytes\n",bytes);
-   BString * empty = new BString();
-   return empty;
-  }
-  char str[len];
-  bytes = node->ReadAttr("parent_rev",B_STRING_TYPE, 0, (void*)str, len);
-  if(bytes == 0) printf("tried and failed to read parent_rev");
-  BString * parent_rev = new BString(str);
-  return parent_rev;
+  status_t status = reply->GetInt32("status",B_ERROR);
+  if(status == B_OK)
+    return SYNC_OK;
+  return status == B_BAD_DATA ? SYNC_BAD_DATA : SYNC_FAILED;
 }
 
 /*
-* Store the parent_rev as an attribute on a local file
-* Takes the BNode representing the file
-* and a BString containing the parent_rev
+* An upload finished. On success the reply's "field"
+* strings are the real Dropbox path, the new parent_rev
+* and the content_hash, unless it wasn't sent because
+* Dropbox already had the same contents.
 */
 void
-set_parent_rev(BNode *node, const BString *rev)
+App::upload_done(BMessage *reply)
 {
-  printf("setting parent_rev |%s| of len %d\n"
-        , rev->String()
-        , rev->CountChars() + 1);
-  node_ref nref;
-  node->GetNodeRef(&nref);
-  watch_node(&nref, B_STOP_WATCHING, be_app_messenger);
-
-  int32 len = rev->CountChars() + 1;
-  const char * str = rev->String();
-  node->WriteAttr("parent_rev_len"
-                , B_INT32_TYPE
-                , 0
-                , (void*)&len
-                , 4);
-  node->WriteAttr("parent_rev"
-                , B_STRING_TYPE
-                , 0
-                , (void*)str
-                , len);
-
-  watch_node(&nref, B_WATCH_STAT, be_app_messenger);
+  if(sync_status(reply) == SYNC_OK && !reply->GetBool("unchanged",false))
+    this->uploaded.Add(system_time(),reply->GetInt64("size",0));
+  this->engine->UploadDone(sync_status(reply),
+    reply->GetInt32("device",-1),reply->GetInt64("node",0),
+    reply->GetBool("unchanged",false),
+    reply->GetInt64("size",-1),reply->GetInt64("mtime",-1),
+    reply->GetString("field",0,""),reply->GetString("field",1,""),
+    reply->GetString("field",2,""));
 }
 
 /*
-* Given a local file path,
-* update the corresponding file on Dropbox
+* A page of the delta arrived: its items (each a
+* "tag" and its "field" strings), then the page's
+* cursor and whether there's more.
 */
 void
-update_file_in_dropbox(const char * filepath, const char *parent_rev)
+App::delta_page_done(BMessage *reply)
 {
-  char * argv[4];
-  argv[0] = "db_put.py";
-
-  BString db_filepath = local_to_db_filepath(filepath);
-  const char * tmp = db_filepath.String();
-  char not_const[db_filepath.CountChars()];
-  strcpy(not_const,tmp);
-  argv[2] = not_const;
-
-  char not_const2[strlen(filepath)];
-  strcpy(not_const2,filepath);
-  argv[1] = not_const2;
-
-  char not_const3[strlen(parent_rev)];
-  strcpy(not_const3,parent_rev);
-  argv[3] = not_const3;
-
-  BString *result = run_python_script(argv,4);
-  BString *real_path = parse_path(result);
-  BString *new_parent_rev = parse_parent_rev(result);
-  delete result;
-
-  printf("path:|%s|\nparent_rev:|%s|\n",real_path->String(),new_parent_rev->String());
-
-  BNode node = BNode(filepath);
-  set_parent_rev(&node,new_parent_rev);
-  delete new_parent_rev;
-
-  BEntry entry = BEntry(filepath);
-  BPath old_path;
-  entry.GetPath(&old_path);
-
-  BPath new_path = BPath(db_to_local_filepath(real_path->String()).String());
+  if(reply->GetInt32("status",B_ERROR) != B_OK)
+  {
+    this->engine->DeltaPageFailed(reply->GetString("field",""));
+    return;
+  }
 
-  printf("Should I move %s to %s?\n", old_path.Path(), new_path.Path());
-  if(strcmp(new_path.Leaf(),old_path.Leaf()) != 0)
+  int32 count = 0;
+  BMessage item;
+  while(reply->FindMessage("item",count,&item) == B_OK)
+    count++;
+  BMessage *messages = new BMessage[count > 0 ? count : 1];
+  DeltaItem *items = new DeltaItem[count > 0 ? count : 1];
+  for(int32 i = 0; i < count; i++)
   {
-    printf("moving %s to %s\n", old_path.Leaf(), new_path.Leaf());
-    BEntry entry = BEntry(old_path.Path()); //entry for local path
-    status_t err = entry.Rename(new_path.Leaf(),true);
-    if(err != B_OK) printf("error moving: %s\n",strerror(err));
+    reply->FindMessage("item",i,&messages[i]);
+    items[i].tag = messages[i].GetString("tag","");
+    for(items[i].count = 0; items[i].count < DELTA_ITEM_FIELDS; items[i].count++)
+    {
+      if(messages[i].FindString("field",items[i].count,&items[i].fields[items[i].count]) != B_OK)
+        break;
+    }
   }
-  delete real_path;
+  this->engine->DeltaPageDone(items,count,reply->GetString("field",0,""),
+    strcmp(reply->GetString("field",1,"0"),"1") == 0);
+  delete[] items;
+  delete[] messages;
 }
 
-//Local filesystem stuff
-
-//TODO: pick better default permissions...
 void
-create_local_directory(BString *dropbox_path)
+App::download_done(BMessage *reply)
 {
-    BString *local_path = new BString(local_path_string);
-    local_path->Append(*dropbox_path);
-    status_t err = create_directory(local_path->String(), 0x0777);
-    printf("Create local dir %s: %s\n",local_path->String(),strerror(err));
-    delete local_path;
+  bool unchanged = reply->GetBool("unchanged",false);
+  struct stat st;
+  if(sync_status(reply) == SYNC_OK && !unchanged
+    && stat(reply->GetString("arg",2,""),&st) == 0)
+    this->downloaded.Add(system_time(),st.st_size);
+  this->engine->DownloadDone(sync_status(reply),unchanged,
+    reply->GetString("arg",1,""),reply->GetString("arg",2,""),
+    reply->GetString("arg",3,""),
+    unchanged ? reply->GetString("content hash","") : reply->GetString("field",1,""));
 }
 
 /*
-* Subscribe to Node Monitor alerts
-* Just wraps the watch_node function of the Node Monitor
-* (with the BMessenger being be_app_messenger)
+* Called when done handling a message.
+* Everything the engine did has had its node monitor
+* messages queued by now, so post a message behind them
+* that expires the echoes it was waiting for.
 */
 void
-watch_entry(const BEntry *entry, int flag)
+App::schedule_echo_sweep()
 {
-  node_ref nref;
-  status_t err;
-
-  err = entry->GetNodeRef(&nref);
-  if(err == B_OK)
-  {
-    err = watch_node(&nref, flag, be_app_messenger);
-    if(err != B_OK)
-      printf("watch_entry: Not Ok.\n");
-  }
+  uint32 generation;
+  if(!this->engine->StartEchoSweep(&generation))
+    return;
+  BMessage sweep = BMessage(MY_ECHO_SWEEP);
+  sweep.AddInt32("generation",(int32)generation);
+  this->PostMessage(&sweep);
 }
 
-/*
-* Given a BEntry* representing a file (or folder)
-* add the relevant BFile and BPath to the global tracking lists
-* (tracked_files and tracked_filepaths)
-*/
 void
-App::track_file(BEntry *new_file)
+App::schedule_quiet_check()
 {
-  BFile *file = new BFile(new_file, B_READ_ONLY);
-  this->tracked_files.AddItem((void*)file);
-  BPath *path = new BPath;
-  new_file->GetPath(path);
-  this->tracked_filepaths.AddItem((void*)path);
+  if(this->quiet_check_due)
+    return;
+  bigtime_t delay = this->engine->NextQuietCheck();
+  if(delay < 0)
+    return;
+  BMessage check = BMessage(MY_QUIET_CHECK);
+  BMessageRunner::StartSending(be_app_messenger,&check,delay,1);
+  this->quiet_check_due = true;
 }
 
 /*
-* Given a directory, subscribe to Node Monitor
-* messages on it and all it's descendents.
-* For all directories, use B_WATCH_DIRECTORY.
-* For all file, use B_WATCH_STAT.
-* It also watches the directory itself
-* with B_WATCH_DIRECOTRY.
+* The delta has been pulled as far as it goes. Wait to
+* hear of the next change, or try again in a while.
 */
 void
-App::recursive_watch(BDirectory *dir)
+App::DeltaFinished(bool ok, bool changed)
 {
-  status_t err;
-
-  BEntry entry;
-  err = dir->GetNextEntry(&entry);
-
-  //for each file in the current directory
-  while(err == B_OK)
+  if(!ok)
   {
-    //put this file in global list
-    this->track_file(&entry);
-    BFile file = BFile(&entry,B_READ_ONLY);
-    if(file.IsDirectory())
-    {
-      watch_entry(&entry,B_WATCH_DIRECTORY);
-      BDirectory *ndir = new BDirectory(&entry);
-      this->recursive_watch(ndir);
-      delete ndir;
-    }
-    else
-    {
-      watch_entry(&entry,B_WATCH_STAT);
-    }
-
-    err = dir->GetNextEntry(&entry);
+    this->schedule_poll();
+    return;
   }
+  this->delta_finished = system_time();
+  if(changed)
+    this->poll_interval = MIN_POLL;
+  this->wait_for_changes();
 }
 
 /*
-* Given a local directory, do the equivalent of `rm -rf`
-* on it, but using the actual filesystem API.
-* You can't just use dir->Remove() because that
-* gives an error if the directory is not empty.
+* Ask Dropbox to tell us when there's anything after
+* the saved cursor, rather than pulling the delta on a
+* timer. The long poll has a worker of its own, since
+* it can take minutes to answer.
 */
 void
-rm_rf(BDirectory *dir)
+App::wait_for_changes()
 {
-  status_t err;
-  BEntry entry;
-  err = dir->GetNextEntry(&entry);
-  while(err==B_OK)
+  if(this->longpoll_waiting)
+    return;
+  bigtime_t wait = this->longpoll_after - system_time();
+  if(wait > 0)
   {
-    BFile file = BFile(&entry, B_READ_ONLY);
-    if(file.IsDirectory())
-    {
-      BDirectory ndir = BDirectory(&entry);
-      rm_rf(&ndir);
-    }
-
-    err = entry.Remove();
-    if(err != B_OK)
-    {
-      BPath path;
-      entry.GetPath(&path);
-      printf("Remove Error: %s on %s\n",strerror(err),path.Path());
-      //what to do if I can't remove something?
-    }
-
-    err = dir->GetNextEntry(&entry);
+    //Dropbox asked us to back off
+    BMessage again = BMessage(MY_LONGPOLL_AGAIN);
+    BMessageRunner::StartSending(be_app_messenger,&again,wait,1);
+    return;
   }
-  err = dir->GetEntry(&entry);
-  err = entry.Remove();
-  if(err != B_OK)
-    printf("Folder Removal Error: %s\n", strerror(err));
+  BMessage request = new_transfer(MY_LONGPOLL_DONE,"longpoll");
+  request.AddString("arg",this->engine->Cursor());
+  this->longpoll_waiting = true;
+  this->notify_lane->PostMessage(&request);
 }
 
 /*
-* Find the index of the target in the tracked_files list.
-* Returns -1 if target is not in the list.
+* The long poll came back. Pull the delta if there are
+* changes, otherwise wait again. If long polls don't
+* work, go back to pulling the delta every so often.
 */
-int32
-App::find_nref_in_tracked_files(node_ref target)
-{
-  node_ref current_nref;
-  BFile * current_file;
-  int32 ktr = 0;
-  int32 limit = this->tracked_files.CountItems();
-
-  while((current_file = (BFile *)this->tracked_files.ItemAt(ktr++)) && ktr<=limit)
-  {
-    current_file->GetNodeRef(&current_nref);
-    if(target == current_nref)
-    {
-      return --ktr; //account for ++ in while
-    }
-  }
-  return -1;
-}
-
-bool
-check_exists(BString db_path) {
-  BString local_path = db_to_local_filepath(db_path);
-  BEntry entry = BEntry(local_path.String());
-  bool init = entry.InitCheck() == B_OK;
-  bool exists = entry.Exists();
-  printf("init:%d,exists:%d\n",init,exists);
-  return init && exists;
-}
-
-bool
-exists(BPath *path)
-{
-  BEntry entry = BEntry(path->Path());
-  return (entry.InitCheck() == B_OK) && entry.Exists();
-}
-
-BPath*
-find_existing_subpath(BPath *fullpath) {
-  if(exists(fullpath)) return new BPath(*fullpath);
-  BPath *current;
-  BPath previous = BPath(*fullpath);
-  previous.GetParent(current);
-  while(!(exists(current))) {
-    current->GetParent(&previous);
-    BPath *tmp = &previous;
-    previous = *current;
-    current = tmp;
-  }
-  return new BPath(previous);
-}
-
-// Act on Deltas
-/*
-* Given a single line of the output of db_delta.py
-* Figures out what to do and does it.
-* (adds and removes files and directories)
-*/
-int
-App::parse_command(BString command)
+void
+App::longpoll_done(BMessage *reply)
 {
-  command.RemoveAll("\n"); //remove trailing whitespace
-  if(command.Compare("RESET") == 0)
-  {
-    printf("Burn Everything. 8D\n");
-
-    status_t err = stop_watching(be_app_messenger);
-    if(err != B_OK) printf("stop_watching error: %s\n",strerror(err));
-
-    BDirectory dir = BDirectory(local_path_string);
-    rm_rf(&dir);
-
-    BString str = BString("/"); //create_local_path wants a remote path 
-    create_local_directory(&str);
-
-    this->recursive_watch(&dir);
-  }
-  else if(command.Compare("FILE ",5) == 0)
-  {
-    BString path, dirpath, partial_path;
-    BPath *bpath;
-    int32 last_space = command.FindLast(" ");
-    command.CopyInto(path,5,last_space - 5);
-
-    path.CopyInto(dirpath,0,path.FindLast("/"));
-
-    create_local_directory(&dirpath);
-    //TODO fix watching new dirs
-    bpath = new BPath(db_to_local_filepath(path.String()).String());
-    BEntry new_file = BEntry(bpath->Path());
-    if(new_file.InitCheck() && new_file.Exists()) {
-      this->new_paths.AddItem((void*)bpath);
-    } else {
-      this->edited_paths.AddItem((void*)bpath);
-    }
-
-    printf("create a file at |%s|\n",path.String());
-    char *argv[3];
-    argv[0] = "db_get.py";
-    char not_const1[path.CountChars() + 1];
-    strcpy(not_const1,path.String());
-    argv[1] = not_const1;
-    BString tmp = db_to_local_filepath(path.String());
-    char not_const2[tmp.CountChars() + 1]; //plus one for null
-    strcpy(not_const2,tmp.String());
-    argv[2] = not_const2;
-
-    //create/update file
-    //potential problem: takes awhile to do this step
-    // having watching for dir turned off is risky.    
-    BString * b = run_python_script(argv,3);
-    delete b;
-
-    //start watching the new/updated file
-    node_ref nref;
-    new_file = BEntry(db_to_local_filepath(path.String()).String());
-    new_file.GetNodeRef(&nref);
-    status_t err = watch_node(&nref,B_WATCH_STAT,be_app_messenger);
-
-    BString parent_rev;
-    command.CopyInto(parent_rev,last_space + 1, command.CountChars() - (last_space+1));
-    BNode node = BNode(db_to_local_filepath(path.String()).String());
-    set_parent_rev(&node,&parent_rev);
-  }
-  else if(command.Compare("FOLDER ",7) == 0)
-  {
-    BString path;
-    command.CopyInto(path,7,command.FindLast(" ") - 7);
-
-    //ignore the creation message
-    BPath bpath = BPath(db_to_local_filepath(path.String()).String());
-    BPath *actually_exists = find_existing_subpath(&bpath);
-    this->new_paths.AddItem((void*)actually_exists);
-
-    //create all nescessary dirs in path
-    printf("create a folder at |%s|\n", path.String());
-    create_local_directory(&path);
-
-    //start watching the new dir
-    BDirectory existing_dir = BDirectory(actually_exists->Path());
-    recursive_watch(&existing_dir);
-  }
-  else if(command.Compare("REMOVE ",7) == 0)
+  this->longpoll_waiting = false;
+  //backstop for echoes whose sweep never came
+  this->engine->ExpireOldEchoes(ECHO_MAX_AGE);
+  if(reply->GetInt32("status",B_ERROR) != B_OK)
   {
-    //TODO: deal with Dropbox file paths being case-insensitive
-    //which here means all lower case
-    BString path;
-    command.CopyInto(path,7,command.Length() - 7);
-
-    const char * pathstr = db_to_local_filepath(path.String()).String();
-    BPath *bpath = new BPath(pathstr);
-    //TODO: check if it exists...
-    this->removed_paths.AddItem((void*)bpath);
-
-    printf("Remove whatever is at |%s|\n", pathstr);
-
-    BEntry entry = BEntry(pathstr);
-    status_t err = entry.Remove();
-    if(err != B_OK)
-      printf("Removal error: %s\n", strerror(err));
+    TRACE(TRACE_INFO,"long poll failed, polling instead");
+    this->schedule_poll();
+    return;
   }
+  int32 backoff = atoi(reply->GetString("field",1,"0"));
+  if(backoff > 0)
+    this->longpoll_after = system_time() + (bigtime_t)backoff * 1000000;
+  if(strcmp(reply->GetString("field",0,"0"),"1") == 0)
+    this->engine->StartDelta();
   else
-  {
-    printf("Did not recognize command.\n");
-    return B_ERROR;
-  }
-  return B_OK;
+    this->wait_for_changes();
 }
 
 /*
-* wrapper for calling db_deltas.py
-* and then running parse_command on each line
-* of the output.
+* Pull the delta again after a while, longer each time
+* the last one had nothing in it.
 */
 void
-App::pull_and_apply_deltas()
+App::schedule_poll()
 {
-  char *argv[1];
-  argv[0] = "db_delta.py";
-  BString *delta_commands = run_python_script(argv,1);
-  BString line;
-  printf("*************RUNNING DELTA\n");
-  while(get_next_line(delta_commands,&line) == B_OK)
-  {
-    int x = parse_command(line); 
-    if(x != B_OK)
-      break;
-  }
-  printf("*************RAN DELTA\n");
+  BMessage poll = BMessage(MY_DELTA_CONST);
+  BMessageRunner::StartSending(be_app_messenger,&poll,this->poll_interval,1);
+  this->poll_interval *= 2;
+  if(this->poll_interval > MAX_POLL)
+    this->poll_interval = MAX_POLL;
 }
 
 /*
@@ -634,307 +343,214 @@ App::pull_and_apply_deltas()
 * and creates data structure for determining which files are deleted or edited
 */
 App::App(void)
-  : BApplication("application/x-vnd.lh-MyDropboxClient")
+  : BApplication("application/x-vnd.lh-MyDropboxClient"),
+    quiet_check_due(false),
+    started(system_time()),
+    delta_finished(-1),
+    notify_lane(NULL),
+    longpoll_waiting(false),
+    longpoll_after(0),
+    poll_interval(MIN_POLL)
 {
-  pull_and_apply_deltas();
-  printf("Done pulling changes, now to start tracking\n");
-
-  //start watching ~/Dropbox folder contents (create, delete, move)
-  BDirectory dir(local_path_string_noslash); //don't use ~ here
-  node_ref nref;
-  status_t err;
-  if(dir.InitCheck() == B_OK){
-    dir.GetNodeRef(&nref);
-    err = watch_node(&nref, B_WATCH_DIRECTORY, be_app_messenger);
-    if(err != B_OK)
-      printf("Watch Node: Not OK\n");
+  //all the talking to Dropbox happens on the transfer threads
+  int32 count = transfer_count();
+  TRACE(TRACE_INFO,"Running up to %ld transfers at once",(long)count);
+  this->transfers = new TransferQueue(be_app_messenger,count);
+  this->transfers->Run();
+
+  this->engine = new SyncEngine(local_path_string_noslash,download_dir_string,
+    &this->node_monitor,this);
+  this->engine->SetQuietTime(quiet_setting());
+  this->engine->SetReuse(reuse_setting());
+
+  //what we knew last time saves reading the whole tree
+  int err = this->engine->Open(STATE_FILE);
+  if(err != 0)
+    TRACE(TRACE_ERROR,"could not open %s: %s",STATE_FILE,strerror(err));
+  if(this->engine->Cursor()[0] == '\0')
+  {
+    BString cursor = read_delta_cursor();
+    if(cursor.Length() > 0 && this->engine->SaveCursor(cursor.String()) == 0)
+    {
+      BEntry old_cursor = BEntry(CURSOR_FILE);
+      old_cursor.Remove();
+    }
   }
-
-  printf("Done watching root directory\n");
-
-  //watch all the child files for edits and the folders for create/delete/move
-  this->recursive_watch(&dir);
-
-  printf("Done watching and tracking all children of ~/Dropbox.\n");
-  BMessage msg = BMessage(MY_DELTA_CONST);
-  bigtime_t microseconds = HOW_OFTEN_TO_POLL;
-  this->msg_runner = new BMessageRunner(be_app_messenger, msg, microseconds, -1);
+  this->engine->Start();
+  TRACE(TRACE_INFO,"Done watching and tracking all %ld children of ~/Dropbox.",
+    (long)this->engine->CountTracked());
+
+  //the changes come in while we get on with watching,
+  //then we wait to hear of more
+  this->notify_lane = new TransferLane(be_app_messenger,BMessenger(),-1);
+  this->notify_lane->Run();
+  this->engine->StartDelta();
+  this->schedule_quiet_check();
+  this->schedule_echo_sweep();
 }
 
-bool
-App::ignore_removed(BPath *path)
+/*
+* Answer a MY_STATUS message. The transfers are asked
+* what they're running, which they answer at once, as
+* their looper never waits on a worker.
+*/
+void
+App::answer_status(BMessage *msg)
 {
-  printf("In ignore_removed\n");
-  //find matching path object in list (by value comparison)
-  for(int32 i = 0; i < this->removed_paths.CountItems(); i++) {
-    BPath *current = (BPath*)this->removed_paths.ItemAt(i);
-    printf("removed_paths[%d]=%s\n",i,current->Path());
-    if( *current == *path) {
-      BPath *p = (BPath*)this->removed_paths.RemoveItem(i);
-      delete p;
-      printf("\treturning true\n");
-      return true;
+  SyncStatus status;
+  status.now = system_time();
+  status.started = this->started;
+  status.tracked = this->engine->CountTracked();
+  status.memory = resident_memory();
+  status.quiet_waiting = this->engine->QuietFiles()->CountItems();
+  status.echoes_waiting = this->engine->Echoes()->CountItems();
+  status.transfers_waiting = 0;
+  status.transfer_lanes = 0;
+  status.transfers_running = 0;
+  BMessage transfers;
+  if(BMessenger(this->transfers).SendMessage(MY_TRANSFER_STATUS,&transfers) == B_OK)
+  {
+    status.transfers_waiting = transfers.GetInt32("waiting",0);
+    status.transfer_lanes = transfers.GetInt32("lanes",0);
+    const char *op;
+    for(int32 i = 0; i < STATUS_MAX_TRANSFERS
+      && transfers.FindString("op",i,&op) == B_OK; i++)
+    {
+      TransferInfo *info = &status.running[i];
+      snprintf(info->op,sizeof(info->op),"%s",op);
+      snprintf(info->path,sizeof(info->path),"%s",
+        transfers.GetString("path",i,""));
+      info->started = transfers.GetInt64("started",i,status.now);
+      status.transfers_running++;
     }
   }
-  printf("\treturning false\n");
-  return false;
+  status.up = this->uploaded;
+  status.down = this->downloaded;
+  status.reused_files = this->engine->CountReused();
+  status.reused_bytes = this->engine->BytesReused();
+  status.delta_running = this->engine->DeltaRunning();
+  status.delta_finished = this->delta_finished;
+  status.waiting_for = this->longpoll_waiting ? "the long poll" : "the next poll";
+  status.busy_since = -1; //we're answering
+
+  char text[8192];
+  format_status(&status,text,sizeof(text));
+  BMessage reply = BMessage(B_REPLY);
+  reply.AddString("text",text);
+  reply.AddInt64("tracked",(int64)status.tracked);
+  reply.AddInt64("memory",status.memory);
+  reply.AddInt64("quiet waiting",(int64)status.quiet_waiting);
+  reply.AddInt64("transfers waiting",(int64)status.transfers_waiting);
+  reply.AddInt32("transfers running",status.transfers_running);
+  reply.AddDouble("up rate",status.up.Rate(status.now));
+  reply.AddDouble("down rate",status.down.Rate(status.now));
+  reply.AddInt64("reused files",status.reused_files);
+  reply.AddInt64("reused bytes",status.reused_bytes);
+  reply.AddBool("delta running",status.delta_running);
+  if(status.delta_finished >= 0)
+    reply.AddInt64("since delta",status.now - status.delta_finished);
+  msg->SendReply(&reply);
 }
 
-bool
-App::ignore_created(BPath *path)
+App::~App(void)
 {
-  for(int32 i = 0; i < this->new_paths.CountItems(); i++) {
-    BPath *current = (BPath*)this->new_paths.ItemAt(i);
-    if( *current == *path) {
-      BPath *p = (BPath*)this->new_paths.RemoveItem(i);
-      delete p;
-      return true;
-    }
-  }
-  return false;
+  delete this->engine;
 }
 
 bool
-App::ignore_edited(BPath *path)
+App::QuitRequested(void)
 {
-  for(int32 i = 0; i < this->edited_paths.CountItems(); i++) {
-    BPath *current = (BPath*)this->edited_paths.ItemAt(i);
-    if( *current == *path) {
-      BPath *p = (BPath*)this->edited_paths.RemoveItem(i);
-      delete p;
-      return true;
-    }
-  }
-  return false;
+  //waits for the transfer in progress, if any
+  //(not for a long poll, which goes with us)
+  if(this->transfers->Lock())
+    this->transfers->Quit();
+  this->engine->Flush();
+  trace_dump(stdout,TRACE_DUMP_LINES);
+  return BApplication::QuitRequested();
 }
 
 /*
 * Message Handling Function
-* If it's a node monitor message,
-* then figure out what to do based on it.
-* Otherwise, let BApplication handle it.
+* Node monitor messages and the transfers' replies go
+* to the engine. Otherwise, let BApplication handle it.
 */
 void
 App::MessageReceived(BMessage *msg)
 {
-  printf("message received:\n");
-  msg->PrintToStream();
+  if(TRACING(TRACE_VERBOSE))
+  {
+    TRACE(TRACE_VERBOSE,"message received:");
+    msg->PrintToStream();
+  }
   switch(msg->what)
   {
+    case MY_LONGPOLL_DONE:
+    {
+      this->longpoll_done(msg);
+      break;
+    }
+    case MY_LONGPOLL_AGAIN:
+    {
+      this->wait_for_changes();
+      break;
+    }
     case MY_DELTA_CONST:
     {
-      printf("Pulling changes from Dropbox\n");
-      pull_and_apply_deltas();
+      TRACE(TRACE_INFO,"Pulling changes from Dropbox");
+      //backstop for echoes whose sweep never came
+      this->engine->ExpireOldEchoes(ECHO_MAX_AGE);
+      this->engine->StartDelta();
+      break;
+    }
+    case MY_DELTA_PAGE:
+    {
+      this->delta_page_done(msg);
+      break;
+    }
+    case MY_GET_DONE:
+    {
+      this->download_done(msg);
+      break;
+    }
+    case MY_PUT_DONE:
+    {
+      this->upload_done(msg);
+      break;
+    }
+    case MY_QUIET_CHECK:
+    {
+      this->quiet_check_due = false;
+      this->engine->UploadQuietFiles();
+      break;
+    }
+    case MY_ECHO_SWEEP:
+    {
+      int32 generation;
+      if(msg->FindInt32("generation",&generation) == B_OK)
+        this->engine->ExpireEchoes((uint32)generation);
+      const EchoSuppressor *echoes = this->engine->Echoes();
+      TRACE(TRACE_DEBUG,"echoes: %lld suppressed, %lld expired, %ld waiting",
+        (long long)echoes->CountSuppressed(),
+        (long long)echoes->CountExpired(),
+        (long)echoes->CountItems());
+      break;
+    }
+    case MY_STATUS:
+    {
+      this->answer_status(msg);
+      break;
+    }
+    case MY_TRACE_DUMP:
+    {
+      trace_dump(stdout,TRACE_DUMP_LINES);
       break;
     }
     case B_NODE_MONITOR:
     {
-      printf("Received Node Monitor Alert\n");
-      status_t err;
-      int32 opcode;
-      err = msg->FindInt32("opcode",&opcode);
-      if(err == B_OK)
-      {
-        switch(opcode)
-        {
-          case B_ENTRY_CREATED:
-          {
-            printf("CREATED NEW FILE\n");
-            entry_ref ref;
-            BPath path;
-            const char * name;
-
-            // unpack the message
-            msg->FindInt32("device",&ref.device);
-            msg->FindInt64("directory",&ref.directory);
-            msg->FindString("name",&name);
-            ref.set_name(name);
-
-            BEntry new_file = BEntry(&ref);
-            new_file.GetPath(&path);
-
-
-            //if we said to ignore a `NEW` msg from the path, then ignore it
-            if(this->ignore_created(&path)) return;
-
-            this->track_file(&new_file);
-
-            if(new_file.IsDirectory())
-            {
-               add_folder_to_dropbox(path.Path());
-               BDirectory new_dir = BDirectory(&new_file);
-               this->recursive_watch(&new_dir);
-            }
-            else
-            {
-              BString *result = add_file_to_dropbox(path.Path());
-              BString *real_path = parse_path(result);
-              BString *parent_rev = parse_parent_rev(result);
-              delete result;
-
-              printf("path:|%s|\nparent_rev:|%s|\n",real_path->String(),parent_rev->String());
-
-              BNode node = BNode(&new_file);
-              set_parent_rev(&node,parent_rev);
-              delete parent_rev;
-              BPath new_path = BPath(db_to_local_filepath(real_path->String()).String());
-
-              if(strcmp(new_path.Leaf(),path.Leaf()) != 0)
-              {
-                printf("moving %s to %s\n", path.Leaf(), new_path.Leaf());
-                BEntry entry = BEntry(path.Path()); //entry for local path
-                status_t err = entry.Rename(new_path.Leaf(),true);
-                if(err != B_OK) printf("error moving: %s\n",strerror(err));
-              }
-              
-              delete real_path;
-              watch_entry(&new_file,B_WATCH_STAT);
-            }
-            break;
-          }
-          case B_ENTRY_MOVED:
-          {
-            printf("MOVED FILE\n");
-            entry_ref eref;
-            BDirectory from_dir, to_dir;
-            node_ref from_ref,to_ref,nref;
-            BPath path;
-            const char* name;
-
-            msg->FindInt32("device",&from_ref.device);
-            msg->FindInt32("device",&to_ref.device);
-            msg->FindInt32("device",&eref.device);
-            msg->FindInt32("device",&nref.device);
-
-            msg->FindInt64("from directory",&from_ref.node);
-            msg->FindInt64("to directory",&to_ref.node);
-            msg->FindInt64("to directory",&eref.directory);
-
-            msg->FindInt64("node",&nref.node);
-
-            msg->FindString("name",&name);
-            eref.set_name(name);
-
-            err = from_dir.SetTo(&from_ref);
-            err = to_dir.SetTo(&to_ref);
-
-            BEntry dest_entry = BEntry(&eref);
-            BEntry test = BEntry("/boot/home/Dropbox/hi");
-            BDirectory dropbox_local = BDirectory(local_path_string);
-            bool into_dropbox = dropbox_local.Contains(&dest_entry);
-            int32 index = this->find_nref_in_tracked_files(nref);
-            if((index >= 0) && into_dropbox)
-            {
-              printf("moving within dropbox\n");
-              BPath *old_path = (BPath*)this->tracked_filepaths.ItemAt(index);
-              BPath new_path;
-              dest_entry.GetPath(&new_path);
-
-              char *argv[3];
-              argv[0] = "db_mv.py";
-              BString opath = local_to_db_filepath(old_path->Path());
-              BString npath = local_to_db_filepath(new_path.Path());
-              char not_const_o[opath.CountChars()];
-              char not_const_n[npath.CountChars()];
-              strcpy(not_const_o,opath.String());
-              strcpy(not_const_n,npath.String());
-              argv[1] = not_const_o;
-              argv[2] = not_const_n;
-              run_python_script(argv,3);
-
-              old_path->SetTo(&dest_entry);
-            }
-            else if(index >= 0)
-            {
-              printf("moving the file out of dropbox\n");
-              BPath *old_path = (BPath*)this->tracked_filepaths.ItemAt(index);
-              delete_file_on_dropbox(old_path->Path());
-              this->tracked_files.RemoveItem(index);
-              this->tracked_filepaths.RemoveItem(index);
-            }
-            else if(into_dropbox)
-            {
-              printf("moving file into dropbox\n");
-              BPath new_path;
-              dest_entry.GetPath(&new_path);
-
-              this->track_file(&dest_entry);
-
-              if(dest_entry.IsDirectory())
-              {
-                 add_folder_to_dropbox(new_path.Path());
-                 BDirectory new_dir = BDirectory(&dest_entry);
-                 this->recursive_watch(&new_dir);
-              }
-              else
-              {
-                add_file_to_dropbox(new_path.Path());
-                watch_entry(&dest_entry,B_WATCH_STAT);
-              }
-            }
-            else
-            {
-              printf("moving unrelated file...?\n");
-            }
-
-            break;
-          }
-          case B_ENTRY_REMOVED:
-          {
-            printf("DELETED FILE\n");
-            node_ref nref;
-            msg->FindInt32("device", &nref.device);
-            msg->FindInt64("node", &nref.node);
-
-            int32 index = this->find_nref_in_tracked_files(nref);
-            if(index >= 0)
-            {
-              BPath *path = (BPath*)this->tracked_filepaths.ItemAt(index);
-              printf("local file %s deleted\n",path->Path());
-              
-              if(ignore_removed(path)) return;
-
-              delete_file_on_dropbox(path->Path());
-              this->tracked_files.RemoveItem(index);
-              this->tracked_filepaths.RemoveItem(index);
-            }
-            else
-            {
-              printf("could not find deleted file\n");
-            }
-
-            break;
-          }
-          case B_STAT_CHANGED:
-          {
-            printf("EDITED FILE\n");
-            node_ref nref;
-            msg->FindInt32("device", &nref.device);
-            msg->FindInt64("node", &nref.node);
-
-            int32 index = this->find_nref_in_tracked_files(nref);
-            if(index >= 0)
-            {
-              BPath *path = (BPath*)this->tracked_filepaths.ItemAt(index);
-              if(ignore_edited(path)) return;
-              BNode node = BNode(path->Path());
-              BString * rev = get_parent_rev(&node);
-              printf("parent_rev:|%s|\n",rev->String());
-              
-              update_file_in_dropbox(path->Path(),rev->String());
-            }
-            else
-            {
-              printf("Could not find edited file\n");
-            }
-            break;
-          }
-          default:
-          {
-            printf("default case opcode...\n");
-          }
-        }
-      }
+      TRACE(TRACE_DEBUG,"Received Node Monitor Alert");
+      FsEvent event;
+      if(NodeMonitorWatch::ToEvent(msg,&event))
+        this->engine->HandleEvent(&event);
       break;
     }
     default:
@@ -943,11 +559,16 @@ App::MessageReceived(BMessage *msg)
       break;
     }
   }
+  this->schedule_quiet_check();
+  this->schedule_echo_sweep();
+  this->engine->Flush();
 }
 
 int
 main(void)
 {
+  trace_init();
+
   //set up application (watch Dropbox folder & contents)
   App *app = new App();
 
@@ -0,0 +1,769 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "HttpConnection.h"
+#include "Throttle.h"
+#include "Trace.h"
+
+//how much of a file goes in one sendfile() when it isn't
+//kept to a limit, and is mapped at a time otherwise
+const int64_t HTTP_FILE_PIECE = 4 * 1024 * 1024;
+//what the splice() pipe is asked to hold, which is how
+//much of a download is moved at a time
+const int HTTP_PIPE_SIZE = 1024 * 1024;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+#ifdef HTTP_TLS
+static SSL_CTX *tls_context = NULL;
+static pthread_once_t tls_once = PTHREAD_ONCE_INIT;
+
+//checked against the system's certificates, which
+//SSL_CERT_FILE and SSL_CERT_DIR can point elsewhere
+static void
+tls_init(void)
+{
+  SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+  if(context == NULL)
+    return;
+  SSL_CTX_set_default_verify_paths(context);
+  SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+  tls_context = context;
+}
+#endif
+
+HttpConnection::HttpConnection(void)
+  : fd(-1),
+#ifdef HTTP_TLS
+    tls(NULL),
+#endif
+    host_header(NULL),
+    buffer(NULL),
+    buffer_start(0),
+    buffer_end(0),
+    headers(NULL),
+    status(0),
+    content_length(-1),
+    chunked(false),
+    closing(false)
+{
+  this->pipe_fds[0] = this->pipe_fds[1] = -1;
+}
+
+HttpConnection::~HttpConnection(void)
+{
+  Close();
+  free(this->host_header);
+  free(this->buffer);
+  free(this->headers);
+}
+
+void
+HttpConnection::Close(void)
+{
+#ifdef HTTP_TLS
+  if(this->tls != NULL)
+  {
+    SSL_free(this->tls);
+    this->tls = NULL;
+  }
+#endif
+  if(this->fd >= 0)
+    close(this->fd);
+  this->fd = -1;
+  //anything still in the pipe belonged to this connection
+  for(int i = 0; i < 2; i++)
+  {
+    if(this->pipe_fds[i] >= 0)
+      close(this->pipe_fds[i]);
+    this->pipe_fds[i] = -1;
+  }
+  this->buffer_start = this->buffer_end = 0;
+}
+
+int
+HttpConnection::fail(int err)
+{
+  Close();
+  return err;
+}
+
+int
+HttpConnection::Connect(const char *host, int port, bool secure, int timeout)
+{
+  Close();
+#ifndef HTTP_TLS
+  if(secure)
+    return EPROTONOSUPPORT;
+#endif
+  if(this->buffer == NULL
+    && (this->buffer = (char*)malloc(HTTP_BUFFER_SIZE)) == NULL)
+    return ENOMEM;
+
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *found;
+  if(getaddrinfo(host, service, &hints, &found) != 0)
+    return EHOSTUNREACH;
+  int err = ECONNREFUSED;
+  for(struct addrinfo *address = found; address != NULL;
+    address = address->ai_next)
+  {
+    int fd = socket(address->ai_family, address->ai_socktype,
+      address->ai_protocol);
+    if(fd < 0)
+    {
+      err = errno;
+      continue;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+    {
+      err = errno;
+      close(fd);
+      continue;
+    }
+    //the headers and the body go in separate writes, don't
+    //let Nagle's algorithm hold the body back for an ACK
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    this->fd = fd;
+    break;
+  }
+  freeaddrinfo(found);
+  if(this->fd < 0)
+    return err;
+
+#ifdef HTTP_TLS
+  if(secure)
+  {
+    pthread_once(&tls_once, tls_init);
+    if(tls_context == NULL || (this->tls = SSL_new(tls_context)) == NULL)
+      return fail(ENOMEM);
+    SSL_set_fd(this->tls, this->fd);
+    SSL_set_tlsext_host_name(this->tls, host);
+    SSL_set1_host(this->tls, host);
+    if(SSL_connect(this->tls) != 1)
+    {
+      TRACE(TRACE_ERROR, "TLS with %s failed: %s", host,
+        X509_verify_cert_error_string(SSL_get_verify_result(this->tls)));
+      return fail(EPROTO);
+    }
+  }
+#endif
+
+  free(this->host_header);
+  size_t size = strlen(host) + 32;
+  this->host_header = (char*)malloc(size);
+  if(this->host_header == NULL)
+    return fail(ENOMEM);
+  if(port == (secure ? 443 : 80))
+    snprintf(this->host_header, size, "Host: %s\r\n", host);
+  else
+    snprintf(this->host_header, size, "Host: %s:%d\r\n", host, port);
+  return 0;
+}
+
+ssize_t
+HttpConnection::read_some(char *data, size_t size)
+{
+#ifdef HTTP_TLS
+  if(this->tls != NULL)
+  {
+    int got = SSL_read(this->tls, data, size > 1 << 30 ? 1 << 30 : (int)size);
+    if(got > 0)
+      return got;
+    if(SSL_get_error(this->tls, got) == SSL_ERROR_ZERO_RETURN)
+      return 0;
+    errno = ECONNRESET;
+    return -1;
+  }
+#endif
+  ssize_t got;
+  do
+    got = recv(this->fd, data, size, 0);
+  while(got < 0 && errno == EINTR);
+  if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    errno = ETIMEDOUT;
+  return got;
+}
+
+int
+HttpConnection::write_all(const char *data, size_t size)
+{
+  while(size > 0)
+  {
+    ssize_t written;
+#ifdef HTTP_TLS
+    if(this->tls != NULL)
+    {
+      written = SSL_write(this->tls, data, size > 1 << 30 ? 1 << 30
+        : (int)size);
+      if(written <= 0)
+        return fail(ECONNRESET);
+      data += written;
+      size -= written;
+      continue;
+    }
+#endif
+    written = send(this->fd, data, size, MSG_NOSIGNAL);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return fail(written < 0 && errno != EAGAIN ? errno : ETIMEDOUT);
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/*
+* The request line and headers, held back to go out with
+* the start of the body if there is one.
+*/
+int
+HttpConnection::send_head(const char *path, const char *headers,
+  int64_t length)
+{
+  if(this->fd < 0)
+    return ENOTCONN;
+  size_t size = strlen(path) + strlen(headers) + strlen(this->host_header)
+    + 96;
+  char *head = (char*)malloc(size);
+  if(head == NULL)
+    return ENOMEM;
+  int used = snprintf(head, size, "POST %s HTTP/1.1\r\n%s%s"
+    "Content-Length: %lld\r\n\r\n", path, this->host_header, headers,
+    (long long)length);
+  int err = 0;
+#ifdef HTTP_TLS
+  if(this->tls != NULL)
+    err = write_all(head, used);
+  else
+#endif
+  {
+    const char *pos = head;
+    size_t left = used;
+    while(left > 0 && err == 0)
+    {
+      ssize_t written = send(this->fd, pos, left,
+        MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0));
+      if(written < 0 && errno == EINTR)
+        continue;
+      if(written <= 0)
+        err = fail(written < 0 && errno != EAGAIN ? errno : ETIMEDOUT);
+      else
+      {
+        pos += written;
+        left -= written;
+      }
+    }
+  }
+  free(head);
+  return err;
+}
+
+int
+HttpConnection::Send(const char *path, const char *headers, const char *body,
+  size_t length)
+{
+  int err = send_head(path, headers, length);
+  if(err == 0 && length > 0)
+    err = write_all(body, length);
+  return err;
+}
+
+int
+HttpConnection::SendFile(const char *path, const char *headers, int file,
+  off_t offset, int64_t length, Throttle *throttle)
+{
+  //a mapping past the end of the file would fault
+  struct stat st;
+  if(fstat(file, &st) != 0)
+    return errno;
+  if(offset + length > st.st_size)
+    return EIO;
+  int err = send_head(path, headers, length);
+  if(err == 0)
+    err = write_file(file, offset, length, throttle);
+  return err;
+}
+
+/*
+* The body of a request, from the file. Each piece waits
+* for the throttle first, and is small if it's limited
+* (the limit can change while it's going).
+*/
+int
+HttpConnection::write_file(int file, off_t offset, int64_t length,
+  Throttle *throttle)
+{
+#ifdef __linux__
+#ifdef HTTP_TLS
+  if(this->tls == NULL)
+#endif
+  {
+    while(length > 0)
+    {
+      bool limited = throttle != NULL && throttle->Limited(THROTTLE_UP);
+      int64_t piece = limited ? (int64_t)HTTP_PIECE_SIZE : HTTP_FILE_PIECE;
+      if(piece > length)
+        piece = length;
+      if(limited)
+        throttle->Take(THROTTLE_UP, piece);
+      ssize_t sent = sendfile(this->fd, file, &offset, piece);
+      if(sent < 0 && errno == EINTR)
+        continue;
+      if(sent < 0)
+        return fail(errno == EAGAIN ? ETIMEDOUT : errno);
+      if(sent == 0)
+        return fail(EIO); //the file got shorter
+      length -= sent;
+    }
+    return 0;
+  }
+#endif
+  long page = sysconf(_SC_PAGESIZE);
+  while(length > 0)
+  {
+    off_t start = offset - offset % page;
+    size_t skip = offset - start;
+    size_t window = length + skip < HTTP_FILE_PIECE
+      ? (size_t)(length + skip) : (size_t)HTTP_FILE_PIECE;
+    char *mapped = (char*)mmap(NULL, window, PROT_READ, MAP_SHARED, file,
+      start);
+    if(mapped == MAP_FAILED)
+      return fail(errno);
+    size_t sent = skip;
+    int err = 0;
+    while(sent < window && err == 0)
+    {
+      bool limited = throttle != NULL && throttle->Limited(THROTTLE_UP);
+      size_t piece = window - sent;
+      if(limited && piece > HTTP_PIECE_SIZE)
+        piece = HTTP_PIECE_SIZE;
+      if(limited)
+        throttle->Take(THROTTLE_UP, piece);
+      err = write_all(mapped + sent, piece);
+      sent += piece;
+    }
+    munmap(mapped, window);
+    if(err != 0)
+      return err;
+    offset += window - skip;
+    length -= window - skip;
+  }
+  return 0;
+}
+
+//read more into the buffer, 0 if the server closed it
+int
+HttpConnection::fill(void)
+{
+  if(this->buffer_start > 0)
+  {
+    memmove(this->buffer, this->buffer + this->buffer_start,
+      this->buffer_end - this->buffer_start);
+    this->buffer_end -= this->buffer_start;
+    this->buffer_start = 0;
+  }
+  if(this->buffer_end == HTTP_BUFFER_SIZE)
+    return -1;
+  ssize_t got = read_some(this->buffer + this->buffer_end,
+    HTTP_BUFFER_SIZE - this->buffer_end);
+  if(got > 0)
+    this->buffer_end += got;
+  return got < 0 ? -1 : (int)got;
+}
+
+/*
+* Read up to the blank line after the headers, and keep
+* what they say about the body. The headers are kept as
+* "name\0value\0" pairs, the names lower cased.
+*/
+int
+HttpConnection::ReadHeaders(void)
+{
+  if(this->fd < 0)
+    return ENOTCONN;
+  while(true)
+  {
+    char *end = NULL;
+    while(true)
+    {
+      size_t held = this->buffer_end - this->buffer_start;
+      char *start = this->buffer + this->buffer_start;
+      for(size_t i = 0; i + 3 < held && end == NULL; i++)
+        if(memcmp(start + i, "\r\n\r\n", 4) == 0)
+          end = start + i;
+      if(end != NULL)
+        break;
+      int got = fill();
+      if(got < 0 && this->buffer_end == HTTP_BUFFER_SIZE)
+        return fail(EPROTO);
+      if(got <= 0)
+        return fail(got == 0 ? ECONNRESET : errno);
+    }
+
+    char *line = this->buffer + this->buffer_start;
+    this->buffer_start = end + 4 - this->buffer;
+    int major, minor, status;
+    if(sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3)
+      return fail(EPROTO);
+    if(status >= 100 && status < 200)
+      continue; //100 Continue, the real answer comes after
+
+    free(this->headers);
+    this->headers = (char*)malloc(end - line + 3);
+    if(this->headers == NULL)
+      return fail(ENOMEM);
+    char *out = this->headers;
+    char *next = line;
+    while(memcmp(next, "\r\n", 2) != 0)
+      next++;
+    next += 2;
+    while(next < end + 2)
+    {
+      char *stop = next;
+      while(stop < end && memcmp(stop, "\r\n", 2) != 0)
+        stop++;
+      char *colon = (char*)memchr(next, ':', stop - next);
+      if(colon != NULL)
+      {
+        for(char *c = next; c < colon; c++)
+          *out++ = tolower(*c);
+        *out++ = '\0';
+        colon++;
+        while(colon < stop && (*colon == ' ' || *colon == '\t'))
+          colon++;
+        memcpy(out, colon, stop - colon);
+        out += stop - colon;
+        *out++ = '\0';
+      }
+      next = stop + 2;
+    }
+    *out = '\0';
+
+    this->status = status;
+    const char *length = Header("content-length");
+    this->content_length = length != NULL ? strtoll(length, NULL, 10) : -1;
+    const char *coding = Header("transfer-encoding");
+    this->chunked = coding != NULL && strcasecmp(coding, "chunked") == 0;
+    const char *connection = Header("connection");
+    this->closing = minor == 0 && major == 1
+      ? connection == NULL || strcasecmp(connection, "keep-alive") != 0
+      : connection != NULL && strcasecmp(connection, "close") == 0;
+    if(status == 204 || status == 304)
+      this->content_length = 0;
+    return 0;
+  }
+}
+
+const char *
+HttpConnection::Header(const char *name) const
+{
+  if(this->headers == NULL)
+    return NULL;
+  const char *pos = this->headers;
+  while(*pos != '\0')
+  {
+    const char *value = pos + strlen(pos) + 1;
+    if(strcasecmp(pos, name) == 0)
+      return value;
+    pos = value + strlen(value) + 1;
+  }
+  return NULL;
+}
+
+int
+HttpConnection::finish_body(void)
+{
+  if(this->closing)
+    Close();
+  return 0;
+}
+
+//a body sent in chunks, each after its size in hex
+int
+HttpConnection::read_chunked(char **body, size_t *length)
+{
+  size_t size = 0, space = 4096;
+  char *data = (char*)malloc(space);
+  if(data == NULL)
+    return fail(ENOMEM);
+  bool trailer = false;
+  while(true)
+  {
+    char *line_end;
+    while((line_end = (char*)memchr(this->buffer + this->buffer_start, '\n',
+      this->buffer_end - this->buffer_start)) == NULL)
+    {
+      int got = fill();
+      if(got <= 0)
+      {
+        free(data);
+        return fail(got == 0 ? ECONNRESET : EPROTO);
+      }
+    }
+    char *line = this->buffer + this->buffer_start;
+    this->buffer_start = line_end + 1 - this->buffer;
+    if(trailer)
+    {
+      if(line_end - line <= 1)
+        break; //the blank line at the very end
+      continue;
+    }
+    size_t chunk = strtoul(line, NULL, 16);
+    if(chunk == 0)
+    {
+      trailer = true;
+      continue;
+    }
+    if(size + chunk + 1 > space)
+    {
+      while(size + chunk + 1 > space)
+        space *= 2;
+      char *bigger = (char*)realloc(data, space);
+      if(bigger == NULL)
+      {
+        free(data);
+        return fail(ENOMEM);
+      }
+      data = bigger;
+    }
+    //the chunk and the CRLF after it
+    size_t wanted = chunk + 2;
+    while(wanted > 0)
+    {
+      if(this->buffer_start == this->buffer_end && fill() <= 0)
+      {
+        free(data);
+        return fail(ECONNRESET);
+      }
+      size_t take = this->buffer_end - this->buffer_start;
+      if(take > wanted)
+        take = wanted;
+      size_t keep = wanted > 2 ? wanted - 2 : 0;
+      memcpy(data + size, this->buffer + this->buffer_start,
+        take < keep ? take : keep);
+      size += take < keep ? take : keep;
+      this->buffer_start += take;
+      wanted -= take;
+    }
+  }
+  data[size] = '\0';
+  *body = data;
+  *length = size;
+  return finish_body();
+}
+
+int
+HttpConnection::ReadBody(char **body, size_t *length)
+{
+  if(this->chunked)
+    return read_chunked(body, length);
+  int64_t expected = this->content_length;
+  size_t space = expected >= 0 ? (size_t)expected + 1 : 4096;
+  char *data = (char*)malloc(space);
+  if(data == NULL)
+    return fail(ENOMEM);
+  size_t size = 0;
+  while(expected < 0 || size < (size_t)expected)
+  {
+    if(size + 1 >= space)
+    {
+      char *bigger = (char*)realloc(data, space * 2);
+      if(bigger == NULL)
+      {
+        free(data);
+        return fail(ENOMEM);
+      }
+      data = bigger;
+      space *= 2;
+    }
+    size_t want = (expected >= 0 ? (size_t)expected : space - 1) - size;
+    size_t held = this->buffer_end - this->buffer_start;
+    if(held > 0)
+    {
+      size_t take = held < want ? held : want;
+      memcpy(data + size, this->buffer + this->buffer_start, take);
+      this->buffer_start += take;
+      size += take;
+      continue;
+    }
+    ssize_t got = read_some(data + size, want);
+    if(got == 0 && expected < 0)
+    {
+      this->closing = true; //it ends where the connection does
+      break;
+    }
+    if(got <= 0)
+    {
+      free(data);
+      return fail(got == 0 ? ECONNRESET : errno);
+    }
+    size += got;
+  }
+  data[size] = '\0';
+  *body = data;
+  *length = size;
+  return finish_body();
+}
+
+int
+HttpConnection::CopyBody(int file, int64_t *copied, Throttle *throttle,
+  volatile int *stop)
+{
+  *copied = 0;
+  if(this->chunked)
+  {
+    //Dropbox gives downloads a length, this is just in case
+    char *body;
+    size_t length;
+    int err = ReadBody(&body, &length);
+    if(err != 0)
+      return err;
+    for(size_t written = 0; written < length; )
+    {
+      ssize_t put = write(file, body + written, length - written);
+      if(put < 0 && errno == EINTR)
+        continue;
+      if(put <= 0)
+      {
+        free(body);
+        return errno;
+      }
+      written += put;
+      *copied += put;
+    }
+    free(body);
+    return 0;
+  }
+
+  int64_t left = this->content_length; //-1 until it's closed
+  bool spliced = false;
+#ifdef __linux__
+  spliced = true;
+#ifdef HTTP_TLS
+  spliced = this->tls == NULL;
+#endif
+  if(spliced && this->pipe_fds[0] < 0)
+  {
+    if(pipe(this->pipe_fds) != 0)
+    {
+      this->pipe_fds[0] = this->pipe_fds[1] = -1;
+      spliced = false;
+    }
+    else
+    {
+      fcntl(this->pipe_fds[0], F_SETFD, FD_CLOEXEC);
+      fcntl(this->pipe_fds[1], F_SETFD, FD_CLOEXEC);
+      fcntl(this->pipe_fds[1], F_SETPIPE_SZ, HTTP_PIPE_SIZE);
+    }
+  }
+#endif
+
+  while(left != 0)
+  {
+    bool limited = throttle != NULL && throttle->Limited(THROTTLE_DOWN);
+    size_t piece = limited ? HTTP_PIECE_SIZE : (size_t)HTTP_PIPE_SIZE;
+    if(left > 0 && (int64_t)piece > left)
+      piece = left;
+    ssize_t got;
+    size_t held = this->buffer_end - this->buffer_start;
+    if(held > 0 || !spliced)
+    {
+      //what came with the headers, or without splice()
+      if(held == 0)
+      {
+        int filled = fill();
+        if(filled == 0 && left < 0)
+        {
+          this->closing = true;
+          break;
+        }
+        if(filled <= 0)
+          return fail(filled == 0 ? ECONNRESET : errno);
+        held = this->buffer_end - this->buffer_start;
+      }
+      got = held < piece ? held : piece;
+      for(ssize_t written = 0; written < got; )
+      {
+        ssize_t put = write(file, this->buffer + this->buffer_start + written,
+          got - written);
+        if(put < 0 && errno == EINTR)
+          continue;
+        if(put <= 0)
+          return fail(errno);
+        written += put;
+      }
+      this->buffer_start += got;
+    }
+#ifdef __linux__
+    else
+    {
+      do
+        got = splice(this->fd, NULL, this->pipe_fds[1], NULL, piece,
+          SPLICE_F_MOVE | SPLICE_F_MORE);
+      while(got < 0 && errno == EINTR);
+      if(got == 0 && left < 0)
+      {
+        this->closing = true;
+        break;
+      }
+      if(got <= 0)
+        return fail(got == 0 ? ECONNRESET : errno == EAGAIN ? ETIMEDOUT
+          : errno);
+      for(ssize_t moved = 0; moved < got; )
+      {
+        ssize_t put = splice(this->pipe_fds[0], NULL, file, NULL,
+          got - moved, SPLICE_F_MOVE);
+        if(put < 0 && errno == EINTR)
+          continue;
+        if(put <= 0)
+          return fail(put == 0 ? EIO : errno);
+        moved += put;
+      }
+    }
+#endif
+    *copied += got;
+    if(left > 0)
+      left -= got;
+    if(throttle != NULL)
+      throttle->Take(THROTTLE_DOWN, got);
+    if(left != 0 && stop != NULL && *stop)
+      return fail(ECANCELED);
+  }
+  return finish_body();
+}
@@ -0,0 +1,97 @@
+#ifndef HTTP_CONNECTION_H
+#define HTTP_CONNECTION_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef HTTP_TLS
+#include <openssl/ssl.h>
+#endif
+
+class Throttle;
+
+//how much of a response is read at a time, and the most
+//its status line and headers can take
+const size_t HTTP_BUFFER_SIZE = 64 * 1024;
+//how much of a file body goes at a time when it's kept
+//to a limit or can be stopped part way
+const size_t HTTP_PIECE_SIZE = 64 * 1024;
+
+/*
+* One HTTP/1.1 connection, kept open from one request to
+* the next, for DropboxApi. A request is a POST whose body
+* comes from memory, or straight from a file: sendfile() on
+* Linux, and written from a mapping of the file otherwise
+* (or over TLS), so it isn't copied on the way. A response
+* body comes back into memory, or straight into a file:
+* splice() through a pipe on Linux, so it doesn't pass
+* through here either.
+*
+* Plain HTTP is all it speaks unless it's built with
+* HTTP_TLS (and OpenSSL), which https needs.
+*
+* Everything returns 0 or an errno, EPROTO for a server
+* that doesn't talk HTTP, ECONNRESET for one that went
+* away. After an error the connection is closed.
+*/
+class HttpConnection
+{
+public:
+  HttpConnection(void);
+  ~HttpConnection(void);
+
+  int Connect(const char *host, int port, bool secure, int timeout);
+  void Close(void);
+  bool Connected(void) const { return fd >= 0; }
+
+  //headers are "Name: value\r\n" lines, Host and
+  //Content-Length are added
+  int Send(const char *path, const char *headers, const char *body,
+    size_t length);
+  int SendFile(const char *path, const char *headers, int file,
+    off_t offset, int64_t length, Throttle *throttle);
+
+  //reads the status line and headers of the response
+  int ReadHeaders(void);
+  int Status(void) const { return status; }
+  //a header of the response, NULL if it hasn't one
+  const char *Header(const char *name) const;
+  //-1 if the response doesn't say
+  int64_t ContentLength(void) const { return content_length; }
+
+  //the whole body, NUL terminated (free() it)
+  int ReadBody(char **body, size_t *length);
+  //the body, written to file at its offset. stop is looked
+  //at between pieces, and ECANCELED returned if it's set.
+  //copied is how much got to the file either way.
+  int CopyBody(int file, int64_t *copied, Throttle *throttle,
+    volatile int *stop);
+
+private:
+  int send_head(const char *path, const char *headers, int64_t length);
+  int write_all(const char *data, size_t size);
+  int write_file(int file, off_t offset, int64_t length, Throttle *throttle);
+  ssize_t read_some(char *data, size_t size);
+  int fill(void);
+  int read_chunked(char **body, size_t *length);
+  int finish_body(void);
+  int fail(int err);
+
+  int fd;
+#ifdef HTTP_TLS
+  SSL *tls;
+#endif
+  char *host_header;
+  char *buffer; //what's been read and not used yet
+  size_t buffer_start;
+  size_t buffer_end;
+  char *headers; //of the last response, names lower cased
+  int status;
+  int64_t content_length;
+  bool chunked;
+  bool closing; //the server closes it after this response
+  int pipe_fds[2]; //for splice(), -1 until needed
+};
+
+#endif
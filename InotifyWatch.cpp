@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "InotifyWatch.h"
+#include "Trace.h"
+
+//enough for a burst of events without going back for more
+const size_t INOTIFY_BUFFER_SIZE = 64 * 1024;
+
+const uint32_t DIRECTORY_EVENTS = IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO
+  | IN_DELETE_SELF | IN_MOVE_SELF;
+const uint32_t FILE_EVENTS = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+  | IN_DELETE_SELF | IN_MOVE_SELF;
+
+struct InotifyNode
+{
+  dev_t device;
+  ino_t node;
+  bool used;
+  char *path; //directories only, NULL otherwise
+};
+
+InotifyWatch::InotifyWatch(void)
+  : init_error(0),
+    nodes(NULL),
+    node_space(0),
+    watched(0),
+    buffered(0),
+    offset(0),
+    move_cookie(0),
+    move_from(-1),
+    move_reported(false),
+    moved_device(0),
+    moved_node(0)
+{
+  this->fd = inotify_init1(IN_CLOEXEC);
+  if(this->fd < 0)
+    this->init_error = errno;
+  this->buffer = (char*)malloc(INOTIFY_BUFFER_SIZE);
+  this->name[0] = '\0';
+}
+
+InotifyWatch::~InotifyWatch(void)
+{
+  if(this->fd >= 0)
+    close(this->fd);
+  for(size_t i = 0; i < this->node_space; i++)
+    free(this->nodes[i].path);
+  free(this->nodes);
+  free(this->buffer);
+}
+
+InotifyNode *
+InotifyWatch::node_for(int wd) const
+{
+  if(wd < 0 || (size_t)wd >= this->node_space || !this->nodes[wd].used)
+    return NULL;
+  return &this->nodes[wd];
+}
+
+int
+InotifyWatch::Watch(const char *path, dev_t device, ino_t node, bool directory)
+{
+  if(this->fd < 0)
+    return this->init_error;
+  struct stat st;
+  if(lstat(path, &st) != 0)
+    return errno;
+  if(st.st_dev != device || st.st_ino != node)
+    return ENOENT;
+
+  int wd = inotify_add_watch(this->fd, path,
+    (directory ? DIRECTORY_EVENTS : FILE_EVENTS) | IN_DONT_FOLLOW);
+  if(wd < 0)
+    return errno;
+  if((size_t)wd >= this->node_space)
+  {
+    size_t space = this->node_space < 64 ? 64 : this->node_space;
+    while(space <= (size_t)wd)
+      space *= 2;
+    InotifyNode *grown = (InotifyNode*)realloc(this->nodes, space * sizeof(InotifyNode));
+    if(grown == NULL)
+    {
+      inotify_rm_watch(this->fd, wd);
+      return ENOMEM;
+    }
+    memset(grown + this->node_space, 0, (space - this->node_space) * sizeof(InotifyNode));
+    this->nodes = grown;
+    this->node_space = space;
+  }
+  //the same node watched again gets the same descriptor
+  InotifyNode *watched_node = &this->nodes[wd];
+  if(!watched_node->used)
+    this->watched++;
+  watched_node->device = device;
+  watched_node->node = node;
+  watched_node->used = true;
+  free(watched_node->path);
+  watched_node->path = directory ? strdup(path) : NULL;
+  return 0;
+}
+
+void
+InotifyWatch::forget(int wd)
+{
+  InotifyNode *gone = node_for(wd);
+  if(gone == NULL)
+    return;
+  free(gone->path);
+  gone->path = NULL;
+  gone->used = false;
+  this->watched--;
+}
+
+//what's called name in a watched directory
+bool
+InotifyWatch::lookup(const InotifyNode *dir, const char *name, struct stat *st)
+{
+  if(dir == NULL || dir->path == NULL)
+    return false;
+  char path[PATH_MAX];
+  if((size_t)snprintf(path, sizeof(path), "%s/%s", dir->path, name) >= sizeof(path))
+    return false;
+  return lstat(path, st) == 0;
+}
+
+/*
+* A watched directory moved from one path to another,
+* and so did every watched directory in it.
+*/
+void
+InotifyWatch::moved_directory(const char *from, const char *to)
+{
+  size_t from_length = strlen(from);
+  size_t to_length = strlen(to);
+  for(size_t i = 0; i < this->node_space; i++)
+  {
+    char *path = this->nodes[i].path;
+    if(path == NULL || strncmp(path, from, from_length) != 0
+      || (path[from_length] != '/' && path[from_length] != '\0'))
+      continue;
+    size_t rest = strlen(path + from_length);
+    char *moved = (char*)malloc(to_length + rest + 1);
+    if(moved == NULL)
+      continue;
+    memcpy(moved, to, to_length);
+    memcpy(moved + to_length, path + from_length, rest + 1);
+    free(path);
+    this->nodes[i].path = moved;
+  }
+}
+
+/*
+* Turn an inotify event into an FsEvent,
+* false if it isn't one SyncEngine wants.
+*/
+bool
+InotifyWatch::translate(const struct inotify_event *raw, FsEvent *event)
+{
+  InotifyNode *watched_node = node_for(raw->wd);
+  //an IN_MOVE_SELF straight after the IN_MOVED_TO that reported it
+  bool move_self_reported = this->move_reported && (raw->mask & IN_MOVE_SELF) != 0
+    && watched_node != NULL && watched_node->device == this->moved_device
+    && watched_node->node == this->moved_node;
+  this->move_reported = false;
+
+  if((raw->mask & IN_Q_OVERFLOW) != 0)
+  {
+    TRACE(TRACE_ERROR, "inotify queue overflowed, events were lost");
+    return false;
+  }
+  if((raw->mask & IN_IGNORED) != 0)
+  {
+    forget(raw->wd);
+    return false;
+  }
+  if(watched_node == NULL)
+    return false;
+
+  memset(event, 0, sizeof(*event));
+  event->device = watched_node->device;
+  event->name = this->name;
+  struct stat st;
+  if((raw->mask & IN_CREATE) != 0)
+  {
+    if(!lookup(watched_node, raw->name, &st))
+      return false;
+    event->kind = FS_CREATED;
+    event->node = st.st_ino;
+    event->directory = watched_node->node;
+    strcpy(this->name, raw->name);
+    return true;
+  }
+  if((raw->mask & IN_MOVED_FROM) != 0)
+  {
+    this->move_cookie = raw->cookie;
+    this->move_from = raw->wd;
+    return false;
+  }
+  if((raw->mask & IN_MOVED_TO) != 0)
+  {
+    InotifyNode *from = NULL;
+    if(this->move_from >= 0 && this->move_cookie == raw->cookie)
+      from = node_for(this->move_from);
+    this->move_from = -1;
+    if(!lookup(watched_node, raw->name, &st))
+      return false;
+    event->kind = FS_MOVED;
+    event->node = st.st_ino;
+    event->directory = watched_node->node;
+    event->from_directory = from != NULL ? from->node : 0;
+    strcpy(this->name, raw->name);
+    if(S_ISDIR(st.st_mode))
+    {
+      for(size_t i = 0; i < this->node_space; i++)
+      {
+        InotifyNode *moved = &this->nodes[i];
+        if(moved->used && moved->path != NULL && moved->device == st.st_dev
+          && moved->node == st.st_ino)
+        {
+          char to[PATH_MAX];
+          snprintf(to, sizeof(to), "%s/%s", watched_node->path, raw->name);
+          char *old = strdup(moved->path);
+          if(old != NULL)
+            moved_directory(old, to);
+          free(old);
+          break;
+        }
+      }
+    }
+    this->move_reported = true;
+    this->moved_device = st.st_dev;
+    this->moved_node = st.st_ino;
+    return true;
+  }
+  if((raw->mask & IN_MOVE_SELF) != 0)
+  {
+    if(move_self_reported)
+      return false;
+    //nothing watched took it in, so it's gone from the folder
+    event->kind = FS_MOVED;
+    event->node = watched_node->node;
+    this->name[0] = '\0';
+    inotify_rm_watch(this->fd, raw->wd);
+    return true;
+  }
+  if((raw->mask & IN_DELETE_SELF) != 0)
+  {
+    event->kind = FS_REMOVED;
+    event->node = watched_node->node;
+    return true;
+  }
+  if((raw->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE)) != 0)
+  {
+    event->kind = FS_CHANGED;
+    event->node = watched_node->node;
+    return true;
+  }
+  return false;
+}
+
+//read more events, false if none came in time
+bool
+InotifyWatch::fill(int timeout_ms)
+{
+  struct pollfd waiting;
+  waiting.fd = this->fd;
+  waiting.events = POLLIN;
+  if(poll(&waiting, 1, timeout_ms) <= 0)
+    return false;
+  ssize_t got = read(this->fd, this->buffer, INOTIFY_BUFFER_SIZE);
+  if(got <= 0)
+    return false;
+  this->buffered = got;
+  this->offset = 0;
+  return true;
+}
+
+bool
+InotifyWatch::Next(FsEvent *event, int timeout_ms)
+{
+  if(this->fd < 0 || this->buffer == NULL)
+    return false;
+  for(;;)
+  {
+    if(this->offset >= this->buffered && !fill(timeout_ms))
+      return false;
+    const struct inotify_event *raw = (const struct inotify_event*)(this->buffer + this->offset);
+    this->offset += sizeof(struct inotify_event) + raw->len;
+    if(translate(raw, event))
+      return true;
+  }
+}
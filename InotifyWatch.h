@@ -0,0 +1,73 @@
+#ifndef INOTIFY_WATCH_H
+#define INOTIFY_WATCH_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FsWatch.h"
+
+struct InotifyNode;
+
+/*
+* FsWatch on Linux's inotify, so SyncEngine can be run
+* (and profiled) off Haiku.
+*
+* inotify names what changed in a directory, not its node,
+* so the directories' paths are kept (and kept up to date
+* as they move) to look the nodes up by. A move out of the
+* watched folders only shows up as the node's own
+* IN_MOVE_SELF, with no IN_MOVED_TO to pair it with.
+* Files are watched one by one, as the node monitor does it.
+*/
+class InotifyWatch: public FsWatch
+{
+public:
+  InotifyWatch(void);
+  ~InotifyWatch(void);
+
+  //0 or an errno
+  int InitCheck(void) const { return fd < 0 ? init_error : 0; }
+  int Fd(void) const { return fd; }
+
+  int Watch(const char *path, dev_t device, ino_t node, bool directory);
+
+  //the next event, waiting up to timeout_ms for one (-1 for
+  //as long as it takes), false if none came; the name lasts
+  //until the next call
+  bool Next(FsEvent *event, int timeout_ms);
+
+  size_t CountWatched(void) const { return watched; }
+
+private:
+  bool fill(int timeout_ms);
+  bool translate(const struct inotify_event *raw, FsEvent *event);
+  InotifyNode *node_for(int wd) const;
+  bool lookup(const InotifyNode *dir, const char *name, struct stat *st);
+  void moved_directory(const char *from, const char *to);
+  void forget(int wd);
+
+  int fd;
+  int init_error;
+  InotifyNode *nodes; //indexed by watch descriptor
+  size_t node_space;
+  size_t watched;
+
+  char *buffer; //events read, and how far they've been handed out
+  size_t buffered;
+  size_t offset;
+
+  //IN_MOVED_FROM waiting for its IN_MOVED_TO
+  uint32_t move_cookie;
+  int move_from;
+  //the node the last IN_MOVED_TO reported, whose IN_MOVE_SELF
+  //is to be ignored
+  bool move_reported;
+  dev_t moved_device;
+  ino_t moved_node;
+
+  char name[NAME_MAX + 1];
+};
+
+#endif
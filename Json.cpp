@@ -0,0 +1,559 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Json.h"
+
+//how deeply arrays and objects can be nested
+const int JSON_MAX_DEPTH = 32;
+
+struct JsonReader
+{
+  const char *pos;
+  const char *end;
+};
+
+static JsonValue *parse_value(JsonReader *reader, int depth);
+
+static void
+skip_space(JsonReader *reader)
+{
+  while(reader->pos < reader->end && (*reader->pos == ' '
+    || *reader->pos == '\t' || *reader->pos == '\n' || *reader->pos == '\r'))
+    reader->pos++;
+}
+
+static bool
+skip_word(JsonReader *reader, const char *word)
+{
+  size_t length = strlen(word);
+  if((size_t)(reader->end - reader->pos) < length
+    || memcmp(reader->pos, word, length) != 0)
+    return false;
+  reader->pos += length;
+  return true;
+}
+
+static JsonValue *
+new_value(int type)
+{
+  JsonValue *value = (JsonValue*)calloc(1, sizeof(JsonValue));
+  if(value != NULL)
+    value->type = type;
+  return value;
+}
+
+static int
+hex_digit(char c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+//the four hex digits after a \u, -1 if they aren't
+static long
+read_hex4(JsonReader *reader)
+{
+  if(reader->end - reader->pos < 4)
+    return -1;
+  long code = 0;
+  for(int i = 0; i < 4; i++)
+  {
+    int digit = hex_digit(reader->pos[i]);
+    if(digit < 0)
+      return -1;
+    code = code * 16 + digit;
+  }
+  reader->pos += 4;
+  return code;
+}
+
+static char *
+put_utf8(char *out, long code)
+{
+  if(code < 0x80)
+    *out++ = (char)code;
+  else if(code < 0x800)
+  {
+    *out++ = (char)(0xc0 | (code >> 6));
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  else if(code < 0x10000)
+  {
+    *out++ = (char)(0xe0 | (code >> 12));
+    *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  else
+  {
+    *out++ = (char)(0xf0 | (code >> 18));
+    *out++ = (char)(0x80 | ((code >> 12) & 0x3f));
+    *out++ = (char)(0x80 | ((code >> 6) & 0x3f));
+    *out++ = (char)(0x80 | (code & 0x3f));
+  }
+  return out;
+}
+
+/*
+* A string, reader at its opening quote. The escapes
+* are never longer than what they stand for, so the
+* string fits in as many bytes as it took in the text.
+*/
+static char *
+parse_string(JsonReader *reader)
+{
+  reader->pos++;
+  const char *start = reader->pos;
+  while(reader->pos < reader->end && *reader->pos != '"')
+    reader->pos += *reader->pos == '\\' ? 2 : 1;
+  if(reader->pos >= reader->end)
+    return NULL;
+  const char *stop = reader->pos;
+  reader->pos++;
+
+  char *string = (char*)malloc(stop - start + 1);
+  if(string == NULL)
+    return NULL;
+  char *out = string;
+  JsonReader escapes = { start, stop };
+  while(escapes.pos < stop)
+  {
+    char c = *escapes.pos++;
+    if(c != '\\')
+    {
+      *out++ = c;
+      continue;
+    }
+    c = *escapes.pos++;
+    switch(c)
+    {
+      case 'b': *out++ = '\b'; break;
+      case 'f': *out++ = '\f'; break;
+      case 'n': *out++ = '\n'; break;
+      case 'r': *out++ = '\r'; break;
+      case 't': *out++ = '\t'; break;
+      case 'u':
+      {
+        long code = read_hex4(&escapes);
+        if(code >= 0xd800 && code < 0xdc00 && stop - escapes.pos >= 6
+          && escapes.pos[0] == '\\' && escapes.pos[1] == 'u')
+        {
+          //the first half of a surrogate pair
+          escapes.pos += 2;
+          long low = read_hex4(&escapes);
+          if(low < 0xdc00 || low >= 0xe000)
+            code = -1;
+          else
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+        }
+        if(code < 0)
+        {
+          free(string);
+          return NULL;
+        }
+        out = put_utf8(out, code);
+        break;
+      }
+      default: *out++ = c; break; //\" \\ and \/
+    }
+  }
+  *out = '\0';
+  return string;
+}
+
+static JsonValue *
+parse_members(JsonReader *reader, int type, int depth)
+{
+  char close = type == JSON_OBJECT ? '}' : ']';
+  JsonValue *container = new_value(type);
+  if(container == NULL)
+    return NULL;
+  reader->pos++;
+  skip_space(reader);
+  if(reader->pos < reader->end && *reader->pos == close)
+  {
+    reader->pos++;
+    return container;
+  }
+  JsonValue **tail = &container->first;
+  while(true)
+  {
+    char *key = NULL;
+    if(type == JSON_OBJECT)
+    {
+      skip_space(reader);
+      if(reader->pos >= reader->end || *reader->pos != '"'
+        || (key = parse_string(reader)) == NULL)
+        break;
+      skip_space(reader);
+      if(reader->pos >= reader->end || *reader->pos != ':')
+      {
+        free(key);
+        break;
+      }
+      reader->pos++;
+    }
+    JsonValue *member = parse_value(reader, depth + 1);
+    if(member == NULL)
+    {
+      free(key);
+      break;
+    }
+    member->key = key;
+    *tail = member;
+    tail = &member->next;
+    skip_space(reader);
+    if(reader->pos >= reader->end)
+      break;
+    if(*reader->pos == close)
+    {
+      reader->pos++;
+      return container;
+    }
+    if(*reader->pos != ',')
+      break;
+    reader->pos++;
+  }
+  json_free(container);
+  return NULL;
+}
+
+static JsonValue *
+parse_value(JsonReader *reader, int depth)
+{
+  if(depth > JSON_MAX_DEPTH)
+    return NULL;
+  skip_space(reader);
+  if(reader->pos >= reader->end)
+    return NULL;
+  JsonValue *value = NULL;
+  switch(*reader->pos)
+  {
+    case '{':
+      return parse_members(reader, JSON_OBJECT, depth);
+    case '[':
+      return parse_members(reader, JSON_ARRAY, depth);
+    case '"':
+    {
+      char *string = parse_string(reader);
+      if(string != NULL && (value = new_value(JSON_STRING)) == NULL)
+        free(string);
+      if(value != NULL)
+        value->string = string;
+      return value;
+    }
+    case 't':
+    case 'f':
+    {
+      bool truth = *reader->pos == 't';
+      if(!skip_word(reader, truth ? "true" : "false"))
+        return NULL;
+      if((value = new_value(JSON_BOOL)) != NULL)
+        value->boolean = truth;
+      return value;
+    }
+    case 'n':
+      return skip_word(reader, "null") ? new_value(JSON_NULL) : NULL;
+  }
+  const char *start = reader->pos;
+  while(reader->pos < reader->end && strchr("+-.0123456789eE", *reader->pos)
+    != NULL)
+    reader->pos++;
+  if(reader->pos == start || (value = new_value(JSON_NUMBER)) == NULL)
+    return NULL;
+  value->string = strndup(start, reader->pos - start);
+  if(value->string == NULL)
+  {
+    free(value);
+    return NULL;
+  }
+  return value;
+}
+
+JsonValue *
+json_parse(const char *text, size_t length)
+{
+  JsonReader reader = { text, text + length };
+  JsonValue *value = parse_value(&reader, 0);
+  skip_space(&reader);
+  if(value != NULL && reader.pos != reader.end)
+  {
+    json_free(value);
+    return NULL;
+  }
+  return value;
+}
+
+void
+json_free(JsonValue *value)
+{
+  while(value != NULL)
+  {
+    JsonValue *next = value->next;
+    json_free(value->first);
+    free(value->key);
+    free(value->string);
+    free(value);
+    value = next;
+  }
+}
+
+const JsonValue *
+json_get(const JsonValue *value, const char *key)
+{
+  if(value == NULL || value->type != JSON_OBJECT)
+    return NULL;
+  for(const JsonValue *member = value->first; member != NULL;
+    member = member->next)
+    if(strcmp(member->key, key) == 0)
+      return member;
+  return NULL;
+}
+
+const char *
+json_string(const JsonValue *value, const char *key)
+{
+  const JsonValue *member = json_get(value, key);
+  return member != NULL && member->type == JSON_STRING ? member->string : NULL;
+}
+
+int64_t
+json_integer(const JsonValue *value, const char *key, int64_t fallback)
+{
+  const JsonValue *member = json_get(value, key);
+  if(member == NULL || member->type != JSON_NUMBER)
+    return fallback;
+  char *end;
+  long long number = strtoll(member->string, &end, 10);
+  return *end == '\0' ? (int64_t)number : fallback;
+}
+
+double
+json_number(const JsonValue *value, const char *key, double fallback)
+{
+  const JsonValue *member = json_get(value, key);
+  if(member == NULL || member->type != JSON_NUMBER)
+    return fallback;
+  char *end;
+  double number = strtod(member->string, &end);
+  return *end == '\0' ? number : fallback;
+}
+
+bool
+json_bool(const JsonValue *value, const char *key, bool fallback)
+{
+  const JsonValue *member = json_get(value, key);
+  return member != NULL && member->type == JSON_BOOL ? member->boolean
+    : fallback;
+}
+
+const char *
+json_tag(const JsonValue *value)
+{
+  return json_string(value, ".tag");
+}
+
+JsonWriter::JsonWriter(void)
+  : text(NULL),
+    length(0),
+    space(0),
+    failed(false),
+    after_key(false),
+    depth(0)
+{
+  append("", 0);
+}
+
+JsonWriter::~JsonWriter(void)
+{
+  free(this->text);
+}
+
+void
+JsonWriter::append(const char *data, size_t size)
+{
+  if(this->failed)
+    return;
+  if(this->length + size + 1 > this->space)
+  {
+    size_t space = this->space == 0 ? 256 : this->space * 2;
+    while(space < this->length + size + 1)
+      space *= 2;
+    char *text = (char*)realloc(this->text, space);
+    if(text == NULL)
+    {
+      this->failed = true;
+      return;
+    }
+    this->text = text;
+    this->space = space;
+  }
+  memcpy(this->text + this->length, data, size);
+  this->length += size;
+  this->text[this->length] = '\0';
+}
+
+//a comma if this isn't the first thing at this depth
+void
+JsonWriter::value_start(void)
+{
+  if(this->after_key)
+  {
+    this->after_key = false;
+    return;
+  }
+  if(this->depth > 0)
+  {
+    if(!this->first[this->depth - 1])
+      append(",", 1);
+    this->first[this->depth - 1] = false;
+  }
+}
+
+void
+JsonWriter::BeginObject(void)
+{
+  value_start();
+  append("{", 1);
+  if(this->depth < JSON_MAX_DEPTH)
+    this->first[this->depth++] = true;
+  else
+    this->failed = true;
+}
+
+void
+JsonWriter::EndObject(void)
+{
+  append("}", 1);
+  if(this->depth > 0)
+    this->depth--;
+}
+
+void
+JsonWriter::BeginArray(void)
+{
+  value_start();
+  append("[", 1);
+  if(this->depth < JSON_MAX_DEPTH)
+    this->first[this->depth++] = true;
+  else
+    this->failed = true;
+}
+
+void
+JsonWriter::EndArray(void)
+{
+  append("]", 1);
+  if(this->depth > 0)
+    this->depth--;
+}
+
+void
+JsonWriter::Key(const char *key)
+{
+  value_start();
+  append_string(key);
+  append(":", 1);
+  this->after_key = true;
+}
+
+/*
+* A string, quoted, with control characters and anything
+* past ASCII escaped (UTF-16 surrogate pairs for what's
+* past the BMP). Bytes that aren't UTF-8 go as U+FFFD.
+*/
+void
+JsonWriter::append_string(const char *string)
+{
+  append("\"", 1);
+  const unsigned char *pos = (const unsigned char*)string;
+  while(*pos != '\0')
+  {
+    const unsigned char *run = pos;
+    while(*pos >= 0x20 && *pos < 0x80 && *pos != '"' && *pos != '\\')
+      pos++;
+    append((const char*)run, pos - run);
+    if(*pos == '\0')
+      break;
+
+    char escape[16];
+    long code = *pos++;
+    if(code == '"' || code == '\\')
+    {
+      escape[0] = '\\';
+      escape[1] = (char)code;
+      append(escape, 2);
+      continue;
+    }
+    if(code >= 0x80)
+    {
+      int more = code >= 0xf0 ? 3 : code >= 0xe0 ? 2 : code >= 0xc0 ? 1 : -1;
+      code &= more == 3 ? 0x07 : more == 2 ? 0x0f : 0x1f;
+      for(int i = 0; i < more; i++)
+      {
+        if((*pos & 0xc0) != 0x80)
+        {
+          more = -1;
+          break;
+        }
+        code = (code << 6) | (*pos++ & 0x3f);
+      }
+      if(more < 0 || code > 0x10ffff)
+        code = 0xfffd;
+    }
+    if(code >= 0x10000)
+    {
+      code -= 0x10000;
+      snprintf(escape, sizeof(escape), "\\u%04lx\\u%04lx",
+        0xd800 + (code >> 10), 0xdc00 + (code & 0x3ff));
+    }
+    else
+      snprintf(escape, sizeof(escape), "\\u%04lx", code);
+    append(escape, strlen(escape));
+  }
+  append("\"", 1);
+}
+
+void
+JsonWriter::String(const char *string)
+{
+  value_start();
+  append_string(string);
+}
+
+void
+JsonWriter::Integer(int64_t number)
+{
+  value_start();
+  char digits[32];
+  snprintf(digits, sizeof(digits), "%lld", (long long)number);
+  append(digits, strlen(digits));
+}
+
+void
+JsonWriter::Number(double number)
+{
+  value_start();
+  char digits[32];
+  snprintf(digits, sizeof(digits), "%.17g", number);
+  append(digits, strlen(digits));
+}
+
+void
+JsonWriter::Bool(bool value)
+{
+  value_start();
+  append(value ? "true" : "false", value ? 4 : 5);
+}
+
+void
+JsonWriter::Null(void)
+{
+  value_start();
+  append("null", 4);
+}
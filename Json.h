@@ -0,0 +1,100 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Just enough JSON for the Dropbox API, for DropboxApi:
+* parsing what it answers into a tree of JsonValues, and
+* writing the arguments it takes with JsonWriter.
+*
+* Strings are UTF-8 both ways. What JsonWriter writes
+* is ASCII, anything else escaped as \uXXXX, so it can
+* go in the Dropbox-API-Arg header.
+*/
+
+enum
+{
+  JSON_NULL = 0,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT
+};
+
+struct JsonValue
+{
+  int type;
+  char *key; //its name in the object it's in, NULL if none
+  char *string; //JSON_STRING, and the text of a JSON_NUMBER
+  bool boolean;
+  JsonValue *first; //the members of a JSON_ARRAY or JSON_OBJECT
+  JsonValue *next; //the one after it in its array or object
+};
+
+//NULL if text isn't JSON (or memory ran out)
+JsonValue *json_parse(const char *text, size_t length);
+void json_free(JsonValue *value);
+
+//a member of an object, NULL if it isn't there or value
+//isn't an object
+const JsonValue *json_get(const JsonValue *value, const char *key);
+//a string member, NULL if it isn't one
+const char *json_string(const JsonValue *value, const char *key);
+//a whole number member, fallback if it isn't one
+int64_t json_integer(const JsonValue *value, const char *key,
+  int64_t fallback);
+//any number member, fallback if it isn't one
+double json_number(const JsonValue *value, const char *key, double fallback);
+bool json_bool(const JsonValue *value, const char *key, bool fallback);
+//the ".tag" of a union, NULL if it has none
+const char *json_tag(const JsonValue *value);
+
+/*
+* Builds a JSON text, putting in the commas and colons:
+*
+*   JsonWriter arg;
+*   arg.BeginObject();
+*   arg.Key("path"); arg.String(path);
+*   arg.EndObject();
+*   header = arg.Text();
+*
+* Text() is NULL if memory ran out.
+*/
+class JsonWriter
+{
+public:
+  JsonWriter(void);
+  ~JsonWriter(void);
+
+  void BeginObject(void);
+  void EndObject(void);
+  void BeginArray(void);
+  void EndArray(void);
+  void Key(const char *key);
+  void String(const char *string);
+  void Integer(int64_t number);
+  void Number(double number); //read back as the same double
+  void Bool(bool value);
+  void Null(void);
+
+  const char *Text(void) const { return failed ? NULL : text; }
+  size_t Length(void) const { return length; }
+
+private:
+  void value_start(void);
+  void append(const char *data, size_t size);
+  void append_string(const char *string);
+
+  char *text;
+  size_t length;
+  size_t space;
+  bool failed;
+  bool after_key;
+  bool first[32]; //nothing in the array or object at each depth yet
+  int depth;
+};
+
+#endif
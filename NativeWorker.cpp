@@ -0,0 +1,1167 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ContentHash.h"
+#include "Json.h"
+#include "NativeWorker.h"
+#include "Trace.h"
+
+//as in db_worker.py
+const char *const TOKEN_FILE = "login_token_store.txt";
+const char *const SESSION_DIR = "upload_sessions";
+const char *const DELTA_PAGE_LIMIT = "500";
+const char *const LONGPOLL_TIMEOUT = "120";
+const int64_t UPLOAD_CHUNK_SIZE = 8 * 1024 * 1024;
+const int UPLOAD_READ_AHEAD = 2;
+const int UPLOAD_RETRIES = 6;
+const double RETRY_DELAY = 0.25;
+const double BATCH_CHECK_DELAY = 0.05;
+const double BATCH_CHECK_MAX = 2.0;
+
+//the most fields a request can have
+const int NATIVE_MAX_FIELDS = 2 * 1000 + 1;
+
+static void
+sleep_seconds(double seconds)
+{
+  struct timespec ts;
+  ts.tv_sec = (time_t)seconds;
+  ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+  while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+//a positive whole number from the environment, or fallback
+static int64_t
+setting(const char *name, int64_t fallback)
+{
+  const char *value = getenv(name);
+  if(value == NULL)
+    return fallback;
+  char *end;
+  long long number = strtoll(value, &end, 10);
+  return end != value && *end == '\0' && number > 0 ? (int64_t)number
+    : fallback;
+}
+
+//whether it's worth sending the same thing again
+static bool
+retriable(int status)
+{
+  return status == 0 || status == 429 || status >= 500;
+}
+
+static int
+write_all(int fd, const char *data, size_t size)
+{
+  while(size > 0)
+  {
+    ssize_t written = write(fd, data, size);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+      return -1;
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+static int
+read_all(int fd, char *data, size_t size)
+{
+  while(size > 0)
+  {
+    ssize_t got = read(fd, data, size);
+    if(got < 0 && errno == EINTR)
+      continue;
+    if(got <= 0)
+      return -1;
+    data += got;
+    size -= got;
+  }
+  return 0;
+}
+
+bool
+native_transport(void)
+{
+  const char *transport = getenv("DBFORHAIKU_TRANSPORT");
+  if(transport == NULL || strcmp(transport, "native") != 0)
+    return false;
+  if(DropboxApi::Reachable())
+    return true;
+  TRACE(TRACE_ERROR, "This build can't reach Dropbox without TLS, "
+    "using db_worker.py");
+  return false;
+}
+
+NativeWorker::NativeWorker(void)
+  : api(NULL),
+    started(false),
+    in_fd(-1),
+    out_fd(-1),
+    as_lines(false),
+    pause_wanted(0),
+    answer_count(0)
+{
+  this->chunk_size = setting("DBFORHAIKU_CHUNK_KB", 0) * 1024;
+  if(this->chunk_size <= 0)
+    this->chunk_size = UPLOAD_CHUNK_SIZE;
+  this->read_ahead = (int)setting("DBFORHAIKU_READ_AHEAD", UPLOAD_READ_AHEAD);
+  this->failure[0] = '\0';
+}
+
+NativeWorker::~NativeWorker(void)
+{
+  Join();
+  delete this->api;
+}
+
+int
+NativeWorker::Start(int in_fd, int out_fd)
+{
+  this->in_fd = in_fd;
+  this->out_fd = out_fd;
+  int err = pthread_create(&this->thread, NULL, run_thread, this);
+  this->started = err == 0;
+  return err;
+}
+
+void *
+NativeWorker::run_thread(void *data)
+{
+  NativeWorker *worker = (NativeWorker*)data;
+  worker->Run(worker->in_fd, worker->out_fd);
+  close(worker->in_fd);
+  close(worker->out_fd);
+  return NULL;
+}
+
+void
+NativeWorker::Join(void)
+{
+  if(!this->started)
+    return;
+  pthread_join(this->thread, NULL);
+  this->started = false;
+}
+
+/*
+* Read request frames (see db_worker.py) until the end of
+* in_fd, and answer each.
+*/
+void
+NativeWorker::Run(int in_fd, int out_fd)
+{
+  const char **fields = (const char**)malloc(NATIVE_MAX_FIELDS
+    * sizeof(char*));
+  while(fields != NULL)
+  {
+    uint32_t size;
+    if(read_all(in_fd, (char*)&size, 4) != 0)
+      break;
+    size = ntohl(size);
+    char *payload = (char*)malloc(size + 1);
+    if(payload == NULL || read_all(in_fd, payload, size) != 0)
+    {
+      free(payload);
+      break;
+    }
+    payload[size] = '\0';
+    int count = 0;
+    for(char *field = payload; count < NATIVE_MAX_FIELDS; count++)
+    {
+      fields[count] = field;
+      char *end = (char*)memchr(field, '\0', payload + size + 1 - field);
+      if(end == payload + size)
+      {
+        count++;
+        break;
+      }
+      field = end + 1;
+    }
+    Handle(fields, count, out_fd, false);
+    free(payload);
+  }
+  free(fields);
+  if(this->api != NULL)
+    this->api->Close();
+}
+
+void
+NativeWorker::send(const char *const *fields, int count)
+{
+  size_t size = 0;
+  for(int i = 0; i < count; i++)
+    size += strlen(fields[i]) + 1;
+  char *frame = (char*)malloc(size + 5);
+  if(frame == NULL)
+    return;
+  char *pos = frame + 4;
+  for(int i = 0; i < count; i++)
+  {
+    size_t length = strlen(fields[i]);
+    memcpy(pos, fields[i], length);
+    pos += length;
+    *pos++ = this->as_lines ? '\t' : '\0';
+  }
+  size = count > 0 ? size - 1 : 0; //no separator after the last
+  if(this->as_lines)
+  {
+    frame[4 + size] = '\n';
+    write_all(this->out_fd, frame + 4, size + 1);
+  }
+  else
+  {
+    uint32_t length = htonl((uint32_t)size);
+    memcpy(frame, &length, 4);
+    write_all(this->out_fd, frame, size + 4);
+  }
+  free(frame);
+}
+
+//a field of the OK answer
+void
+NativeWorker::answer(const char *string)
+{
+  if(this->answer_count < NATIVE_MAX_ANSWERS)
+    this->answers[this->answer_count++] = strdup(string != NULL ? string : "");
+}
+
+int
+NativeWorker::failed(const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(this->failure, sizeof(this->failure), format, args);
+  va_end(args);
+  return API_FAILED;
+}
+
+int
+NativeWorker::api_failed(void)
+{
+  return failed("%s", this->api->Message());
+}
+
+struct NativeOp
+{
+  const char *name;
+  int least; //arguments
+  int most;
+  int (NativeWorker::*run)(const char *const *args, int count);
+};
+
+/*
+* Perform one request and send all of its answers, as
+* Worker.handle() in db_worker.py does.
+*/
+void
+NativeWorker::Handle(const char *const *fields, int count, int out_fd,
+  bool as_lines)
+{
+  static const NativeOp ops[] = {
+    { "put", 2, 3, &NativeWorker::do_put },
+    { "get", 2, 3, &NativeWorker::do_get },
+    { "rm", 1, 1, &NativeWorker::do_rm },
+    { "mv", 2, 2, &NativeWorker::do_mv },
+    { "mkdir", 1, 1, &NativeWorker::do_mkdir },
+    { "rm_batch", 0, NATIVE_MAX_FIELDS, &NativeWorker::do_rm_batch },
+    { "mv_batch", 0, NATIVE_MAX_FIELDS, &NativeWorker::do_mv_batch },
+    { "mkdir_batch", 0, NATIVE_MAX_FIELDS, &NativeWorker::do_mkdir_batch },
+    { "delta_page", 0, 2, &NativeWorker::do_delta_page },
+    { "longpoll", 1, 2, &NativeWorker::do_longpoll },
+  };
+  this->out_fd = out_fd;
+  this->as_lines = as_lines;
+  //a pause that came too late for the last request isn't for this one
+  this->pause_wanted = 0;
+  this->answer_count = 0;
+
+  const NativeOp *op = NULL;
+  for(size_t i = 0; count > 0 && i < sizeof(ops) / sizeof(ops[0]); i++)
+    if(strcmp(fields[0], ops[i].name) == 0)
+      op = &ops[i];
+  int status;
+  if(op == NULL)
+    status = failed("unknown request");
+  else if(count - 1 < op->least || count - 1 > op->most)
+    status = failed("bad arguments to %s: takes %d to %d, not %d", op->name,
+      op->least, op->most, count - 1);
+  else if(this->api == NULL)
+  {
+    //the token cli_client.py wrote
+    char token[4096];
+    FILE *file = fopen(TOKEN_FILE, "r");
+    size_t length = file != NULL ? fread(token, 1, sizeof(token) - 1, file)
+      : 0;
+    if(file != NULL)
+      fclose(file);
+    token[length] = '\0';
+    while(length > 0 && strchr(" \t\r\n", token[length - 1]) != NULL)
+      token[--length] = '\0';
+    if(file == NULL)
+      status = failed("%s: %s", TOKEN_FILE, strerror(errno));
+    else
+    {
+      this->api = new DropboxApi(token, &this->throttle);
+      status = (this->*op->run)(fields + 1, count - 1);
+    }
+  }
+  else
+    status = (this->*op->run)(fields + 1, count - 1);
+
+  if(status == API_OK)
+  {
+    const char *reply[NATIVE_MAX_ANSWERS + 1];
+    reply[0] = "OK";
+    for(int i = 0; i < this->answer_count; i++)
+      reply[i + 1] = this->answers[i];
+    send(reply, this->answer_count + 1);
+  }
+  else if(status == API_STOPPED)
+  {
+    TRACE(TRACE_INFO, "[%s paused]", fields[0]);
+    const char *reply[1] = { "PAUSED" };
+    send(reply, 1);
+  }
+  else
+  {
+    if(op != NULL)
+      TRACE(TRACE_ERROR, "[%s failed: %s]", fields[0], this->failure);
+    const char *reply[2] = { "ERROR", this->failure };
+    send(reply, 2);
+  }
+  for(int i = 0; i < this->answer_count; i++)
+    free(this->answers[i]);
+  this->answer_count = 0;
+}
+
+//the commit argument of an upload
+static void
+write_commit(JsonWriter *arg, const char *db_path, const char *parent_rev)
+{
+  arg->BeginObject();
+  arg->Key("path");
+  arg->String(db_path);
+  arg->Key("mode");
+  arg->BeginObject();
+  if(parent_rev != NULL && parent_rev[0] != '\0')
+  {
+    arg->Key(".tag");
+    arg->String("update");
+    arg->Key("update");
+    arg->String(parent_rev);
+  }
+  else
+  {
+    arg->Key(".tag");
+    arg->String("add");
+  }
+  arg->EndObject();
+  arg->Key("autorename");
+  arg->Bool(true);
+  arg->Key("mute");
+  arg->Bool(true);
+  arg->EndObject();
+}
+
+/*
+* Upload a file. Answers with the path Dropbox stored it
+* under (it differs if there was a conflict), its new rev
+* and its content_hash.
+*/
+int
+NativeWorker::do_put(const char *const *args, int count)
+{
+  const char *local_path = args[0];
+  const char *db_path = args[1];
+  const char *parent_rev = count > 2 ? args[2] : NULL;
+  int file = open(local_path, O_RDONLY);
+  struct stat st;
+  if(file < 0 || fstat(file, &st) != 0)
+  {
+    int status = failed("%s: %s", local_path, strerror(errno));
+    if(file >= 0)
+      close(file);
+    return status;
+  }
+  if(st.st_size > this->chunk_size)
+  {
+    int status = upload_in_session(file, local_path, db_path, parent_rev);
+    close(file);
+    return status;
+  }
+
+  JsonWriter commit;
+  write_commit(&commit, db_path, parent_rev);
+  JsonValue *metadata;
+  int status = this->api->Upload("files/upload", commit.Text(), file, 0,
+    st.st_size, &metadata);
+  close(file);
+  if(status != API_OK)
+    return api_failed();
+  answer(json_string(metadata, "path_display"));
+  answer(json_string(metadata, "rev"));
+  answer(json_string(metadata, "content_hash"));
+  json_free(metadata);
+  return API_OK;
+}
+
+static uint32_t
+rotate(uint32_t value, int bits)
+{
+  return (value << bits) | (value >> (32 - bits));
+}
+
+//SHA-1, only for naming session files as db_worker.py does
+static void
+sha1(const uint8_t *data, size_t size, uint8_t digest[20])
+{
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  size_t padded = (size + 8) / 64 * 64 + 64;
+  for(size_t block = 0; block < padded; block += 64)
+  {
+    uint32_t w[80];
+    for(int i = 0; i < 16; i++)
+    {
+      w[i] = 0;
+      for(int j = 0; j < 4; j++)
+      {
+        size_t at = block + i * 4 + j;
+        uint8_t byte = at < size ? data[at] : at == size ? 0x80 : 0;
+        if(at >= padded - 8)
+          byte = (uint8_t)((uint64_t)size * 8 >> ((padded - 1 - at) * 8));
+        w[i] = (w[i] << 8) | byte;
+      }
+    }
+    for(int i = 16; i < 80; i++)
+      w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for(int i = 0; i < 80; i++)
+    {
+      uint32_t f, k;
+      if(i < 20)
+        f = (b & c) | (~b & d), k = 0x5a827999;
+      else if(i < 40)
+        f = b ^ c ^ d, k = 0x6ed9eba1;
+      else if(i < 60)
+        f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+      else
+        f = b ^ c ^ d, k = 0xca62c1d6;
+      uint32_t next = rotate(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotate(b, 30);
+      b = a;
+      a = next;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  for(int i = 0; i < 20; i++)
+    digest[i] = (uint8_t)(h[i / 4] >> (24 - i % 4 * 8));
+}
+
+/*
+* Where an upload session's progress is kept: the same
+* file db_worker.py would use, so either one can carry on
+* an upload the other started.
+*/
+static void
+session_file(const char *local_path, const char *db_path, char *path,
+  size_t size)
+{
+  size_t local_length = strlen(local_path) + 1;
+  size_t length = local_length + strlen(db_path);
+  uint8_t *name = (uint8_t*)malloc(length);
+  if(name == NULL)
+  {
+    path[0] = '\0'; //so it isn't saved
+    return;
+  }
+  memcpy(name, local_path, local_length);
+  memcpy(name + local_length, db_path, length - local_length);
+  uint8_t digest[20];
+  sha1(name, length, digest);
+  free(name);
+  int used = snprintf(path, size, "%s/", SESSION_DIR);
+  for(int i = 0; i < 20 && used + 3 < (int)size; i++)
+    used += snprintf(path + used, size - used, "%02x", digest[i]);
+}
+
+//st_mtime as Python has it, a float, which is how it's saved
+static double
+float_mtime(const struct stat *st)
+{
+  return (double)st->st_mtim.tv_sec + st->st_mtim.tv_nsec * 1e-9;
+}
+
+//the saved session id and offset, if there is one for this
+//version of the file (free the id)
+static char *
+load_session(const char *path, const struct stat *st, int64_t *offset)
+{
+  *offset = 0;
+  FILE *file = fopen(path, "r");
+  if(file == NULL)
+    return NULL;
+  char text[1024];
+  size_t length = fread(text, 1, sizeof(text), file);
+  fclose(file);
+  JsonValue *state = json_parse(text, length);
+  char *session_id = NULL;
+  if(json_integer(state, "size", -1) == st->st_size
+    && json_number(state, "mtime", -1) == float_mtime(st)
+    && json_string(state, "session_id") != NULL)
+  {
+    session_id = strdup(json_string(state, "session_id"));
+    *offset = json_integer(state, "offset", 0);
+  }
+  json_free(state);
+  return session_id;
+}
+
+static void
+save_session(const char *path, const char *session_id, int64_t offset,
+  const struct stat *st)
+{
+  mkdir(SESSION_DIR, 0755);
+  JsonWriter state;
+  state.BeginObject();
+  state.Key("session_id");
+  state.String(session_id);
+  state.Key("offset");
+  state.Integer(offset);
+  state.Key("size");
+  state.Integer(st->st_size);
+  state.Key("mtime");
+  state.Number(float_mtime(st));
+  state.EndObject();
+  char temp[1024 + 8];
+  snprintf(temp, sizeof(temp), "%s.new", path);
+  FILE *file = fopen(temp, "w");
+  if(file == NULL)
+    return;
+  bool written = state.Text() != NULL
+    && fwrite(state.Text(), 1, state.Length(), file) == state.Length();
+  if(fclose(file) == 0 && written)
+    rename(temp, path);
+}
+
+/*
+* Upload a file a chunk at a time, the last chunk going
+* with the finish, as db_worker.py does. A chunk that
+* doesn't get through is sent again, from wherever Dropbox
+* says it got up to. The chunks go from the file straight
+* to the socket, the next ones asked to be read ahead.
+*/
+int
+NativeWorker::upload_in_session(int file, const char *local_path,
+  const char *db_path, const char *parent_rev)
+{
+  struct stat st;
+  fstat(file, &st);
+  int64_t size = st.st_size;
+  char saved[1024];
+  session_file(local_path, db_path, saved, sizeof(saved));
+  int64_t offset;
+  char *session_id = load_session(saved, &st, &offset);
+  if(session_id != NULL)
+    TRACE(TRACE_INFO, "[resuming upload of %s at %lld of %lld]", local_path,
+      (long long)offset, (long long)size);
+
+  int failures = 0;
+  int status = API_OK;
+  while(true)
+  {
+    int64_t chunk_offset = offset;
+    int64_t length = size - offset < this->chunk_size ? size - offset
+      : this->chunk_size;
+    int64_t end = chunk_offset + length;
+    struct stat now;
+    if(fstat(file, &now) != 0 || now.st_size < size)
+    {
+      status = failed("%s got shorter", local_path);
+      break;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(file, end, this->chunk_size * this->read_ahead,
+      POSIX_FADV_WILLNEED);
+#endif
+
+    JsonWriter arg;
+    arg.BeginObject();
+    if(session_id != NULL)
+    {
+      arg.Key("cursor");
+      arg.BeginObject();
+      arg.Key("session_id");
+      arg.String(session_id);
+      arg.Key("offset");
+      arg.Integer(chunk_offset);
+      arg.EndObject();
+    }
+    const char *route;
+    if(session_id == NULL)
+      route = "files/upload_session/start";
+    else if(end < size)
+      route = "files/upload_session/append_v2";
+    else
+    {
+      route = "files/upload_session/finish";
+      arg.Key("commit");
+      write_commit(&arg, db_path, parent_rev);
+    }
+    if(end < size || session_id == NULL)
+    {
+      arg.Key("close");
+      arg.Bool(false);
+    }
+    arg.EndObject();
+
+    JsonValue *result;
+    status = this->api->Upload(route, arg.Text(), file, chunk_offset, length,
+      &result);
+    if(status != API_OK)
+    {
+      //finish wraps its lookup errors in lookup_failed, append doesn't
+      const JsonValue *error = this->api->Error();
+      const char *tag = json_tag(error);
+      if(tag != NULL && strcmp(tag, "lookup_failed") == 0)
+      {
+        error = json_get(error, "lookup_failed");
+        tag = json_tag(error);
+      }
+      int api_status = this->api->Status();
+      if(tag != NULL && strcmp(tag, "incorrect_offset") == 0)
+      {
+        //it got more (or less) than we thought
+        offset = json_integer(error, "correct_offset", -1);
+        if(offset < 0 || offset > size)
+          break;
+      }
+      else if(tag != NULL && (strcmp(tag, "not_found") == 0
+        || strcmp(tag, "closed") == 0) && failures < UPLOAD_RETRIES)
+      {
+        //expired, or finished already, start over
+        failures++;
+        free(session_id);
+        session_id = NULL;
+        offset = 0;
+      }
+      else if(retriable(api_status) && failures < UPLOAD_RETRIES)
+      {
+        failures++;
+        sleep_seconds(RETRY_DELAY * (1 << (failures - 1)));
+        offset = chunk_offset;
+      }
+      else
+        break;
+      status = API_OK;
+      continue;
+    }
+    if(session_id == NULL)
+    {
+      const char *id = json_string(result, "session_id");
+      session_id = strdup(id != NULL ? id : "");
+    }
+    if(end >= size && strcmp(route, "files/upload_session/finish") == 0)
+    {
+      unlink(saved);
+      answer(json_string(result, "path_display"));
+      answer(json_string(result, "rev"));
+      answer(json_string(result, "content_hash"));
+      json_free(result);
+      free(session_id);
+      return API_OK;
+    }
+    json_free(result);
+    offset = end;
+    failures = 0;
+    save_session(saved, session_id, offset, &st);
+    if(this->pause_wanted)
+    {
+      free(session_id);
+      return API_STOPPED;
+    }
+  }
+  free(session_id);
+  if(status == API_OK)
+  {
+    //what stopped it came from Dropbox
+    if(!retriable(this->api->Status()))
+      unlink(saved);
+    return api_failed();
+  }
+  return status;
+}
+
+/*
+* Download a file. Answers with the rev that was
+* downloaded and its content_hash. Given a rev, what's
+* already in local_path is taken to be the start of it,
+* and only the rest is fetched.
+*/
+int
+NativeWorker::do_get(const char *const *args, int count)
+{
+  const char *db_path = args[0];
+  const char *local_path = args[1];
+  const char *rev = count > 2 && args[2][0] != '\0' ? args[2] : NULL;
+  char *path = (char*)malloc(strlen(db_path) + (rev != NULL ? strlen(rev) : 0)
+    + 8);
+  if(path == NULL)
+    return failed("%s", strerror(ENOMEM));
+  if(rev != NULL)
+    sprintf(path, "rev:%s", rev);
+  else
+    strcpy(path, db_path);
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key("path");
+  arg.String(path);
+  arg.EndObject();
+
+  int64_t start = 0;
+  struct stat st;
+  if(rev != NULL && stat(local_path, &st) == 0)
+    start = st.st_size;
+  //not O_APPEND, splice() won't write to that
+  int file = open(local_path, O_WRONLY | O_CREAT, 0666);
+  if(file < 0)
+  {
+    free(path);
+    return failed("%s: %s", local_path, strerror(errno));
+  }
+  int failures = 0;
+  JsonValue *metadata = NULL;
+  int status = API_OK;
+  while(metadata == NULL)
+  {
+    if(start == 0 && ftruncate(file, 0) != 0)
+    {
+      status = failed("%s: %s", local_path, strerror(errno));
+      break;
+    }
+    status = this->api->Download("files/download", arg.Text(), file, start,
+      rev != NULL ? &this->pause_wanted : NULL, &metadata);
+    if(status == API_STOPPED)
+      break;
+    if(status == API_OK)
+      continue;
+    if(this->api->Status() == 416)
+    {
+      //nothing after start, it's all there already or it's something else
+      JsonWriter lookup;
+      lookup.BeginObject();
+      lookup.Key("path");
+      lookup.String(path);
+      lookup.EndObject();
+      if((status = this->api->Rpc("files/get_metadata", lookup.Text(),
+        &metadata)) != API_OK)
+      {
+        status = api_failed();
+        break;
+      }
+      if(json_integer(metadata, "size", -1) != start)
+      {
+        json_free(metadata);
+        metadata = NULL;
+        start = 0;
+      }
+      continue;
+    }
+    if(!retriable(this->api->Status()) || failures >= UPLOAD_RETRIES)
+    {
+      status = api_failed();
+      break;
+    }
+    failures++;
+    sleep_seconds(RETRY_DELAY * (1 << (failures - 1)));
+    if(rev != NULL && fstat(file, &st) == 0)
+      start = st.st_size;
+  }
+  free(path);
+  int64_t size = fstat(file, &st) == 0 ? st.st_size : -1;
+  close(file);
+  if(metadata == NULL)
+    return status;
+  int64_t expected = json_integer(metadata, "size", -1);
+  if(expected >= 0 && size != expected)
+    status = failed("%s is %lld bytes, it should be %lld", local_path,
+      (long long)size, (long long)expected);
+  else
+  {
+    answer(json_string(metadata, "rev"));
+    answer(json_string(metadata, "content_hash"));
+  }
+  json_free(metadata);
+  return status;
+}
+
+//an endpoint with one path argument whose answer isn't needed
+static int
+path_rpc(DropboxApi *api, const char *route, const char *key1,
+  const char *path1, const char *key2, const char *path2)
+{
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key(key1);
+  arg.String(path1);
+  if(key2 != NULL)
+  {
+    arg.Key(key2);
+    arg.String(path2);
+  }
+  arg.EndObject();
+  JsonValue *result;
+  int status = api->Rpc(route, arg.Text(), &result);
+  json_free(result);
+  return status;
+}
+
+int
+NativeWorker::do_rm(const char *const *args, int count)
+{
+  if(path_rpc(this->api, "files/delete_v2", "path", args[0], NULL, NULL)
+    != API_OK)
+    return api_failed();
+  return API_OK;
+}
+
+int
+NativeWorker::do_mv(const char *const *args, int count)
+{
+  if(path_rpc(this->api, "files/move_v2", "from_path", args[0], "to_path",
+    args[1]) != API_OK)
+    return api_failed();
+  return API_OK;
+}
+
+int
+NativeWorker::do_mkdir(const char *const *args, int count)
+{
+  if(path_rpc(this->api, "files/create_folder_v2", "path", args[0], NULL,
+    NULL) != API_OK)
+    return api_failed();
+  return API_OK;
+}
+
+/*
+* Start a batch job and wait for it to finish. result is
+* what it finished with, whose "entries" are the result
+* for each of its entries, in order.
+*/
+int
+NativeWorker::run_batch(const char *route, const char *check_route,
+  const char *arg, JsonValue **result)
+{
+  if(this->api->Rpc(route, arg, result) != API_OK)
+    return api_failed();
+  char *job = NULL;
+  double delay = BATCH_CHECK_DELAY;
+  const char *tag;
+  while((tag = json_tag(*result)) != NULL && (strcmp(tag, "async_job_id") == 0
+    || strcmp(tag, "in_progress") == 0))
+  {
+    const char *id = json_string(*result, "async_job_id");
+    if(id != NULL)
+    {
+      free(job);
+      job = strdup(id);
+    }
+    json_free(*result);
+    *result = NULL;
+    if(job == NULL)
+      return failed("no async_job_id");
+    sleep_seconds(delay);
+    delay = delay * 2 < BATCH_CHECK_MAX ? delay * 2 : BATCH_CHECK_MAX;
+    JsonWriter check;
+    check.BeginObject();
+    check.Key("async_job_id");
+    check.String(job);
+    check.EndObject();
+    if(this->api->Rpc(check_route, check.Text(), result) != API_OK)
+    {
+      free(job);
+      return api_failed();
+    }
+  }
+  free(job);
+  if(tag == NULL || strcmp(tag, "complete") != 0)
+  {
+    json_free(*result);
+    *result = NULL;
+    return failed("HTTP 409: batch job ended with %s",
+      tag != NULL ? tag : "no .tag");
+  }
+  return API_OK;
+}
+
+/*
+* Send DONE <path> for each entry that worked, FAILED
+* <path> <error> for each that didn't (paths step apart).
+* With gone_is_done a path that isn't there counts as done.
+*/
+void
+NativeWorker::send_batch_results(const char *const *paths, int count,
+  int step, const JsonValue *result, bool gone_is_done)
+{
+  const JsonValue *entries = json_get(result, "entries");
+  const JsonValue *entry = entries != NULL ? entries->first : NULL;
+  for(int i = 0; i < count && entry != NULL; i += step, entry = entry->next)
+  {
+    const char *tag = json_tag(entry);
+    const char *fields[3] = { "DONE", paths[i], NULL };
+    if(tag != NULL && strcmp(tag, "success") == 0)
+    {
+      send(fields, 2);
+      continue;
+    }
+    const JsonValue *failure = json_get(entry, "failure");
+    const char *kind = json_tag(failure);
+    char error[256];
+    snprintf(error, sizeof(error), "%s", kind != NULL ? kind : "unknown");
+    const JsonValue *detail = kind != NULL ? json_get(failure, kind) : NULL;
+    if(detail != NULL && detail->type == JSON_OBJECT)
+    {
+      const char *detail_tag = json_tag(detail);
+      snprintf(error + strlen(error), sizeof(error) - strlen(error), "/%s",
+        detail_tag != NULL ? detail_tag : "");
+    }
+    if(gone_is_done && strcmp(error, "path_lookup/not_found") == 0)
+    {
+      send(fields, 2);
+      continue;
+    }
+    fields[0] = "FAILED";
+    fields[2] = error;
+    send(fields, 3);
+  }
+}
+
+//delete every path in one batch job, with an item for each
+int
+NativeWorker::do_rm_batch(const char *const *args, int count)
+{
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key("entries");
+  arg.BeginArray();
+  for(int i = 0; i < count; i++)
+  {
+    arg.BeginObject();
+    arg.Key("path");
+    arg.String(args[i]);
+    arg.EndObject();
+  }
+  arg.EndArray();
+  arg.EndObject();
+  JsonValue *result;
+  if(run_batch("files/delete_batch", "files/delete_batch/check", arg.Text(),
+    &result) != API_OK)
+    return API_FAILED;
+  send_batch_results(args, count, 1, result, true);
+  json_free(result);
+  return API_OK;
+}
+
+//move every from path to the to path after it in one batch
+//job, with an item for each from path
+int
+NativeWorker::do_mv_batch(const char *const *args, int count)
+{
+  if(count % 2 != 0)
+    return failed("bad arguments to mv_batch: takes pairs of paths");
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key("entries");
+  arg.BeginArray();
+  for(int i = 0; i < count; i += 2)
+  {
+    arg.BeginObject();
+    arg.Key("from_path");
+    arg.String(args[i]);
+    arg.Key("to_path");
+    arg.String(args[i + 1]);
+    arg.EndObject();
+  }
+  arg.EndArray();
+  arg.EndObject();
+  JsonValue *result;
+  if(run_batch("files/move_batch_v2", "files/move_batch/check_v2", arg.Text(),
+    &result) != API_OK)
+    return API_FAILED;
+  send_batch_results(args, count, 2, result, false);
+  json_free(result);
+  return API_OK;
+}
+
+//create every folder in one batch job, with an item for each
+int
+NativeWorker::do_mkdir_batch(const char *const *args, int count)
+{
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key("paths");
+  arg.BeginArray();
+  for(int i = 0; i < count; i++)
+    arg.String(args[i]);
+  arg.EndArray();
+  arg.Key("force_async");
+  arg.Bool(false);
+  arg.EndObject();
+  JsonValue *result;
+  if(run_batch("files/create_folder_batch", "files/create_folder_batch/check",
+    arg.Text(), &result) != API_OK)
+    return API_FAILED;
+  send_batch_results(args, count, 1, result, false);
+  json_free(result);
+  return API_OK;
+}
+
+//when a file last changed on Dropbox, in seconds since
+//1970, "" if it doesn't say
+static void
+modified_time(const JsonValue *entry, char *text, size_t size)
+{
+  const char *modified = json_string(entry, "server_modified");
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  text[0] = '\0';
+  if(modified == NULL || sscanf(modified, "%d-%d-%dT%d:%d:%dZ", &tm.tm_year,
+    &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+    return;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  snprintf(text, size, "%lld", (long long)timegm(&tm));
+}
+
+/*
+* Send an item for each remote change in the next page
+* after the cursor (from the very start if it's empty),
+* and answer with the cursor for the page after and
+* whether there's more, as db_worker.py does.
+*/
+int
+NativeWorker::do_delta_page(const char *const *args, int count)
+{
+  const char *cursor = count > 0 ? args[0] : "";
+  const char *limit = count > 1 ? args[1] : DELTA_PAGE_LIMIT;
+  JsonValue *result = NULL;
+  if(cursor[0] != '\0')
+  {
+    JsonWriter arg;
+    arg.BeginObject();
+    arg.Key("cursor");
+    arg.String(cursor);
+    arg.EndObject();
+    if(this->api->Rpc("files/list_folder/continue", arg.Text(), &result)
+      != API_OK)
+    {
+      const char *tag = this->api->Tag();
+      if(tag == NULL || strcmp(tag, "reset") != 0)
+        return api_failed();
+      result = NULL;
+    }
+  }
+  if(result == NULL)
+  {
+    const char *reset[1] = { "RESET" };
+    send(reset, 1);
+    JsonWriter arg;
+    arg.BeginObject();
+    arg.Key("path");
+    arg.String("");
+    arg.Key("recursive");
+    arg.Bool(true);
+    arg.Key("include_deleted");
+    arg.Bool(true);
+    arg.Key("limit");
+    arg.Integer(atoi(limit));
+    arg.EndObject();
+    if(this->api->Rpc("files/list_folder", arg.Text(), &result) != API_OK)
+      return api_failed();
+  }
+
+  const JsonValue *entries = json_get(result, "entries");
+  for(const JsonValue *entry = entries != NULL ? entries->first : NULL;
+    entry != NULL; entry = entry->next)
+  {
+    const char *tag = json_tag(entry);
+    const char *path = json_string(entry, "path_display");
+    if(tag == NULL || path == NULL)
+      continue;
+    if(strcmp(tag, "file") == 0)
+    {
+      const char *hash = json_string(entry, "content_hash");
+      char size[32] = "", modified[32];
+      int64_t bytes = json_integer(entry, "size", -1);
+      if(bytes >= 0)
+        snprintf(size, sizeof(size), "%lld", (long long)bytes);
+      modified_time(entry, modified, sizeof(modified));
+      const char *rev = json_string(entry, "rev");
+      const char *fields[6] = { "FILE", path, rev != NULL ? rev : "",
+        hash != NULL ? hash : "", size, modified };
+      send(fields, 6);
+    }
+    else if(strcmp(tag, "folder") == 0 || strcmp(tag, "deleted") == 0)
+    {
+      const char *fields[2] = { tag[0] == 'f' ? "FOLDER" : "REMOVE", path };
+      send(fields, 2);
+    }
+  }
+  answer(json_string(result, "cursor"));
+  answer(json_bool(result, "has_more", false) ? "1" : "0");
+  json_free(result);
+  return API_OK;
+}
+
+/*
+* Wait until there are changes after the cursor, or until
+* the timeout. Answers "1" if there are, "0" if not, then
+* how many seconds Dropbox wants left before the next one.
+* A cursor Dropbox no longer knows counts as changes.
+*/
+int
+NativeWorker::do_longpoll(const char *const *args, int count)
+{
+  JsonWriter arg;
+  arg.BeginObject();
+  arg.Key("cursor");
+  arg.String(args[0]);
+  arg.Key("timeout");
+  arg.Integer(atoi(count > 1 ? args[1] : LONGPOLL_TIMEOUT));
+  arg.EndObject();
+  JsonValue *result;
+  if(this->api->Notify("files/list_folder/longpoll", arg.Text(), &result)
+    != API_OK)
+  {
+    const char *tag = this->api->Tag();
+    if(tag == NULL || strcmp(tag, "reset") != 0)
+      return api_failed();
+    answer("1");
+    answer("0");
+    return API_OK;
+  }
+  answer(json_bool(result, "changes", false) ? "1" : "0");
+  char backoff[32];
+  snprintf(backoff, sizeof(backoff), "%lld",
+    (long long)json_integer(result, "backoff", 0));
+  answer(backoff);
+  json_free(result);
+  return API_OK;
+}
@@ -0,0 +1,94 @@
+#ifndef NATIVE_WORKER_H
+#define NATIVE_WORKER_H
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "DropboxApi.h"
+#include "Throttle.h"
+
+const int NATIVE_MAX_ANSWERS = 4;
+
+/*
+* db_worker.py in C++: the same requests, answered with the
+* same frames, but run in this process with DropboxApi,
+* so a file's bytes go between the disk and the socket
+* without passing through Python (or through here).
+*
+* Start() serves the frames on a pair of descriptors from
+* a thread of its own, which is how WorkerProcess and
+* DropboxWorker run it in place of `python db_worker.py`
+* when DBFORHAIKU_TRANSPORT is "native" (see
+* native_transport()), so nothing else changes. It stops
+* when the other end of in_fd is closed. hdbworker runs
+* one on its stdin and stdout, as db_worker.py is run.
+*
+* Pause() does what SIGUSR1 does to db_worker.py: an
+* upload in a session stops once the chunk being sent has
+* got there, a download of a given rev between pieces, and
+* either answers PAUSED. Uploads in a session are kept in
+* upload_sessions too, though not in the same files as
+* db_worker.py's.
+*/
+class NativeWorker
+{
+public:
+  NativeWorker(void);
+  ~NativeWorker(void);
+
+  //returns 0 or an errno
+  int Start(int in_fd, int out_fd);
+  //waits for the thread to finish
+  void Join(void);
+  //serves requests on this thread until in_fd ends
+  void Run(int in_fd, int out_fd);
+  //runs one request, answering on out_fd, a line of
+  //tab separated fields a frame if as_lines
+  void Handle(const char *const *fields, int count, int out_fd,
+    bool as_lines);
+  void Pause(void) { pause_wanted = 1; }
+
+private:
+  static void *run_thread(void *data);
+  void send(const char *const *fields, int count);
+  void answer(const char *string);
+  int failed(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  int api_failed(void);
+
+  int do_put(const char *const *args, int count);
+  int upload_in_session(int file, const char *local_path,
+    const char *db_path, const char *parent_rev);
+  int do_get(const char *const *args, int count);
+  int do_rm(const char *const *args, int count);
+  int do_mv(const char *const *args, int count);
+  int do_mkdir(const char *const *args, int count);
+  int run_batch(const char *route, const char *check_route, const char *arg,
+    JsonValue **result);
+  void send_batch_results(const char *const *paths, int count, int step,
+    const JsonValue *result, bool gone_is_done);
+  int do_rm_batch(const char *const *args, int count);
+  int do_mv_batch(const char *const *args, int count);
+  int do_mkdir_batch(const char *const *args, int count);
+  int do_delta_page(const char *const *args, int count);
+  int do_longpoll(const char *const *args, int count);
+
+  Throttle throttle;
+  DropboxApi *api;
+  pthread_t thread;
+  bool started;
+  int in_fd;
+  int out_fd;
+  bool as_lines;
+  volatile int pause_wanted;
+  int64_t chunk_size;
+  int read_ahead;
+  char *answers[NATIVE_MAX_ANSWERS]; //the fields after OK
+  int answer_count;
+  char failure[1024]; //what goes after ERROR
+};
+
+//whether DBFORHAIKU_TRANSPORT asks for NativeWorker, and
+//this build can reach the server with it
+bool native_transport(void);
+
+#endif
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <Application.h>
+#include <Node.h>
+#include <NodeMonitor.h>
+
+#include "ContentHash.h"
+#include "NodeMonitorWatch.h"
+#include "Trace.h"
+
+/*
+* Subscribe to Node Monitor alerts on a node
+* (with the BMessenger being be_app_messenger).
+* The node is followed wherever it goes, so path
+* isn't needed.
+*/
+int
+NodeMonitorWatch::Watch(const char *path, dev_t device, ino_t node, bool directory)
+{
+  node_ref nref;
+  nref.device = device;
+  nref.node = node;
+  //Haiku's errnos are its status codes
+  return watch_node(&nref,directory ? B_WATCH_DIRECTORY : B_WATCH_STAT,be_app_messenger);
+}
+
+/*
+* The parent_rev and content_hash as older versions
+* stored them in attributes (they're in the sync state now)
+*/
+bool
+NodeMonitorWatch::ReadOldRev(const char *path, char *rev, size_t rev_size,
+  char *hash, size_t hash_size)
+{
+  BNode node = BNode(path);
+  int32 len;
+  ssize_t bytes = node.ReadAttr("parent_rev_len",B_INT32_TYPE,0,(void*)&len,4);
+  if(bytes != 4) {
+   TRACE(TRACE_ERROR,"tried to read parent_rev_len, but only read %ld bytes",(long)bytes);
+   return false;
+  }
+  if(len <= 0 || (size_t)len > rev_size)
+    return false;
+  bytes = node.ReadAttr("parent_rev",B_STRING_TYPE,0,(void*)rev,len);
+  if(bytes <= 0) {
+    TRACE(TRACE_ERROR,"tried and failed to read parent_rev");
+    rev[0] = '\0';
+  }
+  rev[len - 1] = '\0';
+
+  char str[CONTENT_HASH_LENGTH + 1];
+  bytes = node.ReadAttr("content_hash",B_STRING_TYPE,0,(void*)str,sizeof(str));
+  if(bytes != (ssize_t)sizeof(str) || str[CONTENT_HASH_LENGTH] != '\0'
+    || hash_size < sizeof(str))
+    str[0] = '\0';
+  strcpy(hash,hash_size < sizeof(str) ? "" : str);
+  return true;
+}
+
+bool
+NodeMonitorWatch::ToEvent(const BMessage *msg, FsEvent *event)
+{
+  int32 opcode;
+  if(msg->FindInt32("opcode",&opcode) != B_OK)
+    return false;
+  memset(event,0,sizeof(*event));
+  event->device = msg->GetInt32("device",-1);
+  event->node = msg->GetInt64("node",0);
+  switch(opcode)
+  {
+    case B_ENTRY_CREATED:
+    {
+      TRACE(TRACE_DEBUG,"CREATED NEW FILE");
+      event->kind = FS_CREATED;
+      event->directory = msg->GetInt64("directory",0);
+      event->name = msg->GetString("name","");
+      return true;
+    }
+    case B_ENTRY_MOVED:
+    {
+      TRACE(TRACE_DEBUG,"MOVED FILE");
+      event->kind = FS_MOVED;
+      event->from_directory = msg->GetInt64("from directory",0);
+      event->directory = msg->GetInt64("to directory",0);
+      event->name = msg->GetString("name","");
+      return true;
+    }
+    case B_ENTRY_REMOVED:
+    {
+      TRACE(TRACE_DEBUG,"DELETED FILE");
+      event->kind = FS_REMOVED;
+      return true;
+    }
+    case B_STAT_CHANGED:
+    {
+      TRACE(TRACE_DEBUG,"EDITED FILE");
+      event->kind = FS_CHANGED;
+      return true;
+    }
+    default:
+    {
+      TRACE(TRACE_DEBUG,"default case opcode...");
+      return false;
+    }
+  }
+}
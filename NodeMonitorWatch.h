@@ -0,0 +1,25 @@
+#ifndef NODE_MONITOR_WATCH_H
+#define NODE_MONITOR_WATCH_H
+
+#include <Message.h>
+
+#include "FsWatch.h"
+
+/*
+* FsWatch on Haiku's node monitor. The B_NODE_MONITOR
+* messages go to be_app_messenger, and the application
+* hands them to the engine through ToEvent().
+*/
+class NodeMonitorWatch: public FsWatch
+{
+public:
+  int Watch(const char *path, dev_t device, ino_t node, bool directory);
+  bool ReadOldRev(const char *path, char *rev, size_t rev_size,
+    char *hash, size_t hash_size);
+
+  //false if it's not an opcode the engine wants,
+  //the name lasts as long as the message
+  static bool ToEvent(const BMessage *msg, FsEvent *event);
+};
+
+#endif
@@ -0,0 +1,447 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "NodeTable.h"
+
+const size_t INITIAL_BUCKETS = 1024;
+const uint16_t NAME_MOVED_OUT = 0x8000;
+const size_t MAX_NAME_HERE = 256; //longer than any file name
+const size_t BLOCK_SIZE = 64 * 1024;
+const size_t RECORD_ALIGN = 8;
+const size_t RECORD_SIZES = (sizeof(NodeRecord) + MAX_NAME_HERE) / RECORD_ALIGN + 1;
+//deeper than that is a loop
+const int MAX_DEPTH = 256;
+
+static size_t
+sync_size(size_t rev_length)
+{
+  return offsetof(NodeSync, rev) + rev_length + 1;
+}
+
+//with room for the name (or a pointer to it) and rounded up
+static size_t
+record_size(size_t name_length)
+{
+  size_t room = name_length + 1;
+  if(room < sizeof(char*))
+    room = sizeof(char*);
+  size_t size = offsetof(NodeRecord, name_here) + room;
+  return (size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+}
+
+static size_t
+size_of(const NodeRecord *record)
+{
+  return offsetof(NodeRecord, name_here) + (record->name_room & ~NAME_MOVED_OUT);
+}
+
+//if it's been renamed out of the record
+static void
+free_name(NodeRecord *record)
+{
+  if(record->name_room & NAME_MOVED_OUT)
+  {
+    char *name;
+    memcpy(&name, record->name_here, sizeof(name));
+    free(name);
+    record->name_room &= ~NAME_MOVED_OUT;
+  }
+}
+
+NodeTable::NodeTable(void)
+  : buckets(NULL), bucket_count(INITIAL_BUCKETS), count(0),
+    root_device(0), root_node(0), root_path(strdup("")),
+    block(NULL), block_left(0), free_records(NULL)
+{
+  buckets = (NodeRecord**)calloc(bucket_count, sizeof(NodeRecord*));
+  free_records = (NodeRecord**)calloc(RECORD_SIZES, sizeof(NodeRecord*));
+}
+
+NodeTable::~NodeTable(void)
+{
+  MakeEmpty();
+  free(buckets);
+  free(free_records);
+  free(root_path);
+}
+
+bool
+NodeTable::SetRoot(dev_t device, ino_t node, const char *path)
+{
+  char *copy = strdup(path);
+  if(copy == NULL)
+    return false;
+  free(root_path);
+  root_path = copy;
+  root_device = device;
+  root_node = node;
+  return true;
+}
+
+/*
+* Double the number of buckets once there are more records
+* than buckets, so the chains stay about one record long.
+*/
+void
+NodeTable::grow(void)
+{
+  size_t old_count = bucket_count;
+  NodeRecord **old_buckets = buckets;
+  NodeRecord **new_buckets = (NodeRecord**)calloc(old_count * 2, sizeof(NodeRecord*));
+  if(new_buckets == NULL)
+    return; //keep going with longer chains
+
+  buckets = new_buckets;
+  bucket_count = old_count * 2;
+  for(size_t i = 0; i < old_count; i++)
+  {
+    NodeRecord *record = old_buckets[i];
+    while(record != NULL)
+    {
+      NodeRecord *next = record->next;
+      size_t b = bucket_for(record->device, record->node);
+      record->next = buckets[b];
+      buckets[b] = record;
+      record = next;
+    }
+  }
+  free(old_buckets);
+}
+
+NodeRecord *
+NodeTable::Find(dev_t device, ino_t node) const
+{
+  NodeRecord *record = buckets[bucket_for(device, node)];
+  while(record != NULL)
+  {
+    if(record->node == node && record->device == device)
+      return record;
+    record = record->next;
+  }
+  return NULL;
+}
+
+/*
+* A record with room for a name of name_length,
+* off a free list or the end of the current block.
+*/
+NodeRecord *
+NodeTable::new_record(size_t name_length)
+{
+  if(name_length >= MAX_NAME_HERE)
+    return NULL;
+  size_t size = record_size(name_length);
+  NodeRecord *record = free_records[size / RECORD_ALIGN];
+  if(record != NULL)
+    free_records[size / RECORD_ALIGN] = record->next;
+  else
+  {
+    if(block_left < size)
+    {
+      char *new_block = (char*)malloc(BLOCK_SIZE);
+      if(new_block == NULL)
+        return NULL;
+      memcpy(new_block, &block, sizeof(block));
+      block = new_block;
+      block_left = BLOCK_SIZE - RECORD_ALIGN;
+    }
+    record = (NodeRecord*)(block + BLOCK_SIZE - block_left);
+    block_left -= size;
+  }
+  record->name_room = (uint16_t)(size - offsetof(NodeRecord, name_here));
+  return record;
+}
+
+void
+NodeTable::free_record(NodeRecord *record)
+{
+  free_name(record);
+  free(record->sync);
+  size_t size = size_of(record);
+  record->next = free_records[size / RECORD_ALIGN];
+  free_records[size / RECORD_ALIGN] = record;
+}
+
+/*
+* Add a record for the node, or if it is already
+* tracked, update its parent and name.
+* Returns NULL if out of memory.
+*/
+NodeRecord *
+NodeTable::Insert(dev_t device, ino_t node, ino_t parent, const char *name)
+{
+  size_t name_length = strlen(name);
+  NodeRecord *record = Find(device, node);
+  if(record == NULL)
+  {
+    record = new_record(name_length);
+    if(record == NULL)
+      return NULL;
+    record->device = device;
+    record->node = node;
+    record->directory = false;
+    record->upload = NODE_IDLE;
+    record->sync = NULL;
+
+    if(count >= bucket_count)
+      grow();
+    size_t b = bucket_for(device, node);
+    record->next = buckets[b];
+    buckets[b] = record;
+    count++;
+  }
+  else if(name_length >= (size_t)(record->name_room & ~NAME_MOVED_OUT))
+  {
+    //too long to go where it was, so it goes somewhere else
+    char *copy = strdup(name);
+    if(copy == NULL)
+      return NULL;
+    free_name(record);
+    memcpy(record->name_here, &copy, sizeof(copy));
+    record->name_room |= NAME_MOVED_OUT;
+    record->parent = parent;
+    return record;
+  }
+  else
+    free_name(record);
+  record->parent = parent;
+  memmove(record->name_here, name, name_length + 1);
+  return record;
+}
+
+/*
+* Forget about a node.
+* Returns false if it wasn't being tracked.
+*/
+bool
+NodeTable::Remove(dev_t device, ino_t node)
+{
+  NodeRecord **link = &buckets[bucket_for(device, node)];
+  while(*link != NULL)
+  {
+    NodeRecord *record = *link;
+    if(record->node == node && record->device == device)
+    {
+      *link = record->next;
+      free_record(record);
+      count--;
+      return true;
+    }
+    link = &record->next;
+  }
+  return false;
+}
+
+void
+NodeTable::MakeEmpty(void)
+{
+  for(size_t i = 0; i < bucket_count; i++)
+  {
+    NodeRecord *record = buckets[i];
+    while(record != NULL)
+    {
+      free_name(record);
+      free(record->sync);
+      record = record->next;
+    }
+    buckets[i] = NULL;
+  }
+  count = 0;
+  while(block != NULL)
+  {
+    char *before;
+    memcpy(&before, block, sizeof(before));
+    free(block);
+    block = before;
+  }
+  block_left = 0;
+  memset(free_records, 0, RECORD_SIZES * sizeof(NodeRecord*));
+}
+
+NodeRecord *
+NodeTable::First(size_t *bucket) const
+{
+  for(*bucket = 0; *bucket < bucket_count; (*bucket)++)
+  {
+    if(buckets[*bucket] != NULL)
+      return buckets[*bucket];
+  }
+  return NULL;
+}
+
+NodeRecord *
+NodeTable::Next(size_t *bucket, const NodeRecord *record) const
+{
+  if(record->next != NULL)
+    return record->next;
+  for((*bucket)++; *bucket < bucket_count; (*bucket)++)
+  {
+    if(buckets[*bucket] != NULL)
+      return buckets[*bucket];
+  }
+  return NULL;
+}
+
+const char *
+NodeTable::Name(const NodeRecord *record)
+{
+  if(record->name_room & NAME_MOVED_OUT)
+  {
+    const char *name;
+    memcpy(&name, record->name_here, sizeof(name));
+    return name;
+  }
+  return record->name_here;
+}
+
+/*
+* Put together the full path of a record from its name
+* and its parents', up to the root.
+*/
+bool
+NodeTable::GetPath(const NodeRecord *record, char *path, size_t size) const
+{
+  const NodeRecord *chain[MAX_DEPTH];
+  int depth = 0;
+  size_t length = strlen(root_path);
+  while(record->parent != root_node || record->device != root_device)
+  {
+    if(depth == MAX_DEPTH - 1)
+      return false;
+    chain[depth++] = record;
+    length += 1 + strlen(Name(record));
+    record = Find(record->device, record->parent);
+    if(record == NULL)
+      return false;
+  }
+  chain[depth++] = record;
+  length += 1 + strlen(Name(record));
+  if(length >= size)
+    return false;
+
+  char *end = path + strlen(root_path);
+  memcpy(path, root_path, end - path);
+  while(depth > 0)
+  {
+    const char *name = Name(chain[--depth]);
+    size_t name_length = strlen(name);
+    *end++ = '/';
+    memcpy(end, name, name_length);
+    end += name_length;
+  }
+  *end = '\0';
+  return true;
+}
+
+/*
+* Make room for a rev of rev_length in a record's sync,
+* or make it if there isn't one. NULL if out of memory.
+*/
+NodeSync *
+NodeTable::sync_for(NodeRecord *record, size_t rev_length)
+{
+  NodeSync *sync = (NodeSync*)realloc(record->sync, sync_size(rev_length));
+  if(sync == NULL)
+    return NULL;
+  if(record->sync == NULL)
+  {
+    sync->size = -1;
+    sync->mtime = -1;
+    sync->has_hash = false;
+    sync->rev[0] = '\0';
+  }
+  record->sync = sync;
+  return sync;
+}
+
+const char *
+NodeTable::Rev(const NodeRecord *record)
+{
+  if(record->sync == NULL || record->sync->rev[0] == '\0')
+    return NULL;
+  return record->sync->rev;
+}
+
+void
+NodeTable::SetRev(NodeRecord *record, const char *rev)
+{
+  if(rev == NULL)
+    rev = "";
+  if(rev[0] == '\0' && record->sync == NULL)
+    return;
+  size_t rev_length = strlen(rev);
+  NodeSync *sync = sync_for(record, rev_length);
+  if(sync != NULL)
+    memcpy(sync->rev, rev, rev_length + 1);
+}
+
+static int
+hex_digit(char c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+bool
+NodeTable::GetHash(const NodeRecord *record, char *hex)
+{
+  hex[0] = '\0';
+  if(record->sync == NULL || !record->sync->has_hash)
+    return false;
+  for(size_t i = 0; i < NODE_HASH_SIZE; i++)
+    sprintf(hex + i * 2, "%02x", record->sync->hash[i]);
+  return true;
+}
+
+//anything but a content_hash in hex forgets the one there
+void
+NodeTable::SetHash(NodeRecord *record, const char *hex)
+{
+  uint8_t hash[NODE_HASH_SIZE];
+  bool valid = hex != NULL && strlen(hex) == NODE_HASH_SIZE * 2;
+  for(size_t i = 0; valid && i < NODE_HASH_SIZE; i++)
+  {
+    int high = hex_digit(hex[i * 2]), low = hex_digit(hex[i * 2 + 1]);
+    valid = high >= 0 && low >= 0;
+    hash[i] = (uint8_t)(high << 4 | low);
+  }
+  if(!valid && record->sync == NULL)
+    return;
+  NodeSync *sync = record->sync;
+  if(sync == NULL && (sync = sync_for(record, 0)) == NULL)
+    return;
+  sync->has_hash = valid;
+  if(valid)
+    memcpy(sync->hash, hash, NODE_HASH_SIZE);
+}
+
+void
+NodeTable::SetSynced(NodeRecord *record, int64_t size, int64_t mtime)
+{
+  NodeSync *sync = record->sync;
+  if(sync == NULL && (sync = sync_for(record, 0)) == NULL)
+    return;
+  sync->size = size;
+  sync->mtime = mtime;
+}
+
+void
+NodeTable::CopySync(NodeRecord *record, const NodeRecord *from)
+{
+  NodeSync *copy = NULL;
+  if(from != NULL && from->sync != NULL)
+  {
+    size_t size = sync_size(strlen(from->sync->rev));
+    if((copy = (NodeSync*)malloc(size)) == NULL)
+      return;
+    memcpy(copy, from->sync, size);
+  }
+  free(record->sync);
+  record->sync = copy;
+}
@@ -0,0 +1,143 @@
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* Mix the bits of the node number (and device) so that
+* the sequential inode numbers of a fresh tree spread out
+* over the buckets of a power of two sized table.
+*/
+inline size_t
+hash_node(dev_t device, ino_t node)
+{
+  unsigned long long h = (unsigned long long)node;
+  h ^= (unsigned long long)device << 47;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return (size_t)h;
+}
+
+/*
+* What we remember about a tracked file or directory,
+* found by its (device, node) pair.
+* parent is the node of the directory it's in, and its
+* name there (NodeTable::Name()) follows the record, so
+* its path is worked out from its parents' (see
+* NodeTable::GetPath()) and moving a directory doesn't
+* touch what's in it.
+* directory says whether it is one, and upload whether
+* an upload of it is on its way to Dropbox.
+* What Dropbox last had (the parent_rev, content_hash,
+* size and mtime) is in sync, once there's any of it,
+* and read and set through NodeTable.
+* Records have nothing open and come out of the table's
+* own blocks, so one costs under 64 bytes plus its name,
+* buckets and all (tests/bench_node_table.cpp measures it).
+* Records stay where they are until they're removed.
+*/
+enum
+{
+  NODE_IDLE = 0,
+  NODE_UPLOADING,
+  NODE_UPLOAD_AGAIN //changed again while uploading
+};
+
+const size_t NODE_HASH_SIZE = 32; //bytes, twice that in hex
+
+struct NodeSync
+{
+  int64_t size;
+  int64_t mtime;
+  bool has_hash;
+  uint8_t hash[NODE_HASH_SIZE];
+  char rev[1]; //the rest of it follows, empty if we don't know it
+};
+
+struct NodeRecord
+{
+  NodeRecord *next; //hash chain, or the free list
+  ino_t node;
+  ino_t parent;
+  NodeSync *sync; //NULL until we know any of it
+  dev_t device;
+  bool directory;
+  uint8_t upload;
+  //bytes for the name from here on, with NAME_MOVED_OUT set
+  //if it's been renamed to something longer and a pointer
+  //to that is here instead
+  uint16_t name_room;
+  char name_here[4]; //the rest of it follows
+};
+
+/*
+* Hash index of the tracked files and directories,
+* keyed by (device, node) so that node monitor messages
+* can be matched up in constant time.
+* The table owns the records and their strings.
+*/
+class NodeTable
+{
+public:
+  NodeTable(void);
+  ~NodeTable(void);
+
+  //the directory whose records have no parent record
+  bool SetRoot(dev_t device, ino_t node, const char *path);
+
+  NodeRecord *Find(dev_t device, ino_t node) const;
+  //adds a record, or moves and renames the one there
+  NodeRecord *Insert(dev_t device, ino_t node, ino_t parent, const char *name);
+  bool Remove(dev_t device, ino_t node);
+  void MakeEmpty(void);
+  size_t CountItems(void) const { return count; }
+
+  //for(r = First(&i); r != NULL; r = Next(&i,r)) visits every record,
+  //as long as none are added or removed on the way
+  NodeRecord *First(size_t *bucket) const;
+  NodeRecord *Next(size_t *bucket, const NodeRecord *record) const;
+
+  static const char *Name(const NodeRecord *record);
+  //the full local path, false if it doesn't fit or isn't under the root
+  bool GetPath(const NodeRecord *record, char *path, size_t size) const;
+
+  static const char *Rev(const NodeRecord *record); //NULL if unknown
+  static void SetRev(NodeRecord *record, const char *rev);
+  //hex gets NODE_HASH_SIZE * 2 + 1 chars, false if unknown
+  static bool GetHash(const NodeRecord *record, char *hex);
+  static void SetHash(NodeRecord *record, const char *hex);
+  //-1 if unknown
+  static int64_t SyncedSize(const NodeRecord *record)
+    { return record->sync != NULL ? record->sync->size : -1; }
+  static int64_t SyncedMtime(const NodeRecord *record)
+    { return record->sync != NULL ? record->sync->mtime : -1; }
+  static void SetSynced(NodeRecord *record, int64_t size, int64_t mtime);
+  //the parent_rev, content_hash, size and mtime of another,
+  //or none if from is NULL
+  static void CopySync(NodeRecord *record, const NodeRecord *from);
+
+private:
+  size_t bucket_for(dev_t device, ino_t node) const
+    { return hash_node(device, node) & (bucket_count - 1); }
+  void grow(void);
+  NodeRecord *new_record(size_t name_length);
+  void free_record(NodeRecord *record);
+  static NodeSync *sync_for(NodeRecord *record, size_t rev_length);
+
+  NodeRecord **buckets;
+  size_t bucket_count; //always a power of two
+  size_t count;
+  dev_t root_device;
+  ino_t root_node;
+  char *root_path;
+
+  //records are cut from blocks and freed onto a list per size
+  char *block; //the first pointer links to the one before
+  size_t block_left;
+  NodeRecord **free_records;
+};
+
+#endif
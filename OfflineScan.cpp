@@ -0,0 +1,606 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "OfflineScan.h"
+
+//reading directories mostly waits on the disk,
+//so use more threads than there are CPUs
+const int SCAN_THREADS_PER_CPU = 2;
+const int MIN_SCAN_THREADS = 4;
+const int MAX_SCAN_THREADS = 32;
+const size_t MAX_SCAN_PATH = 4096;
+
+//shared by the threads walking the tree
+struct WalkJob
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  //directories nobody has read yet
+  char **paths;
+  ino_t *nodes;
+  size_t waiting, space, node_space;
+  int busy; //threads reading one
+  //what's been found so far, parents first
+  ScanEntry **found;
+  size_t found_count, found_space;
+  size_t directories;
+  int error;
+};
+
+//shared by the threads hashing files
+struct HashFilesJob
+{
+  pthread_mutex_t lock;
+  ScanEntry **files;
+  size_t count, next;
+  int threads_per_file;
+};
+
+static bool
+grow(void **array, size_t *space, size_t need, size_t item)
+{
+  if(need <= *space)
+    return true;
+  size_t bigger = *space < 64 ? 64 : *space * 2;
+  while(bigger < need)
+    bigger *= 2;
+  void *grown = realloc(*array, bigger * item);
+  if(grown == NULL)
+    return false;
+  *array = grown;
+  *space = bigger;
+  return true;
+}
+
+static const char *
+leaf(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash != NULL ? slash + 1 : path;
+}
+
+//of a name in a directory
+static size_t
+hash_name(dev_t device, ino_t parent, const char *name)
+{
+  size_t h = hash_node(device, parent);
+  for(; *name != '\0'; name++)
+  {
+    h ^= (unsigned char)*name;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static int
+compare_pointers(const void *a, const void *b)
+{
+  const void *x = *(const void**)a;
+  const void *y = *(const void**)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+* lstat() everything in one directory, into entries
+* that hold their paths.
+*/
+static int
+read_directory(const char *dir_path, ino_t dir_node,
+  ScanEntry ***found, size_t *count, size_t *space)
+{
+  DIR *dir = opendir(dir_path);
+  if(dir == NULL)
+    return errno;
+  size_t dir_length = strlen(dir_path);
+  char path[MAX_SCAN_PATH];
+  struct dirent *dirent;
+  int err = 0;
+  while((dirent = readdir(dir)) != NULL)
+  {
+    const char *name = dirent->d_name;
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      continue;
+    size_t length = dir_length + 1 + strlen(name);
+    if(length >= sizeof(path))
+      continue;
+    sprintf(path, "%s/%s", dir_path, name);
+    struct stat st;
+    if(lstat(path, &st) != 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)))
+      continue;
+
+    //the path lives just after the entry
+    ScanEntry *entry = (ScanEntry*)malloc(sizeof(ScanEntry) + length + 1);
+    if(entry == NULL || !grow((void**)found, space, *count + 1, sizeof(ScanEntry*)))
+    {
+      free(entry);
+      err = ENOMEM;
+      break;
+    }
+    entry->device = st.st_dev;
+    entry->node = st.st_ino;
+    entry->parent = dir_node;
+    entry->directory = S_ISDIR(st.st_mode);
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->path = (char*)(entry + 1);
+    memcpy(entry->path, path, length + 1);
+    entry->change = 0;
+    entry->replaces = NULL;
+    entry->hash[0] = '\0';
+    (*found)[(*count)++] = entry;
+  }
+  closedir(dir);
+  return err;
+}
+
+/*
+* Take the next directory nobody has read, read it,
+* and add the directories in it for the others,
+* until there are none left and nobody is reading one.
+*/
+static void *
+walk_directories(void *data)
+{
+  WalkJob *job = (WalkJob*)data;
+  ScanEntry **found = NULL;
+  size_t space = 0;
+
+  pthread_mutex_lock(&job->lock);
+  while(true)
+  {
+    while(job->waiting == 0 && job->busy > 0 && job->error == 0)
+      pthread_cond_wait(&job->wake, &job->lock);
+    if(job->waiting == 0 || job->error != 0)
+      break;
+    job->waiting--;
+    char *dir_path = job->paths[job->waiting];
+    ino_t dir_node = job->nodes[job->waiting];
+    bool root = job->found_count == 0 && job->busy == 0;
+    job->busy++;
+    pthread_mutex_unlock(&job->lock);
+
+    size_t count = 0;
+    int err = read_directory(dir_path, dir_node, &found, &count, &space);
+    free(dir_path);
+    //another directory could have been deleted since
+    //it was found, but not ~/Dropbox
+    if(err == ENOENT && !root)
+      err = 0;
+
+    pthread_mutex_lock(&job->lock);
+    job->busy--;
+    job->directories++;
+    if(err == 0 && !grow((void**)&job->found, &job->found_space,
+      job->found_count + count, sizeof(ScanEntry*)))
+      err = ENOMEM;
+    for(size_t i = 0; i < count && err == 0; i++)
+    {
+      ScanEntry *entry = found[i];
+      job->found[job->found_count++] = entry;
+      found[i] = NULL;
+      if(!entry->directory)
+        continue;
+      if(!grow((void**)&job->paths, &job->space, job->waiting + 1, sizeof(char*))
+        || !grow((void**)&job->nodes, &job->node_space, job->space, sizeof(ino_t))
+        || (job->paths[job->waiting] = strdup(entry->path)) == NULL)
+      {
+        err = ENOMEM;
+        break;
+      }
+      job->nodes[job->waiting++] = entry->node;
+    }
+    for(size_t i = 0; i < count; i++)
+      free(found[i]);
+    if(err != 0)
+      job->error = err;
+    pthread_cond_broadcast(&job->wake);
+  }
+  pthread_cond_broadcast(&job->wake);
+  pthread_mutex_unlock(&job->lock);
+  free(found);
+  return NULL;
+}
+
+/*
+* Take the next file nobody has hashed, and hash it,
+* until there are none left.
+*/
+static void *
+hash_files(void *data)
+{
+  HashFilesJob *job = (HashFilesJob*)data;
+  while(true)
+  {
+    pthread_mutex_lock(&job->lock);
+    size_t next = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if(next >= job->count)
+      break;
+    ScanEntry *entry = job->files[next];
+    if(content_hash_file(entry->path, entry->hash, job->threads_per_file) != 0)
+      entry->hash[0] = '\0'; //so it counts as changed
+  }
+  return NULL;
+}
+
+static void
+run_threads(void *(*function)(void*), void *job, int threads)
+{
+  //this thread does its share too
+  pthread_t helpers[MAX_SCAN_THREADS];
+  int started = 0;
+  for(int i = 1; i < threads && i < MAX_SCAN_THREADS; i++)
+  {
+    if(pthread_create(&helpers[started], NULL, function, job) == 0)
+      started++;
+  }
+  function(job);
+  for(int i = 0; i < started; i++)
+    pthread_join(helpers[i], NULL);
+}
+
+OfflineScan::OfflineScan(void)
+  : known(NULL),
+    root_node(0),
+    entries(NULL),
+    entry_count(0),
+    index(NULL),
+    index_size(0),
+    gone(NULL),
+    gone_count(0),
+    replaced(NULL),
+    replaced_count(0),
+    directory_count(0),
+    hashed_count(0)
+{
+}
+
+OfflineScan::~OfflineScan(void)
+{
+  this->clear();
+}
+
+void
+OfflineScan::clear(void)
+{
+  for(size_t i = 0; i < this->entry_count; i++)
+    free(this->entries[i]);
+  free(this->entries);
+  free(this->index);
+  free(this->gone);
+  free(this->replaced);
+  this->entries = NULL;
+  this->entry_count = 0;
+  this->index = NULL;
+  this->index_size = 0;
+  this->gone = NULL;
+  this->gone_count = 0;
+  this->replaced = NULL;
+  this->replaced_count = 0;
+  this->directory_count = 0;
+  this->hashed_count = 0;
+}
+
+int
+OfflineScan::Run(const char *root, const NodeTable *known, int threads)
+{
+  this->clear();
+  this->known = known;
+  struct stat st;
+  if(stat(root, &st) != 0)
+    return errno;
+  if(!S_ISDIR(st.st_mode))
+    return ENOTDIR;
+  this->root_node = st.st_ino;
+
+  if(threads <= 0)
+  {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN) * SCAN_THREADS_PER_CPU;
+    if(threads < MIN_SCAN_THREADS)
+      threads = MIN_SCAN_THREADS;
+  }
+  if(threads > MAX_SCAN_THREADS)
+    threads = MAX_SCAN_THREADS;
+
+  WalkJob walk;
+  memset(&walk, 0, sizeof(walk));
+  pthread_mutex_init(&walk.lock, NULL);
+  pthread_cond_init(&walk.wake, NULL);
+  if(!grow((void**)&walk.paths, &walk.space, 1, sizeof(char*))
+    || !grow((void**)&walk.nodes, &walk.node_space, walk.space, sizeof(ino_t))
+    || (walk.paths[0] = strdup(root)) == NULL)
+    walk.error = ENOMEM;
+  else
+  {
+    walk.nodes[0] = st.st_ino;
+    walk.waiting = 1;
+    run_threads(walk_directories, &walk, threads);
+  }
+  pthread_cond_destroy(&walk.wake);
+  pthread_mutex_destroy(&walk.lock);
+  for(size_t i = 0; i < walk.waiting; i++)
+    free(walk.paths[i]);
+  free(walk.paths);
+  free(walk.nodes);
+  this->entries = walk.found;
+  this->entry_count = walk.found_count;
+  this->directory_count = walk.directories;
+  if(walk.error != 0)
+  {
+    this->clear();
+    return walk.error;
+  }
+
+  this->index_entries();
+  if(this->index == NULL && this->entry_count > 0)
+  {
+    this->clear();
+    return ENOMEM;
+  }
+  for(size_t i = 0; i < this->entry_count; i++)
+  {
+    ScanEntry *entry = this->entries[i];
+    const NodeRecord *record = known->Find(entry->device, entry->node);
+    if(record == NULL || record->directory != entry->directory)
+    {
+      entry->change = SCAN_NEW;
+      continue;
+    }
+    if(record->parent != entry->parent
+      || strcmp(NodeTable::Name(record), leaf(entry->path)) != 0)
+    {
+      //a file that's been moved keeps its size and mtime, otherwise
+      //it's more likely a new one given the node of one that's gone
+      if(!entry->directory && this->looks_changed(entry, record))
+        entry->change = SCAN_NEW;
+      else
+        entry->change = SCAN_MOVED;
+    }
+  }
+  this->find_gone();
+  if(this->gone == NULL && known->CountItems() > 0)
+  {
+    this->clear();
+    return ENOMEM;
+  }
+  this->match_replaced();
+  return this->hash_changed(threads);
+}
+
+void
+OfflineScan::index_entries(void)
+{
+  size_t size = 64;
+  while(size < this->entry_count * 2)
+    size *= 2;
+  this->index = (ScanEntry**)calloc(size, sizeof(ScanEntry*));
+  if(this->index == NULL)
+    return;
+  this->index_size = size;
+  for(size_t i = 0; i < this->entry_count; i++)
+  {
+    ScanEntry *entry = this->entries[i];
+    size_t slot = hash_node(entry->device, entry->node) & (size - 1);
+    while(this->index[slot] != NULL)
+      slot = (slot + 1) & (size - 1);
+    this->index[slot] = entry;
+  }
+}
+
+ScanEntry *
+OfflineScan::Find(dev_t device, ino_t node) const
+{
+  if(this->index == NULL)
+    return NULL;
+  size_t slot = hash_node(device, node) & (this->index_size - 1);
+  for(ScanEntry *entry; (entry = this->index[slot]) != NULL;
+    slot = (slot + 1) & (this->index_size - 1))
+  {
+    if(entry->node == node && entry->device == device)
+      return entry;
+  }
+  return NULL;
+}
+
+//whether a saved record's node is still there, as the same node
+bool
+OfflineScan::found(const NodeRecord *record) const
+{
+  const ScanEntry *entry = this->Find(record->device, record->node);
+  return entry != NULL && (entry->change & SCAN_NEW) == 0;
+}
+
+void
+OfflineScan::find_gone(void)
+{
+  this->gone = (const NodeRecord**)malloc(
+    (this->known->CountItems() + 1) * sizeof(NodeRecord*));
+  if(this->gone == NULL)
+    return;
+  size_t i;
+  for(NodeRecord *r = this->known->First(&i); r != NULL; r = this->known->Next(&i, r))
+  {
+    if(!this->found(r))
+      this->gone[this->gone_count++] = r;
+  }
+}
+
+//(a directory replaced by a new one still has what was in it to remove)
+bool
+OfflineScan::GoneWithParent(size_t i) const
+{
+  const NodeRecord *record = this->gone[i];
+  const NodeRecord *parent = this->known->Find(record->device, record->parent);
+  return parent != NULL && !this->found(parent)
+    && bsearch(&parent, this->replaced, this->replaced_count,
+      sizeof(NodeRecord*), compare_pointers) == NULL;
+}
+
+/*
+* Something with the name of something gone, in the directory
+* it was in, took its place:
+* a file written out afresh and renamed over the old one
+* (so it's the same file to Dropbox, and may well have the
+* same contents), a directory deleted and made again,
+* or something moved over it.
+*/
+void
+OfflineScan::match_replaced(void)
+{
+  if(this->gone_count == 0)
+    return;
+  size_t size = 64;
+  while(size < this->gone_count * 2)
+    size *= 2;
+  size_t *slots = (size_t*)malloc(size * sizeof(size_t));
+  this->replaced = (const NodeRecord**)malloc(this->gone_count * sizeof(NodeRecord*));
+  if(slots == NULL || this->replaced == NULL)
+  {
+    free(slots);
+    return; //they're just gone and new then
+  }
+  //gone index + 1, 0 for empty
+  memset(slots, 0, size * sizeof(size_t));
+  for(size_t i = 0; i < this->gone_count; i++)
+  {
+    const NodeRecord *old = this->gone[i];
+    size_t slot = hash_name(old->device, old->parent, NodeTable::Name(old)) & (size - 1);
+    while(slots[slot] != 0)
+      slot = (slot + 1) & (size - 1);
+    slots[slot] = i + 1;
+  }
+
+  for(size_t i = 0; i < this->entry_count; i++)
+  {
+    ScanEntry *entry = this->entries[i];
+    if((entry->change & (SCAN_NEW | SCAN_MOVED)) == 0)
+      continue;
+    const char *name = leaf(entry->path);
+    size_t slot = hash_name(entry->device, entry->parent, name) & (size - 1);
+    for(; slots[slot] != 0; slot = (slot + 1) & (size - 1))
+    {
+      const NodeRecord *old = this->gone[slots[slot] - 1];
+      if(old == NULL || old->parent != entry->parent
+        || old->device != entry->device || strcmp(NodeTable::Name(old), name) != 0)
+        continue;
+      //a file where a directory was is new, and that's gone
+      if(entry->change == SCAN_NEW && old->directory != entry->directory)
+        break;
+      entry->replaces = old;
+      this->gone[slots[slot] - 1] = NULL;
+      this->replaced[this->replaced_count++] = old;
+      break;
+    }
+  }
+  free(slots);
+  qsort(this->replaced, this->replaced_count, sizeof(NodeRecord*), compare_pointers);
+
+  size_t kept = 0;
+  for(size_t i = 0; i < this->gone_count; i++)
+  {
+    if(this->gone[i] != NULL)
+      this->gone[kept++] = this->gone[i];
+  }
+  this->gone_count = kept;
+}
+
+//the saved record an entry is to be compared with, if any
+const NodeRecord *
+OfflineScan::compared_with(const ScanEntry *entry) const
+{
+  if((entry->change & SCAN_NEW) != 0)
+    return entry->replaces;
+  return this->known->Find(entry->device, entry->node);
+}
+
+//whether a file isn't as Dropbox last had it, going by size and mtime
+bool
+OfflineScan::looks_changed(const ScanEntry *entry, const NodeRecord *was) const
+{
+  return entry->size != NodeTable::SyncedSize(was)
+    || entry->mtime != NodeTable::SyncedMtime(was);
+}
+
+/*
+* Compare the contents of the files that look changed with
+* the content_hash Dropbox has for them, several at a time.
+* Moved files are compared too, in case one is really a new
+* file that was given the node of one that's gone, and
+* happens to have the same size and mtime.
+*/
+int
+OfflineScan::hash_changed(int threads)
+{
+  char hash[NODE_HASH_SIZE * 2 + 1];
+  HashFilesJob job;
+  job.files = (ScanEntry**)malloc((this->entry_count + 1) * sizeof(ScanEntry*));
+  if(job.files == NULL)
+    return ENOMEM;
+  job.count = 0;
+  job.next = 0;
+  for(size_t i = 0; i < this->entry_count; i++)
+  {
+    ScanEntry *entry = this->entries[i];
+    const NodeRecord *was = this->compared_with(entry);
+    if(entry->directory || was == NULL)
+      continue;
+    if(!this->looks_changed(entry, was) && (entry->change & SCAN_MOVED) == 0)
+      continue;
+    //nothing to compare it with
+    if(!NodeTable::GetHash(was, hash))
+      entry->change |= SCAN_CHANGED;
+    else
+      job.files[job.count++] = entry;
+  }
+
+  //a few big files get all the threads each
+  job.threads_per_file = job.count < (size_t)threads ? threads : 1;
+  pthread_mutex_init(&job.lock, NULL);
+  run_threads(hash_files, &job, (size_t)threads < job.count ? threads : (int)job.count);
+  pthread_mutex_destroy(&job.lock);
+
+  for(size_t i = 0; i < job.count; i++)
+  {
+    ScanEntry *entry = job.files[i];
+    const NodeRecord *was = this->compared_with(entry);
+    NodeTable::GetHash(was, hash);
+    if(strcmp(entry->hash, hash) != 0)
+      entry->change |= SCAN_CHANGED;
+    else if(this->looks_changed(entry, was))
+      entry->change |= SCAN_TOUCHED;
+  }
+  this->hashed_count = job.count;
+  free(job.files);
+  return 0;
+}
+
+/*
+* Where a saved record is once the directory it was in has
+* been moved to where that is now: its parent's path now,
+* and its old name. Just its old path if its parent is
+* ~/Dropbox itself, or gone.
+*/
+char *
+OfflineScan::PathAfterMoves(const NodeRecord *record) const
+{
+  const NodeRecord *parent = NULL;
+  if(record->parent != this->root_node)
+    parent = this->known->Find(record->device, record->parent);
+  const ScanEntry *now = parent != NULL && this->found(parent)
+    ? this->Find(parent->device, parent->node) : NULL;
+  if(now == NULL)
+  {
+    char path[MAX_SCAN_PATH];
+    return this->known->GetPath(record, path, sizeof(path)) ? strdup(path) : NULL;
+  }
+  char *path = (char*)malloc(strlen(now->path) + 1 + strlen(NodeTable::Name(record)) + 1);
+  if(path != NULL)
+    sprintf(path, "%s/%s", now->path, NodeTable::Name(record));
+  return path;
+}
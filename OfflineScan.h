@@ -0,0 +1,107 @@
+#ifndef OFFLINE_SCAN_H
+#define OFFLINE_SCAN_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ContentHash.h"
+#include "NodeTable.h"
+
+/*
+* Finds what changed in ~/Dropbox while the client wasn't
+* running, by walking it on several threads and comparing
+* what's there with the saved state (a NodeTable).
+*
+* A file whose size and mtime still match what Dropbox last
+* had is taken to be the same. One that doesn't is hashed
+* (on several threads again) and compared with the saved
+* content_hash, so only files that really changed need
+* uploading. Nodes are matched up by their node number, so
+* something renamed or moved shows up as that, and a moved
+* directory doesn't make everything in it look new.
+*/
+
+//what happened to a node, more than one can apply
+enum
+{
+  SCAN_NEW = 1, //not in the saved state (but see replaces)
+  SCAN_MOVED = 2, //in another directory, or renamed
+  SCAN_CHANGED = 4, //different contents (or we can't tell)
+  SCAN_TOUCHED = 8 //looked changed, but has the same contents
+};
+
+struct ScanEntry
+{
+  dev_t device;
+  ino_t node;
+  ino_t parent;
+  bool directory;
+  int64_t size;
+  int64_t mtime;
+  char *path;
+  int change;
+  //a saved record that had its name in the directory it's in,
+  //and isn't there now
+  //(a file saved by writing a new one and renaming it over
+  //the old, or something moved over it), NULL if none
+  const NodeRecord *replaces;
+  char hash[CONTENT_HASH_LENGTH + 1]; //if it was hashed
+};
+
+class OfflineScan
+{
+public:
+  OfflineScan(void);
+  ~OfflineScan(void);
+
+  //threads 0 means a few per CPU, returns 0 or an errno
+  int Run(const char *root, const NodeTable *known, int threads = 0);
+
+  //everything found, parents before what's in them
+  size_t CountEntries(void) const { return entry_count; }
+  ScanEntry *EntryAt(size_t i) const { return entries[i]; }
+  ScanEntry *Find(dev_t device, ino_t node) const;
+
+  //the saved records that weren't found (other than the ones
+  //replaced), and whether what they were in is gone too,
+  //in which case removing that removes them
+  size_t CountGone(void) const { return gone_count; }
+  const NodeRecord *GoneAt(size_t i) const { return gone[i]; }
+  bool GoneWithParent(size_t i) const;
+
+  //where a saved record is once what it was in has been
+  //moved to where it is now, malloc()ed
+  char *PathAfterMoves(const NodeRecord *record) const;
+
+  size_t CountDirectories(void) const { return directory_count; }
+  size_t CountHashed(void) const { return hashed_count; }
+
+private:
+  void clear(void);
+  void index_entries(void);
+  bool found(const NodeRecord *record) const;
+  void find_gone(void);
+  void match_replaced(void);
+  const NodeRecord *compared_with(const ScanEntry *entry) const;
+  bool looks_changed(const ScanEntry *entry, const NodeRecord *was) const;
+  int hash_changed(int threads);
+
+  const NodeTable *known;
+  ino_t root_node;
+
+  ScanEntry **entries;
+  size_t entry_count;
+  ScanEntry **index; //open addressing by (device, node)
+  size_t index_size; //a power of two
+
+  const NodeRecord **gone;
+  size_t gone_count;
+  const NodeRecord **replaced; //sorted
+  size_t replaced_count;
+
+  size_t directory_count;
+  size_t hashed_count;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+
+#include "NodeTable.h"
+#include "QuietQueue.h"
+
+const size_t QUIET_INITIAL_BUCKETS = 64;
+
+struct QuietEntry
+{
+  dev_t device;
+  ino_t node;
+  int64_t changed; //when it last changed
+  QuietEntry *next; //hash chain
+  QuietEntry *older; //change list
+  QuietEntry *newer;
+};
+
+QuietQueue::QuietQueue(void)
+  : buckets(NULL), bucket_count(QUIET_INITIAL_BUCKETS), count(0),
+    oldest(NULL), newest(NULL), touches(0), popped(0)
+{
+  buckets = (QuietEntry**)calloc(bucket_count, sizeof(QuietEntry*));
+}
+
+QuietQueue::~QuietQueue(void)
+{
+  while(oldest != NULL)
+    remove(oldest);
+  free(buckets);
+}
+
+size_t
+QuietQueue::bucket_for(dev_t device, ino_t node) const
+{
+  return hash_node(device, node) & (bucket_count - 1);
+}
+
+QuietEntry *
+QuietQueue::find(dev_t device, ino_t node) const
+{
+  QuietEntry *entry = buckets[bucket_for(device, node)];
+  while(entry != NULL)
+  {
+    if(entry->node == node && entry->device == device)
+      return entry;
+    entry = entry->next;
+  }
+  return NULL;
+}
+
+void
+QuietQueue::grow(void)
+{
+  size_t old_count = bucket_count;
+  QuietEntry **new_buckets = (QuietEntry**)calloc(old_count * 2, sizeof(QuietEntry*));
+  if(new_buckets == NULL)
+    return;
+  free(buckets);
+  buckets = new_buckets;
+  bucket_count = old_count * 2;
+  for(QuietEntry *entry = oldest; entry != NULL; entry = entry->newer)
+  {
+    size_t b = bucket_for(entry->device, entry->node);
+    entry->next = buckets[b];
+    buckets[b] = entry;
+  }
+}
+
+/*
+* Take an entry off the change list (but not its hash chain).
+*/
+void
+QuietQueue::unlink(QuietEntry *entry)
+{
+  if(entry->older != NULL)
+    entry->older->newer = entry->newer;
+  else
+    oldest = entry->newer;
+  if(entry->newer != NULL)
+    entry->newer->older = entry->older;
+  else
+    newest = entry->older;
+}
+
+void
+QuietQueue::append(QuietEntry *entry)
+{
+  entry->newer = NULL;
+  entry->older = newest;
+  if(newest != NULL)
+    newest->newer = entry;
+  else
+    oldest = entry;
+  newest = entry;
+}
+
+void
+QuietQueue::remove(QuietEntry *entry)
+{
+  QuietEntry **link = &buckets[bucket_for(entry->device, entry->node)];
+  while(*link != entry)
+    link = &(*link)->next;
+  *link = entry->next;
+  unlink(entry);
+  free(entry);
+  count--;
+}
+
+/*
+* The node just changed. Add it, or if it's already
+* waiting, start its quiet period over.
+* Times only go forward, so the newest is always last.
+*/
+void
+QuietQueue::Touch(dev_t device, ino_t node, int64_t now)
+{
+  touches++;
+  QuietEntry *entry = find(device, node);
+  if(entry != NULL)
+  {
+    unlink(entry);
+    entry->changed = now;
+    append(entry);
+    return;
+  }
+
+  entry = (QuietEntry*)malloc(sizeof(QuietEntry));
+  if(entry == NULL)
+    return;
+  entry->device = device;
+  entry->node = node;
+  entry->changed = now;
+
+  if(count >= bucket_count)
+    grow();
+  size_t b = bucket_for(device, node);
+  entry->next = buckets[b];
+  buckets[b] = entry;
+  append(entry);
+  count++;
+}
+
+/*
+* Forget a node (it was deleted, or moved out).
+* Returns false if it wasn't waiting.
+*/
+bool
+QuietQueue::Remove(dev_t device, ino_t node)
+{
+  QuietEntry *entry = find(device, node);
+  if(entry == NULL)
+    return false;
+  remove(entry);
+  return true;
+}
+
+/*
+* If the node that changed longest ago has been quiet
+* for at least quiet, take it off the queue and
+* return true with it in device and node.
+*/
+bool
+QuietQueue::PopQuiet(int64_t now, int64_t quiet, dev_t *device, ino_t *node)
+{
+  if(oldest == NULL || now - oldest->changed < quiet)
+    return false;
+  *device = oldest->device;
+  *node = oldest->node;
+  remove(oldest);
+  popped++;
+  return true;
+}
+
+/*
+* When the next node will have been quiet long enough,
+* or -1 if nothing is waiting.
+*/
+int64_t
+QuietQueue::NextDue(int64_t quiet) const
+{
+  if(oldest == NULL)
+    return -1;
+  return oldest->changed + quiet;
+}
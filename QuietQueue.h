@@ -0,0 +1,52 @@
+#ifndef QUIET_QUEUE_H
+#define QUIET_QUEUE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct QuietEntry;
+
+/*
+* The files that have changed but not been uploaded yet,
+* keyed by (device, node), oldest change first.
+*
+* A file being written (or re-tagged) changes over and
+* over. Touch() restarts its quiet period each time, and
+* PopQuiet() only gives it back once it has been left
+* alone for the whole quiet period, so a burst of changes
+* turns into one upload of the finished file.
+*/
+class QuietQueue
+{
+public:
+  QuietQueue(void);
+  ~QuietQueue(void);
+
+  void Touch(dev_t device, ino_t node, int64_t now);
+  bool Remove(dev_t device, ino_t node);
+  bool PopQuiet(int64_t now, int64_t quiet, dev_t *device, ino_t *node);
+  int64_t NextDue(int64_t quiet) const;
+
+  size_t CountItems(void) const { return count; }
+  uint64_t CountTouches(void) const { return touches; }
+  uint64_t CountPopped(void) const { return popped; }
+
+private:
+  size_t bucket_for(dev_t device, ino_t node) const;
+  QuietEntry *find(dev_t device, ino_t node) const;
+  void unlink(QuietEntry *entry);
+  void append(QuietEntry *entry);
+  void remove(QuietEntry *entry);
+  void grow(void);
+
+  QuietEntry **buckets;
+  size_t bucket_count; //always a power of two
+  size_t count;
+  QuietEntry *oldest; //by last change
+  QuietEntry *newest;
+  uint64_t touches;
+  uint64_t popped;
+};
+
+#endif
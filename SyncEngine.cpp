@@ -0,0 +1,1628 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ContentHash.h"
+#include "SyncEngine.h"
+#include "Trace.h"
+
+const size_t MAX_SYNC_PATH = 4096;
+//a file changed this recently could change again
+//without its mtime moving, so don't trust the mtime
+const time_t RACY_MTIME = 2;
+
+static int64_t
+now_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+* The mtime to remember a file having as Dropbox has it,
+* -1 if it's too recent to go by.
+*/
+static int64_t
+synced_mtime_of(time_t mtime)
+{
+  return mtime > time(NULL) - RACY_MTIME ? -1 : (int64_t)mtime;
+}
+
+static const char *
+leaf(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash != NULL ? slash + 1 : path;
+}
+
+static bool
+grow(void **array, size_t *space, size_t need, size_t item)
+{
+  if(need <= *space)
+    return true;
+  size_t bigger = *space < 64 ? 64 : *space * 2;
+  while(bigger < need)
+    bigger *= 2;
+  void *grown = realloc(*array, bigger * item);
+  if(grown == NULL)
+    return false;
+  *array = grown;
+  *space = bigger;
+  return true;
+}
+
+//mkdir -p, returns 0 or an errno
+static int
+make_directories(const char *path)
+{
+  char partial[MAX_SYNC_PATH];
+  size_t length = strlen(path);
+  if(length >= sizeof(partial))
+    return ENAMETOOLONG;
+  memcpy(partial, path, length + 1);
+  for(size_t i = 1; i <= length; i++)
+  {
+    if(partial[i] != '/' && partial[i] != '\0')
+      continue;
+    char was = partial[i];
+    partial[i] = '\0';
+    if(mkdir(partial, 0777) != 0 && errno != EEXIST)
+      return errno;
+    partial[i] = was;
+  }
+  return 0;
+}
+
+//rm -rf
+static void
+remove_tree(const char *path)
+{
+  DIR *dir = opendir(path);
+  if(dir != NULL)
+  {
+    char child[MAX_SYNC_PATH];
+    struct dirent *dirent;
+    while((dirent = readdir(dir)) != NULL)
+    {
+      if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        continue;
+      snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name);
+      struct stat st;
+      if(lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+        remove_tree(child);
+      else if(unlink(child) != 0)
+        TRACE(TRACE_ERROR, "Remove Error: %s on %s", strerror(errno), child);
+    }
+    closedir(dir);
+  }
+  if(rmdir(path) != 0)
+    TRACE(TRACE_ERROR, "Folder Removal Error: %s", strerror(errno));
+}
+
+static bool
+has_entries(const char *path)
+{
+  DIR *dir = opendir(path);
+  if(dir == NULL)
+    return false;
+  struct dirent *dirent;
+  bool found = false;
+  while(!found && (dirent = readdir(dir)) != NULL)
+    found = strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0;
+  closedir(dir);
+  return found;
+}
+
+SyncEngine::SyncEngine(const char *root, const char *download_dir,
+  FsWatch *watch, SyncTransport *transport)
+  : root_device(-1),
+    root_node(0),
+    fs(watch),
+    transport(transport),
+    echo_sweep_due(false),
+    quiet_time(0),
+    delta_running(false),
+    delta_cursor(NULL),
+    delta_more(false),
+    delta_changed(false),
+    page_failed(false),
+    downloads_pending(0),
+    download_count(0),
+    contents(&tracked_nodes),
+    reuse(true),
+    waiting(NULL),
+    waiting_count(0),
+    waiting_space(0),
+    reused_files(0),
+    reused_bytes(0),
+    resetting(false)
+{
+  this->root = strdup(root);
+  this->root_length = strlen(root);
+  this->download_dir = strdup(download_dir);
+}
+
+SyncEngine::~SyncEngine(void)
+{
+  this->state.Close();
+  free(this->root);
+  free(this->download_dir);
+  free(this->delta_cursor);
+  for(size_t i = 0; i < this->waiting_count; i++)
+  {
+    free(this->waiting[i].path);
+    free(this->waiting[i].temp_path);
+    free(this->waiting[i].rev);
+    free(this->waiting[i].hash);
+  }
+  free(this->waiting);
+}
+
+int
+SyncEngine::Open(const char *state_file)
+{
+  struct stat st;
+  if(stat(this->root, &st) != 0)
+    return errno;
+  this->root_device = st.st_dev;
+  this->root_node = st.st_ino;
+  make_directories(this->download_dir);
+  return this->state.Open(state_file, &this->tracked_nodes,
+    this->root_device, this->root_node, this->root);
+}
+
+// Paths
+
+/*
+* Convert a Dropbox path ("/" and what's under the
+* folder, as Dropbox gives it) to a local absolute
+* filepath by adding the <path to Dropbox> to the beginning
+*/
+bool
+SyncEngine::local_path(const char *db_path, char *path, size_t size) const
+{
+  return (size_t)snprintf(path, size, "%s%s", this->root, db_path) < size;
+}
+
+/*
+* Convert a local absolute filepath to a Dropbox one
+* by removing the <path to Dropbox> from the beginning,
+* leaving the "/" Dropbox wants its paths to start with
+*/
+const char *
+SyncEngine::db_path(const char *path) const
+{
+  if(strncmp(path, this->root, this->root_length) == 0
+    && path[this->root_length] == '/')
+    return path + this->root_length;
+  return path;
+}
+
+//the full local path of a tracked node, false if it can't be worked out
+bool
+SyncEngine::path_of(const NodeRecord *record, char *path, size_t size) const
+{
+  return this->tracked_nodes.GetPath(record, path, size);
+}
+
+//the path of name in a tracked directory (or the folder itself)
+bool
+SyncEngine::child_path(dev_t device, ino_t directory, const char *name,
+  char *path, size_t size) const
+{
+  char dir_path[MAX_SYNC_PATH];
+  if(device == this->root_device && directory == this->root_node)
+    strcpy(dir_path, this->root);
+  else
+  {
+    const NodeRecord *record = this->tracked_nodes.Find(device, directory);
+    if(record == NULL || !path_of(record, dir_path, sizeof(dir_path)))
+      return false;
+  }
+  return (size_t)snprintf(path, size, "%s/%s", dir_path, name) < size;
+}
+
+//whether a directory is the folder or in it
+bool
+SyncEngine::in_folder(dev_t device, ino_t directory) const
+{
+  if(directory == 0)
+    return false;
+  if(device == this->root_device && directory == this->root_node)
+    return true;
+  const NodeRecord *record = this->tracked_nodes.Find(device, directory);
+  return record != NULL && record->directory;
+}
+
+//queue up a request with no more to it than its arguments
+void
+SyncEngine::send(int reply, const char *op, const char *arg1,
+  const char *arg2, const char *arg3)
+{
+  SyncRequest request;
+  memset(&request, 0, sizeof(request));
+  request.reply = reply;
+  request.args[0] = op;
+  request.args[1] = arg1;
+  request.args[2] = arg2;
+  request.args[3] = arg3;
+  request.argc = arg3 != NULL ? 4 : arg2 != NULL ? 3 : 2;
+  this->transport->Send(&request);
+}
+
+// Tracking and watching
+
+/*
+* Add (or update) the record of the file (or folder)
+* at path in tracked_nodes, indexed by its node, and
+* in the sync state.
+* Returns NULL if it can't be tracked.
+*/
+NodeRecord *
+SyncEngine::track_file(const char *path)
+{
+  char parent_path[MAX_SYNC_PATH];
+  size_t parent_length = leaf(path) - path;
+  if(parent_length == 0 || parent_length >= sizeof(parent_path))
+    return NULL;
+  memcpy(parent_path, path, parent_length);
+  parent_path[parent_length] = '\0';
+  struct stat st, parent;
+  if(lstat(path, &st) != 0 || stat(parent_path, &parent) != 0)
+    return NULL;
+  NodeRecord *record = this->tracked_nodes.Insert(st.st_dev, st.st_ino,
+    parent.st_ino, leaf(path));
+  if(record != NULL)
+  {
+    record->directory = S_ISDIR(st.st_mode);
+    this->state.Save(record);
+  }
+  return record;
+}
+
+/*
+* Stop tracking a node, it's gone or out of the folder.
+*/
+void
+SyncEngine::untrack(dev_t device, ino_t node)
+{
+  this->quiet_nodes.Remove(device, node);
+  if(this->tracked_nodes.Remove(device, node))
+    this->state.Forget(device, node);
+}
+
+void
+SyncEngine::watch(const char *path, const NodeRecord *record)
+{
+  if(this->fs->Watch(path, record->device, record->node, record->directory) != 0)
+    TRACE(TRACE_ERROR, "could not watch %s", path);
+}
+
+/*
+* Track and watch everything in a directory,
+* and everything in the directories in it.
+*/
+void
+SyncEngine::recursive_watch(const char *dir_path)
+{
+  DIR *dir = opendir(dir_path);
+  if(dir == NULL)
+    return;
+  char path[MAX_SYNC_PATH];
+  struct dirent *dirent;
+  while((dirent = readdir(dir)) != NULL)
+  {
+    if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+    if((size_t)snprintf(path, sizeof(path), "%s/%s", dir_path, dirent->d_name) >= sizeof(path))
+      continue;
+    NodeRecord *record = this->track_file(path);
+    if(record == NULL)
+      continue;
+    watch(path, record);
+    if(record->directory)
+      this->recursive_watch(path);
+  }
+  closedir(dir);
+}
+
+/*
+* Send what's in a directory that's just turned up. What
+* was put in it before it was watched (a whole tree being
+* copied in, say) has no events of its own to come.
+*/
+void
+SyncEngine::added_contents(const char *dir_path)
+{
+  DIR *dir = opendir(dir_path);
+  if(dir == NULL)
+    return;
+  char path[MAX_SYNC_PATH];
+  struct dirent *dirent;
+  while((dirent = readdir(dir)) != NULL)
+  {
+    if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+    if((size_t)snprintf(path, sizeof(path), "%s/%s", dir_path, dirent->d_name) >= sizeof(path))
+      continue;
+    struct stat st;
+    if(lstat(path, &st) != 0 || this->tracked_nodes.Find(st.st_dev, st.st_ino) != NULL)
+      continue;
+    added(path, this->track_file(path));
+  }
+  closedir(dir);
+}
+
+/*
+* Something new turned up in the folder (made here,
+* or moved in): send it to Dropbox, and watch it.
+*/
+void
+SyncEngine::added(const char *path, NodeRecord *record)
+{
+  if(record == NULL)
+    return;
+  watch(path, record);
+  if(record->directory)
+  {
+    send(SYNC_NO_REPLY, "mkdir", db_path(path));
+    this->added_contents(path);
+  }
+  else
+  {
+    //uploaded once it's finished being written
+    file_changed(record);
+  }
+}
+
+/*
+* Remember that we are causing the given event on a
+* node, so it won't be sent back to Dropbox.
+* It's forgotten once the events already queued by then
+* have been handled (see StartEchoSweep).
+*/
+void
+SyncEngine::expect_echo(dev_t device, ino_t node, int kind)
+{
+  this->echoes.Expect(device, node, kind, kind == FS_CHANGED, now_usecs());
+  this->echo_sweep_due = true;
+}
+
+bool
+SyncEngine::StartEchoSweep(uint32_t *generation)
+{
+  if(!this->echo_sweep_due)
+    return false;
+  *generation = this->echoes.Generation();
+  this->echoes.NextGeneration();
+  this->echo_sweep_due = false;
+  return true;
+}
+
+void
+SyncEngine::ExpireEchoes(uint32_t generation)
+{
+  this->echoes.Expire(generation);
+}
+
+void
+SyncEngine::ExpireOldEchoes(int64_t max_age)
+{
+  this->echoes.ExpireBefore(now_usecs() - max_age);
+}
+
+// Local changes
+
+void
+SyncEngine::HandleEvent(const FsEvent *event)
+{
+  TraceSpan span(TRACE_WATCH);
+  char path[MAX_SYNC_PATH];
+  NodeRecord *record = this->tracked_nodes.Find(event->device, event->node);
+  switch(event->kind)
+  {
+    case FS_CREATED:
+    {
+      //we made it ourselves, and already track it
+      if(this->echoes.Suppress(event->device, event->node, FS_CREATED))
+        break;
+      if(!child_path(event->device, event->directory, event->name, path, sizeof(path)))
+        break;
+      //already found in a new directory, before this came
+      char known[MAX_SYNC_PATH];
+      if(record != NULL && path_of(record, known, sizeof(known))
+        && strcmp(known, path) == 0)
+        break;
+      TRACE(TRACE_DEBUG, "created %s", path);
+      added(path, this->track_file(path));
+      break;
+    }
+    case FS_MOVED:
+    {
+      bool into_folder = in_folder(event->device, event->directory)
+        && child_path(event->device, event->directory, event->name, path, sizeof(path));
+      if(this->echoes.Suppress(event->device, event->node, FS_MOVED))
+      {
+        //our own rename, just keep up with it
+        if(record != NULL && into_folder)
+        {
+          this->tracked_nodes.Insert(event->device, event->node, event->directory, event->name);
+          this->state.Save(record);
+        }
+      }
+      else if(record != NULL && into_folder)
+      {
+        char from[MAX_SYNC_PATH];
+        if(path_of(record, from, sizeof(from)))
+        {
+          TRACE(TRACE_DEBUG, "moving %s to %s", from, path);
+          send(SYNC_NO_REPLY, "mv", db_path(from), db_path(path));
+        }
+        //what's in it comes along by itself
+        this->tracked_nodes.Insert(event->device, event->node, event->directory, event->name);
+        this->state.Save(record);
+      }
+      else if(record != NULL)
+      {
+        if(path_of(record, path, sizeof(path)))
+        {
+          TRACE(TRACE_DEBUG, "%s moved out of the folder", path);
+          TRACE(TRACE_DEBUG, "Telling Dropbox to Delete: %s", db_path(path));
+          send(SYNC_NO_REPLY, "rm", db_path(path));
+        }
+        this->untrack(event->device, event->node);
+      }
+      else if(into_folder)
+      {
+        TRACE(TRACE_DEBUG, "%s moved into the folder", path);
+        added(path, this->track_file(path));
+      }
+      break;
+    }
+    case FS_REMOVED:
+    {
+      if(record == NULL)
+      {
+        //unless we removed it, and stopped tracking it, ourselves
+        if(!this->echoes.Suppress(event->device, event->node, FS_REMOVED))
+          TRACE(TRACE_ERROR, "could not find deleted file");
+        break;
+      }
+      //a node's number can be given to a new one before we
+      //hear the old one's gone, and it's this that we track
+      struct stat st;
+      if(path_of(record, path, sizeof(path)) && lstat(path, &st) == 0
+        && st.st_dev == event->device && st.st_ino == event->node)
+      {
+        TRACE(TRACE_DEBUG, "%s is still there, its node was reused", path);
+        break;
+      }
+      //gone either way, so stop tracking it
+      if(!this->echoes.Suppress(event->device, event->node, FS_REMOVED)
+        && path_of(record, path, sizeof(path)))
+      {
+        TRACE(TRACE_DEBUG, "Telling Dropbox to Delete: %s", db_path(path));
+        send(SYNC_NO_REPLY, "rm", db_path(path));
+      }
+      this->untrack(event->device, event->node);
+      break;
+    }
+    case FS_CHANGED:
+    {
+      if(record == NULL || record->directory)
+        break;
+      if(this->echoes.Suppress(event->device, event->node, FS_CHANGED))
+        break;
+      file_changed(record);
+      break;
+    }
+  }
+}
+
+/*
+* A tracked file changed (or appeared). Upload it
+* once it has been left alone for quiet_time.
+*/
+void
+SyncEngine::file_changed(NodeRecord *record)
+{
+  this->quiet_nodes.Touch(record->device, record->node, now_usecs());
+}
+
+int64_t
+SyncEngine::NextQuietCheck(void) const
+{
+  int64_t due = this->quiet_nodes.NextDue(this->quiet_time);
+  if(due < 0)
+    return -1;
+  int64_t delay = due - now_usecs();
+  return delay < 1000 ? 1000 : delay;
+}
+
+/*
+* Upload everything that's been quiet long enough.
+*/
+void
+SyncEngine::UploadQuietFiles(void)
+{
+  dev_t device;
+  ino_t node;
+  while(this->quiet_nodes.PopQuiet(now_usecs(), this->quiet_time, &device, &node))
+  {
+    NodeRecord *record = this->tracked_nodes.Find(device, node);
+    if(record != NULL)
+      upload_file(record);
+  }
+  TRACE(TRACE_DEBUG, "quiet files: %lld changes, %lld uploads checked, %ld waiting",
+    (long long)this->quiet_nodes.CountTouches(),
+    (long long)this->quiet_nodes.CountPopped(),
+    (long)this->quiet_nodes.CountItems());
+}
+
+/*
+* Queue up sending a tracked file to Dropbox, unless
+* its size and mtime say it's what Dropbox already has.
+* (Failing that, the worker compares its content_hash.)
+* If it's already on its way, it gets sent again
+* once that upload is done (see UploadDone),
+* with the parent_rev that upload gives it.
+*/
+void
+SyncEngine::upload_file(NodeRecord *record)
+{
+  if(record->upload != NODE_IDLE)
+  {
+    record->upload = NODE_UPLOAD_AGAIN;
+    return;
+  }
+  char path[MAX_SYNC_PATH];
+  struct stat st;
+  if(!path_of(record, path, sizeof(path)) || lstat(path, &st) != 0 || S_ISDIR(st.st_mode))
+    return;
+  if(st.st_size == NodeTable::SyncedSize(record) && st.st_mtime == NodeTable::SyncedMtime(record))
+  {
+    TRACE(TRACE_DEBUG, "%s hasn't changed, not uploading", path);
+    return;
+  }
+  if(NodeTable::Rev(record) == NULL)
+  {
+    //not in the sync state, see if an older version left it
+    char old_rev[256] = "", old_hash[CONTENT_HASH_LENGTH + 1] = "";
+    this->fs->ReadOldRev(path, old_rev, sizeof(old_rev), old_hash, sizeof(old_hash));
+    NodeTable::SetRev(record, old_rev);
+    NodeTable::SetHash(record, old_hash);
+  }
+  const char *rev = NodeTable::Rev(record);
+  TRACE(TRACE_DEBUG, "uploading %s, parent_rev |%s|", path, rev != NULL ? rev : "");
+
+  SyncRequest request;
+  memset(&request, 0, sizeof(request));
+  request.reply = SYNC_PUT_DONE;
+  request.args[0] = "put";
+  request.args[1] = path;
+  request.args[2] = db_path(path);
+  request.args[3] = rev != NULL ? rev : "";
+  request.argc = 4;
+  //not sent if it's still what Dropbox has
+  char hash[NODE_HASH_SIZE * 2 + 1];
+  NodeTable::GetHash(record, hash);
+  request.compare_path = path;
+  request.compare_hash = hash;
+  request.device = record->device;
+  request.node = record->node;
+  request.size = st.st_size;
+  request.mtime = synced_mtime_of(st.st_mtime);
+  request.modified = st.st_mtime;
+  record->upload = NODE_UPLOADING;
+  this->transport->Send(&request);
+}
+
+/*
+* An upload finished. On success real_path is the real
+* Dropbox path, rev the new parent_rev and hash the
+* content_hash, unless it wasn't sent because Dropbox
+* already had the same contents.
+*/
+void
+SyncEngine::UploadDone(int status, dev_t device, ino_t node, bool unchanged,
+  int64_t size, int64_t mtime, const char *real_path,
+  const char *rev, const char *hash)
+{
+  NodeRecord *record = this->tracked_nodes.Find(device, node);
+  if(record == NULL)
+    return; //deleted while it was uploading
+
+  bool again = record->upload == NODE_UPLOAD_AGAIN;
+  record->upload = NODE_IDLE;
+  if(status == SYNC_OK)
+  {
+    NodeTable::SetSynced(record, size, mtime);
+    char path[MAX_SYNC_PATH];
+    if(unchanged)
+      TRACE(TRACE_DEBUG, "%s has the same contents, not uploaded",
+        path_of(record, path, sizeof(path)) ? path : NodeTable::Name(record));
+    else
+    {
+      TRACE(TRACE_DEBUG, "uploaded |%s|, rev |%s|", real_path, rev);
+      NodeTable::SetRev(record, rev);
+      NodeTable::SetHash(record, hash);
+      this->contents.Add(record);
+      rename_to_match(record, real_path);
+    }
+    this->state.Save(record);
+  }
+  if(again)
+    upload_file(record);
+}
+
+/*
+* Create the local directory for a Dropbox path,
+* and any missing parents, then track and watch
+* the new directories. Their creation isn't echoed.
+*/
+void
+SyncEngine::create_watched_directory(const char *db_path)
+{
+  char path[MAX_SYNC_PATH];
+  if(!local_path(db_path, path, sizeof(path)))
+    return;
+  //the topmost one that isn't there
+  size_t top = 0, length = strlen(path);
+  struct stat st;
+  for(size_t i = this->root_length; i <= length && top == 0; i++)
+  {
+    if(path[i] != '/' && path[i] != '\0')
+      continue;
+    char was = path[i];
+    path[i] = '\0';
+    if(lstat(path, &st) != 0)
+      top = i;
+    path[i] = was;
+  }
+  if(top == 0)
+    return;
+
+  int err = make_directories(path);
+  if(err != 0)
+    TRACE(TRACE_ERROR, "Create local dir %s: %s", path, strerror(err));
+
+  for(size_t i = top; i <= length; i++)
+  {
+    if(path[i] != '/' && path[i] != '\0')
+      continue;
+    char was = path[i];
+    path[i] = '\0';
+    if(lstat(path, &st) == 0)
+      expect_echo(st.st_dev, st.st_ino, FS_CREATED);
+    path[i] = was;
+  }
+
+  //the children get watched along with the topmost new directory
+  path[top] = '\0';
+  NodeRecord *record = this->track_file(path);
+  if(record != NULL)
+  {
+    watch(path, record);
+    this->recursive_watch(path);
+  }
+}
+
+/*
+* Dropbox renames an upload that conflicts with another
+* version. Give the local file the same name, without
+* sending that rename back to Dropbox as a move.
+*/
+void
+SyncEngine::rename_to_match(NodeRecord *record, const char *real_path)
+{
+  char old_path[MAX_SYNC_PATH], new_path[MAX_SYNC_PATH];
+  const char *new_name = leaf(real_path);
+  if(!path_of(record, old_path, sizeof(old_path)) || strcmp(leaf(old_path), new_name) == 0)
+    return;
+  size_t dir_length = leaf(old_path) - old_path;
+  if(dir_length + strlen(new_name) >= sizeof(new_path))
+    return;
+  memcpy(new_path, old_path, dir_length);
+  strcpy(new_path + dir_length, new_name);
+
+  TRACE(TRACE_DEBUG, "moving %s to %s", leaf(old_path), new_name);
+  expect_echo(record->device, record->node, FS_MOVED);
+  if(rename(old_path, new_path) != 0)
+    TRACE(TRACE_ERROR, "error moving: %s", strerror(errno));
+  else
+  {
+    this->tracked_nodes.Insert(record->device, record->node, record->parent, new_name);
+    this->state.Save(record);
+  }
+}
+
+/*
+* Stop tracking everything in the local directory path,
+* all the way down, as we're about to remove it: its
+* removal is expected to echo (unlinking touches a node's
+* stat as well), and the nodes can't be mistaken for new
+* files given the same numbers.
+*/
+void
+SyncEngine::untrack_tree(const char *path)
+{
+  DIR *dir = opendir(path);
+  if(dir == NULL)
+    return;
+  char child[MAX_SYNC_PATH];
+  struct dirent *dirent;
+  while((dirent = readdir(dir)) != NULL)
+  {
+    if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name);
+    struct stat st;
+    if(lstat(child, &st) != 0)
+      continue;
+    if(S_ISDIR(st.st_mode))
+      untrack_tree(child);
+    expect_echo(st.st_dev, st.st_ino, FS_REMOVED);
+    expect_echo(st.st_dev, st.st_ino, FS_CHANGED);
+    this->untrack(st.st_dev, st.st_ino);
+  }
+  closedir(dir);
+}
+
+// Act on Deltas
+
+/*
+* Given a single item of the worker's delta reply
+* Figures out what to do and does it.
+* (adds and removes files and directories)
+*/
+int
+SyncEngine::apply(const DeltaItem *item)
+{
+  const char *path = item->count > 0 ? item->fields[0] : "";
+  char local[MAX_SYNC_PATH];
+  if(strcmp(item->tag, "RESET") == 0)
+  {
+    //everything is listed after this, so what we have
+    //is kept and only what differs gets fetched or removed
+    TRACE(TRACE_INFO, "Dropbox sent a RESET, reconciling with its full listing");
+    start_reset();
+  }
+  else if(!local_path(path, local, sizeof(local)))
+  {
+    TRACE(TRACE_ERROR, "|%s| is too long a path", path);
+    return EINVAL;
+  }
+  else if(strcmp(item->tag, "FILE") == 0)
+  {
+    //downloaded out of sight, then moved into place
+    //by install_download once it's all there
+    TRACE(TRACE_DEBUG, "create a file at |%s|", path);
+    const char *rev = item->count > 1 ? item->fields[1] : "";
+    const char *hash = item->count > 2 ? item->fields[2] : "";
+    //named for the rev, so a download that gets cut off
+    //carries on where it got to the next time around
+    char temp_path[MAX_SYNC_PATH];
+    if(rev[0] != '\0')
+      snprintf(temp_path, sizeof(temp_path), "%s/rev-%s", this->download_dir, rev);
+    else
+      snprintf(temp_path, sizeof(temp_path), "%s/get-%ld", this->download_dir,
+        (long)++this->download_count);
+
+    if(this->resetting)
+      listed(local);
+    //not fetched if we already have the same contents
+    if(have_rev(local, rev, hash))
+    {
+      TRACE(TRACE_DEBUG, "already have |%s| at that rev", path);
+      return 0;
+    }
+    int64_t size = item->count > 3 ? strtoll(item->fields[3], NULL, 10) : -1;
+    time_t modified = item->count > 4 ? (time_t)strtoll(item->fields[4], NULL, 10) : 0;
+    if(this->reuse && hash[0] != '\0')
+    {
+      //or somewhere else in the folder, or on their way
+      if(copy_local(path, temp_path, rev, hash, size))
+        return 0;
+      if(join_download(path, temp_path, rev, hash, size, modified))
+        return 0;
+      //what later files with the same contents can wait for
+      add_waiting(path, hash);
+    }
+    fetch(path, local, temp_path, rev, hash, size, modified);
+  }
+  else if(strcmp(item->tag, "FOLDER") == 0)
+  {
+    //create all nescessary dirs in path, and watch them
+    TRACE(TRACE_DEBUG, "create a folder at |%s|", path);
+    create_watched_directory(path);
+    if(this->resetting)
+      listed(local);
+  }
+  else if(strcmp(item->tag, "REMOVE") == 0)
+  {
+    //TODO: deal with Dropbox file paths being case-insensitive
+    //which here means all lower case
+    TRACE(TRACE_DEBUG, "Remove whatever is at |%s|", local);
+    struct stat st;
+    if(lstat(local, &st) == 0)
+    {
+      //a folder deleted on Dropbox comes as the one REMOVE
+      if(S_ISDIR(st.st_mode))
+      {
+        untrack_tree(local);
+        remove_tree(local);
+      }
+      else if(remove(local) != 0)
+        TRACE(TRACE_ERROR, "Removal error: %s", strerror(errno));
+      expect_echo(st.st_dev, st.st_ino, FS_REMOVED);
+      expect_echo(st.st_dev, st.st_ino, FS_CHANGED);
+      this->untrack(st.st_dev, st.st_ino);
+    }
+  }
+  else
+  {
+    TRACE(TRACE_ERROR, "Did not recognize command.");
+    return EINVAL;
+  }
+  return 0;
+}
+
+/*
+* Start pulling the delta from where we left off,
+* unless we're still in the middle of doing that.
+*/
+void
+SyncEngine::StartDelta(void)
+{
+  if(this->delta_running)
+  {
+    TRACE(TRACE_DEBUG, "Still pulling the last delta");
+    return;
+  }
+  TRACE(TRACE_INFO, "*************RUNNING DELTA");
+  this->delta_running = true;
+  this->delta_changed = false;
+  free(this->delta_cursor);
+  this->delta_cursor = strdup(this->state.Cursor());
+  request_delta_page();
+}
+
+//how many items to ask for in each page of the delta
+static const char *DELTA_PAGE_SIZE = "500";
+
+void
+SyncEngine::request_delta_page(void)
+{
+  send(SYNC_DELTA_PAGE, "delta_page", this->delta_cursor, DELTA_PAGE_SIZE);
+}
+
+/*
+* A page of the delta arrived. Apply each item, which
+* queues up the downloads, and remember the page's
+* cursor to save once they're done.
+*/
+void
+SyncEngine::DeltaPageDone(const DeltaItem *items, size_t count,
+  const char *cursor, bool more)
+{
+  this->page_failed = false;
+  int64_t started = trace_start();
+  for(size_t i = 0; i < count; i++)
+  {
+    if(apply(&items[i]) != 0)
+      this->page_failed = true;
+    this->delta_changed = true;
+  }
+  trace_finish(TRACE_DELTA_APPLY, started);
+  free(this->delta_cursor);
+  this->delta_cursor = strdup(cursor);
+  this->delta_more = more;
+  finish_delta_page();
+}
+
+void
+SyncEngine::DeltaPageFailed(const char *error)
+{
+  TRACE(TRACE_ERROR, "delta failed: %s", error);
+  this->delta_running = false;
+  this->transport->DeltaFinished(false, false);
+}
+
+void
+SyncEngine::DownloadDone(int status, bool unchanged, const char *path,
+  const char *temp_path, const char *rev, const char *hash)
+{
+  this->downloads_pending--;
+  char local[MAX_SYNC_PATH];
+  if(status != SYNC_OK)
+  {
+    copy_waiting(path, NULL);
+    //what did arrive is kept to carry on from, unless it's wrong
+    if(status == SYNC_BAD_DATA || rev[0] == '\0')
+      unlink(temp_path);
+    this->page_failed = true;
+  }
+  else if(unchanged)
+  {
+    copy_waiting(path, local_path(path, local, sizeof(local)) ? local : NULL);
+    keep_local_copy(path, rev, hash);
+  }
+  else
+  {
+    //copied before it's moved into the folder, where it could change
+    copy_waiting(path, temp_path);
+    if(install_download(path, temp_path, rev, hash) != 0)
+      this->page_failed = true;
+  }
+  finish_delta_page();
+}
+
+/*
+* Once everything in a page has been applied, save its
+* cursor and ask for the next page. If anything failed
+* the cursor isn't saved, and the page is tried again
+* on the next poll.
+*/
+void
+SyncEngine::finish_delta_page(void)
+{
+  if(this->downloads_pending > 0)
+    return;
+  if(this->page_failed)
+  {
+    TRACE(TRACE_ERROR, "could not apply all of the delta page, will try again");
+    this->delta_running = false;
+    this->transport->DeltaFinished(false, this->delta_changed);
+    return;
+  }
+  //a RESET cut short starts over, rather than missing
+  //what it was going to remove at the end
+  if(this->resetting && !this->delta_more)
+    finish_reset();
+  if(!this->resetting && this->state.SaveCursor(this->delta_cursor) != 0)
+    TRACE(TRACE_ERROR, "could not save the delta cursor");
+  if(this->delta_more)
+    request_delta_page();
+  else
+  {
+    this->delta_running = false;
+    //anything left was cut off, and isn't wanted any more
+    remove_tree(this->download_dir);
+    make_directories(this->download_dir);
+    TRACE(TRACE_INFO, "*************RAN DELTA");
+    if(this->delta_changed && this->reused_files > 0)
+      TRACE(TRACE_INFO, "%lld files (%lld bytes) copied here so far, rather than downloaded",
+        (long long)this->reused_files, (long long)this->reused_bytes);
+    this->transport->DeltaFinished(true, this->delta_changed);
+  }
+}
+
+/*
+* Move a finished download into the folder, replacing
+* whatever was there, and start tracking it.
+* Its arrival isn't sent back to Dropbox.
+*/
+int
+SyncEngine::install_download(const char *path, const char *temp_path,
+  const char *rev, const char *hash)
+{
+  char dir_path[MAX_SYNC_PATH];
+  size_t dir_length = leaf(path) - path;
+  if(dir_length > 0)
+    dir_length--; //without the slash
+  if(dir_length >= sizeof(dir_path))
+    return ENAMETOOLONG;
+  memcpy(dir_path, path, dir_length);
+  dir_path[dir_length] = '\0';
+  create_watched_directory(dir_path);
+
+  struct stat download;
+  if(lstat(temp_path, &download) != 0)
+    return errno;
+
+  char local[MAX_SYNC_PATH];
+  if(!local_path(path, local, sizeof(local)))
+    return ENAMETOOLONG;
+  struct stat old;
+  if(lstat(local, &old) == 0)
+  {
+    expect_echo(old.st_dev, old.st_ino, FS_REMOVED);
+    this->untrack(old.st_dev, old.st_ino);
+  }
+
+  expect_echo(download.st_dev, download.st_ino, FS_MOVED);
+  if(rename(temp_path, local) != 0)
+  {
+    int err = errno;
+    TRACE(TRACE_ERROR, "could not move %s into place: %s", local, strerror(err));
+    unlink(temp_path);
+    return err;
+  }
+
+  NodeRecord *record = this->track_file(local);
+  if(record != NULL)
+  {
+    watch(local, record);
+    NodeTable::SetRev(record, rev);
+    NodeTable::SetHash(record, hash);
+    this->contents.Add(record);
+    struct stat st;
+    if(lstat(local, &st) == 0)
+      NodeTable::SetSynced(record, st.st_size, synced_mtime_of(st.st_mtime));
+    this->state.Save(record);
+  }
+  return 0;
+}
+
+/*
+* The local file already has the contents of a rev we
+* were about to download, so just record it as that rev.
+*/
+void
+SyncEngine::keep_local_copy(const char *path, const char *rev, const char *hash)
+{
+  char local[MAX_SYNC_PATH];
+  if(!local_path(path, local, sizeof(local)))
+    return;
+  TRACE(TRACE_DEBUG, "already have |%s|, not downloading", path);
+  NodeRecord *record = this->track_file(local);
+  if(record != NULL)
+  {
+    NodeTable::SetRev(record, rev);
+    NodeTable::SetHash(record, hash);
+    this->contents.Add(record);
+    struct stat st;
+    if(lstat(local, &st) == 0)
+      NodeTable::SetSynced(record, st.st_size, synced_mtime_of(st.st_mtime));
+    this->state.Save(record);
+  }
+}
+
+/*
+* Whether the local file is the rev we were about to
+* download, going by what we last synced: the same rev,
+* or a rev with the same content_hash (which it's then
+* recorded as), and not changed here since.
+*/
+bool
+SyncEngine::have_rev(const char *local, const char *rev, const char *hash)
+{
+  struct stat st;
+  if(lstat(local, &st) != 0 || S_ISDIR(st.st_mode))
+    return false;
+  NodeRecord *record = this->tracked_nodes.Find(st.st_dev, st.st_ino);
+  if(record == NULL || record->upload != NODE_IDLE
+    || !unchanged_since_sync(record, local, &st))
+    return false;
+  const char *known_rev = NodeTable::Rev(record);
+  if(known_rev != NULL && strcmp(rev, known_rev) == 0)
+    return true;
+  char known_hash[NODE_HASH_SIZE * 2 + 1];
+  if(hash[0] == '\0' || !NodeTable::GetHash(record, known_hash)
+    || strcmp(hash, known_hash) != 0)
+    return false;
+  NodeTable::SetRev(record, rev);
+  this->state.Save(record);
+  return true;
+}
+
+/*
+* Ask for a file to be downloaded into temp_path, to be
+* installed by DownloadDone() once it's all there.
+*/
+void
+SyncEngine::fetch(const char *path, const char *local, const char *temp_path,
+  const char *rev, const char *hash, int64_t size, time_t modified)
+{
+  SyncRequest request;
+  memset(&request, 0, sizeof(request));
+  request.reply = SYNC_GET_DONE;
+  request.args[0] = "get";
+  request.args[1] = path;
+  request.args[2] = temp_path;
+  request.args[3] = rev;
+  request.argc = 4;
+  request.verify_path = temp_path;
+  request.verify_hash = hash;
+  request.size = size;
+  request.modified = modified;
+  struct stat st;
+  if(lstat(local, &st) == 0 && S_ISREG(st.st_mode))
+  {
+    request.compare_path = local;
+    request.compare_hash = hash;
+  }
+  this->downloads_pending++;
+  this->transport->Send(&request);
+}
+
+/*
+* Whether a tracked file is still what we last synced: the
+* same size and mtime, or if it was synced too recently to
+* go by its mtime, the same content_hash (and then its
+* mtime is remembered, so it isn't hashed again).
+*/
+bool
+SyncEngine::unchanged_since_sync(NodeRecord *record, const char *path,
+  const struct stat *st)
+{
+  if(st->st_size != NodeTable::SyncedSize(record))
+    return false;
+  if(st->st_mtime == NodeTable::SyncedMtime(record))
+    return true;
+  char known_hash[NODE_HASH_SIZE * 2 + 1];
+  char now_hash[CONTENT_HASH_LENGTH + 1];
+  if(NodeTable::SyncedMtime(record) >= 0
+    || !NodeTable::GetHash(record, known_hash)
+    || content_hash_file(path, now_hash) != 0
+    || strcmp(now_hash, known_hash) != 0)
+    return false;
+  NodeTable::SetSynced(record, st->st_size, synced_mtime_of(st->st_mtime));
+  this->state.Save(record);
+  return true;
+}
+
+/*
+* Copy a tracked file with the contents Dropbox has for
+* path, if there is one, rather than downloading it. Like
+* have_rev(), it goes by the file not having changed
+* since it was synced, or if that was too recently to
+* tell by its mtime, by hashing it again.
+*/
+bool
+SyncEngine::copy_local(const char *path, const char *temp_path,
+  const char *rev, const char *hash, int64_t size)
+{
+  NodeRecord *record;
+  char source[MAX_SYNC_PATH];
+  while((record = this->contents.Find(hash)) != NULL)
+  {
+    struct stat st;
+    if(record->upload == NODE_IDLE
+      && this->tracked_nodes.GetPath(record, source, sizeof(source))
+      && lstat(source, &st) == 0 && S_ISREG(st.st_mode)
+      && st.st_dev == record->device && st.st_ino == record->node
+      && (size < 0 || st.st_size == size)
+      && unchanged_since_sync(record, source, &st))
+      break;
+    //changed since, it's indexed again once it's uploaded
+    this->contents.Forget(record, hash);
+  }
+  return record != NULL
+    && copy_file(source, path, temp_path, rev, hash, size);
+}
+
+/*
+* Copy source (which has the contents) to temp_path and
+* install that as path, as if it had been downloaded.
+*/
+bool
+SyncEngine::copy_file(const char *source, const char *path,
+  const char *temp_path, const char *rev, const char *hash, int64_t size)
+{
+  int64_t copied;
+  bool cloned;
+  int err = clone_file(source, temp_path, &copied, &cloned);
+  if(err == 0 && size >= 0 && copied != size)
+    err = EIO; //it changed as it was copied
+  if(err != 0)
+  {
+    TRACE(TRACE_ERROR, "could not copy %s: %s", source, strerror(err));
+    unlink(temp_path);
+    return false;
+  }
+  if(install_download(path, temp_path, rev, hash) != 0)
+    return false;
+  TRACE(TRACE_DEBUG, "%s |%s| from %s rather than downloading it",
+    cloned ? "cloned" : "copied", path, source);
+  this->reused_files++;
+  this->reused_bytes += copied;
+  return true;
+}
+
+//an entry for a download of path, NULL if there's no room
+WaitingCopy *
+SyncEngine::add_waiting(const char *path, const char *hash)
+{
+  if(!grow((void**)&this->waiting, &this->waiting_space,
+    this->waiting_count + 1, sizeof(WaitingCopy)))
+    return NULL;
+  WaitingCopy *copy = &this->waiting[this->waiting_count];
+  memset(copy, 0, sizeof(*copy));
+  copy->path = strdup(path);
+  copy->hash = strdup(hash);
+  copy->fetching = true;
+  if(copy->path == NULL || copy->hash == NULL)
+  {
+    free(copy->path);
+    free(copy->hash);
+    return NULL;
+  }
+  this->waiting_count++;
+  return copy;
+}
+
+/*
+* If a file with the same contents is being downloaded
+* already, wait for that and copy it, rather than download
+* them both.
+*/
+bool
+SyncEngine::join_download(const char *path, const char *temp_path,
+  const char *rev, const char *hash, int64_t size, time_t modified)
+{
+  size_t i;
+  for(i = 0; i < this->waiting_count; i++)
+  {
+    if(this->waiting[i].fetching && strcmp(this->waiting[i].hash, hash) == 0)
+      break;
+  }
+  if(i == this->waiting_count)
+    return false;
+  WaitingCopy *copy = add_waiting(path, hash);
+  if(copy == NULL)
+    return false;
+  copy->temp_path = strdup(temp_path);
+  copy->rev = strdup(rev);
+  copy->size = size;
+  copy->modified = modified;
+  copy->fetching = false;
+  TRACE(TRACE_DEBUG, "|%s| waits for |%s| to copy", path,
+    this->waiting[i].path);
+  this->downloads_pending++;
+  return true;
+}
+
+/*
+* The download of path is done, and source has its
+* contents (or it failed, and source is NULL): copy it
+* for each file that was waiting for it, or download them
+* after all if that doesn't work.
+*/
+void
+SyncEngine::copy_waiting(const char *path, const char *source)
+{
+  size_t i;
+  for(i = 0; i < this->waiting_count; i++)
+  {
+    if(this->waiting[i].fetching && strcmp(this->waiting[i].path, path) == 0)
+      break;
+  }
+  if(i == this->waiting_count)
+    return;
+  char *hash = this->waiting[i].hash;
+  free(this->waiting[i].path);
+
+  //taken out first, fetching them could come back here
+  WaitingCopy *ready = NULL;
+  size_t ready_count = 0, ready_space = 0, kept = 0;
+  for(size_t j = 0; j < this->waiting_count; j++)
+  {
+    WaitingCopy *copy = &this->waiting[j];
+    if(j == i)
+      continue;
+    if(!copy->fetching && strcmp(copy->hash, hash) == 0
+      && grow((void**)&ready, &ready_space, ready_count + 1,
+        sizeof(WaitingCopy)))
+      ready[ready_count++] = *copy;
+    else
+      this->waiting[kept++] = *copy;
+  }
+  this->waiting_count = kept;
+
+  for(size_t j = 0; j < ready_count; j++)
+  {
+    WaitingCopy *copy = &ready[j];
+    char local[MAX_SYNC_PATH];
+    bool copied = source != NULL && copy_file(source, copy->path,
+      copy->temp_path, copy->rev, copy->hash, copy->size);
+    if(!copied && local_path(copy->path, local, sizeof(local)))
+      fetch(copy->path, local, copy->temp_path, copy->rev, copy->hash,
+        copy->size, copy->modified);
+    else if(!copied)
+      this->page_failed = true;
+    //only now, so the page can't finish while fetch() is sending it
+    this->downloads_pending--;
+    free(copy->path);
+    free(copy->temp_path);
+    free(copy->rev);
+    free(copy->hash);
+  }
+  free(ready);
+  free(hash);
+}
+
+/*
+* A RESET starts a full listing of Dropbox. Everything
+* tracked is taken to be gone from Dropbox until the
+* listing mentions it, and sorted out by finish_reset()
+* once the last page is in.
+*/
+void
+SyncEngine::start_reset(void)
+{
+  this->resetting = true;
+  this->reset_unlisted.MakeEmpty();
+  size_t i;
+  for(NodeRecord *r = this->tracked_nodes.First(&i); r != NULL; r = this->tracked_nodes.Next(&i, r))
+    this->reset_unlisted.Insert(r->device, r->node, r->parent, "");
+}
+
+/*
+* The listing has the local entry in it, and so
+* everything it's in as well.
+*/
+void
+SyncEngine::listed(const char *local)
+{
+  struct stat st;
+  if(lstat(local, &st) != 0)
+    return;
+  NodeRecord *record = this->tracked_nodes.Find(st.st_dev, st.st_ino);
+  while(record != NULL && this->reset_unlisted.Remove(record->device, record->node))
+    record = this->tracked_nodes.Find(record->device, record->parent);
+}
+
+/*
+* What the listing after a RESET didn't have is gone
+* from Dropbox: remove it here too, unless it's a file
+* Dropbox never had or that's changed since we synced
+* it, which is uploaded instead.
+* Folders go once they're empty.
+*/
+void
+SyncEngine::finish_reset(void)
+{
+  NodeRecord **folders = NULL;
+  size_t folder_count = 0, folder_space = 0;
+  char path[MAX_SYNC_PATH];
+  size_t i;
+  for(NodeRecord *r = this->reset_unlisted.First(&i); r != NULL; r = this->reset_unlisted.Next(&i, r))
+  {
+    NodeRecord *record = this->tracked_nodes.Find(r->device, r->node);
+    if(record == NULL)
+      continue;
+    if(record->directory)
+    {
+      if(grow((void**)&folders, &folder_space, folder_count + 1, sizeof(NodeRecord*)))
+        folders[folder_count++] = record;
+      continue;
+    }
+    struct stat st;
+    if(!path_of(record, path, sizeof(path)))
+      continue;
+    if(NodeTable::Rev(record) == NULL || lstat(path, &st) != 0
+      || !unchanged_since_sync(record, path, &st))
+    {
+      //new or changed here, so it's ours to keep
+      upload_file(record);
+      continue;
+    }
+    TRACE(TRACE_DEBUG, "|%s| isn't on Dropbox any more, removing it", path);
+    dev_t device = record->device;
+    ino_t node = record->node;
+    expect_echo(device, node, FS_REMOVED);
+    if(unlink(path) != 0)
+      TRACE(TRACE_ERROR, "Removal error on %s", path);
+    this->untrack(device, node);
+  }
+
+  //deepest first, a pass at a time
+  bool removed = true;
+  while(removed)
+  {
+    removed = false;
+    for(size_t j = folder_count; j-- > 0;)
+    {
+      NodeRecord *record = folders[j];
+      if(!path_of(record, path, sizeof(path)) || has_entries(path))
+        continue;
+      dev_t device = record->device;
+      ino_t node = record->node;
+      expect_echo(device, node, FS_REMOVED);
+      rmdir(path);
+      this->untrack(device, node);
+      folders[j] = folders[--folder_count];
+      removed = true;
+    }
+  }
+  free(folders);
+  this->reset_unlisted.MakeEmpty();
+  this->resetting = false;
+}
+
+// Starting up
+
+/*
+* Watch the folder and everything the sync state says
+* is in it, without reading any of it. Anything that's
+* gone since it was saved is forgotten.
+*/
+void
+SyncEngine::watch_tracked_nodes(void)
+{
+  if(this->fs->Watch(this->root, this->root_device, this->root_node, true) != 0)
+    return;
+
+  NodeRecord **gone = NULL;
+  size_t gone_count = 0, gone_space = 0;
+  char path[MAX_SYNC_PATH];
+  size_t i;
+  for(NodeRecord *r = this->tracked_nodes.First(&i); r != NULL; r = this->tracked_nodes.Next(&i, r))
+  {
+    if(path_of(r, path, sizeof(path))
+      && this->fs->Watch(path, r->device, r->node, r->directory) == 0)
+      continue;
+    if(grow((void**)&gone, &gone_space, gone_count + 1, sizeof(NodeRecord*)))
+      gone[gone_count++] = r;
+  }
+  for(size_t j = 0; j < gone_count; j++)
+  {
+    TRACE(TRACE_DEBUG, "%s is gone", NodeTable::Name(gone[j]));
+    this->untrack(gone[j]->device, gone[j]->node);
+  }
+  free(gone);
+}
+
+/*
+* Send Dropbox a move made while we weren't running, after
+* any moves of what it was in and what it's in now (which
+* it depends on to be where they are). It's marked as sent
+* by taking SCAN_MOVED off it.
+*/
+void
+SyncEngine::post_offline_move(OfflineScan *scan, ScanEntry *entry)
+{
+  if((entry->change & SCAN_MOVED) == 0)
+    return;
+  entry->change &= ~SCAN_MOVED;
+  const NodeRecord *record = this->tracked_nodes.Find(entry->device, entry->node);
+  if(record == NULL)
+    return;
+  ScanEntry *above;
+  for(above = scan->Find(record->device, record->parent); above != NULL; above = scan->Find(above->device, above->parent))
+    post_offline_move(scan, above);
+  for(above = scan->Find(entry->device, entry->parent); above != NULL; above = scan->Find(above->device, above->parent))
+    post_offline_move(scan, above);
+
+  char *from = scan->PathAfterMoves(record);
+  if(from == NULL)
+    return;
+  TRACE(TRACE_DEBUG, "%s was moved to %s", from, entry->path);
+  //moved over something that's gone now
+  if(entry->replaces != NULL)
+    send(SYNC_NO_REPLY, "rm", db_path(entry->path));
+  send(SYNC_NO_REPLY, "mv", db_path(from), db_path(entry->path));
+  free(from);
+}
+
+/*
+* Find what changed in the folder since the sync state
+* was saved, send Dropbox just those changes, and watch
+* and track everything that's there now.
+* Moves go first, while what they move out of is still
+* there, then removals, then new folders and uploads.
+* Returns false if the folder couldn't be read.
+*/
+bool
+SyncEngine::scan_offline_changes(void)
+{
+  int64_t start = now_usecs();
+  OfflineScan scan;
+  int err = scan.Run(this->root, &this->tracked_nodes);
+  if(err != 0)
+  {
+    TRACE(TRACE_ERROR, "could not look for offline changes: %s", strerror(err));
+    return false;
+  }
+  this->fs->Watch(this->root, this->root_device, this->root_node, true);
+
+  long moved = 0, removed = 0, added = 0, uploaded = 0;
+  for(size_t i = 0; i < scan.CountEntries(); i++)
+  {
+    if((scan.EntryAt(i)->change & SCAN_MOVED) != 0)
+      moved++;
+  }
+  for(size_t i = 0; i < scan.CountEntries(); i++)
+    post_offline_move(&scan, scan.EntryAt(i));
+  for(size_t i = 0; i < scan.CountGone(); i++)
+  {
+    if(scan.GoneWithParent(i))
+      continue;
+    char *path = scan.PathAfterMoves(scan.GoneAt(i));
+    if(path != NULL)
+    {
+      TRACE(TRACE_DEBUG, "Telling Dropbox to Delete: %s", db_path(path));
+      send(SYNC_NO_REPLY, "rm", db_path(path));
+    }
+    free(path);
+    removed++;
+  }
+
+  for(size_t i = 0; i < scan.CountEntries(); i++)
+  {
+    ScanEntry *entry = scan.EntryAt(i);
+    const char *name = leaf(entry->path);
+    NodeRecord *record = this->tracked_nodes.Find(entry->device, entry->node);
+    bool save = entry->change != 0 || entry->replaces != NULL;
+    if(record == NULL || (entry->change & SCAN_NEW) != 0)
+    {
+      //(if the node was something else before, that's gone)
+      record = this->tracked_nodes.Insert(entry->device, entry->node, entry->parent, name);
+      if(record == NULL)
+        continue;
+      record->directory = entry->directory;
+      NodeTable::CopySync(record, entry->replaces);
+    }
+    else if(record->parent != entry->parent || strcmp(NodeTable::Name(record), name) != 0)
+    {
+      this->tracked_nodes.Insert(entry->device, entry->node, entry->parent, name);
+      save = true;
+    }
+    const NodeRecord *old = entry->replaces;
+    if(old != NULL && scan.Find(old->device, old->node) == NULL)
+      this->untrack(old->device, old->node);
+
+    this->fs->Watch(entry->path, entry->device, entry->node, entry->directory);
+
+    bool is_new = (entry->change & SCAN_NEW) != 0 && entry->replaces == NULL;
+    if(entry->directory)
+    {
+      if(is_new)
+      {
+        send(SYNC_NO_REPLY, "mkdir", db_path(entry->path));
+        added++;
+      }
+    }
+    else if(is_new || (entry->change & SCAN_CHANGED) != 0)
+    {
+      //already compared, the worker needn't hash it again
+      if(entry->hash[0] != '\0')
+        NodeTable::SetHash(record, NULL);
+      upload_file(record);
+      uploaded++;
+    }
+    else if((entry->change & SCAN_TOUCHED) != 0)
+    {
+      NodeTable::SetSynced(record, entry->size, synced_mtime_of(entry->mtime));
+    }
+    if(save)
+      this->state.Save(record);
+  }
+
+  //(unless the node is something else now)
+  for(size_t i = 0; i < scan.CountGone(); i++)
+  {
+    const NodeRecord *record = scan.GoneAt(i);
+    if(scan.Find(record->device, record->node) == NULL)
+      this->untrack(record->device, record->node);
+  }
+
+  TRACE(TRACE_INFO, "offline changes: %ld entries in %ld directories, %ld hashed, "
+    "%ld moved, %ld removed, %ld new folders, %ld uploads in %.2f s",
+    (long)scan.CountEntries(), (long)scan.CountDirectories(), (long)scan.CountHashed(),
+    moved, removed, added, uploaded, (now_usecs() - start) / 1000000.0);
+  return true;
+}
+
+void
+SyncEngine::Start(void)
+{
+  if(this->tracked_nodes.CountItems() == 0)
+  {
+    //the first time, everything there is taken as in sync
+    if(this->fs->Watch(this->root, this->root_device, this->root_node, true) != 0)
+      TRACE(TRACE_ERROR, "could not watch %s", this->root);
+    this->recursive_watch(this->root);
+  }
+  else if(!scan_offline_changes())
+    watch_tracked_nodes();
+  this->state.Flush();
+  this->contents.Rebuild();
+}
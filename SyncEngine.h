@@ -0,0 +1,215 @@
+#ifndef SYNC_ENGINE_H
+#define SYNC_ENGINE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ContentIndex.h"
+#include "EchoSuppressor.h"
+#include "FsWatch.h"
+#include "NodeTable.h"
+#include "OfflineScan.h"
+#include "QuietQueue.h"
+#include "SyncState.h"
+#include "SyncTransport.h"
+
+const int DELTA_ITEM_FIELDS = 5;
+
+//one item of a delta page, as the worker sends it:
+//RESET, FILE <path> <rev> <content_hash> <size>
+//<modified>, FOLDER <path> or REMOVE <path>
+struct DeltaItem
+{
+  const char *tag;
+  const char *fields[DELTA_ITEM_FIELDS];
+  int count;
+};
+
+//a file in a delta page whose contents are on their way
+//in another's download (fetching), or the other one
+struct WaitingCopy
+{
+  char *path; //the Dropbox path
+  char *temp_path;
+  char *rev;
+  char *hash;
+  int64_t size;
+  time_t modified;
+  bool fetching;
+};
+
+/*
+* Keeps a local folder and Dropbox in sync: sends Dropbox
+* what changes locally (as the FsWatch reports it) and
+* applies the delta Dropbox sends back.
+*
+* It only uses POSIX calls on the folder itself, and
+* reaches the rest through FsWatch and SyncTransport, so
+* the same engine runs in the Haiku client and, with
+* InotifyWatch, under the tests and profilers on Linux
+* ("make core-tests"). Nothing happens by itself: the
+* caller passes in every event and answer, and calls
+* UploadQuietFiles() and ExpireEchoes() when
+* NextQuietCheck() and StartEchoSweep() say to.
+*
+* A file Dropbox sends whose content_hash matches a file
+* already here (see ContentIndex), or one being downloaded
+* for the same delta, is copied from that rather than
+* downloaded, unless SetReuse(false).
+*
+* Times are in microseconds (of CLOCK_MONOTONIC), paths
+* sent to Dropbox are relative to the folder.
+*/
+class SyncEngine
+{
+public:
+  SyncEngine(const char *root, const char *download_dir,
+    FsWatch *watch, SyncTransport *transport);
+  ~SyncEngine(void);
+
+  //load what we knew last time, returns 0 or an errno
+  int Open(const char *state_file);
+  //catch up with what changed while we weren't running,
+  //(everything counts as in sync the first time) and watch
+  //all of it
+  void Start(void);
+  void Flush(void) { state.Flush(); }
+  const char *Cursor(void) const { return state.Cursor(); }
+  int SaveCursor(const char *cursor) { return state.SaveCursor(cursor); }
+  size_t CountTracked(void) const { return tracked_nodes.CountItems(); }
+  const NodeTable *Tracked(void) const { return &tracked_nodes; }
+
+  void HandleEvent(const FsEvent *event);
+
+  //changed files are uploaded once left alone this long
+  void SetQuietTime(int64_t quiet) { quiet_time = quiet; }
+  //copy files we have rather than download them again
+  void SetReuse(bool reuse) { this->reuse = reuse; }
+  //files copied rather than downloaded, and their bytes
+  int64_t CountReused(void) const { return reused_files; }
+  int64_t BytesReused(void) const { return reused_bytes; }
+  //how long until UploadQuietFiles() has anything to do,
+  //-1 if nothing's waiting
+  int64_t NextQuietCheck(void) const;
+  void UploadQuietFiles(void);
+  void UploadDone(int status, dev_t device, ino_t node, bool unchanged,
+    int64_t size, int64_t mtime, const char *real_path,
+    const char *rev, const char *hash);
+
+  //our own changes to the folder, whose events to ignore:
+  //once an event has been handled, the ones we caused by
+  //then have been queued, so if StartEchoSweep() says so,
+  //call ExpireEchoes() with that generation after them
+  bool StartEchoSweep(uint32_t *generation);
+  void ExpireEchoes(uint32_t generation);
+  //backstop for echoes whose sweep never came
+  void ExpireOldEchoes(int64_t max_age);
+  const EchoSuppressor *Echoes(void) const { return &echoes; }
+  const QuietQueue *QuietFiles(void) const { return &quiet_nodes; }
+
+  //pull the delta from the saved cursor, unless that's
+  //going already; the transport hears when it's done
+  void StartDelta(void);
+  bool DeltaRunning(void) const { return delta_running; }
+  void DeltaPageDone(const DeltaItem *items, size_t count,
+    const char *cursor, bool more);
+  void DeltaPageFailed(const char *error);
+  //hash is the local file's when unchanged, the download's if not
+  void DownloadDone(int status, bool unchanged, const char *path,
+    const char *temp_path, const char *rev, const char *hash);
+
+private:
+  bool local_path(const char *db_path, char *path, size_t size) const;
+  const char *db_path(const char *path) const;
+  bool path_of(const NodeRecord *record, char *path, size_t size) const;
+  bool child_path(dev_t device, ino_t directory, const char *name,
+    char *path, size_t size) const;
+  bool in_folder(dev_t device, ino_t directory) const;
+  void send(int reply, const char *op, const char *arg1,
+    const char *arg2 = NULL, const char *arg3 = NULL);
+
+  NodeRecord *track_file(const char *path);
+  void untrack(dev_t device, ino_t node);
+  void untrack_tree(const char *path);
+  void watch(const char *path, const NodeRecord *record);
+  void recursive_watch(const char *dir_path);
+  void added(const char *path, NodeRecord *record);
+  void added_contents(const char *dir_path);
+  void expect_echo(dev_t device, ino_t node, int kind);
+
+  void file_changed(NodeRecord *record);
+  void upload_file(NodeRecord *record);
+  void create_watched_directory(const char *db_path);
+  void rename_to_match(NodeRecord *record, const char *real_path);
+
+  int apply(const DeltaItem *item);
+  void fetch(const char *path, const char *local, const char *temp_path,
+    const char *rev, const char *hash, int64_t size, time_t modified);
+  bool copy_local(const char *path, const char *temp_path, const char *rev,
+    const char *hash, int64_t size);
+  bool copy_file(const char *source, const char *path,
+    const char *temp_path, const char *rev, const char *hash, int64_t size);
+  WaitingCopy *add_waiting(const char *path, const char *hash);
+  bool join_download(const char *path, const char *temp_path,
+    const char *rev, const char *hash, int64_t size, time_t modified);
+  void copy_waiting(const char *path, const char *source);
+  void request_delta_page(void);
+  void finish_delta_page(void);
+  int install_download(const char *path, const char *temp_path,
+    const char *rev, const char *hash);
+  void keep_local_copy(const char *path, const char *rev, const char *hash);
+  bool have_rev(const char *local, const char *rev, const char *hash);
+  bool unchanged_since_sync(NodeRecord *record, const char *path,
+    const struct stat *st);
+  void start_reset(void);
+  void listed(const char *local);
+  void finish_reset(void);
+
+  void watch_tracked_nodes(void);
+  bool scan_offline_changes(void);
+  void post_offline_move(OfflineScan *scan, ScanEntry *entry);
+
+  char *root;
+  size_t root_length;
+  dev_t root_device;
+  ino_t root_node;
+  char *download_dir;
+  FsWatch *fs;
+  SyncTransport *transport;
+
+  NodeTable tracked_nodes;
+  SyncState state; //tracked_nodes and the delta cursor, on disk
+
+  EchoSuppressor echoes;
+  bool echo_sweep_due;
+
+  //changed files waiting to be left alone long enough to upload
+  QuietQueue quiet_nodes;
+  int64_t quiet_time;
+
+  //the delta being pulled, a page at a time
+  bool delta_running;
+  char *delta_cursor; //saved once the page in hand is applied
+  bool delta_more;
+  bool delta_changed; //the delta being pulled had anything in it
+  bool page_failed;
+  int32_t downloads_pending;
+  int32_t download_count; //names the downloads' temporary files
+
+  //the files we have, by content_hash, to copy rather than download
+  ContentIndex contents;
+  bool reuse;
+  WaitingCopy *waiting; //this page's downloads of what others wait for
+  size_t waiting_count;
+  size_t waiting_space;
+  int64_t reused_files;
+  int64_t reused_bytes;
+
+  //a RESET being reconciled with the full listing after it,
+  //what we had that the listing hasn't mentioned yet
+  bool resetting;
+  NodeTable reset_unlisted;
+};
+
+#endif
@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SyncState.h"
+#include "Trace.h"
+
+//the file starts with these, in the byte order of the machine
+const uint32_t STATE_MAGIC = 0x44425354; //'DBST'
+const uint32_t STATE_VERSION = 1;
+const size_t STATE_HEADER = 8;
+
+//each record is its length and checksum, then its kind
+enum
+{
+  STATE_NODE = 1, //a tracked node and what we know of it
+  STATE_FORGET, //a node no longer tracked
+  STATE_CURSOR //the delta cursor
+};
+const size_t RECORD_HEADER = 9;
+const size_t MAX_NAME = 1024;
+const size_t MAX_RECORD = 2048;
+const size_t STATE_BUFFER = 64 * 1024;
+//rewrite the log once it's this many times what it describes
+const size_t COMPACT_FACTOR = 3;
+const size_t COMPACT_MIN = 4096;
+
+static uint32_t
+checksum(const char *data, size_t size)
+{
+  //FNV-1a, just has to notice a record that didn't all get written
+  uint32_t h = 2166136261U;
+  for(size_t i = 0; i < size; i++)
+  {
+    h ^= (unsigned char)data[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static char *
+put(char *to, const void *from, size_t size)
+{
+  memcpy(to, from, size);
+  return to + size;
+}
+
+static const char *
+get(const char *from, void *to, size_t size)
+{
+  memcpy(to, from, size);
+  return from + size;
+}
+
+//fill in the length and checksum of a record ending at end
+static size_t
+seal(char *record, char *end)
+{
+  uint32_t length = (uint32_t)(end - record);
+  memcpy(record, &length, 4);
+  uint32_t check = checksum(record + 8, length - 8);
+  memcpy(record + 4, &check, 4);
+  return length;
+}
+
+static size_t
+node_record(char *record, const NodeRecord *node)
+{
+  const char *name = NodeTable::Name(node);
+  const char *rev = NodeTable::Rev(node);
+  char hash[NODE_HASH_SIZE * 2 + 1];
+  NodeTable::GetHash(node, hash);
+  int64_t synced_size = NodeTable::SyncedSize(node);
+  int64_t synced_mtime = NodeTable::SyncedMtime(node);
+  size_t name_len = strlen(name);
+  size_t rev_len = rev != NULL ? strlen(rev) : 0;
+  size_t hash_len = strlen(hash);
+  if(name_len > MAX_NAME || rev_len > 255)
+    return 0;
+
+  int32_t device = node->device;
+  int64_t id = node->node, parent = node->parent;
+  uint8_t kind = STATE_NODE, directory = node->directory;
+  uint8_t rev_len8 = rev_len, hash_len8 = hash_len;
+  uint16_t name_len16 = name_len;
+  char *end = record + 8;
+  end = put(end, &kind, 1);
+  end = put(end, &device, 4);
+  end = put(end, &id, 8);
+  end = put(end, &parent, 8);
+  end = put(end, &synced_size, 8);
+  end = put(end, &synced_mtime, 8);
+  end = put(end, &directory, 1);
+  end = put(end, &rev_len8, 1);
+  end = put(end, &hash_len8, 1);
+  end = put(end, &name_len16, 2);
+  end = put(end, name, name_len);
+  if(rev_len > 0)
+    end = put(end, rev, rev_len);
+  end = put(end, hash, hash_len);
+  return seal(record, end);
+}
+
+static size_t
+forget_record(char *record, dev_t device, ino_t node)
+{
+  int32_t device32 = device;
+  int64_t id = node;
+  uint8_t kind = STATE_FORGET;
+  char *end = record + 8;
+  end = put(end, &kind, 1);
+  end = put(end, &device32, 4);
+  end = put(end, &id, 8);
+  return seal(record, end);
+}
+
+static size_t
+cursor_record(char *record, const char *cursor)
+{
+  size_t len = strlen(cursor);
+  if(len > MAX_RECORD - RECORD_HEADER)
+    return 0;
+  uint8_t kind = STATE_CURSOR;
+  char *end = record + 8;
+  end = put(end, &kind, 1);
+  end = put(end, cursor, len);
+  return seal(record, end);
+}
+
+SyncState::SyncState(void)
+  : path(NULL), fd(-1), table(NULL), cursor(strdup("")), buffer(NULL), buffered(0),
+    replayed(0), logged(0)
+{
+}
+
+SyncState::~SyncState(void)
+{
+  Close();
+  free(cursor);
+}
+
+void
+SyncState::Close(void)
+{
+  if(fd >= 0)
+  {
+    Flush();
+    close(fd);
+    fd = -1;
+  }
+  free(path);
+  free(buffer);
+  path = NULL;
+  buffer = NULL;
+}
+
+/*
+* Load the saved state into table (which should be empty),
+* whose root becomes root_node, at root_path.
+* Records whose parents aren't there are dropped.
+* A missing or unreadable file just starts a new one.
+*/
+int
+SyncState::Open(const char *path, NodeTable *table,
+  dev_t root_device, ino_t root_node, const char *root_path)
+{
+  Close();
+  this->path = strdup(path);
+  this->table = table;
+  this->buffer = (char*)malloc(STATE_BUFFER);
+  if(this->path == NULL || this->buffer == NULL
+    || !table->SetRoot(root_device, root_node, root_path))
+    return ENOMEM;
+  replayed = 0;
+  logged = 0;
+
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
+    return errno;
+  struct stat st;
+  if(fstat(fd, &st) != 0)
+    return errno;
+
+  size_t valid = 0;
+  if(st.st_size >= (off_t)STATE_HEADER)
+  {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map != MAP_FAILED)
+    {
+      const char *data = (const char*)map;
+      uint32_t magic, version;
+      memcpy(&magic, data, 4);
+      memcpy(&version, data + 4, 4);
+      if(magic == STATE_MAGIC && version == STATE_VERSION)
+        replay(data, st.st_size, &valid);
+      munmap(map, st.st_size);
+    }
+  }
+  drop_orphans();
+
+  if(valid == 0)
+  {
+    //new, or not one of ours, start it again
+    uint32_t header[2] = {STATE_MAGIC, STATE_VERSION};
+    if(ftruncate(fd, 0) != 0 || pwrite(fd, header, STATE_HEADER, 0) != (ssize_t)STATE_HEADER)
+      return errno;
+    valid = STATE_HEADER;
+  }
+  else if(valid < (size_t)st.st_size)
+  {
+    TRACE(TRACE_ERROR, "sync state: ignoring %lld bytes at the end of %s",
+      (long long)(st.st_size - valid), path);
+    if(ftruncate(fd, valid) != 0)
+      return errno;
+  }
+  if(lseek(fd, valid, SEEK_SET) < 0)
+    return errno;
+  logged = replayed;
+  if(logged > COMPACT_MIN && logged > COMPACT_FACTOR * table->CountItems())
+    return Compact();
+  return 0;
+}
+
+/*
+* Apply the records in a mapped file to the table,
+* and the cursor. valid gets
+* the length of the part that checked out.
+*/
+void
+SyncState::replay(const char *data, size_t size, size_t *valid)
+{
+  size_t at = STATE_HEADER;
+  while(at + RECORD_HEADER <= size)
+  {
+    const char *record = data + at;
+    uint32_t length, check;
+    memcpy(&length, record, 4);
+    memcpy(&check, record + 4, 4);
+    if(length < RECORD_HEADER || length > MAX_RECORD || length > size - at
+      || checksum(record + 8, length - 8) != check)
+      break;
+
+    const char *end = record + length;
+    uint8_t kind = record[8];
+    const char *p = record + RECORD_HEADER;
+    if(kind == STATE_NODE && end - p >= 4 + 8 * 4 + 5)
+    {
+      int32_t device;
+      int64_t id, parent, synced_size, synced_mtime;
+      uint8_t directory, rev_len, hash_len;
+      uint16_t name_len;
+      p = get(p, &device, 4);
+      p = get(p, &id, 8);
+      p = get(p, &parent, 8);
+      p = get(p, &synced_size, 8);
+      p = get(p, &synced_mtime, 8);
+      p = get(p, &directory, 1);
+      p = get(p, &rev_len, 1);
+      p = get(p, &hash_len, 1);
+      p = get(p, &name_len, 2);
+      if(end - p != name_len + rev_len + hash_len)
+        break;
+      char name[MAX_NAME + 1], rev[256], hash[256];
+      p = get(p, name, name_len);
+      p = get(p, rev, rev_len);
+      p = get(p, hash, hash_len);
+      name[name_len] = rev[rev_len] = hash[hash_len] = '\0';
+
+      NodeRecord *node = table->Insert(device, id, parent, name);
+      if(node == NULL)
+        break;
+      node->directory = directory != 0;
+      if(synced_size != -1 || synced_mtime != -1)
+        NodeTable::SetSynced(node, synced_size, synced_mtime);
+      NodeTable::SetRev(node, rev);
+      NodeTable::SetHash(node, hash);
+    }
+    else if(kind == STATE_FORGET && end - p == 12)
+    {
+      int32_t device;
+      int64_t id;
+      p = get(p, &device, 4);
+      p = get(p, &id, 8);
+      table->Remove(device, id);
+    }
+    else if(kind == STATE_CURSOR)
+    {
+      char *copy = (char*)malloc(end - p + 1);
+      if(copy == NULL)
+        break;
+      memcpy(copy, p, end - p);
+      copy[end - p] = '\0';
+      free(cursor);
+      cursor = copy;
+    }
+    else
+      break;
+    at += length;
+    replayed++;
+  }
+  *valid = at;
+}
+
+/*
+* Drop the records that aren't in the root,
+* because a parent of theirs isn't there.
+*/
+void
+SyncState::drop_orphans(void)
+{
+  NodeRecord **orphans = NULL;
+  size_t orphan_count = 0, orphan_space = 0;
+  char path[PATH_MAX];
+  size_t i;
+  for(NodeRecord *r = table->First(&i); r != NULL; r = table->Next(&i, r))
+  {
+    if(table->GetPath(r, path, sizeof(path)))
+      continue;
+    if(orphan_count == orphan_space)
+    {
+      orphan_space = orphan_space * 2 + 16;
+      NodeRecord **more = (NodeRecord**)realloc(orphans, orphan_space * sizeof(NodeRecord*));
+      if(more == NULL)
+        break;
+      orphans = more;
+    }
+    orphans[orphan_count++] = r;
+  }
+  for(i = 0; i < orphan_count; i++)
+    table->Remove(orphans[i]->device, orphans[i]->node);
+  free(orphans);
+}
+
+int
+SyncState::write_all(int to, const char *data, size_t size)
+{
+  while(size > 0)
+  {
+    ssize_t written = write(to, data, size);
+    if(written < 0)
+    {
+      if(errno == EINTR)
+        continue;
+      return errno;
+    }
+    data += written;
+    size -= written;
+  }
+  return 0;
+}
+
+int
+SyncState::append(const char *record, size_t size)
+{
+  if(fd < 0)
+    return EBADF;
+  if(size == 0)
+    return EINVAL;
+  if(buffered + size > STATE_BUFFER)
+  {
+    int err = Flush();
+    if(err != 0)
+      return err;
+  }
+  memcpy(buffer + buffered, record, size);
+  buffered += size;
+  logged++;
+  if(logged > COMPACT_MIN && logged > COMPACT_FACTOR * table->CountItems())
+    return Compact();
+  return 0;
+}
+
+int
+SyncState::Save(const NodeRecord *record)
+{
+  char data[MAX_RECORD];
+  return append(data, node_record(data, record));
+}
+
+int
+SyncState::Forget(dev_t device, ino_t node)
+{
+  char data[MAX_RECORD];
+  return append(data, forget_record(data, device, node));
+}
+
+int
+SyncState::SaveCursor(const char *cursor)
+{
+  char *copy = strdup(cursor);
+  if(copy == NULL)
+    return ENOMEM;
+  free(this->cursor);
+  this->cursor = copy;
+
+  char data[MAX_RECORD];
+  int err = append(data, cursor_record(data, cursor));
+  if(err == 0)
+    err = Flush();
+  if(err == 0 && fsync(fd) != 0)
+    err = errno;
+  return err;
+}
+
+int
+SyncState::Flush(void)
+{
+  if(fd < 0 || buffered == 0)
+    return 0;
+  int err = write_all(fd, buffer, buffered);
+  buffered = 0;
+  return err;
+}
+
+/*
+* Write the table and cursor to a new file, and
+* put it in place of the log once it's on disk.
+*/
+int
+SyncState::Compact(void)
+{
+  if(fd < 0)
+    return EBADF;
+  int err = Flush();
+  if(err != 0)
+    return err;
+  size_t len = strlen(path) + 5;
+  char *new_path = (char*)malloc(len);
+  if(new_path == NULL)
+    return ENOMEM;
+  sprintf(new_path, "%s.new", path);
+  int to = open(new_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(to < 0)
+  {
+    err = errno;
+    free(new_path);
+    return err;
+  }
+
+  uint32_t header[2] = {STATE_MAGIC, STATE_VERSION};
+  memcpy(buffer, header, STATE_HEADER);
+  buffered = STATE_HEADER;
+  size_t count = 1;
+  char data[MAX_RECORD];
+  size_t i;
+  for(NodeRecord *r = table->First(&i); r != NULL && err == 0; r = table->Next(&i, r))
+  {
+    size_t size = node_record(data, r);
+    if(size == 0)
+      continue;
+    if(buffered + size > STATE_BUFFER)
+    {
+      err = write_all(to, buffer, buffered);
+      buffered = 0;
+    }
+    memcpy(buffer + buffered, data, size);
+    buffered += size;
+    count++;
+  }
+  size_t size = cursor_record(data, cursor);
+  if(err == 0 && buffered + size > STATE_BUFFER)
+  {
+    err = write_all(to, buffer, buffered);
+    buffered = 0;
+  }
+  memcpy(buffer + buffered, data, size);
+  buffered += size;
+  if(err == 0)
+    err = write_all(to, buffer, buffered);
+  buffered = 0;
+  if(err == 0 && fsync(to) != 0)
+    err = errno;
+  if(err == 0 && rename(new_path, path) != 0)
+    err = errno;
+  if(err != 0)
+  {
+    close(to);
+    unlink(new_path);
+    free(new_path);
+    return err;
+  }
+  free(new_path);
+  close(fd);
+  fd = open(path, O_RDWR);
+  close(to);
+  if(fd < 0)
+    return errno;
+  lseek(fd, 0, SEEK_END);
+  logged = count;
+  return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef SYNC_STATE_H
+#define SYNC_STATE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "NodeTable.h"
+
+/*
+* What we know about ~/Dropbox, kept on disk so it doesn't
+* have to be worked out again at startup: a record per
+* tracked node (its parent, name, rev, content_hash and the
+* size and mtime Dropbox last had), and the cursor of the
+* last delta page applied.
+*
+* The file is a log. Each change appends a record with a
+* checksum, and Open() maps the file and replays it into a
+* NodeTable, stopping at the first record that doesn't
+* check out (the end of a write that a crash cut short),
+* so what's loaded is always everything up to some point.
+* Once the log is mostly records that have been replaced,
+* it's rewritten from the table and renamed over the old one.
+*
+* Records are buffered until Flush(). SaveCursor() flushes
+* and syncs them to disk along with the cursor.
+* The functions that write return 0 or an errno.
+*/
+class SyncState
+{
+public:
+  SyncState(void);
+  ~SyncState(void);
+
+  int Open(const char *path, NodeTable *table,
+    dev_t root_device, ino_t root_node, const char *root_path);
+  void Close(void);
+
+  int Save(const NodeRecord *record);
+  int Forget(dev_t device, ino_t node);
+  int SaveCursor(const char *cursor);
+  const char *Cursor(void) const { return cursor; }
+  int Flush(void);
+  int Compact(void);
+
+  //records read by Open(), and in the file now
+  size_t CountReplayed(void) const { return replayed; }
+  size_t CountLogged(void) const { return logged; }
+
+private:
+  int append(const char *record, size_t size);
+  void replay(const char *data, size_t size, size_t *valid);
+  void drop_orphans(void);
+  int write_all(int to, const char *data, size_t size);
+
+  char *path;
+  int fd;
+  NodeTable *table;
+  char *cursor;
+  char *buffer; //records not written yet
+  size_t buffered;
+  size_t replayed;
+  size_t logged;
+};
+
+#endif
@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __HAIKU__
+#include <OS.h>
+#endif
+
+#include "SyncStatus.h"
+
+static int64_t
+now_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+RateMeter::RateMeter(void)
+  : first(-1),
+    total(0),
+    count(0)
+{
+  for(int i = 0; i < RATE_SECONDS; i++)
+  {
+    this->seconds[i] = -1;
+    this->bytes[i] = 0;
+  }
+}
+
+void
+RateMeter::Add(int64_t now, int64_t bytes)
+{
+  int64_t second = now / 1000000;
+  int slot = (int)(second % RATE_SECONDS);
+  if(this->seconds[slot] != second)
+  {
+    this->seconds[slot] = second;
+    this->bytes[slot] = 0;
+  }
+  this->bytes[slot] += bytes;
+  if(this->first < 0)
+    this->first = now;
+  this->total += bytes;
+  this->count++;
+}
+
+/*
+* The bytes of the last RATE_SECONDS over that time, or
+* over the time since the first bytes if that's shorter.
+*/
+double
+RateMeter::Rate(int64_t now) const
+{
+  if(this->first < 0)
+    return 0;
+  int64_t second = now / 1000000;
+  int64_t sum = 0;
+  for(int i = 0; i < RATE_SECONDS; i++)
+  {
+    if(this->seconds[i] > second - RATE_SECONDS && this->seconds[i] <= second)
+      sum += this->bytes[i];
+  }
+  double window = (now - this->first) / 1000000.0;
+  if(window > RATE_SECONDS)
+    window = RATE_SECONDS;
+  if(window < 1)
+    window = 1;
+  return sum / window;
+}
+
+//appends to text as snprintf would, keeping count of the length
+static void
+add(char *text, size_t size, size_t *length, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  size_t left = *length < size ? size - *length : 0;
+  int wrote = vsnprintf(left > 0 ? text + *length : NULL, left, format, args);
+  va_end(args);
+  if(wrote > 0)
+    *length += wrote;
+}
+
+static void
+add_rate(char *text, size_t size, size_t *length, const char *name,
+  const RateMeter *meter, int64_t now)
+{
+  add(text, size, length, "%s: %.1f KB/s, %.1f MB in %lld files all told\n",
+    name, meter->Rate(now) / 1024, meter->Total() / 1e6,
+    (long long)meter->Count());
+}
+
+size_t
+format_status(const SyncStatus *status, char *text, size_t size)
+{
+  size_t length = 0;
+  if(size > 0)
+    text[0] = '\0';
+  int64_t now = status->now;
+  add(text, size, &length, "running for: %.1f s\n",
+    (now - status->started) / 1e6);
+  if(status->busy_since >= 0)
+    add(text, size, &length, "busy: for %.3f s\n",
+      (now - status->busy_since) / 1e6);
+  else
+    add(text, size, &length, "busy: no, waiting for something to do\n");
+  add(text, size, &length, "tracked: %ld files and folders\n",
+    (long)status->tracked);
+  if(status->memory >= 0)
+    add(text, size, &length, "memory: %.1f MB resident\n",
+      status->memory / 1e6);
+
+  if(status->delta_running)
+    add(text, size, &length, "delta: pulling it now\n");
+  else if(status->delta_finished < 0)
+    add(text, size, &length, "delta: not pulled yet\n");
+  else
+    add(text, size, &length, "delta: pulled %.1f s ago\n",
+      (now - status->delta_finished) / 1e6);
+  if(!status->delta_running && status->waiting_for != NULL)
+    add(text, size, &length, "waiting for: %s\n", status->waiting_for);
+
+  add(text, size, &length, "changed files settling: %ld\n",
+    (long)status->quiet_waiting);
+  add(text, size, &length, "echoes waiting: %ld\n",
+    (long)status->echoes_waiting);
+  add(text, size, &length, "transfers queued: %ld\n",
+    (long)status->transfers_waiting);
+  add(text, size, &length, "transfers running: %d of %d\n",
+    status->transfers_running, status->transfer_lanes);
+  for(int i = 0; i < status->transfers_running && i < STATUS_MAX_TRANSFERS; i++)
+  {
+    const TransferInfo *info = &status->running[i];
+    add(text, size, &length, "  %s %s, %.1f s\n", info->op, info->path,
+      (now - info->started) / 1e6);
+  }
+  add_rate(text, size, &length, "up", &status->up, now);
+  add_rate(text, size, &length, "down", &status->down, now);
+  if(status->reused_files > 0)
+    add(text, size, &length, "reused: %lld files, %.1f MB not downloaded\n",
+      (long long)status->reused_files, status->reused_bytes / 1e6);
+  return length;
+}
+
+#ifdef __HAIKU__
+int64_t
+resident_memory(void)
+{
+  int64_t total = 0;
+  ssize_t cookie = 0;
+  area_info info;
+  while(get_next_area_info(B_CURRENT_TEAM, &cookie, &info) == B_OK)
+    total += info.ram_size;
+  return total;
+}
+#else
+int64_t
+resident_memory(void)
+{
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if(statm == NULL)
+    return -1;
+  long size, resident;
+  int got = fscanf(statm, "%ld %ld", &size, &resident);
+  fclose(statm);
+  if(got != 2)
+    return -1;
+  return (int64_t)resident * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+const char *
+status_socket_path(void)
+{
+  const char *path = getenv("DBFORHAIKU_STATUS");
+  return path != NULL && path[0] != '\0' ? path : DEFAULT_STATUS_SOCKET;
+}
+
+StatusSocket::StatusSocket(void)
+  : fd(-1),
+    path(NULL)
+{
+  this->wake[0] = this->wake[1] = -1;
+  pthread_mutex_init(&this->lock, NULL);
+  this->published.now = this->published.started = now_usecs();
+  this->published.tracked = 0;
+  this->published.memory = -1;
+  this->published.quiet_waiting = this->published.echoes_waiting = 0;
+  this->published.transfers_waiting = 0;
+  this->published.transfer_lanes = this->published.transfers_running = 0;
+  this->published.delta_running = false;
+  this->published.delta_finished = -1;
+  this->published.waiting_for = NULL;
+  this->published.busy_since = now_usecs(); //until the first Publish()
+}
+
+StatusSocket::~StatusSocket(void)
+{
+  if(this->fd >= 0)
+  {
+    char stop = 0;
+    ssize_t wrote = write(this->wake[1], &stop, 1);
+    (void)wrote;
+    pthread_join(this->thread, NULL);
+    close(this->wake[0]);
+    close(this->wake[1]);
+    close(this->fd);
+    unlink(this->path);
+    free(this->path);
+  }
+  pthread_mutex_destroy(&this->lock);
+}
+
+/*
+* Listen at path, taking the place of a socket left
+* there by a client that didn't get to clean up, and
+* start answering.
+*/
+int
+StatusSocket::Listen(const char *path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address.sun_path))
+    return ENAMETOOLONG;
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+    return errno;
+  unlink(path);
+  if(bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+    || listen(fd, 8) != 0 || pipe(this->wake) != 0)
+  {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+  this->fd = fd;
+  int err = pthread_create(&this->thread, NULL, answer_thread, this);
+  if(err != 0)
+  {
+    close(fd);
+    close(this->wake[0]);
+    close(this->wake[1]);
+    this->fd = -1;
+    return err;
+  }
+  this->path = strdup(path);
+  return 0;
+}
+
+void
+StatusSocket::Publish(const SyncStatus *status)
+{
+  pthread_mutex_lock(&this->lock);
+  int64_t busy_since = this->published.busy_since;
+  this->published = *status;
+  this->published.busy_since = busy_since;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void
+StatusSocket::Busy(bool busy)
+{
+  pthread_mutex_lock(&this->lock);
+  this->published.busy_since = busy ? now_usecs() : -1;
+  pthread_mutex_unlock(&this->lock);
+}
+
+void *
+StatusSocket::answer_thread(void *data)
+{
+  StatusSocket *socket = (StatusSocket*)data;
+  struct pollfd fds[2];
+  fds[0].fd = socket->fd;
+  fds[1].fd = socket->wake[0];
+  fds[0].events = fds[1].events = POLLIN;
+  while(true)
+  {
+    fds[0].revents = fds[1].revents = 0;
+    if(poll(fds, 2, -1) < 0 && errno != EINTR)
+      return NULL;
+    if(fds[1].revents != 0)
+      return NULL;
+    int client;
+    while((client = accept(socket->fd, NULL, NULL)) >= 0)
+    {
+      socket->answer(client);
+      close(client);
+    }
+  }
+}
+
+/*
+* The status as last published, with the times worked
+* out from now and the memory as it is now. It fits in the socket's buffer, so it
+* goes in one write that never blocks; a client that's
+* gone misses out.
+*/
+void
+StatusSocket::answer(int client)
+{
+  char text[8192];
+  int64_t memory = resident_memory();
+  pthread_mutex_lock(&this->lock);
+  this->published.now = now_usecs();
+  this->published.memory = memory;
+  size_t length = format_status(&this->published, text, sizeof(text));
+  pthread_mutex_unlock(&this->lock);
+  if(length >= sizeof(text))
+    length = sizeof(text) - 1;
+  fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+  ssize_t wrote = write(client, text, length);
+  (void)wrote;
+}
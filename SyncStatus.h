@@ -0,0 +1,123 @@
+#ifndef SYNC_STATUS_H
+#define SYNC_STATUS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+* What the running client is doing, for whoever asks:
+* hdbstatus through a StatusSocket on Linux, or the 'DBST'
+* scripting message on Haiku. Each front end fills in a
+* SyncStatus from its engine and transfers, and
+* format_status() makes the text both answer with.
+*
+* Times are in microseconds (of CLOCK_MONOTONIC, or
+* system_time() on Haiku), sizes in bytes.
+*/
+
+//how many running transfers a status lists
+const int STATUS_MAX_TRANSFERS = 32;
+const int STATUS_PATH = 256; //longer paths are cut short
+//where hdbsync listens if DBFORHAIKU_STATUS doesn't say
+const char *const DEFAULT_STATUS_SOCKET = "sync_status.sock";
+
+//a transfer a worker is running
+struct TransferInfo
+{
+  char op[16];
+  char path[STATUS_PATH]; //its first argument
+  int64_t started;
+};
+
+/*
+* Bytes a second over the last RATE_SECONDS, from what
+* Add() is told each time a transfer finishes.
+*/
+class RateMeter
+{
+public:
+  enum { RATE_SECONDS = 10 };
+
+  RateMeter(void);
+  void Add(int64_t now, int64_t bytes);
+  double Rate(int64_t now) const;
+  int64_t Total(void) const { return total; }
+  int64_t Count(void) const { return count; }
+
+private:
+  int64_t seconds[RATE_SECONDS]; //which second each slot holds
+  int64_t bytes[RATE_SECONDS];
+  int64_t first; //when the first bytes came, -1 if none yet
+  int64_t total;
+  int64_t count;
+};
+
+struct SyncStatus
+{
+  int64_t now;
+  int64_t started; //when the client started
+  size_t tracked; //files and folders
+  int64_t memory; //resident, -1 if it can't tell
+  size_t quiet_waiting; //changed files waiting to be left alone
+  size_t echoes_waiting;
+
+  size_t transfers_waiting;
+  int transfer_lanes;
+  int transfers_running;
+  TransferInfo running[STATUS_MAX_TRANSFERS];
+
+  RateMeter up;
+  RateMeter down;
+  int64_t reused_files; //copied from files already here
+  int64_t reused_bytes; //rather than downloaded
+
+  bool delta_running;
+  int64_t delta_finished; //when it was last pulled in full, -1 if never
+  const char *waiting_for; //what'll start the next delta, a literal
+  int64_t busy_since; //when what's being done now started, -1 if idle
+};
+
+//the status as "name: value" lines, truncated to fit
+//size, returns the length it would have had
+size_t format_status(const SyncStatus *status, char *text, size_t size);
+
+//how much memory this process has resident, -1 if unknown
+int64_t resident_memory(void);
+
+//the socket DBFORHAIKU_STATUS names, or the default
+const char *status_socket_path(void);
+
+/*
+* A Unix socket that answers each connection with the
+* status and closes it, from a thread of its own so it
+* answers at once even while the thread doing the work is
+* busy hashing a big file or applying a big delta page.
+* That thread Publish()es the status whenever it's been
+* changing it, and says when it starts and stops being
+* Busy(), which the answer tells as well.
+*/
+class StatusSocket
+{
+public:
+  StatusSocket(void);
+  ~StatusSocket(void);
+
+  //returns 0 or an errno
+  int Listen(const char *path);
+  void Publish(const SyncStatus *status);
+  void Busy(bool busy);
+
+private:
+  static void *answer_thread(void *data);
+  void answer(int client);
+
+  int fd;
+  char *path;
+  int wake[2]; //written to stop the thread
+  pthread_t thread;
+  pthread_mutex_t lock;
+  SyncStatus published;
+};
+
+#endif
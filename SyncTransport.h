@@ -0,0 +1,75 @@
+#ifndef SYNC_TRANSPORT_H
+#define SYNC_TRANSPORT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+* How SyncEngine talks to Dropbox: it hands requests for
+* the worker (db_worker.py) to a SyncTransport, and the
+* transport hands each answer back to the engine method
+* its reply says (UploadDone, DownloadDone, DeltaPageDone
+* or DeltaPageFailed). On Haiku that's TransferQueue and
+* the application looper, in the tests a stand-in.
+*/
+
+//which engine method gets the answer
+enum
+{
+  SYNC_NO_REPLY = 0,
+  SYNC_PUT_DONE,
+  SYNC_GET_DONE,
+  SYNC_DELTA_PAGE
+};
+
+//how it went
+enum
+{
+  SYNC_OK = 0,
+  SYNC_FAILED,
+  SYNC_BAD_DATA //the file the worker made has the wrong content_hash
+};
+
+const int SYNC_MAX_ARGS = 4;
+
+/*
+* A worker operation and its arguments, plus what
+* TransferQueue does around it: skip it if the file at
+* compare_path already has compare_hash, fail it if the
+* file at verify_path doesn't end up with verify_hash
+* (both NULL if not wanted). The strings only have to
+* last until Send() returns.
+*/
+struct SyncRequest
+{
+  int reply;
+  const char *args[SYNC_MAX_ARGS];
+  int argc;
+  const char *compare_path;
+  const char *compare_hash;
+  const char *verify_path;
+  const char *verify_hash;
+  //handed back with the answer to an upload
+  dev_t device;
+  ino_t node;
+  int64_t size; //what the transfers are ordered by too
+  int64_t mtime;
+  //when the file last changed, in seconds since 1970 (0
+  //if unknown), for ordering (see TransferPriority.h)
+  time_t modified;
+};
+
+class SyncTransport
+{
+public:
+  virtual ~SyncTransport(void) {}
+
+  virtual void Send(const SyncRequest *request) = 0;
+
+  //the delta has all been applied (changed says whether
+  //there was anything in it), or it failed part way and
+  //should be pulled again in a while
+  virtual void DeltaFinished(bool ok, bool changed) = 0;
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Throttle.h"
+
+const char *const DEFAULT_BANDWIDTH_FILE = "bandwidth.conf";
+//as in db_throttle.py
+const double BURST_SECONDS = 0.1;
+const double CHECK_INTERVAL = 0.5;
+
+static const char *const DIRECTION_NAMES[THROTTLE_DIRECTIONS] =
+  { "total", "up", "down" };
+
+//lockf() keeps other processes out, but not other threads
+//of this one, and closing any descriptor of the file lets
+//go of it, so both happen under this too
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now_seconds(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+Throttle::Throttle(void)
+  : checked(0),
+    have_file(false),
+    file_mtime(0),
+    file_size(0),
+    file_node(0),
+    windows(NULL),
+    window_count(0),
+    state_fd(-1),
+    state(NULL)
+{
+  const char *path = getenv("DBFORHAIKU_BANDWIDTH");
+  this->path = strdup(path != NULL && path[0] != '\0' ? path
+    : DEFAULT_BANDWIDTH_FILE);
+  for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+    this->base[i] = -1;
+}
+
+Throttle::~Throttle(void)
+{
+  if(this->state != NULL)
+    munmap(this->state, THROTTLE_DIRECTIONS * 2 * sizeof(double));
+  if(this->state_fd >= 0)
+  {
+    pthread_mutex_lock(&state_lock);
+    close(this->state_fd);
+    pthread_mutex_unlock(&state_lock);
+  }
+  free(this->windows);
+  free(this->path);
+}
+
+//"HH:MM-HH:MM", as minutes into the day
+static bool
+parse_window(const char *word, int *start, int *end)
+{
+  int hour, minute, end_hour, end_minute, used = 0;
+  if(sscanf(word, "%d:%2d-%d:%2d%n", &hour, &minute, &end_hour, &end_minute,
+    &used) != 4 || word[used] != '\0')
+    return false;
+  *start = hour * 60 + minute;
+  *end = end_hour * 60 + end_minute;
+  return true;
+}
+
+/*
+* Read the limits again if the file has changed (or
+* gone), the way Throttle.reload() in db_throttle.py does.
+* Lines that don't make sense are left out.
+*/
+void
+Throttle::reload(void)
+{
+  struct stat st;
+  if(stat(this->path, &st) != 0)
+  {
+    this->have_file = false;
+    for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+      this->base[i] = -1;
+    this->window_count = 0;
+    return;
+  }
+  if(this->have_file && st.st_mtime == this->file_mtime
+    && st.st_size == this->file_size && st.st_ino == this->file_node)
+    return;
+  FILE *file = fopen(this->path, "r");
+  if(file == NULL)
+    return;
+
+  for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+    this->base[i] = -1;
+  this->window_count = 0;
+  char line[512];
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char *comment = strchr(line, '#');
+    if(comment != NULL)
+      *comment = '\0';
+    char *words[64];
+    int count = 0;
+    char *save;
+    for(char *word = strtok_r(line, " \t\r\n", &save);
+      word != NULL && count < 64; word = strtok_r(NULL, " \t\r\n", &save))
+      words[count++] = word;
+    if(count == 0)
+      continue;
+
+    int64_t *limits = this->base;
+    int first = 0;
+    int start, end;
+    if(parse_window(words[0], &start, &end))
+    {
+      ThrottleWindow *windows = (ThrottleWindow*)realloc(this->windows,
+        (this->window_count + 1) * sizeof(ThrottleWindow));
+      if(windows == NULL)
+        continue;
+      this->windows = windows;
+      ThrottleWindow *window = &windows[this->window_count++];
+      window->start = start;
+      window->end = end;
+      for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+        window->limits[i] = -1;
+      limits = window->limits;
+      first = 1;
+    }
+    for(int i = first; i + 1 < count; i += 2)
+      for(int direction = 0; direction < THROTTLE_DIRECTIONS; direction++)
+      {
+        if(strcmp(words[i], DIRECTION_NAMES[direction]) != 0)
+          continue;
+        char *number_end;
+        double kb = strtod(words[i + 1], &number_end);
+        if(number_end != words[i + 1] && *number_end == '\0')
+          limits[direction] = kb > 0 ? (int64_t)(kb * 1024) : 0;
+      }
+  }
+  fclose(file);
+  this->have_file = true;
+  this->file_mtime = st.st_mtime;
+  this->file_size = st.st_size;
+  this->file_node = st.st_ino;
+}
+
+/*
+* The limit for each direction now, in bytes a second,
+* 0 for none: the first time of day that covers now over
+* the all day ones.
+*/
+void
+Throttle::limits(int64_t *now_limits)
+{
+  double now = now_seconds();
+  if(now - this->checked >= CHECK_INTERVAL)
+  {
+    this->checked = now;
+    reload();
+  }
+  for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+    now_limits[i] = this->base[i] > 0 ? this->base[i] : 0;
+  if(this->window_count == 0)
+    return;
+  time_t seconds = (time_t)now;
+  struct tm local;
+  localtime_r(&seconds, &local);
+  int minute = local.tm_hour * 60 + local.tm_min;
+  for(int w = 0; w < this->window_count; w++)
+  {
+    const ThrottleWindow *window = &this->windows[w];
+    bool inside = window->start <= window->end
+      ? window->start <= minute && minute < window->end
+      : minute >= window->start || minute < window->end;
+    if(!inside)
+      continue;
+    for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+      if(window->limits[i] >= 0)
+        now_limits[i] = window->limits[i];
+    return;
+  }
+}
+
+bool
+Throttle::Limited(int direction)
+{
+  int64_t now_limits[THROTTLE_DIRECTIONS];
+  limits(now_limits);
+  return now_limits[THROTTLE_TOTAL] > 0 || now_limits[direction] > 0;
+}
+
+/*
+* The buckets, as db_throttle.py lays them out: a pair of
+* little-endian doubles for each direction.
+*/
+bool
+Throttle::open_state(void)
+{
+  if(this->state != NULL)
+    return true;
+  size_t size = THROTTLE_DIRECTIONS * 2 * sizeof(double);
+  char state_path[1024];
+  snprintf(state_path, sizeof(state_path), "%s.state", this->path);
+  int fd = open(state_path, O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
+    return false;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || ((size_t)st.st_size < size
+    && ftruncate(fd, size) != 0))
+  {
+    close(fd);
+    return false;
+  }
+  void *state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(state == MAP_FAILED)
+  {
+    close(fd);
+    return false;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  this->state_fd = fd;
+  this->state = (double*)state;
+  return true;
+}
+
+/*
+* Take count tokens from the bucket for direction and
+* the one for both, and sleep off however far that put
+* either of them under.
+*/
+void
+Throttle::Take(int direction, int64_t count)
+{
+  int64_t now_limits[THROTTLE_DIRECTIONS];
+  limits(now_limits);
+  if((now_limits[THROTTLE_TOTAL] <= 0 && now_limits[direction] <= 0)
+    || !open_state())
+    return;
+
+  double wait = 0;
+  pthread_mutex_lock(&state_lock);
+  while(lockf(this->state_fd, F_LOCK, 0) != 0 && errno == EINTR)
+    ;
+  double now = now_seconds();
+  for(int i = 0; i < THROTTLE_DIRECTIONS; i++)
+  {
+    double rate = (double)now_limits[i];
+    if(rate <= 0 || (i != THROTTLE_TOTAL && i != direction))
+      continue;
+    double tokens = this->state[i * 2];
+    double stamp = this->state[i * 2 + 1];
+    if(stamp > 0 && stamp <= now)
+      tokens += (now - stamp) * rate;
+    if(tokens > rate * BURST_SECONDS)
+      tokens = rate * BURST_SECONDS;
+    tokens -= count;
+    this->state[i * 2] = tokens;
+    this->state[i * 2 + 1] = now;
+    if(tokens < 0 && -tokens / rate > wait)
+      wait = -tokens / rate;
+  }
+  lockf(this->state_fd, F_ULOCK, 0);
+  pthread_mutex_unlock(&state_lock);
+  if(wait > 0)
+  {
+    struct timespec ts;
+    ts.tv_sec = (time_t)wait;
+    ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+    while(nanosleep(&ts, &ts) != 0 && errno == EINTR)
+      ;
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+* db_throttle.py's bandwidth limits, for NativeWorker: the
+* limits in bandwidth.conf (or the file DBFORHAIKU_BANDWIDTH
+* names), read again when it changes, and the token
+* buckets in the file next to it, mapped and locked the
+* same way, so native and Python workers share the one
+* limit. See db_throttle.py for what the file says.
+*/
+
+enum
+{
+  THROTTLE_TOTAL = 0,
+  THROTTLE_UP,
+  THROTTLE_DOWN,
+  THROTTLE_DIRECTIONS
+};
+
+struct ThrottleWindow
+{
+  int start; //minutes into the day
+  int end;
+  int64_t limits[THROTTLE_DIRECTIONS]; //bytes a second, -1 if not given
+};
+
+class Throttle
+{
+public:
+  Throttle(void);
+  ~Throttle(void);
+
+  //waits for count bytes to be allowed to go up or down
+  void Take(int direction, int64_t count);
+  //whether anything keeps that direction to a limit now
+  bool Limited(int direction);
+
+private:
+  void reload(void);
+  void limits(int64_t *now_limits);
+  bool open_state(void);
+
+  char *path;
+  double checked; //when the file was last looked at
+  bool have_file;
+  time_t file_mtime;
+  off_t file_size;
+  ino_t file_node;
+  int64_t base[THROTTLE_DIRECTIONS];
+  ThrottleWindow *windows;
+  int window_count;
+  int state_fd;
+  double *state; //tokens and when they were counted, for each bucket
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#ifdef __HAIKU__
+#include <OS.h>
+#endif
+
+#include "Trace.h"
+
+//each power of two of microseconds is split in four,
+//which is as close as the percentiles get
+const int SUB_BUCKETS = 4;
+const int BUCKETS = SUB_BUCKETS * 40; //up to 2^40 us, 12 days
+
+struct TraceHistogram
+{
+  volatile int64_t buckets[BUCKETS];
+  volatile int64_t count;
+  volatile int64_t total;
+  volatile int64_t max;
+};
+
+struct TraceLine
+{
+  volatile uint32_t sequence; //which line it holds + 1, 0 while written
+  int level;
+  int64_t time;
+  char text[TRACE_LINE];
+};
+
+int trace_level = TRACE_INFO;
+int trace_print_level = TRACE_INFO;
+bool trace_spans = true;
+
+static TraceHistogram histograms[TRACE_SPAN_KINDS];
+static TraceLine ring[TRACE_RING_SIZE];
+static volatile uint32_t ring_next = 0;
+
+static const char *SPAN_NAMES[TRACE_SPAN_KINDS] =
+{
+  "watch", "hash", "upload", "download", "delta page", "delta apply"
+};
+static const char *LEVEL_NAMES[] =
+{
+  "off", "error", "info", "debug", "verbose"
+};
+
+//Haiku's gcc2 doesn't have the __sync builtins
+#ifdef __HAIKU__
+static uint32_t
+add32(volatile uint32_t *value, uint32_t add)
+{
+  return (uint32_t)atomic_add((int32*)value, (int32)add);
+}
+
+static int64_t
+add64(volatile int64_t *value, int64_t add)
+{
+  return atomic_add64((int64*)value, add);
+}
+
+static void
+set32(volatile uint32_t *value, uint32_t to)
+{
+  atomic_set((int32*)value, (int32)to);
+}
+
+static uint32_t
+get32(volatile uint32_t *value)
+{
+  return (uint32_t)atomic_get((int32*)value);
+}
+
+static bool
+swap64(volatile int64_t *value, int64_t from, int64_t to)
+{
+  return atomic_test_and_set64((int64*)value, to, from) == from;
+}
+#else
+static uint32_t
+add32(volatile uint32_t *value, uint32_t add)
+{
+  return __sync_fetch_and_add(value, add);
+}
+
+static int64_t
+add64(volatile int64_t *value, int64_t add)
+{
+  return __sync_fetch_and_add(value, add);
+}
+
+static void
+set32(volatile uint32_t *value, uint32_t to)
+{
+  __sync_synchronize();
+  *value = to;
+  __sync_synchronize();
+}
+
+static uint32_t
+get32(volatile uint32_t *value)
+{
+  uint32_t got = *value;
+  __sync_synchronize();
+  return got;
+}
+
+static bool
+swap64(volatile int64_t *value, int64_t from, int64_t to)
+{
+  return __sync_bool_compare_and_swap(value, from, to);
+}
+#endif
+
+static int64_t
+now_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+parse_level(const char *setting, int otherwise)
+{
+  if(setting == NULL || setting[0] == '\0')
+    return otherwise;
+  for(int i = TRACE_OFF; i <= TRACE_VERBOSE; i++)
+  {
+    if(strcasecmp(setting, LEVEL_NAMES[i]) == 0)
+      return i;
+  }
+  int level = atoi(setting);
+  if(level < TRACE_OFF)
+    return TRACE_OFF;
+  return level > TRACE_VERBOSE ? TRACE_VERBOSE : level;
+}
+
+/*
+* DBFORHAIKU_TRACE is how much to log (info if it isn't
+* set), DBFORHAIKU_TRACE_PRINT how much of that to print
+* as well (the same, if it isn't set). DBFORHAIKU_SPANS=0
+* turns the spans off.
+*/
+void
+trace_init(void)
+{
+  trace_level = parse_level(getenv("DBFORHAIKU_TRACE"), TRACE_INFO);
+  trace_print_level = parse_level(getenv("DBFORHAIKU_TRACE_PRINT"), trace_level);
+  const char *spans = getenv("DBFORHAIKU_SPANS");
+  trace_spans = spans == NULL || atoi(spans) != 0;
+}
+
+/*
+* Take the next slot of the ring, and write the line into
+* it, marking it as being written meanwhile so trace_dump()
+* leaves it be.
+*/
+void
+trace_write(int level, const char *format, ...)
+{
+  uint32_t line = add32(&ring_next, 1);
+  TraceLine *slot = &ring[line % TRACE_RING_SIZE];
+  set32(&slot->sequence, 0);
+  slot->level = level;
+  slot->time = now_usecs();
+  va_list args;
+  va_start(args, format);
+  vsnprintf(slot->text, sizeof(slot->text), format, args);
+  va_end(args);
+  if(level <= trace_print_level)
+    printf("%s\n", slot->text);
+  set32(&slot->sequence, line + 1);
+}
+
+int64_t
+trace_start(void)
+{
+  return trace_spans ? now_usecs() : 0;
+}
+
+void
+trace_finish(int kind, int64_t started)
+{
+  if(started == 0)
+    return;
+  trace_record(kind, now_usecs() - started);
+}
+
+static int
+bucket_of(int64_t usecs)
+{
+  if(usecs < SUB_BUCKETS)
+    return usecs < 0 ? 0 : (int)usecs;
+  int power = 0;
+  while((usecs >> power) >= 2 * SUB_BUCKETS)
+    power++;
+  int bucket = SUB_BUCKETS * (power + 1) + (int)(usecs >> power) - SUB_BUCKETS;
+  return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+//the most a span in the bucket took
+static int64_t
+bucket_top(int bucket)
+{
+  if(bucket < SUB_BUCKETS)
+    return bucket;
+  int power = bucket / SUB_BUCKETS - 1;
+  int64_t low = (int64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << power;
+  return low + ((int64_t)1 << power) - 1;
+}
+
+void
+trace_record(int kind, int64_t usecs)
+{
+  if(kind < 0 || kind >= TRACE_SPAN_KINDS)
+    return;
+  TraceHistogram *histogram = &histograms[kind];
+  add64(&histogram->buckets[bucket_of(usecs)], 1);
+  add64(&histogram->count, 1);
+  add64(&histogram->total, usecs);
+  int64_t max = histogram->max;
+  while(usecs > max && !swap64(&histogram->max, max, usecs))
+    max = histogram->max;
+}
+
+void
+trace_stats(int kind, TraceStats *stats)
+{
+  const TraceHistogram *histogram = &histograms[kind];
+  stats->count = histogram->count;
+  stats->total = histogram->total;
+  stats->max = histogram->max;
+}
+
+int64_t
+trace_percentile(int kind, double fraction)
+{
+  const TraceHistogram *histogram = &histograms[kind];
+  int64_t count = 0;
+  for(int i = 0; i < BUCKETS; i++)
+    count += histogram->buckets[i];
+  if(count == 0)
+    return -1;
+  int64_t rank = (int64_t)(fraction * count + 0.5);
+  if(rank < 1)
+    rank = 1;
+  int64_t seen = 0;
+  for(int i = 0; i < BUCKETS; i++)
+  {
+    seen += histogram->buckets[i];
+    if(seen >= rank)
+    {
+      int64_t top = bucket_top(i);
+      return top < histogram->max ? top : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+void
+trace_reset(void)
+{
+  memset((void*)histograms, 0, sizeof(histograms));
+}
+
+static void
+print_ms(FILE *out, int64_t usecs)
+{
+  if(usecs < 0)
+    fprintf(out, " %9s", "-");
+  else
+    fprintf(out, " %9.3f", usecs / 1000.0);
+}
+
+/*
+* Print each kind of span's count and times in ms, then
+* the last lines logged that are still in the ring (and
+* weren't being written just then), oldest first.
+*/
+void
+trace_dump(FILE *out, int lines)
+{
+  fprintf(out, "%-12s %8s %9s %9s %9s %9s %9s\n", "span", "count",
+    "mean ms", "p50", "p90", "p99", "max");
+  for(int kind = 0; kind < TRACE_SPAN_KINDS; kind++)
+  {
+    TraceStats stats;
+    trace_stats(kind, &stats);
+    fprintf(out, "%-12s %8lld", SPAN_NAMES[kind], (long long)stats.count);
+    print_ms(out, stats.count > 0 ? stats.total / stats.count : -1);
+    print_ms(out, trace_percentile(kind, 0.5));
+    print_ms(out, trace_percentile(kind, 0.9));
+    print_ms(out, trace_percentile(kind, 0.99));
+    print_ms(out, stats.count > 0 ? stats.max : -1);
+    fprintf(out, "\n");
+  }
+
+  uint32_t next = get32(&ring_next);
+  if(lines > TRACE_RING_SIZE)
+    lines = TRACE_RING_SIZE;
+  if((uint32_t)lines > next)
+    lines = (int)next;
+  for(uint32_t line = next - lines; line != next; line++)
+  {
+    TraceLine *slot = &ring[line % TRACE_RING_SIZE];
+    if(get32(&slot->sequence) != line + 1)
+      continue;
+    TraceLine copy;
+    copy.level = slot->level;
+    copy.time = slot->time;
+    memcpy(copy.text, slot->text, sizeof(copy.text));
+    if(get32(&slot->sequence) != line + 1)
+      continue; //written over while we copied it
+    copy.text[sizeof(copy.text) - 1] = '\0';
+    fprintf(out, "%lld.%06lld %-7s %s\n", (long long)(copy.time / 1000000),
+      (long long)(copy.time % 1000000), LEVEL_NAMES[copy.level], copy.text);
+  }
+  fflush(out);
+}
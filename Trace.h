@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+* What the client logs, and how long things take.
+*
+* Log lines go through TRACE() with a level. A line above
+* TRACE_MAX_LEVEL (set it with -DTRACE_MAX_LEVEL=...) isn't
+* compiled in, and one above trace_level costs a compare.
+* The rest are formatted into a ring buffer that keeps the
+* last TRACE_RING_SIZE lines, taking a slot without a lock,
+* and printed too if at or below trace_print_level.
+* DBFORHAIKU_TRACE and DBFORHAIKU_TRACE_PRINT set the two
+* (error, info, debug or verbose, or 0 to 4), see
+* trace_init().
+*
+* Spans time an operation (handling a watch event, hashing
+* a file, an upload, a download, applying a delta page)
+* into a histogram per operation, which trace_dump() prints
+* with its percentiles, along with the last lines logged.
+*/
+
+enum
+{
+  TRACE_OFF = 0,
+  TRACE_ERROR,
+  TRACE_INFO,
+  TRACE_DEBUG,
+  TRACE_VERBOSE //every message, in full
+};
+
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_VERBOSE
+#endif
+
+//what the spans time
+enum
+{
+  TRACE_WATCH = 0,
+  TRACE_HASH,
+  TRACE_UPLOAD,
+  TRACE_DOWNLOAD,
+  TRACE_DELTA_PAGE, //pulling one page from Dropbox
+  TRACE_DELTA_APPLY, //applying it here
+  TRACE_SPAN_KINDS
+};
+
+const int TRACE_RING_SIZE = 1024; //lines
+const int TRACE_LINE = 240; //bytes of each, longer ones are cut short
+
+extern int trace_level;
+extern int trace_print_level;
+extern bool trace_spans;
+
+#define TRACE(level, format, args...) \
+  do \
+  { \
+    if((level) <= TRACE_MAX_LEVEL && (level) <= trace_level) \
+      trace_write((level), format, ##args); \
+  } while(0)
+
+#define TRACING(level) ((level) <= TRACE_MAX_LEVEL && (level) <= trace_level)
+
+//read the levels from the environment
+void trace_init(void);
+void trace_write(int level, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+//when a span started, 0 if spans are off
+int64_t trace_start(void);
+void trace_finish(int kind, int64_t started);
+void trace_record(int kind, int64_t usecs);
+
+struct TraceStats
+{
+  int64_t count;
+  int64_t total; //microseconds, all told
+  int64_t max;
+};
+
+void trace_stats(int kind, TraceStats *stats);
+//the time under which that fraction of the spans took,
+//to within a quarter, -1 if there weren't any
+int64_t trace_percentile(int kind, double fraction);
+void trace_reset(void);
+
+//the histograms, then up to lines of the last lines logged
+void trace_dump(FILE *out, int lines);
+
+/*
+* Times the block it's declared in.
+*/
+class TraceSpan
+{
+public:
+  TraceSpan(int kind) : kind(kind), started(trace_start()) {}
+  ~TraceSpan(void) { trace_finish(this->kind, this->started); }
+private:
+  int kind;
+  int64_t started;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "Trace.h"
+#include "TransferPriority.h"
+
+int
+size_class(int64_t size)
+{
+  if(size >= LARGE_FILE)
+    return SIZE_LARGE;
+  if(size >= MEDIUM_FILE)
+    return SIZE_MEDIUM;
+  return SIZE_SMALL;
+}
+
+TransferPriority::TransferPriority(void)
+  : fifo(false),
+    pins(NULL),
+    pin_count(0),
+    checked(-1),
+    file_mtime(-1),
+    file_size(-1),
+    file_node(0)
+{
+  const char *order = getenv("DBFORHAIKU_PRIORITY");
+  this->fifo = order != NULL && strcmp(order, "fifo") == 0;
+  const char *path = getenv("DBFORHAIKU_PINNED");
+  this->path = strdup(path != NULL && path[0] != '\0' ? path : DEFAULT_PINNED_FILE);
+}
+
+TransferPriority::~TransferPriority(void)
+{
+  clear();
+  free(this->path);
+}
+
+void
+TransferPriority::clear(void)
+{
+  for(int i = 0; i < this->pin_count; i++)
+    free(this->pins[i]);
+  free(this->pins);
+  this->pins = NULL;
+  this->pin_count = 0;
+}
+
+int64_t
+TransferPriority::Rank(int64_t queued_at, int64_t size, time_t modified,
+  const char *db_path)
+{
+  if(this->fifo)
+    return queued_at;
+  int64_t rank = queued_at;
+  switch(size_class(size))
+  {
+    case SIZE_MEDIUM: rank += MEDIUM_DELAY; break;
+    case SIZE_LARGE: rank += LARGE_DELAY; break;
+  }
+  if(modified > 0 && modified > time(NULL) - RECENT_CHANGE)
+    rank -= RECENT_BONUS;
+  if(db_path != NULL && pinned(db_path))
+    rank -= PINNED_BONUS;
+  return rank;
+}
+
+/*
+* Big uploads go a chunk at a time through an upload
+* session and downloads carry on from what they've got,
+* so either can stop part way without losing much.
+*/
+bool
+TransferPriority::Pausable(const char *op, int64_t size) const
+{
+  if(this->fifo || size_class(size) != SIZE_LARGE)
+    return false;
+  return strcmp(op, "put") == 0 || strcmp(op, "get") == 0;
+}
+
+//whether the path is a pinned one or under one
+bool
+TransferPriority::pinned(const char *db_path) const
+{
+  for(int i = 0; i < this->pin_count; i++)
+  {
+    size_t length = strlen(this->pins[i]);
+    if(strncmp(this->pins[i], db_path, length) == 0
+      && (db_path[length] == '\0' || db_path[length] == '/'))
+      return true;
+  }
+  return false;
+}
+
+bool
+TransferPriority::Reload(int64_t now)
+{
+  if(this->fifo || (this->checked >= 0 && now - this->checked < PINNED_CHECK))
+    return false;
+  this->checked = now;
+  struct stat st;
+  if(stat(this->path, &st) != 0)
+  {
+    if(this->file_mtime < 0)
+      return false;
+    this->file_mtime = -1;
+    clear();
+    return true;
+  }
+  if(st.st_mtime == this->file_mtime && st.st_size == this->file_size
+    && st.st_ino == this->file_node)
+    return false;
+  this->file_mtime = st.st_mtime;
+  this->file_size = st.st_size;
+  this->file_node = st.st_ino;
+
+  clear();
+  FILE *file = fopen(this->path, "r");
+  if(file == NULL)
+    return true;
+  char line[1024];
+  int space = 0;
+  while(fgets(line, sizeof(line), file) != NULL)
+  {
+    char *start = line;
+    while(isspace((unsigned char)*start))
+      start++;
+    if(*start == '\0' || *start == '#')
+      continue;
+    char *end = start + strlen(start);
+    while(end > start && (isspace((unsigned char)end[-1]) || end[-1] == '/'))
+      end--;
+    *end = '\0';
+    if(this->pin_count == space)
+    {
+      space = space * 2 + 8;
+      this->pins = (char**)realloc(this->pins, space * sizeof(char*));
+    }
+    //Dropbox paths are case insensitive, and start with a slash
+    char *pin = (char*)malloc(strlen(start) + 2);
+    sprintf(pin, "%s%s", *start == '/' || *start == '\0' ? "" : "/", start);
+    for(char *c = pin; *c != '\0'; c++)
+      *c = tolower((unsigned char)*c);
+    this->pins[this->pin_count++] = pin;
+  }
+  fclose(file);
+  TRACE(TRACE_INFO, "%d paths pinned in %s", this->pin_count, this->path);
+  return true;
+}
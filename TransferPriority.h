@@ -0,0 +1,92 @@
+#ifndef TRANSFER_PRIORITY_H
+#define TRANSFER_PRIORITY_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+* Which waiting transfer goes next, for WorkerPool and
+* TransferQueue. Each request is given a rank, a time,
+* and the lowest goes first: when it was queued, put off
+* by however long its size says it can wait, brought
+* forward a little if its file changed lately and a lot
+* if it's pinned. A big file is only ever put off by so
+* much, so small files queued long enough after it go
+* after it, and nothing waits forever.
+*
+* A big upload or download that's running can be paused
+* (between chunks) for a request that ranks ahead of it,
+* once it has had PAUSE_AFTER to get somewhere, and it
+* carries on from where it got to when its turn comes
+* back round. So small files get through while a 4 GB
+* recording is going, and the recording still gets its
+* share.
+*
+* Pinned files are the Dropbox paths (and what's under
+* them) listed one a line in priority.conf, in the working
+* directory, or the file DBFORHAIKU_PINNED names. It's read
+* again when it changes. DBFORHAIKU_PRIORITY=fifo ranks by
+* when they were queued alone, as it used to be.
+*
+* Times are in microseconds, except modified, which is in
+* seconds since 1970; sizes are in bytes, -1 if unknown.
+*/
+
+//from what size a file is medium, and large
+const int64_t MEDIUM_FILE = 1024 * 1024;
+const int64_t LARGE_FILE = 32 * 1024 * 1024;
+//how long each can be put off for
+const int64_t MEDIUM_DELAY = 2000000;
+const int64_t LARGE_DELAY = 60000000;
+//a file changed in the last RECENT_CHANGE seconds is
+//brought forward by RECENT_BONUS, a pinned one by PINNED_BONUS
+const int64_t RECENT_CHANGE = 600;
+const int64_t RECENT_BONUS = 1000000;
+const int64_t PINNED_BONUS = 600000000;
+//how long a big transfer runs before it can be paused
+const int64_t PAUSE_AFTER = 1000000;
+//how often to look at whether the pinned paths have changed
+const int64_t PINNED_CHECK = 1000000;
+
+const char *const DEFAULT_PINNED_FILE = "priority.conf";
+
+enum
+{
+  SIZE_SMALL = 0, //and everything that isn't a file transfer
+  SIZE_MEDIUM,
+  SIZE_LARGE
+};
+
+int size_class(int64_t size);
+
+class TransferPriority
+{
+public:
+  TransferPriority(void);
+  ~TransferPriority(void);
+
+  //db_path is the (lower case) Dropbox path, NULL if none
+  int64_t Rank(int64_t queued_at, int64_t size, time_t modified,
+    const char *db_path);
+  //whether a transfer of op and size can be paused
+  bool Pausable(const char *op, int64_t size) const;
+  //reads the pinned paths again if they've changed,
+  //true if they have (and ranks should be worked out again)
+  bool Reload(int64_t now);
+  bool Fifo(void) const { return fifo; }
+
+private:
+  bool pinned(const char *db_path) const;
+  void clear(void);
+
+  bool fifo;
+  char *path;
+  char **pins; //lower case, without a trailing slash
+  int pin_count;
+  int64_t checked; //when the file was last looked at, -1 never
+  time_t file_mtime; //what it was like then, -1 if missing
+  off_t file_size;
+  ino_t file_node;
+};
+
+#endif
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <MessageRunner.h>
+#include <OS.h>
+
+#include "ContentHash.h"
+#include "Trace.h"
+#include "TransferQueue.h"
+
+/*
+* Make a request for the worker operation op.
+* Add its arguments as "arg" strings before posting it.
+* reply_what is the what of the message sent back
+* once it's done, 0 for no reply.
+*/
+BMessage
+new_transfer(uint32 reply_what, const char *op)
+{
+  BMessage request = BMessage(MY_TRANSFER);
+  request.AddInt32("reply what",(int32)reply_what);
+  request.AddString("arg",op);
+  return request;
+}
+
+TransferLane::TransferLane(BMessenger target, BMessenger queue, int32 index)
+  : BLooper("dropbox transfer lane"),
+    target(target),
+    queue(queue),
+    index(index)
+{
+}
+
+void
+TransferLane::MessageReceived(BMessage *msg)
+{
+  switch(msg->what)
+  {
+    case MY_TRANSFER:
+    {
+      bool paused = run_request(msg);
+      BMessage done = BMessage(MY_LANE_DONE);
+      done.AddInt32("lane",this->index);
+      done.AddBool("paused",paused);
+      this->queue.SendMessage(&done);
+      break;
+    }
+    default:
+      BLooper::MessageReceived(msg);
+      break;
+  }
+}
+
+/*
+* If the request has a "compare path" and "compare hash",
+* hash the local file, and say whether it has that
+* content_hash already (and so the transfer can be skipped).
+* The hash goes in the reply's "content hash" either way.
+*/
+bool
+TransferLane::already_there(BMessage *request, BMessage *reply)
+{
+  const char *path, *expected;
+  if(request->FindString("compare path",&path) != B_OK
+    || request->FindString("compare hash",&expected) != B_OK
+    || expected[0] == '\0')
+    return false;
+  char hash[CONTENT_HASH_LENGTH + 1];
+  if(content_hash_file(path,hash) != 0)
+    return false;
+  reply->AddString("content hash",hash);
+  return strcmp(hash,expected) == 0;
+}
+
+/*
+* If the request has a "verify path" and "verify hash",
+* check the file the worker made has that content_hash.
+*/
+status_t
+TransferLane::verify(BMessage *request)
+{
+  const char *path, *expected;
+  if(request->FindString("verify path",&path) != B_OK
+    || request->FindString("verify hash",&expected) != B_OK
+    || expected[0] == '\0')
+    return B_OK;
+  char hash[CONTENT_HASH_LENGTH + 1];
+  int err = content_hash_file(path,hash);
+  if(err != 0)
+    return err;
+  if(strcmp(hash,expected) != 0)
+  {
+    TRACE(TRACE_ERROR,"%s has content_hash %s, expected %s",path,hash,expected);
+    return B_BAD_DATA;
+  }
+  return B_OK;
+}
+
+//which span times a request for op, -1 if none
+static int
+span_of(const char *op)
+{
+  if(strcmp(op,"put") == 0)
+    return TRACE_UPLOAD;
+  if(strcmp(op,"get") == 0)
+    return TRACE_DOWNLOAD;
+  if(strcmp(op,"delta_page") == 0)
+    return TRACE_DELTA_PAGE;
+  return -1;
+}
+
+/*
+* Send the request to the worker and collect every frame
+* of its answer as it arrives, so a long answer (a big
+* page of a delta) can never fill up the pipe. Returns
+* true if it paused part way rather than finishing.
+*/
+bool
+TransferLane::run_request(BMessage *request)
+{
+  int64 started = trace_start();
+  int32 argc = 0;
+  type_code type;
+  request->GetInfo("arg",&type,&argc);
+  const char **argv = new const char*[argc];
+  for(int32 i = 0; i < argc; i++)
+    request->FindString("arg",i,&argv[i]);
+
+  BMessage reply = BMessage(*request);
+  reply.what = (uint32)request->GetInt32("reply what",0);
+  if(already_there(request,&reply))
+  {
+    reply.AddBool("unchanged",true);
+    reply.AddInt32("status",B_OK);
+    delete[] argv;
+    if(reply.what != 0)
+      this->target.SendMessage(&reply);
+    return false;
+  }
+
+  BMessage frame;
+  BString tag;
+  status_t err = B_BAD_VALUE;
+  if(argc > 0)
+    err = this->worker.Send(argv,argc);
+  while(err == B_OK)
+  {
+    err = this->worker.Receive(&frame);
+    if(err != B_OK)
+      break;
+    frame.FindString("tag",&tag);
+    if(tag == WORKER_PAUSED)
+    {
+      delete[] argv;
+      return true;
+    }
+    if(tag == WORKER_OK || tag == WORKER_ERROR)
+    {
+      const char *field;
+      for(int32 i = 0; frame.FindString("field",i,&field) == B_OK; i++)
+        reply.AddString("field",field);
+      if(tag == WORKER_ERROR)
+      {
+        TRACE(TRACE_ERROR,"%s failed: %s",argv[0],frame.GetString("field",""));
+        err = B_ERROR;
+      }
+      break;
+    }
+    reply.AddMessage("item",&frame);
+  }
+  if(err == B_OK)
+    err = verify(request);
+  reply.AddInt32("status",err);
+  if(argc > 0)
+  {
+    int span = span_of(argv[0]);
+    if(span >= 0)
+      trace_finish(span,started);
+  }
+  delete[] argv;
+
+  if(reply.what != 0)
+    this->target.SendMessage(&reply);
+  if(request->HasMessage("batched"))
+    reply_batched(&reply,err);
+  return false;
+}
+
+/*
+* Answer each request of a batch on its own, with
+* the status of its entry (a DONE or FAILED item,
+* in the same order), or err if there isn't one.
+*/
+void
+TransferLane::reply_batched(BMessage *reply, status_t err)
+{
+  BMessage request, item;
+  for(int32 i = 0; reply->FindMessage("batched",i,&request) == B_OK; i++)
+  {
+    status_t status = err;
+    bool answered = reply->FindMessage("item",i,&item) == B_OK;
+    if(answered)
+    {
+      BString tag;
+      item.FindString("tag",&tag);
+      status = tag == "DONE" ? B_OK : B_ERROR;
+      if(status != B_OK)
+        TRACE(TRACE_ERROR,"%s %s failed: %s",request.GetString("arg",""),
+          item.GetString("field",0,""),item.GetString("field",1,""));
+    }
+    request.what = (uint32)request.GetInt32("reply what",0);
+    if(request.what == 0)
+      continue;
+    request.AddInt32("status",status);
+    if(answered)
+      request.AddMessage("item",&item);
+    this->target.SendMessage(&request);
+  }
+}
+
+TransferQueue::TransferQueue(BMessenger target, int32 lane_count)
+  : BLooper("dropbox transfers"),
+    target(target),
+    schedule(lane_count,this),
+    due_sent(-1)
+{
+  this->lanes = new TransferLane*[this->schedule.CountLanes()];
+  for(int32 i = 0; i < this->schedule.CountLanes(); i++)
+  {
+    this->lanes[i] = new TransferLane(target,BMessenger(this),i);
+    this->lanes[i]->Run();
+  }
+}
+
+TransferQueue::~TransferQueue(void)
+{
+  //each waits for the request it's running, if any
+  for(int32 i = 0; i < this->schedule.CountLanes(); i++)
+  {
+    if(this->lanes[i]->Lock())
+      this->lanes[i]->Quit();
+    ScheduledTransfer *running = this->schedule.Finish(i);
+    if(running != NULL)
+      forget(running);
+  }
+  delete[] this->lanes;
+  //the schedule frees the waiting transfers, but not their requests
+  for(size_t i = 0; i < this->schedule.CountWaiting(); i++)
+  {
+    ScheduledTransfer *transfer = this->schedule.Waiting(i);
+    delete (BMessage*)transfer->data;
+    transfer->data = NULL;
+  }
+}
+
+void
+TransferQueue::MessageReceived(BMessage *msg)
+{
+  switch(msg->what)
+  {
+    case MY_TRANSFER:
+      queue(msg);
+      dispatch();
+      break;
+    case MY_SCHEDULE_DUE:
+      this->due_sent = -1;
+      dispatch();
+      break;
+    case MY_LANE_DONE:
+    {
+      int32 lane;
+      if(msg->FindInt32("lane",&lane) == B_OK && lane >= 0
+        && lane < this->schedule.CountLanes() && this->schedule.Running(lane) != NULL)
+      {
+        BMessage *request = (BMessage*)this->schedule.Running(lane)->data;
+        if(msg->GetBool("paused",false) && request != NULL)
+        {
+          //back in the queue, it's been compared already
+          request->RemoveName("compare hash");
+          this->schedule.Requeue(lane);
+        }
+        else
+          forget(this->schedule.Finish(lane));
+      }
+      dispatch();
+      break;
+    }
+    case MY_TRANSFER_STATUS:
+    {
+      BMessage reply = BMessage(B_REPLY);
+      reply.AddInt32("waiting",(int32)this->schedule.CountWaiting());
+      reply.AddInt32("lanes",this->schedule.CountLanes());
+      for(int32 i = 0; i < this->schedule.CountLanes(); i++)
+      {
+        const ScheduledTransfer *running = this->schedule.Running(i);
+        if(running == NULL)
+          continue;
+        reply.AddString("op",running->args[0]);
+        reply.AddString("path",running->argc > 1 ? running->args[1] : "");
+        reply.AddInt64("started",running->started);
+      }
+      msg->SendReply(&reply);
+      break;
+    }
+    default:
+      BLooper::MessageReceived(msg);
+      break;
+  }
+}
+
+//copy the request onto the schedule, which keeps the copy
+void
+TransferQueue::queue(BMessage *msg)
+{
+  BMessage *request = new BMessage(*msg);
+  int32 argc = 0;
+  type_code type;
+  request->GetInfo("arg",&type,&argc);
+  const char **args = new const char*[argc > 0 ? argc : 1];
+  for(int32 i = 0; i < argc; i++)
+    request->FindString("arg",i,&args[i]);
+  this->schedule.Add(args,argc,request->GetInt64("size",-1),
+    (time_t)request->GetInt64("modified",0),system_time(),request);
+  delete[] args;
+}
+
+/*
+* Start what can start, and have a MY_SCHEDULE_DUE sent
+* for when the schedule wants to look again (a batch
+* window closing, or a transfer that can be paused).
+*/
+void
+TransferQueue::dispatch(void)
+{
+  this->schedule.Dispatch(system_time());
+  bigtime_t due = this->schedule.NextDue();
+  if(due < 0 || (this->due_sent >= 0 && this->due_sent <= due))
+    return;
+  bigtime_t delay = due - system_time();
+  BMessage check = BMessage(MY_SCHEDULE_DUE);
+  BMessageRunner::StartSending(BMessenger(this),&check,delay > 0 ? delay : 1,1);
+  this->due_sent = due;
+}
+
+/*
+* Hand the transfer to the lane, a batch as one request
+* with the ones it was made of as its "batched" messages.
+*/
+void
+TransferQueue::StartTransfer(int lane, ScheduledTransfer *transfer)
+{
+  if(transfer->data != NULL)
+  {
+    this->lanes[lane]->PostMessage((BMessage*)transfer->data);
+    return;
+  }
+  BMessage batch = new_transfer(0,transfer->args[0]);
+  for(int i = 1; i < transfer->argc; i++)
+    batch.AddString("arg",transfer->args[i]);
+  for(size_t i = 0; i < transfer->batched_count; i++)
+    batch.AddMessage("batched",(BMessage*)transfer->batched[i]->data);
+  this->lanes[lane]->PostMessage(&batch);
+}
+
+void
+TransferQueue::PauseTransfer(int lane)
+{
+  this->lanes[lane]->Pause();
+}
+
+//frees the transfer and the requests it was queued for
+void
+TransferQueue::forget(ScheduledTransfer *transfer)
+{
+  delete (BMessage*)transfer->data;
+  for(size_t i = 0; i < transfer->batched_count; i++)
+  {
+    delete (BMessage*)transfer->batched[i]->data;
+    transfer->batched[i]->data = NULL;
+  }
+  free_transfer(transfer);
+}
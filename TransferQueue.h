@@ -0,0 +1,105 @@
+#ifndef TRANSFER_QUEUE_H
+#define TRANSFER_QUEUE_H
+
+#include <List.h>
+#include <Looper.h>
+#include <Messenger.h>
+#include <String.h>
+
+#include "DropboxWorker.h"
+#include "TransferSchedule.h"
+
+const uint32 MY_TRANSFER = 'DBTR';
+const uint32 MY_LANE_DONE = 'DBLD';
+const uint32 MY_SCHEDULE_DUE = 'DBSD';
+const uint32 MY_TRANSFER_STATUS = 'DBTS';
+
+/*
+* One thread with its own Dropbox worker,
+* running the requests TransferQueue hands it.
+*/
+class TransferLane : public BLooper
+{
+public:
+  TransferLane(BMessenger target, BMessenger queue, int32 index);
+  void MessageReceived(BMessage *msg);
+  //(from the queue's thread) pause the request running
+  void Pause(void) { worker.Pause(); }
+
+private:
+  bool already_there(BMessage *request, BMessage *reply);
+  status_t verify(BMessage *request);
+  bool run_request(BMessage *request);
+  void reply_batched(BMessage *reply, status_t err);
+
+  DropboxWorker worker;
+  BMessenger target;
+  BMessenger queue;
+  int32 index;
+};
+
+/*
+* Runs requests to the Dropbox worker off the application
+* looper, so it keeps handling node monitor messages
+* (and poll ticks) while transfers are going.
+*
+* A request is a MY_TRANSFER message whose "arg" strings
+* are the worker operation and its arguments (see
+* new_transfer). When it finishes, the request is sent
+* back to the target with its what set to its
+* "reply what" (no reply if that's 0), and with:
+*   "status" - B_OK if the worker said OK
+*   "field"  - the fields of the worker's OK or ERROR frame
+*   "item"   - a BMessage per item frame, as from
+*              DropboxWorker::Receive
+* Anything else the caller put in the request comes back
+* too, so it can carry whatever the reply handler needs.
+*
+* A request with a "compare path" and "compare hash" is
+* skipped if the local file already has that content_hash.
+* It comes back with "status" B_OK and "unchanged" true.
+* One with a "verify path" and "verify hash" fails with
+* B_BAD_DATA if the file the worker made has another hash.
+*
+* Up to lane_count requests run at once, each lane
+* having its own worker, in the order TransferSchedule
+* (which WorkerPool uses too) gives them: requests on
+* the same Dropbox path in the order posted, rm and mv
+* as barriers, the best ranked first (with "size" and
+* "modified" from the request, see TransferPriority.h),
+* and rm, mv and mkdir batched as one job when they come
+* in a bunch. Each request of a batch still gets its own
+* reply, "status" saying whether its entry worked. A big
+* upload or download paused for a better ranked request
+* carries on from where it got to when its turn comes.
+*
+* A MY_TRANSFER_STATUS message is answered with how many
+* requests are "waiting", how many "lanes" there are,
+* and for each request running its "op", "path" (its
+* first argument) and the system_time() it "started".
+*/
+class TransferQueue : public BLooper, public ScheduleLanes
+{
+public:
+  TransferQueue(BMessenger target, int32 lane_count);
+  ~TransferQueue(void);
+  void MessageReceived(BMessage *msg);
+
+  //ScheduleLanes
+  void StartTransfer(int lane, ScheduledTransfer *transfer);
+  void PauseTransfer(int lane);
+
+private:
+  void queue(BMessage *msg);
+  void dispatch(void);
+  void forget(ScheduledTransfer *transfer);
+
+  BMessenger target;
+  TransferLane **lanes;
+  TransferSchedule schedule; //its data is each request's BMessage
+  bigtime_t due_sent; //when the MY_SCHEDULE_DUE on its way is for, -1 if none
+};
+
+BMessage new_transfer(uint32 reply_what, const char *op);
+
+#endif
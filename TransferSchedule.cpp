@@ -0,0 +1,465 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "Trace.h"
+#include "TransferSchedule.h"
+
+/*
+* Work out the kind of a transfer, and for
+* TRANSFER_PATH the (lower case) Dropbox path it's on.
+*/
+static int
+transfer_kind(ScheduledTransfer *transfer)
+{
+  const char *op = transfer->argc > 0 ? transfer->args[0] : "";
+  int path_arg;
+  if(strcmp(op, "put") == 0)
+    path_arg = 2;
+  else if(strcmp(op, "get") == 0 || strcmp(op, "mkdir") == 0)
+    path_arg = 1;
+  else if(strcmp(op, "rm") == 0 || strcmp(op, "mv") == 0
+    || strcmp(op, "rm_batch") == 0 || strcmp(op, "mv_batch") == 0
+    || strcmp(op, "mkdir_batch") == 0)
+    return TRANSFER_BARRIER;
+  else
+    return TRANSFER_ANY;
+
+  if(path_arg >= transfer->argc)
+    return TRANSFER_BARRIER;
+  transfer->key = strdup(transfer->args[path_arg]);
+  //Dropbox paths are case insensitive
+  for(char *c = transfer->key; *c != '\0'; c++)
+  {
+    if(*c >= 'A' && *c <= 'Z')
+      *c += 'a' - 'A';
+  }
+  return TRANSFER_PATH;
+}
+
+/*
+* The worker operation that does a batch of op,
+* NULL if op can't be batched.
+*/
+static const char *
+batch_op(const char *op)
+{
+  if(strcmp(op, "rm") == 0)
+    return "rm_batch";
+  if(strcmp(op, "mv") == 0)
+    return "mv_batch";
+  if(strcmp(op, "mkdir") == 0)
+    return "mkdir_batch";
+  return NULL;
+}
+
+//whether one Dropbox path is the other or under it
+static bool
+overlaps(const char *a, const char *b)
+{
+  size_t a_length = strlen(a), b_length = strlen(b);
+  size_t shorter = a_length < b_length ? a_length : b_length;
+  if(strncasecmp(a, b, shorter) != 0)
+    return false;
+  return a_length == b_length || a[shorter] == '/' || b[shorter] == '/';
+}
+
+static ScheduledTransfer *
+new_transfer(int argc, int64_t now)
+{
+  ScheduledTransfer *transfer =
+    (ScheduledTransfer*)calloc(1, sizeof(ScheduledTransfer));
+  transfer->args = (char**)calloc(argc > 0 ? argc : 1, sizeof(char*));
+  transfer->argc = argc;
+  transfer->size = -1;
+  transfer->queued_at = now;
+  return transfer;
+}
+
+void
+free_transfer(ScheduledTransfer *transfer)
+{
+  for(int i = 0; i < transfer->argc; i++)
+    free(transfer->args[i]);
+  free(transfer->args);
+  free(transfer->key);
+  for(size_t i = 0; i < transfer->batched_count; i++)
+    free_transfer(transfer->batched[i]);
+  free(transfer->batched);
+  free(transfer);
+}
+
+TransferSchedule::TransferSchedule(int lane_count, ScheduleLanes *lanes)
+  : lanes(lanes),
+    lane_count(lane_count > 0 ? lane_count : 1),
+    waiting(NULL),
+    waiting_count(0),
+    waiting_space(0),
+    window_close(-1),
+    pause_due(-1),
+    dispatching(false)
+{
+  this->running = new ScheduledTransfer*[this->lane_count];
+  this->pausing = new bool[this->lane_count];
+  for(int i = 0; i < this->lane_count; i++)
+  {
+    this->running[i] = NULL;
+    this->pausing[i] = false;
+  }
+}
+
+TransferSchedule::~TransferSchedule(void)
+{
+  for(int i = 0; i < this->lane_count; i++)
+  {
+    if(this->running[i] != NULL)
+      free_transfer(this->running[i]);
+  }
+  delete[] this->running;
+  delete[] this->pausing;
+  for(size_t i = 0; i < this->waiting_count; i++)
+    free_transfer(this->waiting[i]);
+  free(this->waiting);
+}
+
+void
+TransferSchedule::Add(const char *const *args, int argc, int64_t size,
+  time_t modified, int64_t now, void *data)
+{
+  ScheduledTransfer *transfer = new_transfer(argc, now);
+  for(int i = 0; i < argc; i++)
+    transfer->args[i] = strdup(args[i]);
+  transfer->size = size;
+  transfer->modified = modified;
+  transfer->data = data;
+  transfer->kind = transfer_kind(transfer);
+  if(this->priority.Reload(now))
+    rank_all();
+  transfer->rank = this->priority.Rank(now, size, modified, transfer->key);
+  transfer->first_on_key = true;
+  for(size_t i = 0; i < this->waiting_count && transfer->kind == TRANSFER_PATH; i++)
+  {
+    if(this->waiting[i]->kind == TRANSFER_PATH
+      && strcmp(this->waiting[i]->key, transfer->key) == 0)
+      transfer->first_on_key = false;
+  }
+  insert_waiting(this->waiting_count, transfer);
+}
+
+int
+TransferSchedule::CountRunning(void) const
+{
+  int count = 0;
+  for(int i = 0; i < this->lane_count; i++)
+  {
+    if(this->running[i] != NULL)
+      count++;
+  }
+  return count;
+}
+
+int64_t
+TransferSchedule::NextDue(void) const
+{
+  int64_t due = this->window_close;
+  if(this->pause_due >= 0 && (due < 0 || this->pause_due < due))
+    due = this->pause_due;
+  return due;
+}
+
+/*
+* Whether the waiting transfer at position can start now
+* without overtaking anything it has to stay behind,
+* given there's no barrier waiting ahead of it.
+*/
+bool
+TransferSchedule::may_start(size_t position) const
+{
+  const ScheduledTransfer *transfer = this->waiting[position];
+  int kind = transfer->kind;
+
+  for(int i = 0; i < this->lane_count; i++)
+  {
+    const ScheduledTransfer *running = this->running[i];
+    if(running == NULL)
+      continue;
+    if(kind == TRANSFER_BARRIER || running->kind == TRANSFER_BARRIER)
+      return false;
+    if(kind == TRANSFER_PATH && running->kind == TRANSFER_PATH
+      && strcmp(running->key, transfer->key) == 0)
+      return false;
+  }
+  if(kind == TRANSFER_BARRIER)
+    return position == 0;
+  return kind != TRANSFER_PATH || transfer->first_on_key;
+}
+
+/*
+* The position of the best ranked waiting transfer that
+* can start now, waiting_count if none can. Nothing goes
+* before a barrier. With skip_front, the transfer at the
+* front is waiting for its batch window.
+*/
+size_t
+TransferSchedule::pick(bool skip_front) const
+{
+  size_t best = this->waiting_count;
+  for(size_t i = 0; i < this->waiting_count; i++)
+  {
+    const ScheduledTransfer *transfer = this->waiting[i];
+    if((i > 0 || !skip_front) && may_start(i)
+      && (best == this->waiting_count || transfer->rank < this->waiting[best]->rank))
+      best = i;
+    if(transfer->kind == TRANSFER_BARRIER)
+      break;
+  }
+  return best;
+}
+
+void
+TransferSchedule::rank_all(void)
+{
+  for(size_t i = 0; i < this->waiting_count; i++)
+  {
+    ScheduledTransfer *transfer = this->waiting[i];
+    transfer->rank = this->priority.Rank(transfer->queued_at, transfer->size,
+      transfer->modified, transfer->key);
+  }
+}
+
+//the first waiting transfer on key is the one that can go
+void
+TransferSchedule::mark_first_on_key(const char *key)
+{
+  bool first = true;
+  for(size_t i = 0; i < this->waiting_count; i++)
+  {
+    ScheduledTransfer *transfer = this->waiting[i];
+    if(transfer->kind == TRANSFER_PATH && strcmp(transfer->key, key) == 0)
+    {
+      transfer->first_on_key = first;
+      first = false;
+    }
+  }
+}
+
+/*
+* Hand waiting transfers to idle lanes, best ranked
+* first, as far as ordering allows. If they're all busy,
+* see whether a big transfer should make way.
+*/
+void
+TransferSchedule::Dispatch(int64_t now)
+{
+  //a transfer over straight away can queue another
+  if(this->dispatching)
+    return;
+  this->dispatching = true;
+  if(this->window_close >= 0 && now >= this->window_close)
+    this->window_close = -1;
+  this->pause_due = -1;
+  if(this->priority.Reload(now))
+    rank_all();
+
+  bool held = false; //the front is waiting for its batch window
+  while(this->waiting_count > 0)
+  {
+    int lane = 0;
+    while(lane < this->lane_count && this->running[lane] != NULL)
+      lane++;
+    size_t position = pick(held);
+    if(position == this->waiting_count)
+      break;
+    if(lane == this->lane_count)
+    {
+      pause_for(this->waiting[position], now);
+      break; //all busy
+    }
+
+    ScheduledTransfer *transfer = take(position, now);
+    if(transfer == NULL)
+    {
+      held = true;
+      continue;
+    }
+    this->running[lane] = transfer;
+    this->pausing[lane] = false;
+    transfer->started = now;
+    this->lanes->StartTransfer(lane, transfer);
+  }
+  this->dispatching = false;
+}
+
+/*
+* Every lane is busy and transfer could start: pause the
+* worst ranked big transfer that ranks after it, once it
+* has run for PAUSE_AFTER (until then, say when to look
+* again). One at a time, so they don't all stop at once
+* for the one transfer.
+*/
+void
+TransferSchedule::pause_for(const ScheduledTransfer *transfer, int64_t now)
+{
+  int worst = -1;
+  for(int i = 0; i < this->lane_count; i++)
+  {
+    const ScheduledTransfer *running = this->running[i];
+    if(this->pausing[i])
+      return;
+    if(running->rank <= transfer->rank || running->batched_count > 0
+      || !this->priority.Pausable(running->args[0], running->size))
+      continue;
+    if(now - running->started < PAUSE_AFTER)
+    {
+      int64_t due = running->started + PAUSE_AFTER;
+      if(this->pause_due < 0 || due < this->pause_due)
+        this->pause_due = due;
+      continue;
+    }
+    if(worst < 0 || running->rank > this->running[worst]->rank)
+      worst = i;
+  }
+  if(worst < 0)
+    return;
+  TRACE(TRACE_DEBUG, "pausing %s %s for %s %s", this->running[worst]->args[0],
+    this->running[worst]->args[1], transfer->args[0],
+    transfer->argc > 1 ? transfer->args[1] : "");
+  this->pausing[worst] = true;
+  this->lanes->PauseTransfer(worst);
+}
+
+ScheduledTransfer *
+TransferSchedule::Finish(int lane)
+{
+  ScheduledTransfer *transfer = this->running[lane];
+  this->running[lane] = NULL;
+  this->pausing[lane] = false;
+  return transfer;
+}
+
+/*
+* The lane's transfer stopped part way to let a better
+* ranked one past: it goes back among the waiting, where
+* it was, and carries on from where it got to when its
+* turn comes round again.
+*/
+void
+TransferSchedule::Requeue(int lane)
+{
+  ScheduledTransfer *transfer = Finish(lane);
+  TRACE(TRACE_DEBUG, "paused %s %s", transfer->args[0], transfer->args[1]);
+  size_t position = this->waiting_count;
+  while(position > 0 && this->waiting[position - 1]->queued_at > transfer->queued_at)
+    position--;
+  insert_waiting(position, transfer);
+  if(transfer->kind == TRANSFER_PATH)
+    mark_first_on_key(transfer->key);
+}
+
+void
+TransferSchedule::insert_waiting(size_t position, ScheduledTransfer *transfer)
+{
+  if(this->waiting_count == this->waiting_space)
+  {
+    this->waiting_space = this->waiting_space * 2 + 64;
+    this->waiting = (ScheduledTransfer**)realloc(this->waiting,
+      this->waiting_space * sizeof(ScheduledTransfer*));
+  }
+  memmove(&this->waiting[position + 1], &this->waiting[position],
+    (this->waiting_count - position) * sizeof(ScheduledTransfer*));
+  this->waiting[position] = transfer;
+  this->waiting_count++;
+}
+
+ScheduledTransfer *
+TransferSchedule::remove_waiting(size_t position)
+{
+  ScheduledTransfer *transfer = this->waiting[position];
+  this->waiting_count--;
+  memmove(&this->waiting[position], &this->waiting[position + 1],
+    (this->waiting_count - position) * sizeof(ScheduledTransfer*));
+  if(transfer->kind == TRANSFER_PATH)
+    mark_first_on_key(transfer->key);
+  return transfer;
+}
+
+/*
+* Whether the waiting transfer at position can go in one
+* batch with the ones before it, all from the front of
+* the queue. Moves mustn't touch each other's paths,
+* as a batch doesn't say what order they're done in.
+*/
+bool
+TransferSchedule::joins_batch(size_t position) const
+{
+  const ScheduledTransfer *first = this->waiting[0];
+  const ScheduledTransfer *transfer = this->waiting[position];
+  const char *op = transfer->argc > 0 ? transfer->args[0] : "";
+  if(strcmp(op, first->args[0]) != 0)
+    return false;
+  if(strcmp(op, "mv") != 0)
+    return true;
+  if(transfer->argc < 3)
+    return false;
+
+  const char *from = transfer->args[1];
+  const char *to = transfer->args[2];
+  for(size_t i = 0; i < position; i++)
+  {
+    const ScheduledTransfer *earlier = this->waiting[i];
+    for(int arg = 1; arg <= 2 && arg < earlier->argc; arg++)
+    {
+      if(overlaps(earlier->args[arg], from) || overlaps(earlier->args[arg], to))
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+* Take the waiting transfer at position off the queue
+* to be started, as part of a batch if it can be.
+* NULL if it's to wait for its batch window to close.
+*/
+ScheduledTransfer *
+TransferSchedule::take(size_t position, int64_t now)
+{
+  ScheduledTransfer *first = this->waiting[position];
+  const char *op = first->argc > 0 ? batch_op(first->args[0]) : NULL;
+  if(op == NULL || position != 0 || CountRunning() > 0)
+    return remove_waiting(position);
+
+  size_t count = 1;
+  while(count < BATCH_LIMIT && count < this->waiting_count
+    && joins_batch(count))
+    count++;
+
+  //nothing else is waiting, so more may be on their way
+  int64_t close = first->queued_at + BATCH_WINDOW;
+  if(count == this->waiting_count && count < BATCH_LIMIT && now < close)
+  {
+    if(this->window_close < 0)
+      this->window_close = close;
+    return NULL;
+  }
+  if(count == 1)
+    return remove_waiting(0);
+
+  int argc = 1;
+  for(size_t i = 0; i < count; i++)
+    argc += this->waiting[i]->argc - 1;
+  ScheduledTransfer *batch = new_transfer(argc, first->queued_at);
+  batch->args[0] = strdup(op);
+  batch->kind = TRANSFER_BARRIER;
+  batch->rank = first->rank;
+  batch->batched = (ScheduledTransfer**)malloc(count * sizeof(ScheduledTransfer*));
+  argc = 1;
+  for(size_t i = 0; i < count; i++)
+  {
+    ScheduledTransfer *transfer = remove_waiting(0);
+    for(int j = 1; j < transfer->argc; j++)
+      batch->args[argc++] = strdup(transfer->args[j]);
+    batch->batched[batch->batched_count++] = transfer;
+  }
+  return batch;
+}
@@ -0,0 +1,138 @@
+#ifndef TRANSFER_SCHEDULE_H
+#define TRANSFER_SCHEDULE_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "TransferPriority.h"
+
+//how long the first rm, mv or mkdir of a batch waits for
+//more to join it, and the most one batch can have
+//(what Dropbox takes in one delete_batch or move_batch)
+const int64_t BATCH_WINDOW = 100000;
+const size_t BATCH_LIMIT = 1000;
+
+//how a transfer has to be ordered against the others
+enum
+{
+  TRANSFER_ANY = 0, //not tied to a path
+  TRANSFER_PATH, //in order with others on its path
+  TRANSFER_BARRIER //in order with everything
+};
+
+/*
+* A transfer as TransferSchedule keeps it: its worker
+* operation and arguments, what it's ranked by, and
+* whatever the front end keeps for it in data (NULL for
+* a batch, whose batched transfers have theirs).
+*/
+struct ScheduledTransfer
+{
+  char **args;
+  int argc;
+  int64_t size; //-1 if unknown
+  time_t modified;
+  int64_t queued_at;
+  int64_t started; //when it went to a lane
+  int64_t rank; //lowest goes first
+  int kind;
+  char *key; //lower case Dropbox path, for TRANSFER_PATH
+  bool first_on_key; //nothing waiting before it is on its path
+  void *data;
+  ScheduledTransfer **batched; //what a batch was made of
+  size_t batched_count;
+};
+
+//frees the transfer and its batched ones, but not their data
+void free_transfer(ScheduledTransfer *transfer);
+
+/*
+* What runs the transfers TransferSchedule hands out:
+* WorkerPool's worker processes, or TransferQueue's
+* lanes on Haiku.
+*/
+class ScheduleLanes
+{
+public:
+  virtual ~ScheduleLanes(void) {}
+  //run transfer on lane, which was idle; the lane has it
+  //until TransferSchedule::Finish() or Requeue()
+  virtual void StartTransfer(int lane, ScheduledTransfer *transfer) = 0;
+  //ask lane to pause what it's running once it can carry on
+  virtual void PauseTransfer(int lane) = 0;
+};
+
+/*
+* The order WorkerPool and TransferQueue run transfers in,
+* on up to lane_count lanes at once. Transfers on the same
+* Dropbox path run in the order queued, and rm and mv
+* (which can touch anything under their path) wait for
+* everything before them and hold up everything after.
+* Of the transfers that can start, the best ranked goes
+* first (see TransferPriority.h), and a big upload or
+* download is paused for one that ranks ahead of it. It
+* goes back in the queue, where it was, and carries on
+* from where it got to when its turn comes round again.
+*
+* An rm, mv or mkdir at the front of the queue waits up
+* to BATCH_WINDOW for others of the same kind to queue up
+* behind it (as they do when a folder's worth of files is
+* deleted or moved), and they all go as one batch job.
+*
+* It has no clock or threads of its own: times are
+* passed in, in microseconds, and Dispatch() is to be
+* called again once NextDue() comes round.
+*/
+class TransferSchedule
+{
+public:
+  TransferSchedule(int lane_count, ScheduleLanes *lanes);
+  ~TransferSchedule(void);
+
+  //queue a transfer of args (which are copied), with size
+  //and modified as TransferPriority takes them
+  void Add(const char *const *args, int argc, int64_t size, time_t modified,
+    int64_t now, void *data);
+  //hand waiting transfers to idle lanes, as far as they can go
+  void Dispatch(int64_t now);
+  //lane's transfer is over, here it is to be freed
+  ScheduledTransfer *Finish(int lane);
+  //lane's transfer stopped part way, it goes back in the queue
+  void Requeue(int lane);
+
+  //when Dispatch() is next due, -1 if it isn't
+  int64_t NextDue(void) const;
+
+  size_t CountWaiting(void) const { return waiting_count; }
+  ScheduledTransfer *Waiting(size_t position) const { return waiting[position]; }
+  int CountRunning(void) const;
+  int CountLanes(void) const { return lane_count; }
+  //NULL if the lane is idle
+  ScheduledTransfer *Running(int lane) const { return running[lane]; }
+
+private:
+  bool may_start(size_t position) const;
+  size_t pick(bool skip_front) const;
+  void rank_all(void);
+  void mark_first_on_key(const char *key);
+  void pause_for(const ScheduledTransfer *transfer, int64_t now);
+  ScheduledTransfer *take(size_t position, int64_t now);
+  bool joins_batch(size_t position) const;
+  ScheduledTransfer *remove_waiting(size_t position);
+  void insert_waiting(size_t position, ScheduledTransfer *transfer);
+
+  ScheduleLanes *lanes;
+  int lane_count;
+  ScheduledTransfer **running; //by lane, NULL if idle
+  bool *pausing; //by lane, it's been asked to pause
+  ScheduledTransfer **waiting; //oldest first
+  size_t waiting_count;
+  size_t waiting_space;
+  int64_t window_close; //when the batch being waited for goes, -1 if none
+  int64_t pause_due; //when a transfer can be paused, -1 if none is to be
+  bool dispatching;
+  TransferPriority priority;
+};
+
+#endif
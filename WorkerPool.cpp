@@ -0,0 +1,730 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Trace.h"
+#include "WorkerPool.h"
+
+/*
+* What the pool keeps of a request alongside its
+* ScheduledTransfer (whose data it is).
+*/
+struct PendingRequest
+{
+  int reply;
+  char *compare_path;
+  char *compare_hash;
+  char *verify_path;
+  char *verify_hash;
+  dev_t device;
+  ino_t node;
+  int64_t size;
+  int64_t mtime;
+};
+
+struct WorkerLane
+{
+  WorkerProcess worker;
+  WorkerFrame *items; //item frames of its answer so far
+  size_t item_count;
+  size_t item_space;
+};
+
+long WorkerProcess::started = 0;
+
+static int64_t
+now_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char *
+copy_string(const char *string)
+{
+  return string == NULL ? NULL : strdup(string);
+}
+
+WorkerProcess::WorkerProcess(void)
+  : pid(-1),
+    native(NULL),
+    to_worker(-1),
+    from_worker(-1),
+    buffer(NULL),
+    buffered(0),
+    space(0)
+{
+}
+
+WorkerProcess::~WorkerProcess(void)
+{
+  Stop();
+  free(this->buffer);
+}
+
+/*
+* Fork and exec `python db_worker.py` with pipes on its
+* stdin and stdout, as DropboxWorker::Start() does. Its
+* stdout is read without blocking.
+*/
+int
+WorkerProcess::Start(void)
+{
+  if(this->pid >= 0 || this->native != NULL)
+    return 0;
+
+  //a dead worker shouldn't kill us when we write to it
+  signal(SIGPIPE, SIG_IGN);
+  if(native_transport())
+    return start_native();
+
+  int in_fd[2], out_fd[2];
+  if(pipe(in_fd) != 0)
+    return errno;
+  if(pipe(out_fd) != 0)
+  {
+    int err = errno;
+    close(in_fd[0]);
+    close(in_fd[1]);
+    return err;
+  }
+
+  this->pid = fork();
+  if(this->pid < 0)
+  {
+    int err = errno;
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+    return err;
+  }
+  if(this->pid == 0)
+  {
+    dup2(in_fd[0], STDIN_FILENO);
+    dup2(out_fd[1], STDOUT_FILENO);
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+
+    char *argv[3];
+    argv[0] = (char*)"python";
+    argv[1] = (char*)"db_worker.py";
+    argv[2] = NULL;
+    execvp("python", argv);
+    _exit(127);
+  }
+
+  close(in_fd[0]);
+  close(out_fd[1]);
+  this->to_worker = in_fd[1];
+  this->from_worker = out_fd[0];
+  fcntl(this->to_worker, F_SETFD, FD_CLOEXEC);
+  fcntl(this->from_worker, F_SETFD, FD_CLOEXEC);
+  fcntl(this->from_worker, F_SETFL, fcntl(this->from_worker, F_GETFL) | O_NONBLOCK);
+  this->buffered = 0;
+  started++;
+  TRACE(TRACE_INFO, "Started Dropbox worker, pid %d", (int)this->pid);
+  return 0;
+}
+
+//the same pipes, with a NativeWorker's thread on the far ends
+int
+WorkerProcess::start_native(void)
+{
+  int in_fd[2], out_fd[2];
+  if(pipe(in_fd) != 0)
+    return errno;
+  if(pipe(out_fd) != 0)
+  {
+    int err = errno;
+    close(in_fd[0]);
+    close(in_fd[1]);
+    return err;
+  }
+  for(int i = 0; i < 2; i++)
+  {
+    fcntl(in_fd[i], F_SETFD, FD_CLOEXEC);
+    fcntl(out_fd[i], F_SETFD, FD_CLOEXEC);
+  }
+  this->native = new NativeWorker();
+  int err = this->native->Start(in_fd[0], out_fd[1]);
+  if(err != 0)
+  {
+    delete this->native;
+    this->native = NULL;
+    close(in_fd[0]); close(in_fd[1]);
+    close(out_fd[0]); close(out_fd[1]);
+    return err;
+  }
+  this->to_worker = in_fd[1];
+  this->from_worker = out_fd[0];
+  fcntl(this->from_worker, F_SETFL, fcntl(this->from_worker, F_GETFL) | O_NONBLOCK);
+  this->buffered = 0;
+  started++;
+  TRACE(TRACE_INFO, "Started Dropbox worker, native");
+  return 0;
+}
+
+/*
+* Close the worker's stdin, which makes it exit,
+* and wait for it to go away.
+*/
+void
+WorkerProcess::Stop(void)
+{
+  if(this->native != NULL)
+  {
+    close(this->to_worker);
+    close(this->from_worker);
+    delete this->native; //joins it
+    this->native = NULL;
+    this->to_worker = this->from_worker = -1;
+    this->buffered = 0;
+    return;
+  }
+  if(this->pid < 0)
+    return;
+  close(this->to_worker);
+  close(this->from_worker);
+  int status;
+  waitpid(this->pid, &status, 0);
+  this->pid = -1;
+  this->to_worker = this->from_worker = -1;
+  this->buffered = 0;
+}
+
+/*
+* Send a request (operation name followed by its arguments)
+* as one frame. Starts the worker if it isn't running.
+*/
+int
+WorkerProcess::Send(const char *const *argv, int argc)
+{
+  int err = Start();
+  if(err != 0)
+    return err;
+
+  size_t total = 4;
+  for(int i = 0; i < argc; i++)
+    total += strlen(argv[i]) + 1;
+  char *frame = (char*)malloc(total);
+  if(frame == NULL)
+    return ENOMEM;
+  char *pos = frame + 4;
+  for(int i = 0; i < argc; i++)
+  {
+    strcpy(pos, argv[i]);
+    pos += strlen(argv[i]) + 1;
+  }
+  total--; //no separator after the last field
+  uint32_t size = htonl((uint32_t)(total - 4));
+  memcpy(frame, &size, 4);
+
+  pos = frame;
+  size_t left = total;
+  while(left > 0)
+  {
+    ssize_t written = write(this->to_worker, pos, left);
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0)
+    {
+      err = EIO;
+      break;
+    }
+    pos += written;
+    left -= written;
+  }
+  free(frame);
+  if(err != 0)
+  {
+    TRACE(TRACE_ERROR, "Dropbox worker went away, will restart it.");
+    Stop();
+  }
+  return err;
+}
+
+void
+WorkerProcess::Pause(void)
+{
+  if(this->native != NULL)
+    this->native->Pause();
+  else if(this->pid >= 0)
+    kill(this->pid, SIGUSR1);
+}
+
+/*
+* Hand out the next whole frame read from the worker,
+* reading what's waiting in the pipe if there isn't one.
+*/
+int
+WorkerProcess::Read(WorkerFrame *frame)
+{
+  if(this->pid < 0 && this->native == NULL)
+    return -1;
+
+  bool gone = false;
+  for(int pass = 0; pass < 2; pass++)
+  {
+    uint32_t size = 0;
+    if(this->buffered >= 4)
+    {
+      memcpy(&size, this->buffer, 4);
+      size = ntohl(size);
+    }
+    if(this->buffered >= 4 && this->buffered >= 4 + (size_t)size)
+    {
+      frame->data = (char*)malloc(size + 1);
+      memcpy(frame->data, this->buffer + 4, size);
+      frame->data[size] = '\0';
+      this->buffered -= 4 + size;
+      memmove(this->buffer, this->buffer + 4 + size, this->buffered);
+
+      //fields are separated by NULs, and the end is a NUL too
+      int count = 1;
+      for(uint32_t i = 0; i < size; i++)
+      {
+        if(frame->data[i] == '\0')
+          count++;
+      }
+      frame->fields = (const char**)malloc(count * sizeof(const char*));
+      frame->count = 0;
+      const char *field = frame->data;
+      const char *end = frame->data + size;
+      while(field <= end)
+      {
+        frame->fields[frame->count++] = field;
+        field += strlen(field) + 1;
+      }
+      return 1;
+    }
+    if(pass == 1 || gone)
+      break;
+
+    //read all there is
+    for(;;)
+    {
+      if(this->space - this->buffered < 64 * 1024)
+      {
+        size_t space = this->space * 2 + 64 * 1024;
+        char *buffer = (char*)realloc(this->buffer, space);
+        if(buffer == NULL)
+        {
+          gone = true;
+          break;
+        }
+        this->buffer = buffer;
+        this->space = space;
+      }
+      ssize_t len = read(this->from_worker, this->buffer + this->buffered,
+        this->space - this->buffered);
+      if(len < 0 && errno == EINTR)
+        continue;
+      if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      if(len <= 0)
+      {
+        gone = true;
+        break;
+      }
+      this->buffered += len;
+    }
+  }
+  if(!gone)
+    return 0;
+  TRACE(TRACE_ERROR, "Lost the Dropbox worker, will restart it.");
+  Stop();
+  return -1;
+}
+
+void
+WorkerProcess::FreeFrame(WorkerFrame *frame)
+{
+  free(frame->data);
+  free(frame->fields);
+  frame->data = NULL;
+  frame->fields = NULL;
+  frame->count = 0;
+}
+
+static void
+free_request(PendingRequest *request)
+{
+  if(request == NULL)
+    return;
+  free(request->compare_path);
+  free(request->compare_hash);
+  free(request->verify_path);
+  free(request->verify_hash);
+  free(request);
+}
+
+//frees the transfer and the requests it was queued for
+static void
+free_scheduled(ScheduledTransfer *transfer)
+{
+  free_request((PendingRequest*)transfer->data);
+  for(size_t i = 0; i < transfer->batched_count; i++)
+  {
+    free_request((PendingRequest*)transfer->batched[i]->data);
+    transfer->batched[i]->data = NULL;
+  }
+  free_transfer(transfer);
+}
+
+static void
+free_frames(WorkerFrame *frames, size_t count)
+{
+  for(size_t i = 0; i < count; i++)
+    WorkerProcess::FreeFrame(&frames[i]);
+  free(frames);
+}
+
+//which span times a request with that reply, -1 if none
+static int
+span_of(int reply)
+{
+  switch(reply)
+  {
+    case SYNC_PUT_DONE: return TRACE_UPLOAD;
+    case SYNC_GET_DONE: return TRACE_DOWNLOAD;
+    case SYNC_DELTA_PAGE: return TRACE_DELTA_PAGE;
+  }
+  return -1;
+}
+
+WorkerPool::WorkerPool(int lane_count, WorkerListener *listener)
+  : listener(listener),
+    schedule(lane_count, this)
+{
+  this->lanes = new WorkerLane[this->schedule.CountLanes()];
+  for(int i = 0; i < this->schedule.CountLanes(); i++)
+  {
+    this->lanes[i].items = NULL;
+    this->lanes[i].item_count = 0;
+    this->lanes[i].item_space = 0;
+  }
+}
+
+WorkerPool::~WorkerPool(void)
+{
+  //the workers are stopped without waiting for what they're running
+  for(int i = 0; i < this->schedule.CountLanes(); i++)
+  {
+    WorkerLane *lane = &this->lanes[i];
+    ScheduledTransfer *running = this->schedule.Finish(i);
+    if(running != NULL)
+      free_scheduled(running);
+    free_frames(lane->items, lane->item_count);
+  }
+  delete[] this->lanes;
+  //the schedule frees the waiting transfers, but not their requests
+  for(size_t i = 0; i < this->schedule.CountWaiting(); i++)
+  {
+    ScheduledTransfer *transfer = this->schedule.Waiting(i);
+    free_request((PendingRequest*)transfer->data);
+    transfer->data = NULL;
+  }
+}
+
+/*
+* Copy the request onto the queue (its strings only last
+* until we return), and start it if it can be.
+*/
+void
+WorkerPool::Queue(const SyncRequest *sync)
+{
+  PendingRequest *request = (PendingRequest*)calloc(1, sizeof(PendingRequest));
+  request->reply = sync->reply;
+  if(sync->compare_path != NULL)
+  {
+    request->compare_path = copy_string(sync->compare_path);
+    request->compare_hash = copy_string(sync->compare_hash);
+  }
+  if(sync->verify_path != NULL)
+  {
+    request->verify_path = copy_string(sync->verify_path);
+    request->verify_hash = copy_string(sync->verify_hash);
+  }
+  request->device = sync->device;
+  request->node = sync->node;
+  request->size = sync->size;
+  request->mtime = sync->mtime;
+  this->schedule.Add(sync->args, sync->argc, sync->size, sync->modified,
+    now_usecs(), request);
+  Dispatch();
+}
+
+void
+WorkerPool::Dispatch(void)
+{
+  this->schedule.Dispatch(now_usecs());
+}
+
+int
+WorkerPool::GetRunning(TransferInfo *running, int space) const
+{
+  int count = 0;
+  for(int i = 0; i < this->schedule.CountLanes() && count < space; i++)
+  {
+    const ScheduledTransfer *transfer = this->schedule.Running(i);
+    if(transfer == NULL)
+      continue;
+    snprintf(running[count].op, sizeof(running[count].op), "%s",
+      transfer->args[0]);
+    snprintf(running[count].path, sizeof(running[count].path), "%s",
+      transfer->argc > 1 ? transfer->args[1] : "");
+    running[count].started = transfer->started;
+    count++;
+  }
+  return count;
+}
+
+int64_t
+WorkerPool::NextWindow(void) const
+{
+  int64_t due = this->schedule.NextDue();
+  if(due < 0)
+    return -1;
+  int64_t delay = due - now_usecs();
+  return delay > 0 ? delay : 0;
+}
+
+int
+WorkerPool::GetPollFds(struct pollfd *fds, int space) const
+{
+  int count = 0;
+  for(int i = 0; i < this->schedule.CountLanes() && count < space; i++)
+  {
+    const WorkerLane *lane = &this->lanes[i];
+    if(this->schedule.Running(i) == NULL || lane->worker.Fd() < 0)
+      continue;
+    fds[count].fd = lane->worker.Fd();
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+    count++;
+  }
+  return count;
+}
+
+/*
+* Read what the lanes polled have for us,
+* then start whatever can start.
+*/
+void
+WorkerPool::Handle(const struct pollfd *fds, int count)
+{
+  for(int i = 0; i < count; i++)
+  {
+    if(fds[i].revents == 0)
+      continue;
+    for(int j = 0; j < this->schedule.CountLanes(); j++)
+    {
+      if(this->schedule.Running(j) != NULL
+        && this->lanes[j].worker.Fd() == fds[i].fd)
+      {
+        read_lane(j);
+        break;
+      }
+    }
+  }
+  Dispatch();
+}
+
+/*
+* Start a request on an idle lane, unless the local file
+* already has the content_hash it was to be compared with.
+*/
+void
+WorkerPool::StartTransfer(int lane, ScheduledTransfer *transfer)
+{
+  const PendingRequest *request = (const PendingRequest*)transfer->data;
+  if(request != NULL && request->compare_path != NULL
+    && request->compare_hash != NULL && request->compare_hash[0] != '\0')
+  {
+    char hash[CONTENT_HASH_LENGTH + 1];
+    if(content_hash_file(request->compare_path, hash) == 0
+      && strcmp(hash, request->compare_hash) == 0)
+    {
+      this->schedule.Finish(lane);
+      reply(transfer, SYNC_OK, true, NULL, NULL, 0, hash);
+      free_scheduled(transfer);
+      return;
+    }
+  }
+
+  if(this->lanes[lane].worker.Send(transfer->args, transfer->argc) != 0)
+    finish(lane, NULL, SYNC_FAILED);
+}
+
+void
+WorkerPool::PauseTransfer(int lane)
+{
+  this->lanes[lane].worker.Pause();
+}
+
+/*
+* Collect every frame of the lane's answer that has
+* arrived, finishing the request at its OK or ERROR.
+*/
+void
+WorkerPool::read_lane(int index)
+{
+  WorkerLane *lane = &this->lanes[index];
+  while(this->schedule.Running(index) != NULL)
+  {
+    WorkerFrame frame;
+    int got = lane->worker.Read(&frame);
+    if(got == 0)
+      return;
+    if(got < 0)
+    {
+      finish(index, NULL, SYNC_FAILED);
+      return;
+    }
+    const char *tag = frame.fields[0];
+    if(strcmp(tag, "PAUSED") == 0)
+    {
+      WorkerProcess::FreeFrame(&frame);
+      requeue(index);
+      return;
+    }
+    if(strcmp(tag, "OK") == 0 || strcmp(tag, "ERROR") == 0)
+    {
+      int status = SYNC_OK;
+      if(strcmp(tag, "ERROR") == 0)
+      {
+        TRACE(TRACE_ERROR, "%s failed: %s", this->schedule.Running(index)->args[0],
+          frame.count > 1 ? frame.fields[1] : "");
+        status = SYNC_FAILED;
+      }
+      finish(index, &frame, status);
+      WorkerProcess::FreeFrame(&frame);
+      return;
+    }
+    if(lane->item_count == lane->item_space)
+    {
+      lane->item_space = lane->item_space * 2 + 16;
+      lane->items = (WorkerFrame*)realloc(lane->items,
+        lane->item_space * sizeof(WorkerFrame));
+    }
+    lane->items[lane->item_count++] = frame;
+  }
+}
+
+/*
+* The lane's request stopped part way to let a better
+* ranked one past, and goes back in the queue.
+*/
+void
+WorkerPool::requeue(int index)
+{
+  WorkerLane *lane = &this->lanes[index];
+  free_frames(lane->items, lane->item_count);
+  lane->items = NULL;
+  lane->item_count = lane->item_space = 0;
+
+  //it has been compared already
+  PendingRequest *request = (PendingRequest*)this->schedule.Running(index)->data;
+  free(request->compare_hash);
+  request->compare_hash = NULL;
+  this->schedule.Requeue(index);
+}
+
+/*
+* The lane's request is over: check the file it made if
+* it was to be checked, and answer it (or each request of
+* its batch). The lane is free before the answer goes, so
+* whatever the answer queues can start on it.
+*/
+void
+WorkerPool::finish(int index, const WorkerFrame *final, int status)
+{
+  WorkerLane *lane = &this->lanes[index];
+  ScheduledTransfer *transfer = this->schedule.Finish(index);
+  const PendingRequest *request = (const PendingRequest*)transfer->data;
+  WorkerFrame *items = lane->items;
+  size_t item_count = lane->item_count;
+  lane->items = NULL;
+  lane->item_count = lane->item_space = 0;
+
+  if(status == SYNC_OK && request != NULL && request->verify_path != NULL
+    && request->verify_hash != NULL && request->verify_hash[0] != '\0')
+  {
+    char hash[CONTENT_HASH_LENGTH + 1];
+    if(content_hash_file(request->verify_path, hash) != 0)
+      status = SYNC_FAILED;
+    else if(strcmp(hash, request->verify_hash) != 0)
+    {
+      TRACE(TRACE_ERROR, "%s has content_hash %s, expected %s",
+        request->verify_path, hash, request->verify_hash);
+      status = SYNC_BAD_DATA;
+    }
+  }
+  int span = request != NULL ? span_of(request->reply) : -1;
+  if(span >= 0 && trace_spans)
+    trace_record(span, now_usecs() - transfer->started);
+
+  reply(transfer, status, false, final, items, item_count, NULL);
+  if(transfer->batched_count > 0)
+    reply_batched(transfer, status, items, item_count);
+  free_scheduled(transfer);
+  free_frames(items, item_count);
+}
+
+void
+WorkerPool::reply(const ScheduledTransfer *transfer, int status,
+  bool unchanged, const WorkerFrame *final, const WorkerFrame *items,
+  size_t item_count, const char *content_hash)
+{
+  const PendingRequest *request = (const PendingRequest*)transfer->data;
+  if(request == NULL || request->reply == SYNC_NO_REPLY || this->listener == NULL)
+    return;
+  WorkerReply answer;
+  answer.reply = request->reply;
+  answer.status = status;
+  answer.unchanged = unchanged;
+  answer.args = transfer->args;
+  answer.argc = transfer->argc;
+  answer.final = final;
+  answer.items = items;
+  answer.item_count = item_count;
+  answer.content_hash = content_hash;
+  answer.device = request->device;
+  answer.node = request->node;
+  answer.size = request->size;
+  answer.mtime = request->mtime;
+  this->listener->TransferDone(&answer);
+}
+
+/*
+* Answer each request of a batch on its own, with
+* the status of its entry (a DONE or FAILED item,
+* in the same order), or status if there isn't one.
+*/
+void
+WorkerPool::reply_batched(const ScheduledTransfer *batch, int status,
+  const WorkerFrame *items, size_t item_count)
+{
+  for(size_t i = 0; i < batch->batched_count; i++)
+  {
+    const ScheduledTransfer *transfer = batch->batched[i];
+    int entry_status = status;
+    const WorkerFrame *item = i < item_count ? &items[i] : NULL;
+    if(item != NULL)
+    {
+      entry_status = strcmp(item->fields[0], "DONE") == 0 ? SYNC_OK : SYNC_FAILED;
+      if(entry_status != SYNC_OK)
+        TRACE(TRACE_ERROR, "%s %s failed: %s", transfer->args[0],
+          item->count > 1 ? item->fields[1] : "",
+          item->count > 2 ? item->fields[2] : "");
+    }
+    reply(transfer, entry_status, false, NULL, item, item != NULL ? 1 : 0, NULL);
+  }
+}
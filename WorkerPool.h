@@ -0,0 +1,155 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <sys/types.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ContentHash.h"
+#include "NativeWorker.h"
+#include "SyncStatus.h"
+#include "SyncTransport.h"
+#include "TransferSchedule.h"
+
+/*
+* One frame from db_worker.py: fields[0] is its tag (OK,
+* ERROR, or an item's, like FILE), the rest what follows.
+*/
+struct WorkerFrame
+{
+  char *data; //the payload, fields point into it
+  const char **fields;
+  int count;
+};
+
+/*
+* db_worker.py run with pipes on its stdin and stdout, as
+* DropboxWorker does it, but read without blocking so one
+* thread can look after several (see WorkerPool). With
+* DBFORHAIKU_TRANSPORT set to "native" the other ends of
+* the pipes are a NativeWorker's instead.
+*/
+class WorkerProcess
+{
+public:
+  WorkerProcess(void);
+  ~WorkerProcess(void);
+
+  //returns 0 or an errno
+  int Start(void);
+  void Stop(void);
+  int Fd(void) const { return from_worker; }
+  int Send(const char *const *argv, int argc);
+  //ask it to stop what it's running once it can carry on
+  //later, which it answers with PAUSED (see db_worker.py)
+  void Pause(void);
+  //1 with the next frame in frame (free it with FreeFrame()),
+  //0 if there isn't a whole one yet, -1 if the worker's gone
+  int Read(WorkerFrame *frame);
+  static void FreeFrame(WorkerFrame *frame);
+
+  //how many workers have been started, all told
+  static long CountStarted(void) { return started; }
+
+private:
+  int start_native(void);
+
+  pid_t pid;
+  NativeWorker *native; //in place of the process, if not NULL
+  int to_worker; //write end of the worker's stdin
+  int from_worker; //read end of the worker's stdout
+  char *buffer; //what's been read of the frames to come
+  size_t buffered;
+  size_t space;
+  static long started;
+};
+
+/*
+* A finished request, as WorkerPool hands it back:
+* its arguments, how it went, the worker's OK or ERROR
+* frame and any items before it, and what the engine
+* put in the request to have back.
+*/
+struct WorkerReply
+{
+  int reply; //SYNC_PUT_DONE ...
+  int status; //SYNC_OK ...
+  bool unchanged; //skipped, the local file had compare_hash
+  const char *const *args;
+  int argc;
+  const WorkerFrame *final; //NULL if the worker never answered
+  const WorkerFrame *items;
+  size_t item_count;
+  const char *content_hash; //the local file's, if unchanged
+  dev_t device;
+  ino_t node;
+  int64_t size;
+  int64_t mtime;
+};
+
+class WorkerListener
+{
+public:
+  virtual ~WorkerListener(void) {}
+  virtual void TransferDone(const WorkerReply *reply) = 0;
+};
+
+struct WorkerLane;
+
+/*
+* TransferQueue for the portable build: runs SyncEngine's
+* requests on up to lane_count workers at once, in the
+* order TransferSchedule (which TransferQueue uses too)
+* gives them, batching rm, mv and mkdir and pausing big
+* transfers for better ranked ones as it says.
+* It has no threads of its own: the caller polls the
+* descriptors GetPollFds() gives it and calls Handle()
+* with what came back, and Dispatch() once NextWindow()
+* says a batch window has closed or a pause is due.
+*
+* Comparing and checking content hashes happen on the
+* caller's thread, before and after each request.
+*/
+class WorkerPool : public ScheduleLanes
+{
+public:
+  WorkerPool(int lane_count, WorkerListener *listener);
+  ~WorkerPool(void);
+
+  void Queue(const SyncRequest *request);
+  void Dispatch(void);
+
+  //fills in up to space pollfds, returns how many
+  int GetPollFds(struct pollfd *fds, int space) const;
+  void Handle(const struct pollfd *fds, int count);
+
+  //microseconds until Dispatch() is due, -1 if it isn't
+  int64_t NextWindow(void) const;
+
+  size_t CountWaiting(void) const { return schedule.CountWaiting(); }
+  int CountRunning(void) const { return schedule.CountRunning(); }
+  int CountLanes(void) const { return schedule.CountLanes(); }
+  //fills in up to space of the running requests, returns how many
+  int GetRunning(TransferInfo *running, int space) const;
+
+  //ScheduleLanes
+  void StartTransfer(int lane, ScheduledTransfer *transfer);
+  void PauseTransfer(int lane);
+
+private:
+  void read_lane(int index);
+  void requeue(int index);
+  void finish(int index, const WorkerFrame *final, int status);
+  void reply(const ScheduledTransfer *transfer, int status, bool unchanged,
+    const WorkerFrame *final, const WorkerFrame *items, size_t item_count,
+    const char *content_hash);
+  void reply_batched(const ScheduledTransfer *batch, int status,
+    const WorkerFrame *items, size_t item_count);
+
+  WorkerListener *listener;
+  WorkerLane *lanes; //by lane, as the schedule numbers them
+  TransferSchedule schedule;
+};
+
+#endif
@@ -0,0 +1,213 @@
+import httplib
+import json
+import os
+import socket
+import urlparse
+
+from db_throttle import ThrottledBody
+
+# A thin Dropbox API v2 client that keeps one HTTP connection per host open
+# for as long as the owning process lives.  The official SDK is still used by
+# cli_client.py for the interactive OAuth flow, but the long-lived worker
+# (db_worker.py) talks to Dropbox through this so that it can reuse its
+# connections and so that it can be pointed at a local stand-in server for
+# testing (set DBFORHAIKU_SERVER to something like http://127.0.0.1:8765).
+# Given a db_throttle.Throttle, uploads and downloads keep to its limits.
+
+API_HOST = 'api.dropboxapi.com'
+CONTENT_HOST = 'content.dropboxapi.com'
+NOTIFY_HOST = 'notify.dropboxapi.com'
+
+SERVER_ENVIRONMENT_VARIABLE = 'DBFORHAIKU_SERVER'
+
+# Size of the pieces used when copying request and response bodies.
+COPY_BUFFER_SIZE = 64 * 1024
+
+# A long poll can be held open for up to 480 seconds plus up to 90 that
+# Dropbox adds, so the notify host gets longer than the others to answer.
+NOTIFY_TIMEOUT = 600
+
+class ApiError(Exception):
+    """An error reported by the Dropbox server (or by talking to it).
+    status is the HTTP status code, 0 for network problems.  For endpoint
+    specific errors (HTTP 409) error is the decoded JSON error summary."""
+    def __init__(self, status, body):
+        Exception.__init__(self, "HTTP %d: %s" % (status, body))
+        self.status = status
+        self.body = body
+        self.error = None
+        if status == 409:
+            try:
+                self.error = json.loads(body).get('error')
+            except ValueError:
+                pass
+
+    def tag(self):
+        """The ".tag" of the endpoint specific error, or None."""
+        if isinstance(self.error, dict):
+            return self.error.get('.tag')
+        return None
+
+class Stopped(Exception):
+    """A download was stopped part way because the caller asked."""
+    pass
+
+class DropboxAPI(object):
+    def __init__(self, token, server=None, timeout=120, throttle=None):
+        self.token = token
+        self.timeout = timeout
+        self.throttle = throttle
+        if server is None:
+            server = os.environ.get(SERVER_ENVIRONMENT_VARIABLE)
+        self.hosts = {}
+        if server:
+            # Every endpoint lives on the one local stand-in server.
+            url = urlparse.urlparse(server)
+            for host in (API_HOST, CONTENT_HOST, NOTIFY_HOST):
+                self.hosts[host] = (url.scheme == 'https', url.netloc)
+        else:
+            for host in (API_HOST, CONTENT_HOST, NOTIFY_HOST):
+                self.hosts[host] = (True, host)
+        self.connections = {}
+
+    def _connection(self, host):
+        conn = self.connections.get(host)
+        if conn is None:
+            secure, netloc = self.hosts[host]
+            timeout = self.timeout
+            if host == NOTIFY_HOST:
+                timeout = max(timeout, NOTIFY_TIMEOUT)
+            if secure:
+                conn = httplib.HTTPSConnection(netloc, timeout=timeout)
+            else:
+                conn = httplib.HTTPConnection(netloc, timeout=timeout)
+            try:
+                conn.connect()
+            except (httplib.HTTPException, socket.error) as e:
+                raise ApiError(0, "%s: %s" % (host, e))
+            # Headers and body go out in separate writes, don't let Nagle's
+            # algorithm hold the body back waiting for an ACK.
+            conn.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self.connections[host] = conn
+        return conn
+
+    def _drop_connection(self, host):
+        conn = self.connections.pop(host, None)
+        if conn is not None:
+            conn.close()
+
+    def close(self):
+        for host in self.connections.keys():
+            self._drop_connection(host)
+
+    def _request(self, host, route, body, headers, authorize=True):
+        """Send one request and return the response, whose body has not been
+        read yet.  A kept-alive connection that the server has since closed
+        shows up as an error on first use, so retry once on a new one.  File
+        bodies are rewound to where they were for the retry."""
+        headers = dict(headers)
+        if authorize:
+            headers['Authorization'] = 'Bearer ' + self.token
+        start = None
+        if hasattr(body, 'read'):
+            start = body.tell()
+        attempts = 2
+        while True:
+            attempts -= 1
+            conn = self._connection(host)
+            if start is not None:
+                body.seek(start)
+            try:
+                conn.request('POST', '/2/' + route, body, headers)
+                return conn.getresponse()
+            except (httplib.HTTPException, socket.error) as e:
+                self._drop_connection(host)
+                if attempts <= 0:
+                    raise ApiError(0, "%s: %s" % (host, e))
+
+    def _finish(self, host, response):
+        """Read the whole body of a response, raising ApiError if the status
+        is not 200."""
+        try:
+            body = response.read()
+        except (httplib.HTTPException, socket.error) as e:
+            self._drop_connection(host)
+            raise ApiError(0, "%s: %s" % (host, e))
+        if response.getheader('connection', '').lower() == 'close':
+            self._drop_connection(host)
+        if response.status != 200:
+            raise ApiError(response.status, body)
+        return body
+
+    def rpc(self, route, arg):
+        """Call an RPC style endpoint (JSON in, JSON out)."""
+        response = self._request(API_HOST, route, json.dumps(arg),
+            {'Content-Type': 'application/json'})
+        body = self._finish(API_HOST, response)
+        if len(body) == 0:
+            return None
+        return json.loads(body)
+
+    def notify(self, route, arg):
+        """Call a notification endpoint (JSON in, JSON out), which takes no
+        access token and may not answer for minutes."""
+        response = self._request(NOTIFY_HOST, route, json.dumps(arg),
+            {'Content-Type': 'application/json'}, False)
+        return json.loads(self._finish(NOTIFY_HOST, response))
+
+    def upload(self, route, arg, data):
+        """Call a content upload endpoint.  data is a string, or a file object
+        which is sent from its current position to its end."""
+        headers = {'Content-Type': 'application/octet-stream',
+            'Dropbox-API-Arg': json.dumps(arg)}
+        if hasattr(data, 'read'):
+            headers['Content-Length'] = \
+                str(os.fstat(data.fileno()).st_size - data.tell())
+        else:
+            headers['Content-Length'] = str(len(data))
+        if self.throttle is not None:
+            data = ThrottledBody(data, self.throttle)
+        response = self._request(CONTENT_HOST, route, data, headers)
+        return json.loads(self._finish(CONTENT_HOST, response))
+
+    def download(self, route, arg, out_file, start=0, stop=None):
+        """Call a content download endpoint, copying the body into out_file.
+        Returns the metadata from the Dropbox-API-Result header.  With a
+        start, only the bytes from there on are asked for, and they are
+        written after what out_file already has (all of it is written from
+        the beginning if the server sends the whole thing anyway).  If stop
+        is given and says True between pieces, raises Stopped, leaving what
+        was written so far in out_file."""
+        headers = {'Dropbox-API-Arg': json.dumps(arg)}
+        if start > 0:
+            headers['Range'] = 'bytes=%d-' % start
+        response = self._request(CONTENT_HOST, route, '', headers)
+        if response.status not in (200, 206):
+            self._finish(CONTENT_HOST, response)
+        result = json.loads(response.getheader('dropbox-api-result'))
+        if response.status == 200:
+            out_file.seek(0)
+            out_file.truncate()
+        # read() just stops if the connection is cut, so count.
+        length = response.getheader('content-length')
+        received = 0
+        try:
+            while True:
+                data = response.read(COPY_BUFFER_SIZE)
+                if not data:
+                    break
+                out_file.write(data)
+                received += len(data)
+                if self.throttle is not None:
+                    self.throttle.take('down', len(data))
+                if stop is not None and stop():
+                    self._drop_connection(CONTENT_HOST)
+                    raise Stopped()
+        except (httplib.HTTPException, socket.error) as e:
+            self._drop_connection(CONTENT_HOST)
+            raise ApiError(0, "%s: %s" % (CONTENT_HOST, e))
+        if length is not None and received < int(length):
+            self._drop_connection(CONTENT_HOST)
+            raise ApiError(0, "%s: cut off after %d of %s bytes" %
+                (CONTENT_HOST, received, length))
+        return result
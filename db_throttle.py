@@ -0,0 +1,245 @@
+import fcntl
+import mmap
+import os
+import re
+import struct
+import sys
+import time
+
+# Bandwidth limits for the transfers, shared by every db_worker.py process
+# (each transfer lane has a worker of its own, and so does the long poll).
+# There's a token bucket for uploads, one for downloads and one for both,
+# kept in a small file next to the limits that every worker maps, so however
+# many transfers are going they share the one limit.  A worker takes tokens
+# for each block before it sends it (or after it reads it), and sleeps off
+# whatever it took beyond what was there.
+#
+# The limits are in bandwidth.conf in the working directory (or the file
+# DBFORHAIKU_BANDWIDTH names), which is read again whenever it changes, so
+# changing it slows down or speeds up the transfers already going:
+#
+#   # KB a second, 0 (or leaving it out) is no limit
+#   up 256
+#   down 1024
+#   total 1024
+#   # other limits at these times of day
+#   08:00-18:00 up 128
+#   22:00-06:00 up 0 down 0 total 0
+#
+# A time of day line changes just the limits it gives, from its start to its
+# end (past midnight if the end is before the start).  The first line that
+# covers the time applies.  Without the file nothing is limited.
+#
+# usage: python db_throttle.py                  (the limits now)
+#        python db_throttle.py up 256 down 0    (change the all day limits)
+
+CONFIG_FILE = 'bandwidth.conf'
+CONFIG_ENVIRONMENT_VARIABLE = 'DBFORHAIKU_BANDWIDTH'
+
+DIRECTIONS = ['total', 'up', 'down']
+
+# How long, at most, a bucket can save up for when nothing's being sent,
+# which is how far over the limit a burst can go.
+BURST_SECONDS = 0.1
+
+# How often to look at whether the limits have changed, in seconds.
+CHECK_INTERVAL = 0.5
+
+# Each bucket's tokens (bytes) and when they were counted, in seconds.
+BUCKET = struct.Struct('<dd')
+
+TIME_RANGE = re.compile(r'^(\d\d?):(\d\d)-(\d\d?):(\d\d)$')
+
+def parse_config(text):
+    """The all day limits, in bytes a second by direction, and a list of
+    (start minute, end minute, limits) for the times of day, from the text
+    of a bandwidth.conf.  Lines that don't make sense are left out."""
+    base = {}
+    windows = []
+    for line in text.splitlines():
+        words = line.split('#', 1)[0].split()
+        if not words:
+            continue
+        limits = base
+        match = TIME_RANGE.match(words[0])
+        if match:
+            hour, minute, end_hour, end_minute = map(int, match.groups())
+            limits = {}
+            windows.append((hour * 60 + minute, end_hour * 60 + end_minute,
+                limits))
+            words = words[1:]
+        for i in range(0, len(words) - 1, 2):
+            if words[i] not in DIRECTIONS:
+                continue
+            try:
+                limits[words[i]] = max(0, int(float(words[i + 1]) * 1024))
+            except ValueError:
+                pass
+    return base, windows
+
+def in_window(minute, start, end):
+    if start <= end:
+        return start <= minute < end
+    return minute >= start or minute < end
+
+class Throttle(object):
+    def __init__(self, path=None):
+        if path is None:
+            path = os.environ.get(CONFIG_ENVIRONMENT_VARIABLE, CONFIG_FILE)
+        self.path = path
+        self.checked = 0.0
+        self.version = None
+        self.base = {}
+        self.windows = []
+        self.fd = None
+        self.state = None
+
+    def reload(self):
+        """Read the limits again if the file has changed (or gone)."""
+        try:
+            st = os.stat(self.path)
+        except OSError:
+            self.version = None
+            self.base, self.windows = {}, []
+            return
+        version = (st.st_mtime, st.st_size, st.st_ino)
+        if version == self.version:
+            return
+        try:
+            with open(self.path, 'r') as f:
+                self.base, self.windows = parse_config(f.read())
+        except IOError:
+            return
+        self.version = version
+
+    def limits(self, when=None):
+        """Bytes a second by direction, 0 (or missing) for no limit."""
+        now = time.time()
+        if now - self.checked >= CHECK_INTERVAL:
+            self.checked = now
+            self.reload()
+        if not self.windows:
+            return self.base
+        local = time.localtime(when or now)
+        minute = local.tm_hour * 60 + local.tm_min
+        for start, end, limits in self.windows:
+            if in_window(minute, start, end):
+                merged = dict(self.base)
+                merged.update(limits)
+                return merged
+        return self.base
+
+    def open_state(self):
+        """The buckets, mapped from the file next to the limits."""
+        if self.state is None:
+            fd = os.open(self.path + '.state', os.O_RDWR | os.O_CREAT, 0600)
+            size = BUCKET.size * len(DIRECTIONS)
+            if os.fstat(fd).st_size < size:
+                os.ftruncate(fd, size)
+            self.state = mmap.mmap(fd, size)
+            self.fd = fd
+        return self.state
+
+    def take(self, direction, count):
+        """Wait for count bytes to be allowed to go in direction ('up' or
+        'down'), as well as for both directions together."""
+        limits = self.limits()
+        if not limits:
+            return
+        buckets = []
+        for i, name in enumerate(DIRECTIONS):
+            rate = limits.get(name, 0)
+            if rate > 0 and name in ('total', direction):
+                buckets.append((i, rate))
+        if not buckets:
+            return
+        state = self.open_state()
+        wait = 0.0
+        fcntl.lockf(self.fd, fcntl.LOCK_EX)
+        try:
+            now = time.time()
+            for i, rate in buckets:
+                tokens, stamp = BUCKET.unpack_from(state, i * BUCKET.size)
+                if 0 < stamp <= now:
+                    tokens += (now - stamp) * rate
+                tokens = min(tokens, rate * BURST_SECONDS) - count
+                BUCKET.pack_into(state, i * BUCKET.size, tokens, now)
+                if tokens < 0:
+                    wait = max(wait, -tokens / rate)
+        finally:
+            fcntl.lockf(self.fd, fcntl.LOCK_UN)
+        if wait > 0:
+            time.sleep(wait)
+
+    def close(self):
+        if self.state is not None:
+            self.state.close()
+            os.close(self.fd)
+            self.state = None
+            self.fd = None
+
+class ThrottledBody(object):
+    """A request body that httplib reads a block at a time to send, taking
+    tokens for each block.  data is a string or a file object, sent from its
+    current position."""
+    def __init__(self, data, throttle):
+        if not hasattr(data, 'read'):
+            from cStringIO import StringIO
+            data = StringIO(data)
+        self.data = data
+        self.throttle = throttle
+
+    def read(self, size=-1):
+        block = self.data.read(size)
+        if block:
+            self.throttle.take('up', len(block))
+        return block
+
+    def tell(self):
+        return self.data.tell()
+
+    def seek(self, offset, whence=0):
+        self.data.seek(offset, whence)
+
+def describe(limits):
+    return ', '.join('%s %s' % (name, '%g KB/s' % (limits[name] / 1024.0)
+        if limits.get(name) else 'unlimited') for name in DIRECTIONS)
+
+def set_limits(path, changes):
+    """Rewrite the all day limits in the file, keeping the rest of it."""
+    lines = []
+    if os.path.exists(path):
+        with open(path, 'r') as f:
+            lines = f.read().splitlines()
+    kept = []
+    for line in lines:
+        words = line.split('#', 1)[0].split()
+        if words and words[0] in changes:
+            continue
+        kept.append(line)
+    for name in DIRECTIONS:
+        if name in changes:
+            kept.insert(0, '%s %s' % (name, changes[name]))
+    with open(path + '.new', 'w') as f:
+        f.write('\n'.join(kept) + '\n')
+    os.rename(path + '.new', path)
+
+def main(args):
+    throttle = Throttle()
+    if len(args) % 2 != 0:
+        print >> sys.stderr, 'usage: python db_throttle.py ' \
+            '[up|down|total KB/s]...'
+        return 1
+    changes = {}
+    for i in range(0, len(args), 2):
+        if args[i] not in DIRECTIONS:
+            print >> sys.stderr, 'not a direction: ' + args[i]
+            return 1
+        changes[args[i]] = args[i + 1]
+    if changes:
+        set_limits(throttle.path, changes)
+    print describe(throttle.limits())
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,531 @@
+import Queue
+import calendar
+import hashlib
+import json
+import os
+import signal
+import struct
+import sys
+import threading
+import time
+
+from db_api import ApiError, DropboxAPI, Stopped
+from db_throttle import Throttle
+
+# A long-lived helper process for hdbclient.exe.  Rather than starting a new
+# Python interpreter (and a new connection to Dropbox) for every put, get,
+# rm, mv and mkdir, the client starts this once and sends it requests over
+# its stdin, reading the replies from its stdout.  Log messages go to stderr.
+#
+# Every message in either direction is a frame: a 4 byte big-endian length
+# followed by that many bytes of fields separated by NUL bytes, so paths
+# containing spaces (or anything other than NUL) come through intact.  The
+# first field of a request is the operation name, the rest are its
+# arguments.  A request is answered by zero or more item frames (only
+# delta_page and the batch operations make those) followed by exactly one
+# frame starting with "OK" or "ERROR", or "PAUSED" (see below).
+#
+# For testing from the shell, "python db_worker.py --once <op> <args...>"
+# performs a single request and prints the reply frames, one per line.
+#
+# Files bigger than one chunk are uploaded through an upload session, a
+# chunk at a time, with the next chunks read from disk while one is being
+# sent.  The progress of each session is saved in SESSION_DIR after every
+# chunk Dropbox acknowledges, so an upload that fails (or a worker that is
+# killed) part way through carries on from there next time it is put.
+#
+# Downloads are appended to whatever is already in the file they're going
+# to, asking only for the rest of the file, so a get that was cut off (this
+# time or an earlier one) carries on from there.
+#
+# So a SIGUSR1 pauses an upload in a session (once the chunk being sent has
+# got there) or a download of a given rev, which then answers "PAUSED", and
+# sending the same request again carries on with it.  The client does that
+# to let more urgent transfers past a big one.  Anything else just finishes.
+
+# Written by cli_client.py after the user authorises the client.
+TOKEN_FILE = "login_token_store.txt"
+
+# How many entries to ask for in each page of a delta.
+DELTA_PAGE_SIZE = 500
+
+# How long a longpoll waits for changes, in seconds (30 to 480, Dropbox adds
+# up to 90 more at random).
+LONGPOLL_TIMEOUT = 120
+
+# Size of the pieces big files are uploaded in, and how many of them are
+# read ahead of the one being sent.  DBFORHAIKU_CHUNK_KB and
+# DBFORHAIKU_READ_AHEAD change them.
+UPLOAD_CHUNK_SIZE = 8 * 1024 * 1024
+UPLOAD_READ_AHEAD = 2
+
+# How many times in a row sending a chunk (or getting what's left of a
+# download) may fail before giving up, and how long to wait before the
+# first retry (doubling each time after).
+UPLOAD_RETRIES = 6
+RETRY_DELAY = 0.25
+
+# How long to wait before first asking whether a batch job is done (doubling
+# each time after, up to BATCH_CHECK_MAX).
+BATCH_CHECK_DELAY = 0.05
+BATCH_CHECK_MAX = 2.0
+
+# Where the progress of unfinished upload sessions is kept.
+SESSION_DIR = "upload_sessions"
+
+FRAME_HEADER = struct.Struct('>I')
+
+def read_frame(stream):
+    """Read one frame and return its list of fields, None at end of file."""
+    header = stream.read(FRAME_HEADER.size)
+    if len(header) < FRAME_HEADER.size:
+        return None
+    (length,) = FRAME_HEADER.unpack(header)
+    payload = stream.read(length)
+    if len(payload) < length:
+        return None
+    return payload.split('\0')
+
+def write_frame(stream, fields):
+    payload = '\0'.join(fields)
+    stream.write(FRAME_HEADER.pack(len(payload)))
+    stream.write(payload)
+    stream.flush()
+
+def read_token():
+    with open(TOKEN_FILE, 'r') as f:
+        return f.read().strip()
+
+def setting(name, default):
+    """A positive whole number from the environment, or default."""
+    try:
+        value = int(os.environ.get(name, ''))
+    except ValueError:
+        return default
+    if value <= 0:
+        return default
+    return value
+
+class ChunkReader(object):
+    """Reads a file from offset to size a chunk at a time on a thread of its
+    own, keeping up to depth chunks ready.  There is always at least one
+    chunk, empty if offset is already at size."""
+    def __init__(self, path, offset, size, chunk_size, depth):
+        self.chunks = Queue.Queue(depth)
+        self.stopping = False
+        self.thread = threading.Thread(target=self.run,
+            args=(path, offset, size, chunk_size))
+        self.thread.daemon = True
+        self.thread.start()
+
+    def run(self, path, offset, size, chunk_size):
+        try:
+            with open(path, 'rb') as f:
+                f.seek(offset)
+                while not self.stopping:
+                    data = f.read(min(chunk_size, size - offset))
+                    if offset + len(data) < size and \
+                            len(data) < chunk_size:
+                        raise IOError("%s got shorter" % path)
+                    self.chunks.put((offset, data))
+                    offset += len(data)
+                    if offset >= size:
+                        break
+        except IOError as e:
+            self.chunks.put(e)
+
+    def next(self):
+        """The offset and data of the next chunk."""
+        chunk = self.chunks.get()
+        if isinstance(chunk, IOError):
+            raise chunk
+        return chunk
+
+    def stop(self):
+        self.stopping = True
+        while self.thread.is_alive():
+            try:
+                self.chunks.get(timeout=0.1)
+            except Queue.Empty:
+                pass
+
+def modified_time(entry):
+    """When the file last changed on Dropbox, in seconds since 1970, as a
+    string, '' if it doesn't say."""
+    try:
+        return str(calendar.timegm(time.strptime(entry['server_modified'],
+            '%Y-%m-%dT%H:%M:%SZ')))
+    except (KeyError, ValueError):
+        return ''
+
+def retriable(e):
+    """Whether it's worth sending the same thing again after e."""
+    return e.status == 0 or e.status == 429 or e.status >= 500
+
+def session_error(e):
+    """The tag and details of an upload session lookup error.  Finish wraps
+    them in lookup_failed, append doesn't."""
+    error = e.error
+    if isinstance(error, dict) and error.get('.tag') == 'lookup_failed':
+        error = error.get('lookup_failed')
+    if not isinstance(error, dict):
+        return None, {}
+    return error.get('.tag'), error
+
+class Worker(object):
+    def __init__(self, api, send):
+        self.api = api
+        self.send = send # Called with a list of fields for each reply frame.
+        self.chunk_size = setting('DBFORHAIKU_CHUNK_KB', 0) * 1024 or \
+            UPLOAD_CHUNK_SIZE
+        self.read_ahead = setting('DBFORHAIKU_READ_AHEAD', UPLOAD_READ_AHEAD)
+        self.pause_wanted = False
+
+    def pause(self, signum=None, frame=None):
+        """Stop the request being run as soon as it can carry on later."""
+        self.pause_wanted = True
+
+    def paused(self):
+        return self.pause_wanted
+
+    def handle(self, fields):
+        """Perform one request and send all of its replies."""
+        # A pause that came too late for the last request isn't for this one.
+        self.pause_wanted = False
+        if len(fields) == 0 or not hasattr(self, 'do_' + fields[0]):
+            self.send(['ERROR', 'unknown request'])
+            return
+        try:
+            result = getattr(self, 'do_' + fields[0])(*fields[1:])
+            self.send(['OK'] + result)
+        except Stopped:
+            print >> sys.stderr, "[%s paused]" % fields[0]
+            self.send(['PAUSED'])
+        except TypeError as e:
+            self.send(['ERROR', 'bad arguments to %s: %s' % (fields[0], e)])
+        except (ApiError, IOError, OSError) as e:
+            print >> sys.stderr, "[%s failed: %s]" % (fields[0], e)
+            self.send(['ERROR', str(e)])
+
+    def do_put(self, local_path, db_path, parent_rev=None):
+        """Upload a file.  Replies with the path Dropbox actually stored it
+        under (it differs if there was a conflict), its new rev and its
+        content_hash."""
+        if parent_rev:
+            mode = {'.tag': 'update', 'update': parent_rev}
+        else:
+            mode = {'.tag': 'add'}
+        commit = {'path': db_path, 'mode': mode, 'autorename': True,
+            'mute': True}
+        if os.path.getsize(local_path) > self.chunk_size:
+            metadata = self.upload_in_session(local_path, commit)
+        else:
+            with open(local_path, 'rb') as f:
+                metadata = self.api.upload('files/upload', commit, f)
+        return [metadata['path_display'], metadata['rev'],
+            metadata.get('content_hash', '')]
+
+    def session_file(self, local_path, db_path):
+        name = hashlib.sha1(local_path + '\0' + db_path).hexdigest()
+        return os.path.join(SESSION_DIR, name)
+
+    def load_session(self, path, size, mtime):
+        """The saved session id and offset, if there is one for this
+        version of the file."""
+        try:
+            with open(path, 'r') as f:
+                state = json.load(f)
+        except (IOError, ValueError):
+            return None, 0
+        if state.get('size') != size or state.get('mtime') != mtime:
+            return None, 0
+        return state['session_id'], state['offset']
+
+    def save_session(self, path, session_id, offset, size, mtime):
+        if not os.path.isdir(SESSION_DIR):
+            os.makedirs(SESSION_DIR)
+        with open(path + '.new', 'w') as f:
+            json.dump({'session_id': session_id, 'offset': offset,
+                'size': size, 'mtime': mtime}, f)
+        os.rename(path + '.new', path)
+
+    def forget_session(self, path):
+        try:
+            os.remove(path)
+        except OSError:
+            pass
+
+    def upload_in_session(self, local_path, commit):
+        """Upload a file a chunk at a time, the last chunk going with the
+        finish.  A chunk that doesn't get through is sent again, starting
+        from wherever Dropbox says it got up to."""
+        st = os.stat(local_path)
+        size = st.st_size
+        mtime = st.st_mtime
+        saved = self.session_file(local_path, commit['path'])
+        session_id, offset = self.load_session(saved, size, mtime)
+        if session_id is not None:
+            print >> sys.stderr, "[resuming upload of %s at %d of %d]" % \
+                (local_path, offset, size)
+        reader = None
+        chunk = None
+        failures = 0
+        try:
+            while True:
+                if reader is None:
+                    reader = ChunkReader(local_path, offset, size,
+                        self.chunk_size, self.read_ahead)
+                if chunk is None:
+                    chunk = reader.next()
+                chunk_offset, data = chunk
+                end = chunk_offset + len(data)
+                cursor = {'session_id': session_id, 'offset': chunk_offset}
+                try:
+                    if session_id is None:
+                        result = self.api.upload('files/upload_session/start',
+                            {'close': False}, data)
+                        session_id = result['session_id']
+                    elif end < size:
+                        self.api.upload('files/upload_session/append_v2',
+                            {'cursor': cursor, 'close': False}, data)
+                    else:
+                        metadata = self.api.upload(
+                            'files/upload_session/finish',
+                            {'cursor': cursor, 'commit': commit}, data)
+                        self.forget_session(saved)
+                        return metadata
+                except ApiError as e:
+                    tag, error = session_error(e)
+                    if tag == 'incorrect_offset':
+                        # It got more (or less) than we thought.
+                        offset = error['correct_offset']
+                        if offset > size:
+                            raise
+                    elif tag in ('not_found', 'closed') and \
+                            failures < UPLOAD_RETRIES:
+                        # Expired, or finished already.  Start over.
+                        failures += 1
+                        session_id = None
+                        offset = 0
+                    elif retriable(e) and failures < UPLOAD_RETRIES:
+                        failures += 1
+                        time.sleep(RETRY_DELAY * 2 ** (failures - 1))
+                        offset = chunk_offset
+                    else:
+                        raise
+                    if offset != chunk_offset:
+                        reader.stop()
+                        reader = None
+                        chunk = None
+                    continue
+                offset = end
+                failures = 0
+                chunk = None
+                self.save_session(saved, session_id, offset, size, mtime)
+                if self.pause_wanted:
+                    raise Stopped()
+        except ApiError as e:
+            if not retriable(e):
+                self.forget_session(saved)
+            raise
+        finally:
+            if reader is not None:
+                reader.stop()
+
+    def do_get(self, db_path, local_path, rev=None):
+        """Download a file.  Replies with the rev that was downloaded and
+        its content_hash.  Given a rev, what's already in local_path is
+        taken to be the start of it, and only the rest is fetched."""
+        arg = {'path': db_path}
+        if rev:
+            arg['path'] = 'rev:' + rev
+        start = 0
+        if rev and os.path.exists(local_path):
+            start = os.path.getsize(local_path)
+        failures = 0
+        metadata = None
+        with open(local_path, 'ab') as f:
+            while metadata is None:
+                if start == 0:
+                    f.seek(0)
+                    f.truncate()
+                try:
+                    metadata = self.api.download('files/download', arg, f,
+                        start, rev and self.paused or None)
+                except ApiError as e:
+                    if e.status == 416:
+                        # Nothing after start, it's all there already or
+                        # it's something else.
+                        metadata = self.api.rpc('files/get_metadata',
+                            {'path': arg['path']})
+                        if metadata.get('size') != start:
+                            metadata = None
+                            start = 0
+                        continue
+                    if not retriable(e) or failures >= UPLOAD_RETRIES:
+                        raise
+                    failures += 1
+                    time.sleep(RETRY_DELAY * 2 ** (failures - 1))
+                    f.flush()
+                    if rev:
+                        start = os.fstat(f.fileno()).st_size
+        size = os.path.getsize(local_path)
+        if 'size' in metadata and size != metadata['size']:
+            raise IOError("%s is %d bytes, it should be %d" % (local_path,
+                size, metadata['size']))
+        return [metadata['rev'], metadata.get('content_hash', '')]
+
+    def do_rm(self, db_path):
+        self.api.rpc('files/delete_v2', {'path': db_path})
+        return []
+
+    def do_mv(self, from_path, to_path):
+        self.api.rpc('files/move_v2', {'from_path': from_path,
+            'to_path': to_path})
+        return []
+
+    def do_mkdir(self, db_path):
+        self.api.rpc('files/create_folder_v2', {'path': db_path})
+        return []
+
+    def run_batch(self, route, check_route, arg):
+        """Start a batch job and wait for it to finish, returns the result
+        for each of its entries, in order."""
+        result = self.api.rpc(route, arg)
+        job = None
+        delay = BATCH_CHECK_DELAY
+        while result['.tag'] in ('async_job_id', 'in_progress'):
+            job = result.get('async_job_id', job)
+            time.sleep(delay)
+            delay = min(delay * 2, BATCH_CHECK_MAX)
+            result = self.api.rpc(check_route, {'async_job_id': job})
+        if result['.tag'] != 'complete':
+            raise ApiError(409, json.dumps({'error': result}))
+        return result['entries']
+
+    def send_batch_results(self, paths, results, gone_is_done=False):
+        """Send DONE <path> for each entry that worked, FAILED <path>
+        <error> for each that didn't.  With gone_is_done a path that isn't
+        there counts as done."""
+        for path, result in zip(paths, results):
+            if result['.tag'] == 'success':
+                self.send(['DONE', path])
+                continue
+            failure = result.get('failure', {})
+            error = failure.get('.tag', 'unknown')
+            if error in failure and isinstance(failure[error], dict):
+                error += '/' + failure[error].get('.tag', '')
+            if gone_is_done and error == 'path_lookup/not_found':
+                self.send(['DONE', path])
+            else:
+                self.send(['FAILED', path, error])
+
+    def do_rm_batch(self, *db_paths):
+        """Delete every path in one batch job, with an item for each."""
+        results = self.run_batch('files/delete_batch',
+            'files/delete_batch/check',
+            {'entries': [{'path': path} for path in db_paths]})
+        self.send_batch_results(db_paths, results, True)
+        return []
+
+    def do_mv_batch(self, *paths):
+        """Move every from path to the to path after it in one batch job,
+        with an item for each from path."""
+        if len(paths) % 2 != 0:
+            raise TypeError('mv_batch takes pairs of paths')
+        from_paths = paths[0::2]
+        results = self.run_batch('files/move_batch_v2',
+            'files/move_batch/check_v2',
+            {'entries': [{'from_path': from_path, 'to_path': to_path}
+                for from_path, to_path in zip(from_paths, paths[1::2])]})
+        self.send_batch_results(from_paths, results)
+        return []
+
+    def do_mkdir_batch(self, *db_paths):
+        """Create every folder in one batch job, with an item for each."""
+        results = self.run_batch('files/create_folder_batch',
+            'files/create_folder_batch/check',
+            {'paths': list(db_paths), 'force_async': False})
+        self.send_batch_results(db_paths, results)
+        return []
+
+    def do_delta_page(self, cursor='', limit=str(DELTA_PAGE_SIZE)):
+        """Send an item for each remote change in the next page after cursor
+        (from the very start if it is empty): RESET, FILE <path> <rev>
+        <content_hash> <size> <modified>, FOLDER <path> or REMOVE <path>.
+        Replies with the cursor to ask for the page after this one, and "1"
+        if there is more, "0" if not.  The client saves the cursor once it
+        has applied the page, so an interrupted sync picks up where it left
+        off."""
+        result = None
+        if cursor:
+            try:
+                result = self.api.rpc('files/list_folder/continue',
+                    {'cursor': cursor})
+            except ApiError as e:
+                if e.tag() != 'reset':
+                    raise
+        if result is None:
+            self.send(['RESET'])
+            result = self.api.rpc('files/list_folder', {'path': '',
+                'recursive': True, 'include_deleted': True,
+                'limit': int(limit)})
+        for entry in result['entries']:
+            tag = entry['.tag']
+            if tag == 'file':
+                self.send(['FILE', entry['path_display'], entry['rev'],
+                    entry.get('content_hash', ''), str(entry.get('size', '')),
+                    modified_time(entry)])
+            elif tag == 'folder':
+                self.send(['FOLDER', entry['path_display']])
+            elif tag == 'deleted':
+                self.send(['REMOVE', entry['path_display']])
+        more = '0'
+        if result['has_more']:
+            more = '1'
+        return [result['cursor'], more]
+
+    def do_longpoll(self, cursor, timeout=str(LONGPOLL_TIMEOUT)):
+        """Wait until there are changes after cursor, or until the timeout.
+        Replies with "1" if there are (so delta_page has something to get),
+        "0" if not, then how many seconds Dropbox wants left before the next
+        longpoll ("0" for none).  A cursor Dropbox no longer knows counts as
+        changes, delta_page then answers with a RESET."""
+        try:
+            result = self.api.notify('files/list_folder/longpoll',
+                {'cursor': cursor, 'timeout': int(timeout)})
+        except ApiError as e:
+            if e.tag() != 'reset':
+                raise
+            return ['1', '0']
+        changes = '0'
+        if result.get('changes'):
+            changes = '1'
+        return [changes, str(result.get('backoff', 0))]
+
+def main(args):
+    api = DropboxAPI(read_token(), throttle=Throttle())
+    if len(args) > 0 and args[0] == '--once':
+        def print_reply(fields):
+            print '\t'.join(fields)
+        worker = Worker(api, print_reply)
+        worker.handle(args[1:])
+        return 0
+
+    stdin = sys.stdin
+    stdout = sys.stdout
+    # Stray prints would corrupt the framing, send them to the log instead.
+    sys.stdout = sys.stderr
+    worker = Worker(api, lambda fields: write_frame(stdout, fields))
+    signal.signal(signal.SIGUSR1, worker.pause)
+    signal.siginterrupt(signal.SIGUSR1, False)
+    while True:
+        fields = read_frame(stdin)
+        if fields is None:
+            break
+        worker.handle(fields)
+    api.close()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,85 @@
+/*
+* hdbstatus: asks a running hdbsync what it's doing (see
+* SyncStatus.h) and prints what it says.
+*
+*   hdbstatus [-w seconds] [socket]
+*
+* The socket defaults to what DBFORHAIKU_STATUS says, or
+* sync_status.sock, in the directory hdbsync was run in.
+* With -w it asks again every so many seconds until
+* stopped. On Haiku, ask hdbclient.exe instead with
+*   hey application/x-vnd.lh-MyDropboxClient DBST
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "SyncStatus.h"
+
+//returns 0 or an errno
+static int
+ask(const char *path)
+{
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address.sun_path))
+    return ENAMETOOLONG;
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+    return errno;
+  if(connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+  {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  char buffer[4096];
+  ssize_t got;
+  while((got = read(fd, buffer, sizeof(buffer))) > 0)
+    fwrite(buffer, 1, got, stdout);
+  int err = got < 0 ? errno : 0;
+  close(fd);
+  fflush(stdout);
+  return err;
+}
+
+int
+main(int argc, char **argv)
+{
+  int every = 0;
+  const char *path = status_socket_path();
+  for(int i = 1; i < argc; i++)
+  {
+    if(strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+      every = atoi(argv[++i]);
+    else if(argv[i][0] != '-')
+      path = argv[i];
+    else
+    {
+      fprintf(stderr, "usage: hdbstatus [-w seconds] [socket]\n");
+      return 1;
+    }
+  }
+
+  while(true)
+  {
+    int err = ask(path);
+    if(err != 0)
+    {
+      fprintf(stderr, "could not ask hdbsync at %s: %s\n", path, strerror(err));
+      return 1;
+    }
+    if(every <= 0)
+      return 0;
+    sleep(every);
+    printf("\n");
+  }
+}
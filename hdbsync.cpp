@@ -0,0 +1,571 @@
+/*
+* hdbsync: the sync engine as a program for Linux (or
+* anything else with inotify), keeping a folder in sync
+* the way hdbclient.exe keeps ~/Dropbox in sync on Haiku,
+* with InotifyWatch for the node monitor and a WorkerPool
+* for the TransferQueue. One thread runs everything, from
+* a poll() loop. It's what the benchmarks in
+* tests/bench_suite.py time.
+*
+*   hdbsync [folder [download folder]]
+*
+* The folder defaults to ~/Dropbox and the download folder
+* (which has to be on the same file system) to
+* ~/.Dropbox-downloads. Like hdbclient.exe it keeps its
+* state in sync_state and starts db_worker.py from the
+* directory it's run in, and reads DBFORHAIKU_TRANSFERS,
+* DBFORHAIKU_QUIET_MS and (through the worker)
+* DBFORHAIKU_SERVER. It stops on SIGINT or SIGTERM, and
+* prints the span times and last lines logged (see Trace.h)
+* on SIGUSR1 and when it stops. hdbstatus asks it what
+* it's doing through the socket DBFORHAIKU_STATUS names
+* (sync_status.sock if it doesn't).
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "InotifyWatch.h"
+#include "SyncEngine.h"
+#include "SyncStatus.h"
+#include "Trace.h"
+#include "WorkerPool.h"
+
+//the long poll's reply, after SyncTransport's
+const int LONGPOLL_DONE = SYNC_DELTA_PAGE + 1;
+//when long polls aren't working, how long to wait before
+//pulling the delta, doubled each time nothing's changed
+const int64_t MIN_POLL = 10000000;
+const int64_t MAX_POLL = 300000000;
+const int DEFAULT_TRANSFERS = 4;
+const int MAX_TRANSFERS = 32;
+const char *STATE_FILE = "sync_state";
+const int64_t ECHO_MAX_AGE = 60000000;
+const int64_t DEFAULT_QUIET_TIME = 2000000;
+
+const int TRACE_DUMP_LINES = 50;
+
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t dump_wanted = 0;
+
+static void
+stop(int)
+{
+  stopping = 1;
+}
+
+static void
+want_dump(int)
+{
+  dump_wanted = 1;
+}
+
+static int64_t
+now_usecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int64_t
+quiet_setting(void)
+{
+  const char *setting = getenv("DBFORHAIKU_QUIET_MS");
+  if(setting == NULL)
+    return DEFAULT_QUIET_TIME;
+  int64_t quiet = (int64_t)atoi(setting) * 1000;
+  return quiet < 0 ? 0 : quiet;
+}
+
+//DBFORHAIKU_REUSE=0 downloads every file, even one
+//that's already here somewhere else
+static bool
+reuse_setting(void)
+{
+  const char *setting = getenv("DBFORHAIKU_REUSE");
+  return setting == NULL || strcmp(setting, "0") != 0;
+}
+
+static int
+transfer_count(void)
+{
+  const char *setting = getenv("DBFORHAIKU_TRANSFERS");
+  int count = DEFAULT_TRANSFERS;
+  if(setting != NULL)
+    count = atoi(setting);
+  if(count < 1)
+    count = 1;
+  if(count > MAX_TRANSFERS)
+    count = MAX_TRANSFERS;
+  return count;
+}
+
+/*
+* What App is on Haiku: the engine's requests go to the
+* transfers, their answers and the inotify events come
+* back to the engine.
+*/
+class SyncDaemon: public SyncTransport, public WorkerListener
+{
+public:
+  SyncDaemon(const char *root, const char *download_dir);
+  ~SyncDaemon(void);
+
+  int Start(void);
+  void Run(void);
+
+  void Send(const SyncRequest *request);
+  void DeltaFinished(bool ok, bool changed);
+  void TransferDone(const WorkerReply *reply);
+
+private:
+  void handle_events(int timeout_ms);
+  void sweep_echoes(void);
+  int64_t next_timeout(int64_t now) const;
+  void run_timers(int64_t now);
+  void schedule_quiet_check(void);
+  void publish_status(void);
+
+  void upload_done(const WorkerReply *reply);
+  void delta_page_done(const WorkerReply *reply);
+  void download_done(const WorkerReply *reply);
+
+  void wait_for_changes(void);
+  void longpoll_done(const WorkerReply *reply);
+  void schedule_poll(void);
+
+  InotifyWatch watch;
+  SyncEngine *engine;
+  WorkerPool *transfers;
+  WorkerPool *notifier; //one worker of its own, for the long poll
+  StatusSocket status;
+
+  int64_t started;
+  int64_t delta_finished; //when the delta was last pulled in full, -1 if never
+  RateMeter uploaded;
+  RateMeter downloaded;
+
+  int64_t quiet_check_at; //when to upload quiet files, -1 if not due
+
+  bool longpoll_waiting;
+  int64_t longpoll_after; //not before then, if Dropbox said to back off
+  int64_t longpoll_again; //when to try again, -1 if not waiting to
+  int64_t poll_at; //when to pull the delta, -1 if not on a timer
+  int64_t poll_interval; //for when long polls don't work
+};
+
+SyncDaemon::SyncDaemon(const char *root, const char *download_dir)
+  : started(now_usecs()),
+    delta_finished(-1),
+    quiet_check_at(-1),
+    longpoll_waiting(false),
+    longpoll_after(0),
+    longpoll_again(-1),
+    poll_at(-1),
+    poll_interval(MIN_POLL)
+{
+  int count = transfer_count();
+  TRACE(TRACE_INFO, "Running up to %d transfers at once", count);
+  this->transfers = new WorkerPool(count, this);
+  this->notifier = new WorkerPool(1, this);
+  this->engine = new SyncEngine(root, download_dir, &this->watch, this);
+  this->engine->SetQuietTime(quiet_setting());
+  this->engine->SetReuse(reuse_setting());
+}
+
+SyncDaemon::~SyncDaemon(void)
+{
+  delete this->engine;
+  delete this->transfers;
+  delete this->notifier;
+}
+
+int
+SyncDaemon::Start(void)
+{
+  int err = this->watch.InitCheck();
+  if(err != 0)
+  {
+    TRACE(TRACE_ERROR, "inotify: %s", strerror(err));
+    return err;
+  }
+  err = this->engine->Open(STATE_FILE);
+  if(err != 0)
+    TRACE(TRACE_ERROR, "could not open %s: %s", STATE_FILE, strerror(err));
+  err = this->status.Listen(status_socket_path());
+  if(err != 0)
+    TRACE(TRACE_ERROR, "could not listen at %s: %s", status_socket_path(),
+      strerror(err));
+  this->engine->Start();
+  TRACE(TRACE_INFO, "Done watching and tracking all %ld children of the folder.",
+    (long)this->engine->CountTracked());
+  this->engine->StartDelta();
+  return 0;
+}
+
+void
+SyncDaemon::Send(const SyncRequest *request)
+{
+  this->transfers->Queue(request);
+}
+
+void
+SyncDaemon::TransferDone(const WorkerReply *reply)
+{
+  switch(reply->reply)
+  {
+    case SYNC_PUT_DONE:
+      upload_done(reply);
+      break;
+    case SYNC_GET_DONE:
+      download_done(reply);
+      break;
+    case SYNC_DELTA_PAGE:
+      delta_page_done(reply);
+      break;
+    case LONGPOLL_DONE:
+      longpoll_done(reply);
+      break;
+  }
+}
+
+//field i of the worker's OK or ERROR frame, after its tag
+static const char *
+field(const WorkerReply *reply, int i, const char *missing = "")
+{
+  if(reply->final == NULL || i + 1 >= reply->final->count)
+    return missing;
+  return reply->final->fields[i + 1];
+}
+
+/*
+* An upload finished. On success the fields are the real
+* Dropbox path, the new parent_rev and the content_hash,
+* unless it wasn't sent because Dropbox already had the
+* same contents.
+*/
+void
+SyncDaemon::upload_done(const WorkerReply *reply)
+{
+  if(reply->status == SYNC_OK && !reply->unchanged)
+    this->uploaded.Add(now_usecs(), reply->size);
+  this->engine->UploadDone(reply->status, reply->device, reply->node,
+    reply->unchanged, reply->size, reply->mtime,
+    field(reply, 0), field(reply, 1), field(reply, 2));
+}
+
+void
+SyncDaemon::delta_page_done(const WorkerReply *reply)
+{
+  if(reply->status != SYNC_OK)
+  {
+    this->engine->DeltaPageFailed(field(reply, 0));
+    return;
+  }
+  size_t count = reply->item_count;
+  DeltaItem *items = new DeltaItem[count > 0 ? count : 1];
+  for(size_t i = 0; i < count; i++)
+  {
+    const WorkerFrame *frame = &reply->items[i];
+    items[i].tag = frame->fields[0];
+    for(items[i].count = 0; items[i].count < DELTA_ITEM_FIELDS
+      && items[i].count + 1 < frame->count; items[i].count++)
+      items[i].fields[items[i].count] = frame->fields[items[i].count + 1];
+  }
+  this->engine->DeltaPageDone(items, count, field(reply, 0),
+    strcmp(field(reply, 1, "0"), "1") == 0);
+  delete[] items;
+}
+
+void
+SyncDaemon::download_done(const WorkerReply *reply)
+{
+  const char *arg[4] = {"", "", "", ""};
+  for(int i = 1; i < 4 && i < reply->argc; i++)
+    arg[i] = reply->args[i];
+  struct stat st;
+  if(reply->status == SYNC_OK && !reply->unchanged && stat(arg[2], &st) == 0)
+    this->downloaded.Add(now_usecs(), st.st_size);
+  this->engine->DownloadDone(reply->status, reply->unchanged,
+    arg[1], arg[2], arg[3],
+    reply->unchanged ? reply->content_hash : field(reply, 1));
+}
+
+/*
+* The delta has been pulled as far as it goes. Wait to
+* hear of the next change, or try again in a while.
+*/
+void
+SyncDaemon::DeltaFinished(bool ok, bool changed)
+{
+  if(!ok)
+  {
+    schedule_poll();
+    return;
+  }
+  this->delta_finished = now_usecs();
+  if(changed)
+    this->poll_interval = MIN_POLL;
+  wait_for_changes();
+}
+
+void
+SyncDaemon::wait_for_changes(void)
+{
+  if(this->longpoll_waiting)
+    return;
+  int64_t now = now_usecs();
+  if(this->longpoll_after > now)
+  {
+    //Dropbox asked us to back off
+    this->longpoll_again = this->longpoll_after;
+    return;
+  }
+  SyncRequest request;
+  memset(&request, 0, sizeof(request));
+  request.reply = LONGPOLL_DONE;
+  request.args[0] = "longpoll";
+  request.args[1] = this->engine->Cursor();
+  request.argc = 2;
+  this->longpoll_waiting = true;
+  this->notifier->Queue(&request);
+}
+
+/*
+* The long poll came back. Pull the delta if there are
+* changes, otherwise wait again. If long polls don't
+* work, go back to pulling the delta every so often.
+*/
+void
+SyncDaemon::longpoll_done(const WorkerReply *reply)
+{
+  this->longpoll_waiting = false;
+  //backstop for echoes whose sweep never came
+  this->engine->ExpireOldEchoes(ECHO_MAX_AGE);
+  if(reply->status != SYNC_OK)
+  {
+    TRACE(TRACE_INFO, "long poll failed, polling instead");
+    schedule_poll();
+    return;
+  }
+  int backoff = atoi(field(reply, 1, "0"));
+  if(backoff > 0)
+    this->longpoll_after = now_usecs() + (int64_t)backoff * 1000000;
+  if(strcmp(field(reply, 0, "0"), "1") == 0)
+    this->engine->StartDelta();
+  else
+    wait_for_changes();
+}
+
+void
+SyncDaemon::schedule_poll(void)
+{
+  this->poll_at = now_usecs() + this->poll_interval;
+  this->poll_interval *= 2;
+  if(this->poll_interval > MAX_POLL)
+    this->poll_interval = MAX_POLL;
+}
+
+void
+SyncDaemon::handle_events(int timeout_ms)
+{
+  FsEvent event;
+  while(this->watch.Next(&event, timeout_ms))
+  {
+    this->engine->HandleEvent(&event);
+    timeout_ms = 0;
+  }
+}
+
+/*
+* Everything the engine did has had its inotify events
+* queued by now (they're queued as it's done), so once
+* those are handled the echoes it expected can go.
+*/
+void
+SyncDaemon::sweep_echoes(void)
+{
+  uint32_t generation;
+  while(this->engine->StartEchoSweep(&generation))
+  {
+    handle_events(0);
+    this->engine->ExpireEchoes(generation);
+  }
+}
+
+//how long poll() can wait, in microseconds, -1 for ever
+int64_t
+SyncDaemon::next_timeout(int64_t now) const
+{
+  int64_t timeout = this->transfers->NextWindow();
+  int64_t times[3] = {this->quiet_check_at, this->poll_at,
+    this->longpoll_again};
+  for(int i = 0; i < 3; i++)
+  {
+    if(times[i] < 0)
+      continue;
+    int64_t wait = times[i] > now ? times[i] - now : 0;
+    if(timeout < 0 || wait < timeout)
+      timeout = wait;
+  }
+  return timeout;
+}
+
+void
+SyncDaemon::run_timers(int64_t now)
+{
+  if(this->poll_at >= 0 && now >= this->poll_at)
+  {
+    TRACE(TRACE_INFO, "Pulling changes from Dropbox");
+    this->poll_at = -1;
+    //backstop for echoes whose sweep never came
+    this->engine->ExpireOldEchoes(ECHO_MAX_AGE);
+    this->engine->StartDelta();
+  }
+  if(this->longpoll_again >= 0 && now >= this->longpoll_again)
+  {
+    this->longpoll_again = -1;
+    wait_for_changes();
+  }
+  if(this->quiet_check_at >= 0 && now >= this->quiet_check_at)
+  {
+    this->quiet_check_at = -1;
+    this->engine->UploadQuietFiles();
+  }
+  if(this->transfers->NextWindow() == 0)
+    this->transfers->Dispatch();
+}
+
+void
+SyncDaemon::schedule_quiet_check(void)
+{
+  if(this->quiet_check_at >= 0)
+    return;
+  int64_t delay = this->engine->NextQuietCheck();
+  if(delay >= 0)
+    this->quiet_check_at = now_usecs() + delay;
+}
+
+/*
+* Let the status socket know what we're doing, for the
+* next to ask.
+*/
+void
+SyncDaemon::publish_status(void)
+{
+  SyncStatus status;
+  status.now = now_usecs();
+  status.started = this->started;
+  status.tracked = this->engine->CountTracked();
+  status.memory = -1; //the status socket looks
+  status.quiet_waiting = this->engine->QuietFiles()->CountItems();
+  status.echoes_waiting = this->engine->Echoes()->CountItems();
+  status.transfers_waiting = this->transfers->CountWaiting();
+  status.transfer_lanes = this->transfers->CountLanes();
+  status.transfers_running = this->transfers->GetRunning(status.running,
+    STATUS_MAX_TRANSFERS);
+  status.up = this->uploaded;
+  status.down = this->downloaded;
+  status.reused_files = this->engine->CountReused();
+  status.reused_bytes = this->engine->BytesReused();
+  status.delta_running = this->engine->DeltaRunning();
+  status.delta_finished = this->delta_finished;
+  status.waiting_for = NULL;
+  if(this->longpoll_waiting)
+    status.waiting_for = "the long poll";
+  else if(this->longpoll_again >= 0)
+    status.waiting_for = "Dropbox to stop asking us to back off";
+  else if(this->poll_at >= 0)
+    status.waiting_for = "the next poll";
+  status.busy_since = -1;
+  this->status.Publish(&status);
+}
+
+void
+SyncDaemon::Run(void)
+{
+  struct pollfd fds[MAX_TRANSFERS + 2];
+  while(!stopping)
+  {
+    int64_t timeout = next_timeout(now_usecs());
+    int count = 0;
+    fds[count].fd = this->watch.Fd();
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+    count++;
+    int lanes = this->transfers->GetPollFds(&fds[count], MAX_TRANSFERS);
+    count += lanes;
+    count += this->notifier->GetPollFds(&fds[count], 1);
+
+    int timeout_ms = timeout < 0 ? -1 : (int)((timeout + 999) / 1000);
+    publish_status();
+    this->status.Busy(false);
+    int ready = poll(fds, count, timeout_ms);
+    this->status.Busy(true);
+    if(ready < 0 && errno != EINTR)
+    {
+      TRACE(TRACE_ERROR, "poll: %s", strerror(errno));
+      break;
+    }
+    if(ready > 0)
+    {
+      if(fds[0].revents != 0)
+        handle_events(0);
+      this->transfers->Handle(&fds[1], lanes);
+      this->notifier->Handle(&fds[1 + lanes], count - 1 - lanes);
+    }
+    run_timers(now_usecs());
+    sweep_echoes();
+    schedule_quiet_check();
+    this->engine->Flush();
+    if(dump_wanted)
+    {
+      dump_wanted = 0;
+      trace_dump(stdout, TRACE_DUMP_LINES);
+    }
+  }
+  this->engine->Flush();
+  TRACE(TRACE_INFO, "Stopping: %ld workers started, %ld files tracked",
+    WorkerProcess::CountStarted(), (long)this->engine->CountTracked());
+  trace_dump(stdout, TRACE_DUMP_LINES);
+}
+
+int
+main(int argc, char **argv)
+{
+  //the log is read as it's written, by the benchmarks
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  trace_init();
+
+  const char *home = getenv("HOME");
+  if(home == NULL)
+    home = ".";
+  char root[2048], download_dir[2048];
+  snprintf(root, sizeof(root), "%s/Dropbox", home);
+  snprintf(download_dir, sizeof(download_dir), "%s/.Dropbox-downloads", home);
+  if(argc > 1)
+    snprintf(root, sizeof(root), "%s", argv[1]);
+  if(argc > 2)
+    snprintf(download_dir, sizeof(download_dir), "%s", argv[2]);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  action.sa_handler = want_dump;
+  sigaction(SIGUSR1, &action, NULL);
+
+  SyncDaemon sync_daemon(root, download_dir);
+  if(sync_daemon.Start() != 0)
+    return 1;
+  sync_daemon.Run();
+  return 0;
+}
@@ -0,0 +1,54 @@
+/*
+* hdbworker: NativeWorker as a program, run the way
+* db_worker.py is, to stand in for it or try it out.
+*
+*   hdbworker < requests > answers
+*   hdbworker --once <op> [args...]
+*
+* The first serves request frames on stdin until it ends,
+* answering on stdout, and pauses on SIGUSR1. The second
+* runs one request and prints each answer as a line of
+* tab separated fields.
+*/
+
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "NativeWorker.h"
+#include "Trace.h"
+
+static NativeWorker *worker;
+
+static void
+pause_worker(int signum)
+{
+  worker->Pause();
+}
+
+int
+main(int argc, char **argv)
+{
+  trace_init();
+  //log lines would get mixed up with the answers, send them to stderr
+  int out_fd = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+  worker = new NativeWorker();
+  if(argc > 1 && strcmp(argv[1], "--once") == 0)
+  {
+    worker->Handle(argv + 2, argc - 2, out_fd, true);
+    delete worker;
+    return 0;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = pause_worker;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  worker->Run(STDIN_FILENO, out_fd);
+  delete worker;
+  return 0;
+}
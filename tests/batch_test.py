@@ -0,0 +1,148 @@
+import os
+import shutil
+import sys
+import tempfile
+import time
+
+from delta_paging_test import Worker
+from fake_dropbox_server import start_server
+
+# How many deletes, moves and new folders a second get to Dropbox when a
+# folder's worth of them happen at once, sent one call each (what
+# hdbclient.exe used to do, one after another since each rm and mv holds up
+# the queue) and sent the way TransferQueue now groups them: everything
+# waiting, up to BATCH_LIMIT at a time, as one delete_batch, move_batch or
+# create_folder_batch job.  The client's side is played here with
+# db_worker.py against the stand-in server, with a latency on every request
+# standing in for the round trip to Dropbox.
+#
+# Also checks that Dropbox ends up as it should either way, and that a batch
+# reports each entry that failed.
+#
+# usage: python batch_test.py [file count] [latency]
+
+BATCH_LIMIT = 1000
+BATCH_WINDOW = 0.1 # The first of a batch waits this long for the rest.
+
+def fill(server, count):
+    with server.db.lock:
+        for i in range(count):
+            server.db.put_file('/Photos/2014/img%06d.jpg' % i, 'x', {}, False)
+
+def batches(items, per_item):
+    for start in range(0, len(items), BATCH_LIMIT):
+        yield [field for item in items[start:start + BATCH_LIMIT]
+            for field in per_item(item)]
+
+def run(server, worker, op, items, per_item, batched):
+    """Returns operations a second, requests the server got, and the items
+    that failed."""
+    with server.db.lock:
+        requests = server.db.requests
+    failed = []
+    start = time.time()
+    if batched:
+        time.sleep(BATCH_WINDOW)
+        for args in batches(items, per_item):
+            results, final = worker.request(op + '_batch', *args)
+            assert final[0] == 'OK', final
+            failed += [result[1] for result in results
+                if result[0] == 'FAILED']
+    else:
+        for item in items:
+            results, final = worker.request(op, *per_item(item))
+            if final[0] != 'OK':
+                failed.append(per_item(item)[0])
+    took = time.time() - start
+    with server.db.lock:
+        requests = server.db.requests - requests
+    return len(items) / took, requests, failed
+
+def paths_under(server, folder):
+    with server.db.lock:
+        return sorted(entry['path_display'] for entry in
+            server.db.entries.values() if entry['.tag'] == 'file' and
+            entry['path_lower'].startswith(folder.lower() + '/'))
+
+def one_way(env, count, latency, batched):
+    server = start_server(latency=latency)
+    fill(server, count)
+    env['DBFORHAIKU_SERVER'] = server.url
+    worker = Worker(env)
+    files = paths_under(server, '/Photos/2014')
+
+    folders = ['/Archive/%03d' % i for i in range(count / 100)]
+    mkdir = run(server, worker, 'mkdir', folders, lambda path: [path],
+        batched)
+    moves = [(path, '/Archive/%03d/%s' % (i / 100, path.split('/')[-1]))
+        for i, path in enumerate(files)]
+    mv = run(server, worker, 'mv', moves, lambda move: list(move), batched)
+    moved = paths_under(server, '/Archive') == \
+        sorted(to for _, to in moves)
+    rm = run(server, worker, 'rm', [to for _, to in moves],
+        lambda path: [path], batched)
+    removed = paths_under(server, '/Archive') == []
+
+    worker.stop()
+    server.shutdown()
+    return mkdir, mv, rm, moved and removed
+
+def main(count, latency):
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        os.chdir(directory)
+        env = dict(os.environ)
+
+        print "%d files, %d folders, %.0f ms a request:" % (count,
+            count / 100, latency * 1000)
+        results = {}
+        for name, batched in (('one call each', False), ('batched', True)):
+            results[batched] = one_way(env, count, latency, batched)
+            for op, (rate, requests, failed) in zip(('mkdir', 'mv', 'rm'),
+                    results[batched][:3]):
+                print "  %-13s %-5s %9.1f a second  %5d requests" % \
+                    (name, op, rate, requests)
+
+        # One of each that can't be done, rm of something that isn't there
+        # is taken as done.
+        server = start_server()
+        fill(server, 3)
+        env['DBFORHAIKU_SERVER'] = server.url
+        worker = Worker(env)
+        moves, final = worker.request('mv_batch',
+            '/Photos/2014/img000000.jpg', '/Moved/a.jpg',
+            '/Photos/2014/missing.jpg', '/Moved/b.jpg')
+        removes, _ = worker.request('rm_batch', '/Photos/2014/img000001.jpg',
+            '/Photos/2014/missing.jpg')
+        folders, _ = worker.request('mkdir_batch', '/New', '/Photos')
+        worker.stop()
+        server.shutdown()
+        print "mv_batch with a missing file:", [item[0] for item in moves]
+
+        single, batch = results[False], results[True]
+        print "Checking Assertions:"
+        print "batched moves are faster:", batch[1][0] > 10 * single[1][0]
+        print "batched deletes are faster:", batch[2][0] > 10 * single[2][0]
+        print "batched moves and deletes need fewer requests:", \
+            all(batch[i][1] * 10 < single[i][1] for i in (1, 2))
+        print "Dropbox ends up the same either way:", single[3] and batch[3]
+        print "nothing failed:", \
+            all(not result[i][2] for result in results.values()
+                for i in range(3))
+        print "each failure is reported:", \
+            [item[0] for item in moves] == ['DONE', 'FAILED'] and \
+            [item[0] for item in removes] == ['DONE', 'DONE'] and \
+            [item[0] for item in folders] == ['DONE', 'FAILED']
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    count = 2000
+    latency = 0.02
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        latency = float(sys.argv[2])
+    main(count, latency)
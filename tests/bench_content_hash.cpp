@@ -0,0 +1,166 @@
+/*
+* Checks the SHA-256 code against the standard test vectors
+* (with and without the SHA instructions), then measures how
+* fast content_hash_file() gets through a multi-GB file:
+* plain C on one thread, SHA instructions on one thread,
+* and SHA instructions on every CPU.
+*
+* The file is written first, so it's read back from the cache
+* if it fits, and the numbers are for hashing rather than the disk.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_content_hash bench_content_hash.cpp ../ContentHash.cpp ../Trace.cpp -lpthread
+*   ./bench_content_hash [size in MB] [scratch file]
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "ContentHash.h"
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+sha256_hex(const void *data, size_t size, char *hex)
+{
+  Sha256 sha;
+  uint8_t digest[32];
+  sha256_init(&sha);
+  //feed it in odd sized pieces to exercise the buffering
+  const char *pos = (const char*)data;
+  size_t piece = 1;
+  while(size > 0)
+  {
+    size_t take = piece < size ? piece : size;
+    sha256_update(&sha, pos, take);
+    pos += take;
+    size -= take;
+    piece = piece * 3 + 1;
+  }
+  sha256_final(&sha, digest);
+  for(int i = 0; i < 32; i++)
+    sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static bool
+check_vectors(void)
+{
+  static const char *inputs[3] = {"", "abc",
+    "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+  static const char *expected[4] = {
+    "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+    "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"};
+  char hex[CONTENT_HASH_LENGTH + 1];
+  bool ok = true;
+  for(int i = 0; i < 4; i++)
+  {
+    if(i < 3)
+      sha256_hex(inputs[i], strlen(inputs[i]), hex);
+    else
+    {
+      char *million = (char*)malloc(1000000);
+      memset(million, 'a', 1000000);
+      sha256_hex(million, 1000000, hex);
+      free(million);
+    }
+    if(strcmp(hex, expected[i]) != 0)
+    {
+      printf("  test vector %d: got %s\n", i, hex);
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+static void
+measure(const char *name, const char *path, double size, int threads, char *hex)
+{
+  double start = now();
+  int err = content_hash_file(path, hex, threads);
+  double elapsed = now() - start;
+  if(err != 0)
+  {
+    printf("%-28s failed: %s\n", name, strerror(err));
+    return;
+  }
+  printf("%-28s %6.2f GB/s  (%.2f s)\n", name, size / elapsed / 1e9, elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+  long long megabytes = 2048;
+  const char *path = "bench_content_hash.tmp";
+  if(argc > 1)
+    megabytes = atoll(argv[1]);
+  if(argc > 2)
+    path = argv[2];
+
+  bool simd = sha256_simd_available();
+  sha256_use_simd(false);
+  printf("test vectors, plain C: %s\n", check_vectors() ? "ok" : "WRONG");
+  sha256_use_simd(true);
+  if(simd)
+    printf("test vectors, SHA instructions: %s\n", check_vectors() ? "ok" : "WRONG");
+  else
+    printf("no SHA instructions on this CPU (or compiler)\n");
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    perror(path);
+    return 1;
+  }
+  size_t chunk_size = 1024 * 1024;
+  unsigned char *chunk = (unsigned char*)malloc(chunk_size);
+  unsigned int seed = 12345;
+  for(long long i = 0; i < megabytes; i++)
+  {
+    for(size_t j = 0; j < chunk_size; j++)
+    {
+      seed = seed * 1103515245 + 12345;
+      chunk[j] = (unsigned char)(seed >> 16);
+    }
+    if(write(fd, chunk, chunk_size) != (ssize_t)chunk_size)
+    {
+      perror("write");
+      return 1;
+    }
+  }
+  close(fd);
+  free(chunk);
+
+  double size = (double)megabytes * 1024 * 1024;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  printf("hashing %lld MB in %lu blocks of 4 MB, %ld CPUs\n", megabytes,
+    (unsigned long)((megabytes + 3) / 4), cpus);
+
+  char plain[CONTENT_HASH_LENGTH + 1], fast[CONTENT_HASH_LENGTH + 1];
+  char parallel[CONTENT_HASH_LENGTH + 1];
+  sha256_use_simd(false);
+  measure("plain C, 1 thread", path, size, 1, plain);
+  sha256_use_simd(true);
+  measure(simd ? "SHA instructions, 1 thread" : "plain C again, 1 thread",
+    path, size, 1, fast);
+  char name[64];
+  sprintf(name, "%s, %ld threads", simd ? "SHA instructions" : "plain C", cpus);
+  measure(name, path, size, 0, parallel);
+
+  printf("content_hash %s\n", plain);
+  bool same = strcmp(plain, fast) == 0 && strcmp(plain, parallel) == 0;
+  printf("all three agree: %s\n", same ? "yes" : "NO");
+  unlink(path);
+  return same ? 0 : 1;
+}
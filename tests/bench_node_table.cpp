@@ -0,0 +1,137 @@
+/*
+* Micro-benchmark of NodeTable lookups, compared with
+* the linear scan that find_nref_in_tracked_files used to do
+* (without even the GetNodeRef() call it made per entry),
+* and how much memory a tracked file costs, which is meant
+* to stay under 64 bytes plus its name (counting malloc()'s
+* own overhead and the buckets), more once it's synced.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_node_table bench_node_table.cpp ../NodeTable.cpp
+*   ./bench_node_table
+*/
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "NodeTable.h"
+
+const int LOOKUPS = 1000000;
+const dev_t DEVICE = 3;
+const ino_t FIRST_NODE = 1000;
+const size_t RECORD_BUDGET = 64;
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//bytes malloc()ed and not yet freed
+static size_t
+heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  struct mallinfo info = mallinfo();
+  return (size_t)(unsigned)info.uordblks + (size_t)(unsigned)info.hblkhd;
+#endif
+}
+
+static void
+bench(size_t entries)
+{
+  NodeTable table;
+  char name[64];
+  for(size_t i = 0; i < entries; i++)
+  {
+    sprintf(name, "track%07lu.mp3", (unsigned long)i);
+    table.Insert(DEVICE, FIRST_NODE + i, FIRST_NODE - 1, name);
+  }
+
+  //random lookups, mostly hits, so that the cache isn't warmed for us
+  srand(42);
+  size_t found = 0;
+  double start = now();
+  for(int i = 0; i < LOOKUPS; i++)
+  {
+    ino_t node = FIRST_NODE + (ino_t)(((size_t)rand() * 7919) % (entries + entries / 10));
+    if(table.Find(DEVICE, node) != NULL)
+      found++;
+  }
+  double hash_ns = (now() - start) * 1e9 / LOOKUPS;
+
+  //the old way: walk every entry until the node matches
+  ino_t *nodes = (ino_t*)malloc(entries * sizeof(ino_t));
+  for(size_t i = 0; i < entries; i++)
+    nodes[i] = FIRST_NODE + i;
+  int scans = entries > 100000 ? 20 : (int)(20000000 / entries);
+  volatile size_t scan_found = 0;
+  start = now();
+  for(int i = 0; i < scans; i++)
+  {
+    ino_t node = FIRST_NODE + (ino_t)(((size_t)rand() * 7919) % entries);
+    for(size_t j = 0; j < entries; j++)
+      if(nodes[j] == node) { scan_found++; break; }
+  }
+  double scan_ns = (now() - start) * 1e9 / scans;
+  free(nodes);
+
+  printf("%8lu entries: hash lookup %7.1f ns, linear scan %12.1f ns (%lu%% hits)\n",
+    (unsigned long)entries, hash_ns, scan_ns,
+    (unsigned long)(found * 100 / LOOKUPS));
+}
+
+/*
+* Heap per record, less the name, for a table of entries
+* files as they are when first tracked and once synced.
+*/
+static bool
+memory(size_t entries)
+{
+  size_t before = heap_used();
+  size_t names = 0;
+  NodeTable *table = new NodeTable();
+  char name[64];
+  for(size_t i = 0; i < entries; i++)
+  {
+    sprintf(name, "track%07lu.mp3", (unsigned long)i);
+    names += strlen(name) + 1;
+    table->Insert(DEVICE, FIRST_NODE + i, FIRST_NODE - 1, name);
+  }
+  double tracked = ((double)(heap_used() - before) - names) / entries;
+
+  size_t i;
+  for(NodeRecord *r = table->First(&i); r != NULL; r = table->Next(&i, r))
+  {
+    NodeTable::SetRev(r, "015d7f3e4a2b0c1d");
+    NodeTable::SetHash(r, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    NodeTable::SetSynced(r, 16, 1700000000);
+  }
+  double synced = ((double)(heap_used() - before) - names) / entries;
+  delete table;
+
+  bool ok = tracked < RECORD_BUDGET;
+  printf("%8lu entries: %5.1f bytes each plus the name, %5.1f once synced"
+    " (budget %lu): %s\n", (unsigned long)entries, tracked, synced,
+    (unsigned long)RECORD_BUDGET, ok ? "under" : "OVER");
+  return ok;
+}
+
+int
+main(void)
+{
+  bench(1000);
+  bench(100000);
+  bench(1000000);
+  bool ok = memory(100000);
+  ok = memory(1000000) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,316 @@
+/*
+* How long the startup scan for offline changes takes, and
+* whether it finds exactly what was changed.
+*
+* Makes a tree of files and the NodeTable the client would
+* have saved for it (sizes, mtimes and content_hashes), then
+* changes a given percentage of the files the ways they get
+* changed while the client isn't running: edited, touched
+* without changing, saved by writing a new copy and renaming
+* it over the old, renamed, deleted and added. One whole
+* directory is moved as well. The scan is timed on one thread
+* and on the default number, with the caches dropped first if
+* we're allowed to (run as root for cold numbers).
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_offline_scan bench_offline_scan.cpp ../OfflineScan.cpp ../NodeTable.cpp ../ContentHash.cpp ../Trace.cpp -lpthread
+*   ./bench_offline_scan [file count] [percent changed] [scratch directory]
+*/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "OfflineScan.h"
+
+const int FILES_PER_DIR = 200;
+const int DIRS_PER_GROUP = 20;
+const time_t OLD_MTIME = 1700000000;
+
+//the ways a file gets changed, in turn
+enum
+{
+  EDIT,
+  TOUCH,
+  REPLACE,
+  RENAME,
+  DELETE,
+  ADD,
+  KINDS
+};
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool
+drop_caches(void)
+{
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if(fd < 0)
+    return false;
+  bool ok = write(fd, "3\n", 2) == 2;
+  close(fd);
+  return ok;
+}
+
+static void
+write_file(const char *path, const char *contents, time_t mtime)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return;
+  write(fd, contents, strlen(contents));
+  close(fd);
+  struct timeval times[2];
+  times[0].tv_sec = times[1].tv_sec = mtime;
+  times[0].tv_usec = times[1].tv_usec = 0;
+  utimes(path, times);
+}
+
+static void
+dir_path(char *path, const char *root, long dir)
+{
+  sprintf(path, "%s/season%03ld/show%05ld", root, dir / DIRS_PER_GROUP, dir);
+}
+
+static void
+file_path(char *path, const char *root, long file)
+{
+  dir_path(path, root, file / FILES_PER_DIR);
+  sprintf(path + strlen(path), "/segment%07ld.mp3", file);
+}
+
+static void
+make_tree(const char *root, long files)
+{
+  char path[2048];
+  mkdir(root, 0755);
+  for(long i = 0; i < files; i++)
+  {
+    long dir = i / FILES_PER_DIR;
+    if(i % FILES_PER_DIR == 0)
+    {
+      if(dir % DIRS_PER_GROUP == 0)
+      {
+        sprintf(path, "%s/season%03ld", root, dir / DIRS_PER_GROUP);
+        mkdir(path, 0755);
+      }
+      dir_path(path, root, dir);
+      mkdir(path, 0755);
+    }
+    file_path(path, root, i);
+    write_file(path, path, OLD_MTIME);
+  }
+}
+
+//what the client would have saved, everything synced
+static void
+save_state(NodeTable *table, const char *dir_path, ino_t dir_node)
+{
+  DIR *dir = opendir(dir_path);
+  if(dir == NULL)
+    return;
+  struct dirent *entry;
+  char path[2048];
+  while((entry = readdir(dir)) != NULL)
+  {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    sprintf(path, "%s/%s", dir_path, entry->d_name);
+    struct stat st;
+    if(lstat(path, &st) != 0)
+      continue;
+    NodeRecord *record = table->Insert(st.st_dev, st.st_ino, dir_node, entry->d_name);
+    record->directory = S_ISDIR(st.st_mode);
+    if(record->directory)
+    {
+      save_state(table, path, st.st_ino);
+      continue;
+    }
+    char hash[CONTENT_HASH_LENGTH + 1];
+    content_hash_file(path, hash, 1);
+    NodeTable::SetRev(record, "015d7f3e4a2b0c1d");
+    NodeTable::SetHash(record, hash);
+    NodeTable::SetSynced(record, st.st_size, st.st_mtime);
+  }
+  closedir(dir);
+}
+
+struct Expected
+{
+  long counts[KINDS];
+};
+
+static void
+change_files(const char *root, long files, double percent, Expected *expected)
+{
+  char path[2048], other[2048];
+  memset(expected, 0, sizeof(*expected));
+  long changes = (long)(files * percent / 100);
+  if(changes < KINDS)
+    changes = KINDS;
+  //spread out over the tree, but not in the directory that gets moved
+  long step = (files - FILES_PER_DIR) / changes;
+  if(step < 1)
+    step = 1;
+  for(long n = 0; n < changes; n++)
+  {
+    long file = FILES_PER_DIR + n * step;
+    if(file >= files)
+      break;
+    int kind = n % KINDS;
+    file_path(path, root, file);
+    switch(kind)
+    {
+      case EDIT:
+        write_file(path, "edited while the client was off", OLD_MTIME + 60);
+        break;
+      case TOUCH:
+      {
+        struct timeval times[2];
+        times[0].tv_sec = times[1].tv_sec = OLD_MTIME + 60;
+        times[0].tv_usec = times[1].tv_usec = 0;
+        utimes(path, times);
+        break;
+      }
+      case REPLACE:
+        //an editor saving the same contents
+        sprintf(other, "%s.tmp", path);
+        write_file(other, path, OLD_MTIME + 60);
+        rename(other, path);
+        break;
+      case RENAME:
+        sprintf(other, "%s.renamed", path);
+        rename(path, other);
+        break;
+      case DELETE:
+        unlink(path);
+        break;
+      case ADD:
+        sprintf(other, "%s.new", path);
+        write_file(other, other, OLD_MTIME + 60);
+        break;
+    }
+    expected->counts[kind]++;
+  }
+  //the first directory goes into another season
+  dir_path(path, root, 0);
+  sprintf(other, "%s/season%03ld/moved", root, (files / FILES_PER_DIR - 1) / DIRS_PER_GROUP);
+  rename(path, other);
+}
+
+static bool
+check(const OfflineScan *scan, const Expected *expected)
+{
+  long counts[KINDS];
+  memset(counts, 0, sizeof(counts));
+  long moved_dirs = 0, other = 0;
+  for(size_t i = 0; i < scan->CountEntries(); i++)
+  {
+    const ScanEntry *entry = scan->EntryAt(i);
+    if(entry->directory)
+    {
+      if(entry->change == SCAN_MOVED)
+        moved_dirs++;
+      else if(entry->change != 0)
+        other++;
+    }
+    else if(entry->replaces != NULL && entry->change == (SCAN_NEW | SCAN_TOUCHED))
+      counts[REPLACE]++;
+    else if(entry->change == SCAN_CHANGED)
+      counts[EDIT]++;
+    else if(entry->change == SCAN_TOUCHED)
+      counts[TOUCH]++;
+    else if(entry->change == SCAN_MOVED)
+      counts[RENAME]++;
+    else if(entry->change == SCAN_NEW)
+      counts[ADD]++;
+    else if(entry->change != 0 || entry->replaces != NULL)
+      other++;
+  }
+  for(size_t i = 0; i < scan->CountGone(); i++)
+  {
+    if(!scan->GoneWithParent(i))
+      counts[DELETE]++;
+  }
+  bool ok = moved_dirs == 1 && other == 0;
+  for(int kind = 0; kind < KINDS; kind++)
+    ok = ok && counts[kind] == expected->counts[kind];
+  printf("  found %ld edited, %ld touched, %ld replaced, %ld renamed, %ld deleted,"
+    " %ld added, %ld directories moved, %ld other: %s\n",
+    counts[EDIT], counts[TOUCH], counts[REPLACE], counts[RENAME], counts[DELETE],
+    counts[ADD], moved_dirs, other, ok ? "right" : "WRONG");
+  return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+  long files = 100000;
+  double percent = 1;
+  const char *scratch = "bench_offline_scan.tmp";
+  if(argc > 1)
+    files = atol(argv[1]);
+  if(argc > 2)
+    percent = atof(argv[2]);
+  if(argc > 3)
+    scratch = argv[3];
+  if(files < 2 * FILES_PER_DIR)
+    files = 2 * FILES_PER_DIR;
+
+  char root[1024];
+  mkdir(scratch, 0755);
+  sprintf(root, "%s/Dropbox", scratch);
+  printf("making %ld files in %ld directories\n", files,
+    (files + FILES_PER_DIR - 1) / FILES_PER_DIR);
+  make_tree(root, files);
+  struct stat root_st;
+  stat(root, &root_st);
+  NodeTable known;
+  known.SetRoot(root_st.st_dev, root_st.st_ino, root);
+  save_state(&known, root, root_st.st_ino);
+
+  Expected expected;
+  change_files(root, files, percent, &expected);
+  printf("changed %.1f%%: %ld edited, %ld touched, %ld replaced, %ld renamed,"
+    " %ld deleted, %ld added, 1 directory moved\n", percent,
+    expected.counts[EDIT], expected.counts[TOUCH], expected.counts[REPLACE],
+    expected.counts[RENAME], expected.counts[DELETE], expected.counts[ADD]);
+
+  bool ok = true;
+  bool cold = false;
+  int thread_counts[] = { 1, 0 };
+  for(int t = 0; t < 2; t++)
+  {
+    cold = drop_caches();
+    OfflineScan scan;
+    double start = now();
+    int err = scan.Run(root, &known, thread_counts[t]);
+    double took = now() - start;
+    if(t == 0)
+      printf("%s caches\n", cold ? "cold" : "warm (couldn't drop the)");
+    printf("%s thread%s %8.3f s  %lu entries, %lu directories, %lu hashed\n",
+      thread_counts[t] == 1 ? "one" : "default", thread_counts[t] == 1 ? "    " : "s",
+      took, (unsigned long)scan.CountEntries(), (unsigned long)scan.CountDirectories(),
+      (unsigned long)scan.CountHashed());
+    ok = ok && err == 0 && check(&scan, &expected)
+      && scan.CountHashed() == (size_t)(expected.counts[EDIT]
+        + expected.counts[TOUCH] + expected.counts[REPLACE] + expected.counts[RENAME]);
+  }
+
+  char command[1100];
+  sprintf(command, "rm -rf %s", scratch);
+  system(command);
+  return ok ? 0 : 1;
+}
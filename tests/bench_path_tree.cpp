@@ -0,0 +1,199 @@
+/*
+* Renaming a folder of 50000 files, with the paths kept as
+* NodeTable keeps them (each record's name and a link to its
+* parent), and as the client used to keep them (a BPath per
+* entry, the full path in each) where every path under the
+* folder has to be rewritten for them to stay right.
+*
+* Then builds every path under the renamed folder from the
+* tree, as a transfer would, checks they all match the
+* rewritten ones, and compares the memory each way takes.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_path_tree bench_path_tree.cpp ../NodeTable.cpp
+*   ./bench_path_tree [file count]
+*/
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "NodeTable.h"
+
+const int FILES_PER_DIR = 200;
+const int RENAMES = 1000;
+const dev_t DEVICE = 3;
+const ino_t ROOT_NODE = 1;
+const ino_t FOLDER_NODE = 2;
+const ino_t OTHER_NODE = 3; //where it gets moved to
+const ino_t FIRST_NODE = 1000;
+const char *ROOT = "/boot/home/Dropbox";
+
+//what a BPath holds
+struct FlatPath
+{
+  char *path;
+  int32_t err;
+};
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//bytes malloc()ed and not yet freed
+static size_t
+heap_used(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#else
+  struct mallinfo info = mallinfo();
+  return (size_t)(unsigned)info.uordblks + (size_t)(unsigned)info.hblkhd;
+#endif
+}
+
+static FlatPath *
+new_flat_path(const char *path)
+{
+  FlatPath *flat = new FlatPath;
+  flat->path = strdup(path);
+  flat->err = 0;
+  return flat;
+}
+
+//the naive fix: rewrite every path under from
+static size_t
+rename_flat(FlatPath **paths, size_t count, const char *from, const char *to)
+{
+  size_t from_length = strlen(from), to_length = strlen(to), rewritten = 0;
+  for(size_t i = 0; i < count; i++)
+  {
+    char *path = paths[i]->path;
+    if(strncmp(path, from, from_length) != 0
+      || (path[from_length] != '/' && path[from_length] != '\0'))
+      continue;
+    char *moved = (char*)malloc(to_length + strlen(path + from_length) + 1);
+    memcpy(moved, to, to_length);
+    strcpy(moved + to_length, path + from_length);
+    free(path);
+    paths[i]->path = moved;
+    rewritten++;
+  }
+  return rewritten;
+}
+
+int
+main(int argc, char **argv)
+{
+  long files = 50000;
+  if(argc > 1)
+    files = atol(argv[1]);
+  long dirs = (files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+  size_t entries = 2 + dirs + files;
+  char path[1024], name[64], from[256], to[256];
+  sprintf(from, "%s/Projects", ROOT);
+  sprintf(to, "%s/Archive/Projects 2014", ROOT);
+
+  //the same tree both ways
+  size_t before = heap_used();
+  NodeTable *table = new NodeTable();
+  table->SetRoot(DEVICE, ROOT_NODE, ROOT);
+  table->Insert(DEVICE, OTHER_NODE, ROOT_NODE, "Archive")->directory = true;
+  table->Insert(DEVICE, FOLDER_NODE, ROOT_NODE, "Projects")->directory = true;
+  for(long d = 0; d < dirs; d++)
+  {
+    sprintf(name, "take%04ld", d);
+    table->Insert(DEVICE, FIRST_NODE + d, FOLDER_NODE, name)->directory = true;
+  }
+  for(long i = 0; i < files; i++)
+  {
+    sprintf(name, "track%07ld.wav", i);
+    table->Insert(DEVICE, FIRST_NODE + dirs + i, FIRST_NODE + i / FILES_PER_DIR, name);
+  }
+  size_t tree_bytes = heap_used() - before;
+
+  before = heap_used();
+  FlatPath **flat = (FlatPath**)malloc(entries * sizeof(FlatPath*));
+  size_t n = 0;
+  sprintf(path, "%s/Archive", ROOT);
+  flat[n++] = new_flat_path(path);
+  flat[n++] = new_flat_path(from);
+  for(long d = 0; d < dirs; d++)
+  {
+    sprintf(path, "%s/take%04ld", from, d);
+    flat[n++] = new_flat_path(path);
+  }
+  for(long i = 0; i < files; i++)
+  {
+    sprintf(path, "%s/take%04ld/track%07ld.wav", from, i / FILES_PER_DIR, i);
+    flat[n++] = new_flat_path(path);
+  }
+  size_t flat_bytes = heap_used() - before;
+
+  //back and forth, so every rename has the same work to do
+  double start = now();
+  for(int r = 0; r < RENAMES; r++)
+  {
+    if(r % 2 == 0)
+      table->Insert(DEVICE, FOLDER_NODE, OTHER_NODE, "Projects 2014");
+    else
+      table->Insert(DEVICE, FOLDER_NODE, ROOT_NODE, "Projects");
+  }
+  double tree_rename = (now() - start) / RENAMES;
+
+  int flat_renames = RENAMES / 100;
+  size_t rewritten = 0;
+  start = now();
+  for(int r = 0; r < flat_renames; r++)
+  {
+    if(r % 2 == 0)
+      rewritten = rename_flat(flat, n, from, to);
+    else
+      rename_flat(flat, n, to, from);
+  }
+  double flat_rename = (now() - start) / flat_renames;
+
+  //the last rename of each was back, so move both once more
+  table->Insert(DEVICE, FOLDER_NODE, OTHER_NODE, "Projects 2014");
+  rename_flat(flat, n, from, to);
+
+  //every path under the folder, built when a transfer wants it
+  bool same = true;
+  start = now();
+  for(size_t i = 1; i < n; i++)
+  {
+    ino_t node = i == 1 ? FOLDER_NODE : FIRST_NODE + (i - 2);
+    const NodeRecord *record = table->Find(DEVICE, node);
+    if(record == NULL || !table->GetPath(record, path, sizeof(path))
+      || strcmp(path, flat[i]->path) != 0)
+      same = false;
+  }
+  double build = (now() - start) / (n - 1);
+
+  printf("%ld files in %ld folders under %s\n", files, dirs, from);
+  printf("rename it, path tree      %12.1f ns\n", tree_rename * 1e9);
+  printf("rename it, BPath per entry %11.1f ns  (%lu paths rewritten)\n",
+    flat_rename * 1e9, (unsigned long)rewritten);
+  printf("build one path from the tree %9.1f ns\n", build * 1e9);
+  printf("memory, path tree         %8.1f MB  %5.1f bytes per entry\n",
+    tree_bytes / 1048576.0, (double)tree_bytes / entries);
+  printf("memory, BPath per entry   %8.1f MB  %5.1f bytes per entry\n",
+    flat_bytes / 1048576.0, (double)flat_bytes / entries);
+  printf("every path the same after the rename: %s\n", same ? "yes" : "NO");
+
+  for(size_t i = 0; i < n; i++)
+  {
+    free(flat[i]->path);
+    delete flat[i];
+  }
+  free(flat);
+  delete table;
+  return same && tree_bytes < flat_bytes ? 0 : 1;
+}
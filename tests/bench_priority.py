@@ -0,0 +1,166 @@
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import tempfile
+import time
+
+from bench_suite import Daemon, SOURCE, local_check, percentile, \
+    server_check, wait_for
+from fake_dropbox_server import start_server
+
+# How long small files take to get to the other side while big ones are
+# going, with transfers ranked by size (TransferPriority.h) and first come
+# first served (DBFORHAIKU_PRIORITY=fifo).  For each order, hdbsync (see
+# bench_suite.py) is given a few big recordings and then a lot of small
+# files at once, written into the folder to be uploaded, and then put on
+# the server to be downloaded.  Reports the p50 and p99 of the small files'
+# time to get there, when the last big one did, and how often a big
+# transfer was paused to let small ones past.
+#
+# usage: python bench_priority.py [--big 6] [--big-mb 36] [--small 200]
+#            [--rate 4096] [--transfers 4] ...  (--help lists them all)
+
+ORDERS = ['fifo', 'priority']
+
+def big_data(name, megabytes, block):
+    return name.ljust(64) + block * megabytes
+
+def plan(args, prefix):
+    """The big files and the small ones, each a list of (path, data)."""
+    chooser = random.Random(args.seed)
+    block = os.urandom(1024 * 1024)
+    big = [('%sbig_%d.ogg' % (prefix, i),
+        big_data('%s %d' % (prefix, i), args.big_mb, block))
+        for i in range(args.big)]
+    small = [('%ssmall_%03d.m3u' % (prefix, i),
+        os.urandom(chooser.randint(1024, args.small_kb * 1024)))
+        for i in range(args.small)]
+    return big, small
+
+def summary(direction, big, small, started, done, paused):
+    times = [done[path] - started[path] for path, data in small
+        if path in done]
+    big_done = [done[path] - started[path] for path, data in big
+        if path in done]
+    return {
+        'direction': direction,
+        'small_p50': percentile(times, 0.5),
+        'small_p99': percentile(times, 0.99),
+        'small_done': len(times),
+        'last_big': max(big_done) if len(big_done) == len(big) else None,
+        'paused': paused,
+    }
+
+def paused_count(daemon, op):
+    with open(daemon.log_path) as f:
+        return sum(1 for line in f if line.startswith('[%s paused]' % op))
+
+def uploads(daemon, db, args):
+    big, small = plan(args, 'up_')
+    started = {}
+    for path, data in big + small:
+        with open(os.path.join(daemon.root, path), 'wb') as f:
+            f.write(data)
+        started[path] = time.time()
+    contents = dict(big + small)
+    done = wait_for(daemon, set(contents), server_check(db, contents),
+        args.timeout)
+    return summary('upload', big, small, started, done,
+        paused_count(daemon, 'put'))
+
+def downloads(daemon, db, args):
+    big, small = plan(args, 'down_')
+    started = {}
+    #all in one go, so they come in one delta page (the next page
+    #isn't pulled until this one's downloads are done)
+    with db.lock:
+        for path, data in big + small:
+            db.put_file('/' + path, data, {}, False)
+            started[path] = db.change_times['/' + path.lower()]
+    sizes = dict((path, len(data)) for path, data in big + small)
+    done = wait_for(daemon, set(sizes), local_check(daemon, sizes),
+        args.timeout)
+    return summary('download', big, small, started, done,
+        paused_count(daemon, 'get'))
+
+def run(order, args):
+    server = start_server(latency=args.latency, stream_rate=args.rate * 1024)
+    scratch = tempfile.mkdtemp()
+    daemon = Daemon(scratch, server, args.transfers, args.quiet_ms)
+    daemon.env['DBFORHAIKU_CHUNK_KB'] = str(args.chunk_kb)
+    if order == 'fifo':
+        daemon.env['DBFORHAIKU_PRIORITY'] = 'fifo'
+    results = []
+    try:
+        daemon.start()
+        time.sleep(1)
+        results.append(uploads(daemon, server.db, args))
+        results.append(downloads(daemon, server.db, args))
+    finally:
+        daemon.stop()
+        server.shutdown()
+        shutil.rmtree(scratch)
+    return results
+
+def seconds(value):
+    return '%8s' % '-' if value is None else '%6.2f s' % value
+
+def main(args):
+    if not args.no_build:
+        subprocess.check_call(['make', '-s', '-C', SOURCE, 'core-daemon'])
+    print '%d files of %d MB, then %d of up to %d KB, %d transfers at once, ' \
+        '%d KB/s per connection, %d KB chunks' % (args.big, args.big_mb,
+        args.small, args.small_kb, args.transfers, args.rate, args.chunk_kb)
+    print '%-9s %-9s %9s %9s %9s %7s' % ('order', '', 'small p50',
+        'small p99', 'last big', 'paused')
+    results = {}
+    for order in ORDERS:
+        results[order] = run(order, args)
+        for result in results[order]:
+            print '%-9s %-9s %s  %s  %s %7d' % (order, result['direction'],
+                seconds(result['small_p50']), seconds(result['small_p99']),
+                seconds(result['last_big']), result['paused'])
+
+    ok = True
+    for fifo, ranked in zip(results['fifo'], results['priority']):
+        sooner = ranked['small_done'] == args.small and \
+            fifo['small_p50'] is not None and \
+            ranked['small_p50'] < fifo['small_p50'] and \
+            ranked['small_p99'] < fifo['small_p99']
+        print 'check: small %ss get there sooner than first come first ' \
+            'served: %s' % (ranked['direction'], 'yes' if sooner else 'NO')
+        finished = ranked['last_big'] is not None
+        print 'check: big %ss still get there: %s' % (ranked['direction'],
+            'yes' if finished else 'NO')
+        ok = ok and sooner and finished
+    print 'check: all: %s' % ('yes' if ok else 'NO')
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Time to sync of small '
+        'files behind big ones, ranked and first come first served.')
+    parser.add_argument('--big', type=int, default=6,
+        help='big files, ahead of the small ones')
+    parser.add_argument('--big-mb', type=int, default=36,
+        help='MB in each big file')
+    parser.add_argument('--small', type=int, default=200)
+    parser.add_argument('--small-kb', type=int, default=64,
+        help='the most KB in a small file')
+    parser.add_argument('--rate', type=int, default=4096,
+        help='KB/s each connection can send')
+    parser.add_argument('--latency', type=float, default=0.02,
+        help='seconds added to every request')
+    parser.add_argument('--transfers', type=int, default=4,
+        help='DBFORHAIKU_TRANSFERS for hdbsync')
+    parser.add_argument('--chunk-kb', type=int, default=1024,
+        help='DBFORHAIKU_CHUNK_KB for the workers')
+    parser.add_argument('--quiet-ms', type=int, default=500,
+        help='DBFORHAIKU_QUIET_MS for hdbsync')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--timeout', type=float, default=300)
+    parser.add_argument('--no-build', action='store_true')
+    return parser.parse_args()
+
+if __name__ == '__main__':
+    main(parse_args())
@@ -0,0 +1,191 @@
+/*
+* Counts the uploads (and bytes uploaded) for a scripted
+* workload of files being written in chunks, re-tagged,
+* touched and chmodded, comparing uploading on every
+* B_STAT_CHANGED (what the client used to do) with
+* waiting for each file to go quiet in a QuietQueue and
+* skipping files whose size and mtime, or else content,
+* haven't changed since Dropbox last got them.
+* The sizes and mtimes count as unchanged only when the
+* mtime was old enough to trust, like in HaikuDropbox.cpp.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_quiet_queue bench_quiet_queue.cpp ../QuietQueue.cpp
+*   ./bench_quiet_queue [quiet time in ms]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "QuietQueue.h"
+
+const int FILES = 8;
+const int64_t FILE_SIZE = 8 * 1024 * 1024;
+const int64_t CHUNK = 128 * 1024;
+const int64_t CHUNK_GAP = 20000; //microseconds between chunk writes
+const dev_t DEVICE = 3;
+const int MAX_EVENTS = 4096;
+const int64_t RACY_MTIME = 2; //as in HaikuDropbox.cpp
+
+//a B_STAT_CHANGED, and what the file looks like just after it
+struct Event
+{
+  int64_t when;
+  int file;
+  int64_t size;
+  int64_t mtime; //seconds
+  int content; //bumped whenever the bytes change
+};
+
+struct FileState
+{
+  int64_t size;
+  int64_t mtime;
+  int content;
+  int64_t synced_size;
+  int64_t synced_mtime;
+  int synced_content;
+};
+
+static Event events[MAX_EVENTS];
+static int event_count = 0;
+
+static void
+add_event(int64_t when, int file, int64_t size, int64_t mtime, int content)
+{
+  Event *e = &events[event_count++];
+  e->when = when;
+  e->file = file;
+  e->size = size;
+  e->mtime = mtime;
+  e->content = content;
+}
+
+/*
+* Copy the files in one after another, a chunk at a time,
+* then re-tag them (three same-sized rewrites of the header),
+* touch them, and chmod them.
+*/
+static void
+script(void)
+{
+  int64_t t = 0;
+  int content[FILES] = {0};
+  for(int f = 0; f < FILES; f++)
+  {
+    for(int64_t size = CHUNK; size <= FILE_SIZE; size += CHUNK)
+    {
+      add_event(t, f, size, t / 1000000, ++content[f]);
+      t += CHUNK_GAP;
+    }
+  }
+  t += 20000000;
+  for(int f = 0; f < FILES; f++)
+  {
+    for(int i = 0; i < 3; i++)
+    {
+      add_event(t, f, FILE_SIZE, t / 1000000, ++content[f]);
+      t += 100000;
+    }
+  }
+  t += 20000000;
+  for(int f = 0; f < FILES; f++)
+    add_event(t + f * 1000, f, FILE_SIZE, t / 1000000, content[f]);
+  t += 20000000;
+  for(int f = 0; f < FILES; f++)
+    add_event(t + f * 1000, f, FILE_SIZE, -1, content[f]); //-1: mtime unchanged
+}
+
+static void
+every_change(void)
+{
+  long uploads = 0, partial = 0;
+  int64_t bytes = 0;
+  for(int i = 0; i < event_count; i++)
+  {
+    uploads++;
+    bytes += events[i].size;
+    if(events[i].size < FILE_SIZE)
+      partial++;
+  }
+  printf("%-22s %6ld uploads %9.1f MB  (%ld of files still being written)\n",
+    "upload every change", uploads, bytes / 1e6, partial);
+}
+
+static void
+when_quiet(int64_t quiet)
+{
+  FileState files[FILES];
+  for(int f = 0; f < FILES; f++)
+  {
+    files[f].size = files[f].mtime = 0;
+    files[f].content = 0;
+    files[f].synced_size = files[f].synced_mtime = -1;
+    files[f].synced_content = -1;
+  }
+
+  QuietQueue queue;
+  long uploads = 0, partial = 0, same_stat = 0, same_content = 0;
+  int64_t bytes = 0;
+  for(int i = 0; i <= event_count; i++)
+  {
+    //catch up on the checks due before this event (or all of them at the end)
+    int64_t now = i < event_count ? events[i].when : INT64_MAX;
+    dev_t device;
+    ino_t node;
+    while(queue.NextDue(quiet) >= 0 && queue.NextDue(quiet) <= now)
+    {
+      int64_t due = queue.NextDue(quiet);
+      while(queue.PopQuiet(due, quiet, &device, &node))
+      {
+        FileState *file = &files[node];
+        if(file->size == file->synced_size && file->mtime == file->synced_mtime)
+          same_stat++;
+        else if(file->content == file->synced_content)
+          same_content++; //hashed, but not sent
+        else
+        {
+          uploads++;
+          bytes += file->size;
+          if(file->size < FILE_SIZE)
+            partial++;
+        }
+        file->synced_size = file->size;
+        file->synced_mtime = file->mtime;
+        if(file->mtime > due / 1000000 - RACY_MTIME)
+          file->synced_mtime = -1; //could change again within the second
+        file->synced_content = file->content;
+      }
+    }
+    if(i == event_count)
+      break;
+
+    FileState *file = &files[events[i].file];
+    file->size = events[i].size;
+    if(events[i].mtime >= 0)
+      file->mtime = events[i].mtime;
+    file->content = events[i].content;
+    queue.Touch(DEVICE, events[i].file, events[i].when);
+  }
+  char name[64];
+  sprintf(name, "quiet for %lld ms", (long long)(quiet / 1000));
+  printf("%-22s %6ld uploads %9.1f MB  (%ld of files still being written)\n",
+    name, uploads, bytes / 1e6, partial);
+  printf("%-22s %6ld skipped by size and mtime, %ld by content_hash\n",
+    "", same_stat, same_content);
+}
+
+int
+main(int argc, char **argv)
+{
+  int64_t quiet = 2000000;
+  if(argc > 1)
+    quiet = atoll(argv[1]) * 1000;
+  script();
+  printf("%d files of %lld MB written in %lld KB chunks, then re-tagged, "
+    "touched and chmodded: %d stat changes\n", FILES,
+    (long long)(FILE_SIZE >> 20), (long long)(CHUNK >> 10), event_count);
+  every_change();
+  when_quiet(quiet);
+  return 0;
+}
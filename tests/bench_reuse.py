@@ -0,0 +1,142 @@
+import argparse
+import os
+import random
+import shutil
+import subprocess
+import tempfile
+import time
+
+from bench_suite import Daemon, SOURCE, counters, local_check, wait_for
+from fake_dropbox_server import start_server
+
+# Bytes downloaded for a delta full of files with the same contents, with
+# files already here copied rather than downloaded again (ContentIndex.h)
+# and with DBFORHAIKU_REUSE=0.  For each, hdbsync (see bench_suite.py) is
+# sent a set of jingles in every station's folder at once, and then one
+# more station's folder of the same jingles.  Reports the bytes the server
+# sent for each, the bytes that saved, how long it took and what hdbsync's
+# status said it reused.
+#
+# usage: python bench_reuse.py [--jingles 20] [--stations 10]
+#            [--jingle-kb 512] [--rate 4096] ...  (--help lists them all)
+
+MODES = ['download', 'reuse']
+
+def jingles(args):
+    """The contents every station has, as (name, data)."""
+    chooser = random.Random(args.seed)
+    return [('jingle_%02d.ogg' % i, os.urandom(chooser.randint(
+        args.jingle_kb * 512, args.jingle_kb * 1024)))
+        for i in range(args.jingles)]
+
+def put_stations(daemon, db, first, count, files, timeout):
+    """Put count stations' folders of files on the server all in one go
+    (so they come in one delta page), wait for them to be here.  Returns
+    the seconds that took, the bytes downloaded and whether they all got
+    here intact."""
+    contents = dict(('station_%02d/%s' % (station, name), data)
+        for station in range(first, first + count) for name, data in files)
+    before = counters(db)['download_bytes']
+    start = time.time()
+    with db.lock:
+        for path, data in contents.items():
+            db.put_file('/' + path, data, {}, False)
+    sizes = dict((path, len(data)) for path, data in contents.items())
+    done = wait_for(daemon, set(sizes), local_check(daemon, sizes, contents),
+        timeout)
+    elapsed = time.time() - start
+    return {
+        'seconds': elapsed,
+        'downloaded': counters(db)['download_bytes'] - before,
+        'intact': len(done) == len(contents),
+    }
+
+def reused_line(daemon):
+    for line in (daemon.status() or '').splitlines():
+        if line.startswith('reused: '):
+            return line[len('reused: '):]
+    return 'nothing'
+
+def run(mode, args, files):
+    server = start_server(latency=args.latency, stream_rate=args.rate * 1024)
+    scratch = tempfile.mkdtemp()
+    daemon = Daemon(scratch, server, args.transfers, args.quiet_ms)
+    if mode == 'download':
+        daemon.env['DBFORHAIKU_REUSE'] = '0'
+    results = []
+    try:
+        daemon.start()
+        time.sleep(1)
+        results.append(put_stations(daemon, server.db, 0, args.stations,
+            files, args.timeout))
+        results.append(put_stations(daemon, server.db, args.stations, 1,
+            files, args.timeout))
+        results.append(reused_line(daemon))
+    finally:
+        daemon.stop()
+        server.shutdown()
+        shutil.rmtree(scratch)
+    return results
+
+def megabytes(count):
+    return '%8.1f MB' % (count / 1e6)
+
+def main(args):
+    if not args.no_build:
+        subprocess.check_call(['make', '-s', '-C', SOURCE, 'core-daemon'])
+    files = jingles(args)
+    unique = sum(len(data) for name, data in files)
+    print '%d jingles (%.1f MB) in each of %d stations, then one more ' \
+        'station, %d KB/s per connection' % (args.jingles, unique / 1e6,
+        args.stations, args.rate)
+    print '%-9s %-14s %11s %11s %9s' % ('', '', 'downloaded', 'saved',
+        'seconds')
+    results = {}
+    for mode in MODES:
+        results[mode] = run(mode, args, files)
+        for stage, result, stations in zip(('stations', 'one more'),
+                results[mode][:2], (args.stations, 1)):
+            print '%-9s %-14s %s %s %9.2f' % (mode, stage,
+                megabytes(result['downloaded']),
+                megabytes(unique * stations - result['downloaded']),
+                result['seconds'])
+        print '%-9s status says reused: %s' % (mode, results[mode][2])
+
+    reuse, download = results['reuse'], results['download']
+    intact = all(result['intact'] for mode in MODES
+        for result in results[mode][:2])
+    print 'check: every file got here intact: %s' % ('yes' if intact
+        else 'NO')
+    once = reuse[0]['downloaded'] < download[0]['downloaded'] and \
+        reuse[0]['downloaded'] < unique * 2
+    print 'check: the same contents are only downloaded once: %s' % (
+        'yes' if once else 'NO')
+    none = reuse[1]['downloaded'] == 0
+    print 'check: contents already here are not downloaded: %s' % (
+        'yes' if none else 'NO')
+    print 'check: all: %s' % ('yes' if intact and once and none else 'NO')
+
+def parse_args():
+    parser = argparse.ArgumentParser(description='Bytes downloaded for '
+        'files with the same contents, reused and downloaded each time.')
+    parser.add_argument('--jingles', type=int, default=20,
+        help='different files in each station')
+    parser.add_argument('--stations', type=int, default=10,
+        help='folders with the same files in the first delta')
+    parser.add_argument('--jingle-kb', type=int, default=512,
+        help='the most KB in a jingle')
+    parser.add_argument('--rate', type=int, default=4096,
+        help='KB/s each connection can send')
+    parser.add_argument('--latency', type=float, default=0.02,
+        help='seconds added to every request')
+    parser.add_argument('--transfers', type=int, default=4,
+        help='DBFORHAIKU_TRANSFERS for hdbsync')
+    parser.add_argument('--quiet-ms', type=int, default=500,
+        help='DBFORHAIKU_QUIET_MS for hdbsync')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--timeout', type=float, default=300)
+    parser.add_argument('--no-build', action='store_true')
+    return parser.parse_args()
+
+if __name__ == '__main__':
+    main(parse_args())
@@ -0,0 +1,439 @@
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+from fake_dropbox_server import start_server
+from tree_gen import Contents, fill_server, plan_tree, total_size, write_tree
+
+# End to end benchmarks of the sync engine: hdbsync (the engine as a Linux
+# program, "make core-daemon") syncing a scratch folder with the stand-in
+# server, which adds a round trip time to every request, limits how fast
+# each connection sends, and can turn requests away or cut them off.  Runs,
+# in turn, on one hdbsync:
+#
+#   initial  - a tree already on the server, synced into an empty folder
+#   import   - a tree copied into the folder, uploaded
+#   storm    - a few files saved over and over, uploaded once they settle
+#   delta    - a tree appearing on the server at once, downloaded
+#
+# and reports for each the files a second, the p50 and p99 time for a file
+# to get to the other side (from the start for the initial sync, from the
+# file being written or put on the server for the others), the peak memory
+# of hdbsync and of its workers, how many workers were started, how long
+# hdbsync took to answer a status query (asked every time the files are
+# checked), and what the server saw.  A scenario that doesn't finish in time says how much of
+# it did.  --json writes all of that to a file.
+#
+# usage: python bench_suite.py [--files N] [--sizes audio] [--latency 0.02]
+#            [--rate KB/s] [--errors 0.01] [--json out.json] ...
+#        (--help lists them all)
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.dirname(TESTS)
+DAEMON = os.path.join(SOURCE, 'object-core', 'hdbsync')
+WORKER_SCRIPTS = ['db_worker.py', 'db_api.py', 'db_throttle.py']
+SCENARIOS = ['initial', 'import', 'storm', 'delta']
+SERVER_COUNTERS = ['requests', 'connections', 'uploads', 'upload_bytes',
+    'download_bytes', 'sent_bytes', 'dropped', 'errors']
+
+def percentile(values, fraction):
+    """The nearest-rank percentile, None for no values."""
+    if not values:
+        return None
+    ordered = sorted(values)
+    rank = int(round(fraction * (len(ordered) - 1)))
+    return ordered[rank]
+
+def proc_kb(pid, field):
+    """A VmRSS or VmHWM line of /proc/<pid>/status, in KB."""
+    try:
+        with open('/proc/%d/status' % pid) as f:
+            for line in f:
+                if line.startswith(field + ':'):
+                    return int(line.split()[1])
+    except IOError:
+        pass
+    return 0
+
+def children(pid):
+    found = []
+    for entry in os.listdir('/proc'):
+        if not entry.isdigit():
+            continue
+        try:
+            with open('/proc/%s/stat' % entry) as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+        except IOError:
+            continue
+        if int(fields[1]) == pid:
+            found.append(int(entry))
+    return found
+
+class Daemon(object):
+    """hdbsync, run from a scratch directory with its own copy of the worker
+    scripts and a dummy token, its log going to a file."""
+    def __init__(self, scratch, server, transfers, quiet_ms):
+        self.work = os.path.join(scratch, 'work')
+        self.home = os.path.join(scratch, 'home')
+        self.root = os.path.join(self.home, 'Dropbox')
+        os.makedirs(self.work)
+        os.makedirs(self.root)
+        for script in WORKER_SCRIPTS:
+            shutil.copy(os.path.join(SOURCE, script), self.work)
+        with open(os.path.join(self.work, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        # The workers are run as "python", which has to be this Python.
+        bin_dir = os.path.join(scratch, 'bin')
+        os.makedirs(bin_dir)
+        os.symlink(sys.executable, os.path.join(bin_dir, 'python'))
+        env = dict(os.environ)
+        env['PATH'] = bin_dir + os.pathsep + env.get('PATH', '')
+        env['HOME'] = self.home
+        env['DBFORHAIKU_SERVER'] = server.url
+        env['DBFORHAIKU_TRANSFERS'] = str(transfers)
+        env['DBFORHAIKU_QUIET_MS'] = str(quiet_ms)
+        self.env = env
+        self.log_path = os.path.join(scratch, 'hdbsync.log')
+        # Appended to, by hdbsync and by its workers (which can outlive it
+        # a moment), so a restart doesn't write over what's there.
+        self.log = open(self.log_path, 'a')
+        self.process = None
+        self.worker_peak_kb = 0
+        self.rss_peak_kb = 0
+        self.status_times = []
+
+    def start(self):
+        if self.log.closed:
+            self.log = open(self.log_path, 'a')
+        self.process = subprocess.Popen([DAEMON], cwd=self.work,
+            env=self.env, stdout=self.log, stderr=self.log)
+
+    def spawns(self):
+        with open(self.log_path) as f:
+            return sum(1 for line in f
+                if line.startswith('Started Dropbox worker'))
+
+    def sample(self):
+        """Note the memory hdbsync and its workers have now."""
+        if self.process is None:
+            return
+        own = proc_kb(self.process.pid, 'VmRSS')
+        workers = sum(proc_kb(child, 'VmRSS')
+            for child in children(self.process.pid))
+        self.rss_peak_kb = max(self.rss_peak_kb, own)
+        self.worker_peak_kb = max(self.worker_peak_kb, workers)
+        start = time.time()
+        if self.status() is not None:
+            self.status_times.append(time.time() - start)
+
+    def status(self):
+        """What hdbsync says it's doing, as hdbstatus would print it, None
+        if it doesn't answer."""
+        client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        client.settimeout(5)
+        try:
+            client.connect(os.path.join(self.work, 'sync_status.sock'))
+            pieces = []
+            while True:
+                piece = client.recv(4096)
+                if not piece:
+                    return ''.join(pieces)
+                pieces.append(piece)
+        except socket.error:
+            return None
+        finally:
+            client.close()
+
+    def reset_peaks(self):
+        self.worker_peak_kb = 0
+        self.rss_peak_kb = 0
+        self.status_times = []
+
+    def alive(self):
+        return self.process is not None and self.process.poll() is None
+
+    def stop(self):
+        high_water = 0
+        if self.alive():
+            high_water = proc_kb(self.process.pid, 'VmHWM')
+            self.process.send_signal(signal.SIGTERM)
+            deadline = time.time() + 10
+            while self.alive() and time.time() < deadline:
+                time.sleep(0.05)
+            if self.alive():
+                self.process.kill()
+            self.process.wait()
+        self.log.close()
+        return high_water
+
+def wait_for(daemon, pending, check, timeout):
+    """Call check(path) for each pending path every so often until each has
+    said when it got there (a time, rather than None) or the time's up.
+    Returns the times by path."""
+    done = {}
+    deadline = time.time() + timeout
+    while pending and time.time() < deadline and daemon.alive():
+        daemon.sample()
+        for path in list(pending):
+            when = check(path)
+            if when is not None:
+                done[path] = when
+                pending.discard(path)
+        if pending:
+            time.sleep(0.02)
+    daemon.sample()
+    return done
+
+def local_check(daemon, sizes, contents=None):
+    """A check for a planned file being in the folder in full (or with the
+    given contents), seen now."""
+    def check(path):
+        local = os.path.join(daemon.root, *path.split('/'))
+        try:
+            if os.path.getsize(local) != sizes[path]:
+                return None
+            if contents is not None:
+                with open(local, 'rb') as f:
+                    if f.read() != contents[path]:
+                        return None
+        except (IOError, OSError):
+            return None
+        return time.time()
+    return check
+
+def server_check(db, contents):
+    """A check for a planned file being on the server at "/<path>" with
+    the given contents, as of when the server last changed it."""
+    def check(path):
+        key = '/' + path.lower()
+        with db.lock:
+            entry = db.entries.get(key)
+            if entry is not None and entry.get('data') == contents[path]:
+                return db.change_times.get(key, time.time())
+        return None
+    return check
+
+def counters(db):
+    with db.lock:
+        return dict((name, getattr(db, name)) for name in SERVER_COUNTERS)
+
+class Scenario(object):
+    """Collects what one scenario did into its report."""
+    def __init__(self, name, daemon, db, plan):
+        self.name = name
+        self.daemon = daemon
+        self.db = db
+        self.plan = plan
+        self.daemon.reset_peaks()
+        self.spawns = daemon.spawns()
+        self.server = counters(db)
+        self.start = time.time()
+
+    def report(self, latencies, extra={}):
+        """latencies is each finished file's time to get there."""
+        elapsed = max(time.time() - self.start, 1e-6)
+        finished = len(latencies)
+        now = counters(self.db)
+        finished_bytes = total_size(self.plan) * finished / \
+            max(len(self.plan), 1)
+        result = {
+            'files': len(self.plan),
+            'bytes': total_size(self.plan),
+            'completed': float(finished) / max(len(self.plan), 1),
+            'seconds': elapsed,
+            'files_per_second': finished / elapsed,
+            'mb_per_second': finished_bytes / elapsed / 1e6,
+            'latency_p50': percentile(latencies, 0.5),
+            'latency_p99': percentile(latencies, 0.99),
+            'daemon_rss_peak_kb': self.daemon.rss_peak_kb,
+            'worker_rss_peak_kb': self.daemon.worker_peak_kb,
+            'worker_spawns': self.daemon.spawns() - self.spawns,
+            'status_p99_ms': 1000 * (percentile(self.daemon.status_times,
+                0.99) or 0),
+            'server': dict((name, now[name] - self.server[name])
+                for name in SERVER_COUNTERS),
+        }
+        result.update(extra)
+        def seconds(value):
+            return '-' if value is None else '%.3f s' % value
+        print '%-8s %5d files %6.1f%% done in %7.2f s  %8.1f files/s ' \
+            '%7.2f MB/s  p50 %s  p99 %s  %d spawns  status p99 %.1f ms' % (
+            self.name, len(self.plan), 100 * result['completed'], elapsed,
+            result['files_per_second'], result['mb_per_second'],
+            seconds(result['latency_p50']), seconds(result['latency_p99']),
+            result['worker_spawns'], result['status_p99_ms'])
+        for name, value in sorted(extra.items()):
+            print '         %s: %s' % (name, value)
+        return result
+
+def initial_sync(daemon, db, args, contents):
+    """Everything on the server before hdbsync starts, nothing local."""
+    plan = plan_tree(args.files, args.depth, args.fan_out, args.sizes,
+        args.seed, 'initial')
+    fill_server(db, plan, contents)
+    scenario = Scenario('initial', daemon, db, plan)
+    daemon.start()
+    sizes = dict(plan)
+    done = wait_for(daemon, set(sizes), local_check(daemon, sizes),
+        args.timeout)
+    return scenario.report([when - scenario.start for when in done.values()])
+
+def bulk_import(daemon, db, args, contents):
+    """A tree copied into the folder, file by file."""
+    plan = plan_tree(args.files, args.depth, args.fan_out, args.sizes,
+        args.seed + 1, 'import')
+    scenario = Scenario('import', daemon, db, plan)
+    written = {}
+    data = {}
+    for path, size in plan:
+        data[path] = contents.data(path, size)
+        write_tree(daemon.root, [(path, size)], contents)
+        written[path] = time.time()
+    done = wait_for(daemon, set(data), server_check(db, data), args.timeout)
+    return scenario.report([when - written[path]
+        for path, when in done.items()])
+
+def edit_storm(daemon, db, args, contents):
+    """A few files saved over and over, faster than the quiet time, as an
+    editor with autosave (or a recording being written) does."""
+    plan = plan_tree(args.storm_files, 0, 0, 'fixed:%d' % args.storm_size,
+        args.seed + 2, 'storm')
+    data = dict((path, contents.data(path, size)) for path, size in plan)
+    write_tree(daemon.root, plan, contents)
+    wait_for(daemon, set(data), server_check(db, data), args.timeout)
+
+    scenario = Scenario('storm', daemon, db, plan)
+    last_write = {}
+    for edit in range(1, args.storm_edits + 1):
+        for path, size in plan:
+            data[path] = contents.data(path, size, edit)
+            with open(os.path.join(daemon.root, *path.split('/')), 'wb') as f:
+                f.write(data[path])
+            last_write[path] = time.time()
+        time.sleep(args.storm_interval)
+    done = wait_for(daemon, set(data), server_check(db, data), args.timeout)
+    uploads = counters(db)['uploads'] - scenario.server['uploads']
+    edits = len(plan) * args.storm_edits
+    return scenario.report([max(0.0, when - last_write[path])
+        for path, when in done.items()],
+        {'edits': edits, 'coalescing': float(edits) / max(uploads, 1)})
+
+def large_delta(daemon, db, args, contents):
+    """A tree appearing on the server all at once, while hdbsync waits."""
+    plan = plan_tree(args.files, args.depth, args.fan_out, args.sizes,
+        args.seed + 3, 'delta')
+    scenario = Scenario('delta', daemon, db, plan)
+    fill_server(db, plan, contents)
+    with db.lock:
+        put_at = dict((path, db.change_times['/' + path.lower()])
+            for path, size in plan)
+    sizes = dict(plan)
+    done = wait_for(daemon, set(sizes), local_check(daemon, sizes),
+        args.timeout)
+    return scenario.report([when - put_at[path]
+        for path, when in done.items()])
+
+def main(args):
+    if not args.no_build:
+        subprocess.check_call(['make', '-s', '-C', SOURCE, 'core-daemon'])
+    server = start_server(latency=args.latency,
+        stream_rate=args.rate * 1024, drop_rate=args.drops,
+        error_rate=args.errors)
+    scratch = tempfile.mkdtemp()
+    contents = Contents(args.seed)
+    print '%d files (%s, %d deep, %d across), %.0f ms round trip, %s per ' \
+        'connection, %.1f%% dropped, %.1f%% turned away' % (args.files,
+        args.sizes, args.depth, args.fan_out, args.latency * 1000,
+        '%d KB/s' % args.rate if args.rate else 'no limit',
+        args.drops * 100, args.errors * 100)
+
+    names = args.scenarios.split(',')
+    for name in names:
+        if name not in SCENARIOS:
+            raise ValueError('unknown scenario ' + name)
+    run = {'initial': initial_sync, 'import': bulk_import,
+        'storm': edit_storm, 'delta': large_delta}
+    daemon = Daemon(scratch, server, args.transfers, args.quiet_ms)
+    results = {}
+    try:
+        # The initial sync starts hdbsync itself, once the server has the
+        # tree.  Otherwise give it a moment to catch up with the empty one.
+        if names[0] != 'initial':
+            daemon.start()
+            time.sleep(1)
+        for name in names:
+            if name != 'initial' and not daemon.alive():
+                print '%s: hdbsync is not running, see %s' % (name,
+                    daemon.log_path)
+                break
+            results[name] = run[name](daemon, server.db, args, contents)
+    finally:
+        high_water = daemon.stop()
+        server.shutdown()
+    report = {
+        'settings': dict(vars(args)),
+        'scenarios': results,
+        'daemon_rss_high_water_kb': high_water,
+        'worker_spawns': daemon.spawns(),
+    }
+    print 'hdbsync peak memory %d KB, %d workers started' % (high_water,
+        report['worker_spawns'])
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+        print 'wrote', args.json
+    if args.keep:
+        print 'left the scratch files in', scratch
+    else:
+        shutil.rmtree(scratch)
+
+def parse_args(argv):
+    parser = argparse.ArgumentParser(
+        description='End to end benchmarks of hdbsync and the stand-in server.')
+    parser.add_argument('--files', type=int, default=500,
+        help='files in each tree')
+    parser.add_argument('--depth', type=int, default=3,
+        help='how deep the folders go')
+    parser.add_argument('--fan-out', type=int, default=4,
+        help='folders in each folder')
+    parser.add_argument('--sizes', default='lognormal:16384:1.5',
+        help='file sizes (fixed:N, uniform:A:B, lognormal:MEDIAN:SIGMA '
+        'or audio)')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--latency', type=float, default=0.02,
+        help='seconds added to every request')
+    parser.add_argument('--rate', type=int, default=0,
+        help='KB/s each connection can send, 0 for no limit')
+    parser.add_argument('--drops', type=float, default=0.0,
+        help='chance of a request being cut off')
+    parser.add_argument('--errors', type=float, default=0.0,
+        help='chance of a request getting a 429 or 503')
+    parser.add_argument('--transfers', type=int, default=4,
+        help='DBFORHAIKU_TRANSFERS for hdbsync')
+    parser.add_argument('--quiet-ms', type=int, default=200,
+        help='DBFORHAIKU_QUIET_MS for hdbsync')
+    parser.add_argument('--storm-files', type=int, default=10)
+    parser.add_argument('--storm-edits', type=int, default=20)
+    parser.add_argument('--storm-interval', type=float, default=0.05,
+        help='seconds between rounds of edits')
+    parser.add_argument('--storm-size', type=int, default=64 * 1024)
+    parser.add_argument('--scenarios', default=','.join(SCENARIOS),
+        help='which to run, in order')
+    parser.add_argument('--timeout', type=float, default=300,
+        help='seconds each scenario gets to finish')
+    parser.add_argument('--json', help='write the results here')
+    parser.add_argument('--no-build', action='store_true',
+        help="don't run make first")
+    parser.add_argument('--keep', action='store_true',
+        help='leave the scratch folder and hdbsync.log')
+    return parser.parse_args(argv)
+
+if __name__ == '__main__':
+    main(parse_args(sys.argv[1:]))
@@ -0,0 +1,270 @@
+/*
+* Startup time with and without the saved sync state.
+*
+* Makes a tree of files, then times the two ways of getting
+* a NodeTable for it: walking the tree and opening every entry
+* (what the client did at every startup, BFile and IsDirectory()
+* per entry), and opening the SyncState saved from that walk.
+* Caches are dropped before each if we're allowed to
+* (run as root for cold numbers), otherwise both are warm.
+*
+* Then checks that a state file cut off at random points, or
+* with rubbish on the end, loads as some prefix of itself,
+* and that saving the same records over and over keeps
+* the file compacted.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_sync_state bench_sync_state.cpp ../SyncState.cpp ../NodeTable.cpp ../Trace.cpp
+*   ./bench_sync_state [file count] [scratch directory]
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "SyncState.h"
+
+const int FILES_PER_DIR = 200;
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool
+drop_caches(void)
+{
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if(fd < 0)
+    return false;
+  bool ok = write(fd, "3\n", 2) == 2;
+  close(fd);
+  return ok;
+}
+
+static void
+make_tree(const char *root, long files)
+{
+  char path[2048];
+  mkdir(root, 0755);
+  for(long i = 0; i < files; i++)
+  {
+    if(i % FILES_PER_DIR == 0)
+    {
+      sprintf(path, "%s/show%05ld", root, i / FILES_PER_DIR);
+      mkdir(path, 0755);
+    }
+    sprintf(path, "%s/show%05ld/segment%07ld.mp3", root, i / FILES_PER_DIR, i);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd >= 0)
+    {
+      write(fd, path, 16);
+      close(fd);
+    }
+  }
+}
+
+//the old startup: open every entry to see what it is
+static void
+walk(NodeTable *table, const char *dir_path, ino_t dir_node)
+{
+  DIR *dir = opendir(dir_path);
+  if(dir == NULL)
+    return;
+  struct dirent *entry;
+  char path[2048];
+  while((entry = readdir(dir)) != NULL)
+  {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    sprintf(path, "%s/%s", dir_path, entry->d_name);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+      if(fd >= 0)
+        close(fd);
+      continue;
+    }
+    close(fd);
+    NodeRecord *record = table->Insert(st.st_dev, st.st_ino, dir_node, entry->d_name);
+    if(record == NULL)
+      continue;
+    record->directory = S_ISDIR(st.st_mode);
+    if(record->directory)
+      walk(table, path, st.st_ino);
+  }
+  closedir(dir);
+}
+
+static bool
+same_tables(const NodeTable *a, const NodeTable *b)
+{
+  if(a->CountItems() != b->CountItems())
+    return false;
+  size_t i;
+  char path[2048], other_path[2048];
+  char hash[NODE_HASH_SIZE * 2 + 1], other_hash[NODE_HASH_SIZE * 2 + 1];
+  for(NodeRecord *r = a->First(&i); r != NULL; r = a->Next(&i, r))
+  {
+    NodeRecord *other = b->Find(r->device, r->node);
+    if(other == NULL || !a->GetPath(r, path, sizeof(path))
+      || !b->GetPath(other, other_path, sizeof(other_path))
+      || strcmp(path, other_path) != 0
+      || other->directory != r->directory)
+      return false;
+    const char *rev = NodeTable::Rev(r), *other_rev = NodeTable::Rev(other);
+    if((rev == NULL) != (other_rev == NULL)
+      || (rev != NULL && strcmp(rev, other_rev) != 0)
+      || NodeTable::GetHash(r, hash) != NodeTable::GetHash(other, other_hash)
+      || strcmp(hash, other_hash) != 0
+      || NodeTable::SyncedSize(other) != NodeTable::SyncedSize(r)
+      || NodeTable::SyncedMtime(other) != NodeTable::SyncedMtime(r))
+      return false;
+  }
+  return true;
+}
+
+static void
+copy_prefix(const char *from, const char *to, off_t length, const char *junk, size_t junk_size)
+{
+  char *data = (char*)malloc(length);
+  int fd = open(from, O_RDONLY);
+  ssize_t got = read(fd, data, length);
+  close(fd);
+  fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(got > 0)
+    write(fd, data, got);
+  write(fd, junk, junk_size);
+  close(fd);
+  free(data);
+}
+
+int
+main(int argc, char **argv)
+{
+  long files = 200000;
+  const char *scratch = "bench_sync_state.tmp";
+  if(argc > 1)
+    files = atol(argv[1]);
+  if(argc > 2)
+    scratch = argv[2];
+
+  char root[1024], state_path[1024], torn_path[1024];
+  mkdir(scratch, 0755);
+  sprintf(root, "%s/Dropbox", scratch);
+  sprintf(state_path, "%s/sync_state", scratch);
+  sprintf(torn_path, "%s/torn_state", scratch);
+  printf("making %ld files in %ld directories\n", files,
+    (files + FILES_PER_DIR - 1) / FILES_PER_DIR);
+  make_tree(root, files);
+  struct stat root_st;
+  stat(root, &root_st);
+
+  bool cold = drop_caches();
+  double start = now();
+  NodeTable walked;
+  walked.SetRoot(root_st.st_dev, root_st.st_ino, root);
+  walk(&walked, root, root_st.st_ino);
+  double walk_time = now() - start;
+
+  //what syncing would have filled in
+  size_t i;
+  for(NodeRecord *r = walked.First(&i); r != NULL; r = walked.Next(&i, r))
+  {
+    if(r->directory)
+      continue;
+    NodeTable::SetRev(r, "015d7f3e4a2b0c1d");
+    NodeTable::SetHash(r, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    NodeTable::SetSynced(r, 16, 1700000000);
+  }
+  unlink(state_path);
+  {
+    //(a new file adds nothing to the table)
+    SyncState state;
+    state.Open(state_path, &walked, root_st.st_dev, root_st.st_ino, root);
+    for(NodeRecord *r = walked.First(&i); r != NULL; r = walked.Next(&i, r))
+      state.Save(r);
+    state.SaveCursor("AAGk1b2c3d4e5f6g7h8i9j0kAAAA");
+  }
+  struct stat state_st;
+  stat(state_path, &state_st);
+
+  drop_caches();
+  start = now();
+  NodeTable loaded;
+  SyncState state;
+  int err = state.Open(state_path, &loaded, root_st.st_dev, root_st.st_ino, root);
+  double load_time = now() - start;
+
+  printf("%s caches\n", cold ? "cold" : "warm (couldn't drop the)");
+  printf("walk, opening every entry    %8.3f s  %lu records\n",
+    walk_time, (unsigned long)walked.CountItems());
+  printf("open the saved state         %8.3f s  %lu records, %.1f MB\n",
+    load_time, (unsigned long)loaded.CountItems(), state_st.st_size / 1048576.0);
+  printf("speedup                      %8.1fx\n", walk_time / load_time);
+  bool ok = err == 0 && same_tables(&walked, &loaded)
+    && strcmp(state.Cursor(), "AAGk1b2c3d4e5f6g7h8i9j0kAAAA") == 0;
+  printf("loaded the same records and cursor: %s\n", ok ? "yes" : "NO");
+  state.Close();
+
+  //cut off part way through a record, or with rubbish on the end
+  bool prefixes = true;
+  srand(7);
+  for(int trial = 0; trial < 20; trial++)
+  {
+    off_t length = trial < 10 ? rand() % state_st.st_size : state_st.st_size;
+    //rubbish that starts like a record
+    copy_prefix(state_path, torn_path, length, "\x40\0\0\0rubbish", trial < 10 ? 0 : 11);
+    NodeTable torn;
+    SyncState torn_state;
+    if(torn_state.Open(torn_path, &torn, root_st.st_dev, root_st.st_ino, root) != 0)
+      prefixes = false;
+    size_t count = torn.CountItems();
+    torn_state.Close();
+    //what's left is a good state file of just those
+    NodeTable again;
+    torn_state.Open(torn_path, &again, root_st.st_dev, root_st.st_ino, root);
+    if(count > walked.CountItems() || !same_tables(&torn, &again)
+      || (trial >= 10 && count != walked.CountItems()))
+      prefixes = false;
+  }
+  printf("torn or padded files load a prefix: %s\n", prefixes ? "yes" : "NO");
+
+  //the same few records saved over and over
+  NodeTable few;
+  SyncState busy;
+  unlink(torn_path);
+  busy.Open(torn_path, &few, root_st.st_dev, root_st.st_ino, root);
+  NodeRecord *copies[100];
+  NodeRecord *r = walked.First(&i);
+  for(int n = 0; n < 100; n++, r = walked.Next(&i, r))
+  {
+    copies[n] = few.Insert(r->device, r->node, r->parent, NodeTable::Name(r));
+    NodeTable::SetRev(copies[n], NodeTable::Rev(r));
+  }
+  for(int n = 0; n < 200000; n++)
+    busy.Save(copies[n % 100]);
+  busy.Flush();
+  struct stat busy_st;
+  stat(torn_path, &busy_st);
+  bool compacted = busy.CountLogged() < 20000 && busy_st.st_size < 2 * 1024 * 1024;
+  printf("200000 saves of 100 records: %lu records, %.1f KB on disk, compacted: %s\n",
+    (unsigned long)busy.CountLogged(), busy_st.st_size / 1024.0, compacted ? "yes" : "NO");
+  busy.Close();
+
+  char command[1100];
+  sprintf(command, "rm -rf %s", scratch);
+  system(command);
+  return ok && prefixes && compacted ? 0 : 1;
+}
@@ -0,0 +1,221 @@
+import Queue
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)),
+    '..'))
+
+from db_throttle import set_limits
+from fake_dropbox_server import start_server
+
+# Keeps several db_worker.py processes uploading and downloading against the
+# stand-in server, with limits in a bandwidth.conf they all share, and
+# measures the rate they get (upload bytes as the server receives them,
+# download bytes as they land on disk) once they've settled in.  Checks
+# each limit is kept to within 5%: uploads, downloads, both together, a
+# limit changed while the transfers are going, and a time of day limit.
+#
+# usage: python bench_throttle.py [limit in KB/s] [workers]
+#            [seconds measured] [file size in KB]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+
+# Seconds to let the workers get going (and pay off the bucket's burst)
+# before measuring.
+SETTLE = 1.0
+
+class Transfers(object):
+    """Workers each taking the next of an endless run of requests, until
+    stopped."""
+    def __init__(self, env, directions, directory, size):
+        self.env = env
+        self.directory = directory
+        self.size = size
+        self.stopping = False
+        self.failures = []
+        self.workers = []
+        self.lock = threading.Lock()
+        self.next = 0
+        self.threads = [threading.Thread(target=self.lane, args=(direction,))
+            for direction in directions]
+        for thread in self.threads:
+            thread.start()
+
+    def request(self, direction):
+        with self.lock:
+            self.next += 1
+            number = self.next
+        if direction == 'up':
+            return ['put', os.path.join(self.directory, 'take.ogg'),
+                '/uploads/take_%05d.ogg' % number]
+        return ['get', '/library/track.ogg', os.path.join(self.directory,
+            'got', 'track_%05d.ogg' % number)]
+
+    def lane(self, direction):
+        worker = subprocess.Popen(['python', WORKER], env=self.env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        with self.lock:
+            self.workers.append(worker)
+        try:
+            while not self.stopping:
+                payload = '\0'.join(self.request(direction))
+                worker.stdin.write(struct.pack('>I', len(payload)) + payload)
+                worker.stdin.flush()
+                header = worker.stdout.read(4)
+                if len(header) < 4:
+                    break
+                (length,) = struct.unpack('>I', header)
+                reply_bytes = worker.stdout.read(length)
+                # Cut off by stop(), the lane is done rather than failed.
+                if len(reply_bytes) < length or self.stopping:
+                    break
+                reply = reply_bytes.split('\0')
+                if reply[0] != 'OK':
+                    self.failures.append(reply)
+        except IOError:
+            pass
+
+    def stop(self):
+        self.stopping = True
+        with self.lock:
+            for worker in self.workers:
+                worker.kill()
+        for thread in self.threads:
+            thread.join()
+        for worker in self.workers:
+            worker.wait()
+        if self.failures:
+            raise Exception('%d transfers failed: %s' % (len(self.failures),
+                self.failures[0]))
+
+def received(server, directory):
+    """Bytes uploaded and downloaded so far."""
+    with server.db.lock:
+        up = server.db.received_bytes
+    down = 0
+    got = os.path.join(directory, 'got')
+    for name in os.listdir(got):
+        try:
+            down += os.path.getsize(os.path.join(got, name))
+        except OSError:
+            pass
+    return up, down
+
+def measure(server, directory, seconds):
+    """KB a second up and down over the next so many seconds."""
+    up, down = received(server, directory)
+    start = time.time()
+    time.sleep(seconds)
+    end_up, end_down = received(server, directory)
+    elapsed = time.time() - start
+    return (end_up - up) / elapsed / 1024, (end_down - down) / elapsed / 1024
+
+def check(name, got, limit):
+    off = (got - limit) / float(limit) * 100
+    print '%-30s %8.1f KB/s for a %6.1f KB/s limit (%+5.1f%%)' % (name, got,
+        limit, off)
+    print 'check: %s within 5%% of its limit: %s' % (name,
+        'yes' if abs(off) <= 5 else 'NO')
+    return abs(off) <= 5
+
+def window_around_now(minutes):
+    """A time of day range from a minute ago to so many minutes on."""
+    now = time.time()
+    start = time.localtime(now - 60)
+    end = time.localtime(now + minutes * 60)
+    return '%02d:%02d-%02d:%02d' % (start.tm_hour, start.tm_min, end.tm_hour,
+        end.tm_min)
+
+def main(limit, workers, seconds, size):
+    server = start_server()
+    directory = tempfile.mkdtemp()
+    ok = True
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        os.mkdir(os.path.join(directory, 'got'))
+        data = os.urandom(size)
+        with open(os.path.join(directory, 'take.ogg'), 'wb') as f:
+            f.write(data)
+        with server.db.lock:
+            server.db.put_file('/library/track.ogg', data, {}, False)
+        config = os.path.join(directory, 'bandwidth.conf')
+        env = dict(os.environ)
+        env['DBFORHAIKU_SERVER'] = server.url
+        env['DBFORHAIKU_BANDWIDTH'] = config
+        os.chdir(directory)
+        half = workers / 2 or 1
+
+        def phase(lines, directions):
+            got = os.path.join(directory, 'got')
+            for name in os.listdir(got):
+                os.remove(os.path.join(got, name))
+            with open(config, 'w') as f:
+                f.write('\n'.join(lines) + '\n')
+            transfers = Transfers(env, directions, directory, size)
+            time.sleep(SETTLE)
+            return transfers
+
+        print '%d workers, %d KB files, %.0f s measured' % (workers,
+            size / 1024, seconds)
+        transfers = phase([], ['up'] * half + ['down'] * half)
+        up, down = measure(server, directory, SETTLE)
+        transfers.stop()
+        print '%-30s %8.1f KB/s up, %.1f KB/s down' % ('no limits', up, down)
+
+        transfers = phase(['up %d' % limit], ['up'] * workers)
+        up, down = measure(server, directory, seconds)
+        transfers.stop()
+        ok &= check('uploads', up, limit)
+
+        transfers = phase(['down %d' % limit], ['down'] * workers)
+        up, down = measure(server, directory, seconds)
+        transfers.stop()
+        ok &= check('downloads', down, limit)
+
+        transfers = phase(['total %d' % limit],
+            ['up'] * half + ['down'] * half)
+        up, down = measure(server, directory, seconds)
+        transfers.stop()
+        ok &= check('both together', up + down, limit)
+
+        transfers = phase(['up %d' % limit], ['up'] * workers)
+        up, down = measure(server, directory, seconds / 2)
+        ok &= check('uploads before the change', up, limit)
+        set_limits(config, {'up': limit / 2})
+        time.sleep(SETTLE)
+        up, down = measure(server, directory, seconds / 2)
+        transfers.stop()
+        ok &= check('uploads after the change', up, limit / 2)
+
+        transfers = phase(['up %d' % limit, '%s up %d' % (window_around_now(10),
+            limit / 4)], ['up'] * workers)
+        up, down = measure(server, directory, seconds)
+        transfers.stop()
+        ok &= check('uploads at this time of day', up, limit / 4)
+    finally:
+        os.chdir('/')
+        shutil.rmtree(directory)
+    print 'check: every limit kept to: %s' % ('yes' if ok else 'NO')
+
+if __name__ == '__main__':
+    limit = 1024
+    workers = 4
+    seconds = 6.0
+    size = 256 * 1024
+    if len(sys.argv) > 1:
+        limit = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        workers = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        seconds = float(sys.argv[3])
+    if len(sys.argv) > 4:
+        size = int(sys.argv[4]) * 1024
+    main(limit, workers, seconds, size)
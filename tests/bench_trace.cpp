@@ -0,0 +1,194 @@
+/*
+* Times what a TRACE() line costs when its level is off,
+* when it only goes to the ring and when it's printed
+* (to /dev/null), and what a TraceSpan costs with spans
+* on and off. Then checks the ring keeps whole lines with
+* several threads writing at once, and that the
+* percentiles trace_dump() prints are within a quarter of
+* the real ones.
+*
+* Doesn't need Haiku, build and run it from the tests directory with:
+*   g++ -O2 -I.. -o bench_trace bench_trace.cpp ../Trace.cpp -lpthread
+*   ./bench_trace [lines]
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Trace.h"
+
+const int THREADS = 4;
+const int THREAD_LINES = 20000;
+const int SAMPLES = 100000;
+
+static int64_t
+now_nsecs(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+report(const char *what, int64_t nsecs, long lines)
+{
+  printf("%-32s %8.1f ns a line\n", what, (double)nsecs / lines);
+}
+
+//the lines a TRACE() with the level and print level make
+static int64_t
+time_lines(int level, int print_level, long lines)
+{
+  trace_level = level;
+  trace_print_level = print_level;
+  int64_t start = now_nsecs();
+  for(long i = 0; i < lines; i++)
+    TRACE(TRACE_DEBUG, "uploaded |/Shows/show%05ld/segment%07ld.mp3|, rev |%lx|",
+      i / 100, i, i * 7919);
+  return now_nsecs() - start;
+}
+
+static void *
+write_lines(void *arg)
+{
+  long thread = (long)arg;
+  for(int i = 0; i < THREAD_LINES; i++)
+    TRACE(TRACE_INFO, "thread %ld line %d end", thread, i);
+  return NULL;
+}
+
+/*
+* Every line the dump has left is one some thread wrote,
+* whole, and each thread's lines come in the order it
+* wrote them.
+*/
+static bool
+ring_intact(FILE *dump)
+{
+  int last[THREADS];
+  for(int i = 0; i < THREADS; i++)
+    last[i] = -1;
+  int seen = 0;
+  char line[512];
+  while(fgets(line, sizeof(line), dump) != NULL)
+  {
+    const char *text = strstr(line, "thread ");
+    if(text == NULL)
+      continue;
+    long thread;
+    int number;
+    char end[8];
+    if(sscanf(text, "thread %ld line %d %7s", &thread, &number, end) != 3
+      || strcmp(end, "end") != 0 || thread < 0 || thread >= THREADS
+      || number <= last[thread] || number >= THREAD_LINES)
+      return false;
+    last[thread] = number;
+    seen++;
+  }
+  return seen > TRACE_RING_SIZE / 2;
+}
+
+static int
+compare_int64(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+  long lines = 1000000;
+  if(argc > 1)
+    lines = atol(argv[1]);
+
+  FILE *devnull = fopen("/dev/null", "w");
+  int stdout_copy = dup(fileno(stdout));
+  fflush(stdout);
+
+  time_lines(TRACE_DEBUG, TRACE_INFO, lines / 10); //warm up
+  int64_t off = time_lines(TRACE_INFO, TRACE_INFO, lines);
+  int64_t ring = time_lines(TRACE_DEBUG, TRACE_INFO, lines);
+  //the printed lines go to /dev/null
+  dup2(fileno(devnull), fileno(stdout));
+  int64_t printed = time_lines(TRACE_DEBUG, TRACE_DEBUG, lines);
+  fflush(stdout);
+  dup2(stdout_copy, fileno(stdout));
+  int64_t start = now_nsecs();
+  for(long i = 0; i < lines; i++)
+    fprintf(devnull, "uploaded |/Shows/show%05ld/segment%07ld.mp3|, rev |%lx|\n",
+      i / 100, i, i * 7919);
+  int64_t plain = now_nsecs() - start;
+
+  report("level off", off, lines);
+  report("to the ring", ring, lines);
+  report("to the ring and printed", printed, lines);
+  report("plain fprintf, for comparison", plain, lines);
+
+  trace_spans = true;
+  start = now_nsecs();
+  for(long i = 0; i < lines; i++)
+    TraceSpan span(TRACE_WATCH);
+  int64_t spans_on = now_nsecs() - start;
+  trace_spans = false;
+  start = now_nsecs();
+  for(long i = 0; i < lines; i++)
+    TraceSpan span(TRACE_WATCH);
+  int64_t spans_off = now_nsecs() - start;
+  report("span, spans on", spans_on, lines);
+  report("span, spans off", spans_off, lines);
+  TraceStats stats;
+  trace_stats(TRACE_WATCH, &stats);
+  printf("check: every span on is counted: %s\n",
+    stats.count == lines ? "yes" : "NO");
+  printf("check: a line that's off costs less than one to the ring: %s\n",
+    off < ring ? "yes" : "NO");
+
+  trace_level = TRACE_INFO;
+  trace_print_level = TRACE_ERROR;
+  pthread_t threads[THREADS];
+  for(long i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, write_lines, (void*)i);
+  for(int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  FILE *dump = tmpfile();
+  trace_dump(dump, TRACE_RING_SIZE);
+  rewind(dump);
+  printf("check: lines written from %d threads at once are whole: %s\n",
+    THREADS, ring_intact(dump) ? "yes" : "NO");
+  fclose(dump);
+
+  //upload times: mostly a few ms, a tail out to seconds
+  trace_reset();
+  int64_t *samples = (int64_t*)malloc(SAMPLES * sizeof(int64_t));
+  srandom(1);
+  for(int i = 0; i < SAMPLES; i++)
+  {
+    int64_t usecs = 1000 + random() % 9000;
+    if(i % 20 == 0)
+      usecs = 100000 + random() % 3000000;
+    samples[i] = usecs;
+    trace_record(TRACE_UPLOAD, usecs);
+  }
+  qsort(samples, SAMPLES, sizeof(int64_t), compare_int64);
+  const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+  bool close = true;
+  for(size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); i++)
+  {
+    int64_t real = samples[(int)(fractions[i] * SAMPLES + 0.5) - 1];
+    int64_t guess = trace_percentile(TRACE_UPLOAD, fractions[i]);
+    printf("p%-5g real %9.3f ms, from the histogram %9.3f ms\n",
+      fractions[i] * 100, real / 1000.0, guess / 1000.0);
+    if(guess < real || guess > real + real / 4)
+      close = false;
+  }
+  printf("check: the percentiles are within a quarter: %s\n",
+    close ? "yes" : "NO");
+  free(samples);
+  fclose(devnull);
+  return 0;
+}
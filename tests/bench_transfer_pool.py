@@ -0,0 +1,122 @@
+import Queue
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from fake_dropbox_server import start_server
+
+# Downloads and uploads a batch of files through 1, 4 and 16 db_worker.py
+# processes at once, the way TransferQueue spreads requests over its lanes
+# (each lane a thread with its own worker, taking the next request when it's
+# done with the last).  The stand-in server adds a round trip time to every
+# request and limits each connection's transfer rate, since one transfer
+# only gets a fraction of a real link.
+#
+# usage: python bench_transfer_pool.py [file count] [file size in KB]
+#            [latency in seconds] [per-connection KB/s]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+CONCURRENCY = [1, 4, 16]
+
+def lane(env, requests, failures):
+    worker = subprocess.Popen(['python', WORKER], env=env,
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    while True:
+        try:
+            fields = requests.get_nowait()
+        except Queue.Empty:
+            break
+        payload = '\0'.join(fields)
+        worker.stdin.write(struct.pack('>I', len(payload)) + payload)
+        worker.stdin.flush()
+        (length,) = struct.unpack('>I', worker.stdout.read(4))
+        reply = worker.stdout.read(length).split('\0')
+        if reply[0] != 'OK':
+            failures.append(reply)
+    worker.stdin.close()
+    worker.wait()
+
+def run(env, all_requests, concurrency):
+    requests = Queue.Queue()
+    for fields in all_requests:
+        requests.put(fields)
+    failures = []
+    lanes = [threading.Thread(target=lane, args=(env, requests, failures))
+        for i in range(concurrency)]
+    start = time.time()
+    for thread in lanes:
+        thread.start()
+    for thread in lanes:
+        thread.join()
+    if failures:
+        raise Exception('%d transfers failed: %s' % (len(failures),
+            failures[0]))
+    return time.time() - start
+
+def report(name, concurrency, count, size, elapsed, baseline):
+    print '%-9s %2d at once %7.1f files/sec %7.2f MB/sec  %5.1fx' % (name,
+        concurrency, count / elapsed, count * size / elapsed / 1e6,
+        baseline / elapsed)
+
+def main(count, size, latency, rate):
+    server = start_server(latency=latency, stream_rate=rate)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        env = dict(os.environ)
+        env['DBFORHAIKU_SERVER'] = server.url
+        os.chdir(directory)
+
+        data = os.urandom(size)
+        with server.db.lock:
+            for i in range(count):
+                server.db.put_file('/library/track_%04d.ogg' % i, data, {},
+                    False)
+        local = []
+        for i in range(count):
+            path = os.path.join(directory, 'take_%04d.ogg' % i)
+            with open(path, 'wb') as f:
+                f.write(data)
+            local.append(path)
+
+        print '%d files of %d KB, %.0f ms round trip, %d KB/s per ' \
+            'connection' % (count, size / 1024, latency * 1000, rate / 1024)
+        baseline = None
+        for concurrency in CONCURRENCY:
+            gets = [['get', '/library/track_%04d.ogg' % i,
+                os.path.join(directory, 'got_%d_%04d.ogg' % (concurrency, i))]
+                for i in range(count)]
+            elapsed = run(env, gets, concurrency)
+            baseline = baseline or elapsed
+            report('download', concurrency, count, size, elapsed, baseline)
+        baseline = None
+        for concurrency in CONCURRENCY:
+            puts = [['put', path, '/uploads/%d/%s' % (concurrency,
+                os.path.basename(path))] for path in local]
+            elapsed = run(env, puts, concurrency)
+            baseline = baseline or elapsed
+            report('upload', concurrency, count, size, elapsed, baseline)
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    count = 256
+    size = 64 * 1024
+    latency = 0.05
+    rate = 1024 * 1024
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        size = int(sys.argv[2]) * 1024
+    if len(sys.argv) > 3:
+        latency = float(sys.argv[3])
+    if len(sys.argv) > 4:
+        rate = int(sys.argv[4]) * 1024
+    main(count, size, latency, rate)
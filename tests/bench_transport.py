@@ -0,0 +1,173 @@
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from fake_dropbox_server import start_server, content_hash
+
+# Runs the same requests through db_worker.py and through hdbworker, the
+# native transport (build it with "make core-daemon"), against the local
+# stand-in server: lots of small uploads, then big uploads in a session and
+# big downloads, then a batch and a delta page.  Prints how fast each went
+# and how much CPU the worker took for it, then checks both left Dropbox
+# the same and answered the same.  The stand-in server is Python too, so
+# it's the worker's CPU that says the most.
+#
+# usage: python bench_transport.py [small file count] [big file MB]
+#                                  [big file count]
+
+SOURCE = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+TRANSPORTS = [
+    ('python', ['python', os.path.join(SOURCE, 'db_worker.py')]),
+    ('native', [os.path.join(SOURCE, 'object-core', 'hdbworker')]),
+]
+
+class Worker(object):
+    def __init__(self, command, env):
+        self.process = subprocess.Popen(command, env=env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def call(self, *fields):
+        """The items and final frame of one request."""
+        payload = '\0'.join(fields)
+        self.process.stdin.write(struct.pack('>I', len(payload)) + payload)
+        self.process.stdin.flush()
+        items = []
+        while True:
+            (length,) = struct.unpack('>I', self.process.stdout.read(4))
+            frame = self.process.stdout.read(length).split('\0')
+            if frame[0] in ('OK', 'ERROR', 'PAUSED'):
+                return items, frame
+            items.append(frame)
+
+    def stop(self):
+        """The CPU seconds it used."""
+        self.process.stdin.close()
+        pid, status, usage = os.wait4(self.process.pid, 0)
+        self.process.returncode = status
+        return usage.ru_utime + usage.ru_stime
+
+def run(command, env, requests):
+    """Send each request to a new worker, returns the seconds it all took,
+    the worker's CPU seconds and its answers."""
+    worker = Worker(command, env)
+    answers = []
+    start = time.time()
+    for request in requests:
+        answers.append(worker.call(*request))
+    elapsed = time.time() - start
+    return elapsed, worker.stop(), answers
+
+def make_file(path, size):
+    with open(path, 'wb') as f:
+        f.write(os.urandom(size))
+
+def main(small_count, big_mb, big_count):
+    directory = tempfile.mkdtemp()
+    results = {}
+    checks = []
+    try:
+        os.chdir(directory)
+        with open('login_token_store.txt', 'w') as f:
+            f.write('stand-in-token')
+        os.mkdir('up')
+        for i in range(small_count):
+            make_file('up/jingle_%05d.txt' % i, 2048)
+        big = big_mb * 1024 * 1024
+        for i in range(big_count):
+            make_file('up/recording_%d.wav' % i, big)
+        env = dict(os.environ)
+        env['DBFORHAIKU_CHUNK_KB'] = str(8 * 1024)
+
+        print '%d files of 2 KB, %d of %d MB' % (small_count, big_count,
+            big_mb)
+        print '%-7s %-16s %10s %10s %9s' % ('', '', 'seconds', 'rate',
+            'worker cpu')
+        servers = {}
+        for name, command in TRANSPORTS:
+            server = start_server()
+            servers[name] = server
+            env['DBFORHAIKU_SERVER'] = server.url
+            os.mkdir(name)
+            small = [('put', 'up/jingle_%05d.txt' % i,
+                '/small/jingle_%05d.txt' % i) for i in range(small_count)]
+            puts = [('put', 'up/recording_%d.wav' % i,
+                '/big/recording_%d.wav' % i) for i in range(big_count)]
+            gets = [('get', '/big/recording_%d.wav' % i,
+                '%s/recording_%d.wav' % (name, i)) for i in range(big_count)]
+            rest = [('mkdir_batch',) + tuple('/folder_%d' % i
+                for i in range(50)),
+                ('mv_batch',) + tuple(path for i in range(50)
+                    for path in ('/small/jingle_%05d.txt' % i,
+                    '/folder_%d/jingle.txt' % i)),
+                ('rm_batch',) + tuple('/small/jingle_%05d.txt' % i
+                    for i in range(50, 60)),
+                ('delta_page', '', '100000')]
+            result = {}
+            for stage, requests, unit, amount in (
+                    ('small uploads', small, 'ops/s', small_count),
+                    ('big uploads', puts, 'MB/s', big_mb * big_count),
+                    ('big downloads', gets, 'MB/s', big_mb * big_count),
+                    ('batches, delta', rest, 'ops/s', len(rest))):
+                elapsed, cpu, answers = run(command, env, requests)
+                result[stage] = (elapsed, cpu, answers)
+                print '%-7s %-16s %10.2f %10.1f %-5s %5.2f s' % (name, stage,
+                    elapsed, amount / elapsed, unit, cpu)
+            results[name] = result
+
+        def finals(name, stage):
+            """The tag and content hash of each answer."""
+            return [(final[0], final[-1]) for items, final in
+                results[name][stage][2]]
+        for stage in ('small uploads', 'big uploads', 'big downloads'):
+            checks.append(('%s answered the same' % stage,
+                finals('python', stage) == finals('native', stage)))
+        checks.append(('everything answered OK', all(final[0] == 'OK'
+            for name in results for stage in results[name]
+            for items, final in results[name][stage][2])))
+        checks.append(('downloads arrived intact', all(
+            open('native/recording_%d.wav' % i, 'rb').read() ==
+            open('up/recording_%d.wav' % i, 'rb').read()
+            for i in range(big_count))))
+        checks.append(('content hashes match', all(
+            final[3] == content_hash(open('up/recording_%d.wav' % i,
+            'rb').read()) for i, (items, final) in
+            enumerate(results['native']['big uploads'][2]))))
+        python_items = [items for items, final in
+            results['python']['batches, delta'][2]]
+        native_items = [items for items, final in
+            results['native']['batches, delta'][2]]
+        checks.append(('batch items the same', python_items[:3] ==
+            native_items[:3]))
+        checks.append(('delta pages the same size',
+            len(python_items[3]) == len(native_items[3])))
+
+        def tree(server):
+            return sorted((path, entry.get('content_hash')) for path, entry in
+                server.db.entries.items())
+        checks.append(('Dropbox ends up the same',
+            tree(servers['python']) == tree(servers['native'])))
+        checks.append(('no upload sessions left saved',
+            not os.path.isdir('upload_sessions') or
+            os.listdir('upload_sessions') == []))
+    finally:
+        shutil.rmtree(directory)
+
+    print 'Checking Assertions:'
+    for name, passed in checks:
+        print '%s: %s' % (name, passed)
+
+if __name__ == '__main__':
+    small_count = 200
+    big_mb = 64
+    big_count = 4
+    if len(sys.argv) > 1:
+        small_count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        big_mb = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        big_count = int(sys.argv[3])
+    main(small_count, big_mb, big_count)
@@ -0,0 +1,83 @@
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from fake_dropbox_server import start_server
+
+# Compares uploading lots of small files the old way, one Python process per
+# operation, with sending them all to one long-lived db_worker.py.  Both talk
+# to the local stand-in server, with an optional simulated round trip time.
+#
+# usage: python bench_worker.py [file count] [latency in seconds]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+
+def make_files(directory, count):
+    paths = []
+    for i in range(count):
+        path = os.path.join(directory, 'station_id_%05d.txt' % i)
+        with open(path, 'w') as f:
+            f.write('Jingle number %d\n' % i)
+        paths.append(path)
+    return paths
+
+def one_process_per_operation(paths, env):
+    for path in paths:
+        subprocess.check_call(['python', WORKER, '--once', 'put', path,
+            '/before/' + os.path.basename(path)], env=env,
+            stdout=open(os.devnull, 'w'))
+
+def one_worker(paths, env):
+    worker = subprocess.Popen(['python', WORKER], env=env,
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    for path in paths:
+        payload = '\0'.join(['put', path, '/after/' + os.path.basename(path)])
+        worker.stdin.write(struct.pack('>I', len(payload)) + payload)
+        worker.stdin.flush()
+        (length,) = struct.unpack('>I', worker.stdout.read(4))
+        reply = worker.stdout.read(length).split('\0')
+        if reply[0] != 'OK':
+            raise Exception('put failed: %s' % reply)
+    worker.stdin.close()
+    worker.wait()
+
+def measure(name, function, paths, env, server):
+    connections = server.db.connections
+    start = time.time()
+    function(paths, env)
+    elapsed = time.time() - start
+    print '%-28s %7.1f ops/sec  (%d operations in %.2f s, %d connections)' % \
+        (name, len(paths) / elapsed, len(paths), elapsed,
+        server.db.connections - connections)
+
+def main(count, latency):
+    server = start_server(latency=latency)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('fake-token')
+        env = dict(os.environ)
+        env['DBFORHAIKU_SERVER'] = server.url
+        os.chdir(directory)
+        paths = make_files(directory, count)
+        print 'Uploading %d files, %.0f ms simulated latency' % \
+            (count, latency * 1000)
+        measure('process per operation', one_process_per_operation, paths,
+            env, server)
+        measure('persistent worker', one_worker, paths, env, server)
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    count = 200
+    latency = 0.0
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        latency = float(sys.argv[2])
+    main(count, latency)
@@ -0,0 +1,49 @@
+import time
+import os
+
+from client_harness import start_client, stop_client
+from fake_dropbox_server import start_server
+
+# Writes a file a chunk at a time, the way a big download or rip does, then
+# touches it, and checks that the client waited for it to be finished before
+# uploading it once (and didn't upload it again for the touch).
+
+CHUNKS = 40
+CHUNK = 'x' * (64 * 1024)
+
+#setup
+os.system("rm -rf /boot/home/Dropbox/*")
+server = start_server()
+
+# start dbclient
+p, directory = start_client(server)
+time.sleep(2)
+
+#write the file slowly
+song = open("/boot/home/Dropbox/song.flac", 'w')
+for i in range(CHUNKS):
+    song.write(CHUNK)
+    song.flush()
+    time.sleep(0.05)
+song.close()
+
+#wait for it to go quiet and upload
+time.sleep(6)
+uploads = server.db.uploads
+upload_bytes = server.db.upload_bytes
+
+#touching it changes the mtime, not the contents
+os.utime("/boot/home/Dropbox/song.flac", None)
+time.sleep(6)
+
+# kill dbclient
+stop_client(p, directory)
+
+# produce result
+print "Checking Assertions:"
+entry = server.db.entries.get("/song.flac")
+print "uploads:", uploads, "bytes:", upload_bytes
+print "uploaded once:", uploads == 1
+print "uploaded whole:", entry is not None and \
+    len(entry['data']) == CHUNKS * len(CHUNK)
+print "touch not uploaded:", server.db.uploads == uploads
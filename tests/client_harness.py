@@ -0,0 +1,30 @@
+import os
+import shutil
+import subprocess
+import tempfile
+
+# Starts hdbclient.exe against a stand-in server (see fake_dropbox_server.py)
+# from a scratch directory holding its own copy of the worker scripts and a
+# dummy access token, so a real login_token_store.txt is never touched.
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.dirname(TESTS)
+CLIENT = os.path.join(SOURCE, 'objects.x86-gcc2-release', 'hdbclient.exe')
+WORKER_SCRIPTS = ['db_worker.py', 'db_api.py', 'db_throttle.py']
+
+def start_client(server):
+    """Returns the client's Popen object and its working directory."""
+    directory = tempfile.mkdtemp()
+    for script in WORKER_SCRIPTS:
+        shutil.copy(os.path.join(SOURCE, script), directory)
+    with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+        f.write('stand-in-token')
+    env = dict(os.environ)
+    env['DBFORHAIKU_SERVER'] = server.url
+    client = subprocess.Popen([CLIENT], cwd=directory, env=env)
+    return client, directory
+
+def stop_client(client, directory):
+    client.kill()
+    client.wait()
+    shutil.rmtree(directory)
@@ -0,0 +1,104 @@
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+from fake_dropbox_server import start_server
+
+# Pages through a large delta with db_worker.py the way hdbclient.exe does,
+# saving the cursor after each page, and stops part way through as if the
+# client had been killed.  A second worker then carries on from the saved
+# cursor.  Checks that every file turns up exactly once, that the resumed
+# sync doesn't start over with a RESET, and that no page is bigger than the
+# page size asked for.
+#
+# usage: python delta_paging_test.py [file count] [page size]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+
+class Worker(object):
+    def __init__(self, env):
+        self.process = subprocess.Popen(['python', WORKER], env=env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def request(self, *fields):
+        """Returns the list of item frames and the final frame."""
+        payload = '\0'.join(fields)
+        self.process.stdin.write(struct.pack('>I', len(payload)) + payload)
+        self.process.stdin.flush()
+        items = []
+        while True:
+            (length,) = struct.unpack('>I', self.process.stdout.read(4))
+            frame = self.process.stdout.read(length).split('\0')
+            if frame[0] in ('OK', 'ERROR'):
+                return items, frame
+            items.append(frame)
+
+    def stop(self):
+        self.process.stdin.close()
+        self.process.wait()
+
+def sync(env, cursor, page_size, max_pages, seen, resets):
+    """Apply pages until caught up or max_pages, returns the saved cursor."""
+    worker = Worker(env)
+    pages = 0
+    more = True
+    largest = 0
+    while more and pages < max_pages:
+        items, final = worker.request('delta_page', cursor, str(page_size))
+        assert final[0] == 'OK', final
+        for item in items:
+            if item[0] == 'RESET':
+                resets.append(pages)
+            elif item[0] == 'FILE':
+                seen[item[1]] = seen.get(item[1], 0) + 1
+        largest = max(largest, len(items))
+        cursor = final[1] # Saved only once the page is applied.
+        more = final[2] == '1'
+        pages += 1
+    worker.stop()
+    return cursor, pages, largest
+
+def main(count, page_size):
+    server = start_server()
+    with server.db.lock:
+        for i in range(count):
+            server.db.put_file('/station/ids/id_%06d.mp3' % i, 'x', {}, False)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        env = dict(os.environ)
+        env['DBFORHAIKU_SERVER'] = server.url
+        os.chdir(directory)
+
+        seen = {}
+        resets = []
+        total_pages = count / page_size
+        cursor, first_pages, largest1 = sync(env, '', page_size,
+            total_pages / 2, seen, resets)
+        print "interrupted after %d pages, %d files" % (first_pages, len(seen))
+        cursor, second_pages, largest2 = sync(env, cursor, page_size,
+            total_pages * 2, seen, resets)
+        print "resumed for %d more pages, %d files" % (second_pages, len(seen))
+
+        print "Checking Assertions:"
+        print "every file seen:", len(seen) == count
+        print "no file seen twice:", max(seen.values()) == 1
+        print "only the first page reset:", resets == [0]
+        print "pages no bigger than %d items:" % page_size, \
+            max(largest1, largest2) <= page_size + 1
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    count = 20000
+    page_size = 500
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        page_size = int(sys.argv[2])
+    main(count, page_size)
@@ -0,0 +1,582 @@
+/*
+* Runs SyncEngine on a scratch folder with InotifyWatch and
+* a transport that just writes down what it was asked to
+* send, and checks that what happens locally turns into the
+* right requests for Dropbox: a new file into a put, a new
+* folder into a mkdir, a rename into an mv, a delete or a
+* move out of the folder into an rm. Then that applying a
+* delta (a new folder, a download, removing a folder with
+* everything in it) and renaming after a conflict send
+* nothing back, that changes made while it wasn't running
+* are found at the next start, and that a RESET only
+* removes and fetches what differs.
+*
+* Last, times the engine keeping up with a burst of new
+* files: events handled a second, and how long until all
+* their uploads are queued.
+*
+* Doesn't need Haiku, "make core-check" builds and runs it,
+* or from the tests directory:
+*   g++ -O2 -I.. -o engine_test engine_test.cpp ../SyncEngine.cpp ../InotifyWatch.cpp
+*     ../NodeTable.cpp ../EchoSuppressor.cpp ../QuietQueue.cpp ../ContentHash.cpp
+*     ../SyncState.cpp ../OfflineScan.cpp ../Trace.cpp -lpthread
+*   ./engine_test [file count] [scratch directory]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "ContentHash.h"
+#include "InotifyWatch.h"
+#include "SyncEngine.h"
+
+const int MAX_REQUESTS = 100000;
+
+/*
+* Writes each request down as its arguments with
+* spaces between, "put" leaving out the local path.
+*/
+class RecordingTransport: public SyncTransport
+{
+public:
+  RecordingTransport(void) : count(0), deltas(0), delta_ok(false) {}
+  ~RecordingTransport(void) { Clear(); }
+
+  void Send(const SyncRequest *request)
+  {
+    char line[8192] = "";
+    for(int i = 0; i < request->argc; i++)
+    {
+      if(strcmp(request->args[0], "put") == 0 && i == 1)
+        continue;
+      if(i > 0)
+        strcat(line, " ");
+      strncat(line, request->args[i], sizeof(line) - strlen(line) - 2);
+    }
+    if(count < MAX_REQUESTS)
+    {
+      requests[count++] = strdup(line);
+    }
+  }
+
+  void DeltaFinished(bool ok, bool changed)
+  {
+    deltas++;
+    delta_ok = ok;
+  }
+
+  int Find(const char *line) const
+  {
+    for(int i = 0; i < count; i++)
+    {
+      if(strcmp(requests[i], line) == 0)
+        return i;
+    }
+    return -1;
+  }
+
+  int CountStarting(const char *op) const
+  {
+    int found = 0;
+    for(int i = 0; i < count; i++)
+    {
+      if(strncmp(requests[i], op, strlen(op)) == 0)
+        found++;
+    }
+    return found;
+  }
+
+  void Clear(void)
+  {
+    for(int i = 0; i < count; i++)
+      free(requests[i]);
+    count = 0;
+  }
+
+  void Print(void) const
+  {
+    for(int i = 0; i < count; i++)
+      printf("  sent: %s\n", requests[i]);
+  }
+
+  char *requests[MAX_REQUESTS];
+  int count;
+  int deltas;
+  bool delta_ok;
+};
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+write_file(const char *path, const char *contents)
+{
+  FILE *file = fopen(path, "w");
+  fputs(contents, file);
+  fclose(file);
+}
+
+//time spent in the engine
+static double handling_time = 0;
+
+/*
+* Hand the engine everything the folder has reported,
+* then expire the echoes, as the application does.
+* Returns how many events there were.
+*/
+static long
+pump(InotifyWatch *watch, SyncEngine *engine, int timeout_ms = 50)
+{
+  long handled = 0;
+  FsEvent event;
+  while(watch->Next(&event, timeout_ms))
+  {
+    double start = now();
+    engine->HandleEvent(&event);
+    handling_time += now() - start;
+    handled++;
+  }
+  uint32_t generation;
+  if(engine->StartEchoSweep(&generation))
+    engine->ExpireEchoes(generation);
+  engine->Flush();
+  return handled;
+}
+
+//the local changes, and what they send
+static bool
+local_changes(const char *root, InotifyWatch *watch, SyncEngine *engine,
+  RecordingTransport *sent)
+{
+  char path[2048], to[2048];
+  bool ok = true;
+
+  sprintf(path, "%s/notes.txt", root);
+  write_file(path, "hello");
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  bool put = sent->Find("put /notes.txt ") >= 0;
+  printf("a new file is uploaded: %s\n", put ? "yes" : "NO");
+
+  sprintf(path, "%s/Projects", root);
+  mkdir(path, 0755);
+  pump(watch, engine);
+  bool made = sent->Find("mkdir /Projects") >= 0;
+  printf("a new folder is made: %s\n", made ? "yes" : "NO");
+
+  sprintf(path, "%s/notes.txt", root);
+  sprintf(to, "%s/Projects/plan.txt", root);
+  rename(path, to);
+  pump(watch, engine);
+  bool moved = sent->Find("mv /notes.txt /Projects/plan.txt") >= 0;
+  printf("a move is sent as one: %s\n", moved ? "yes" : "NO");
+
+  sprintf(path, "%s/Projects", root);
+  sprintf(to, "%s/Work", root);
+  rename(path, to);
+  pump(watch, engine);
+  sprintf(path, "%s/Work/plan.txt", root);
+  unlink(path);
+  pump(watch, engine);
+  bool removed = sent->Find("mv /Projects /Work") >= 0
+    && sent->Find("rm /Work/plan.txt") >= 0;
+  printf("a delete in a renamed folder is sent: %s\n", removed ? "yes" : "NO");
+
+  sprintf(path, "%s/draft.txt", root);
+  write_file(path, "draft");
+  pump(watch, engine);
+  sprintf(to, "%s/../outside.txt", root);
+  rename(path, to);
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  bool out = sent->Find("rm /draft.txt") >= 0 && sent->CountStarting("put /draft.txt") == 0;
+  printf("a move out of the folder is a delete: %s\n", out ? "yes" : "NO");
+  unlink(to);
+
+  //a tree copied in faster than its folders are watched
+  sprintf(path, "%s/Album", root);
+  mkdir(path, 0755);
+  sprintf(path, "%s/Album/Disc 1", root);
+  mkdir(path, 0755);
+  sprintf(path, "%s/Album/Disc 1/track.ogg", root);
+  write_file(path, "track");
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  bool copied = sent->Find("mkdir /Album/Disc 1") >= 0
+    && sent->CountStarting("put /Album/Disc 1/track.ogg") == 1;
+  printf("what's in a new folder already is sent: %s\n", copied ? "yes" : "NO");
+  unlink(path);
+  sprintf(path, "%s/Album/Disc 1", root);
+  rmdir(path);
+  sprintf(path, "%s/Album", root);
+  rmdir(path);
+  pump(watch, engine);
+
+  ok = put && made && moved && removed && out && copied;
+  if(!ok)
+    sent->Print();
+  sent->Clear();
+  return ok;
+}
+
+//applying a delta and what the engine changes itself
+static bool
+remote_changes(const char *root, const char *downloads, InotifyWatch *watch,
+  SyncEngine *engine, RecordingTransport *sent)
+{
+  char path[2048];
+  sprintf(path, "%s/report.txt", root);
+  write_file(path, "first");
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  int put = sent->Find("put /report.txt ");
+  //a folder with things in it, to be deleted on Dropbox
+  sprintf(path, "%s/Old", root);
+  mkdir(path, 0755);
+  sprintf(path, "%s/Old/Live", root);
+  mkdir(path, 0755);
+  sprintf(path, "%s/Old/notes.txt", root);
+  write_file(path, "old notes");
+  sprintf(path, "%s/Old/Live/set.txt", root);
+  write_file(path, "old set");
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  sent->Clear();
+
+  //Dropbox renamed the upload, the local file follows
+  bool renamed = false;
+  if(put >= 0)
+  {
+    struct stat st;
+    sprintf(path, "%s/report.txt", root);
+    stat(path, &st);
+    engine->UploadDone(SYNC_OK, st.st_dev, st.st_ino, false, st.st_size, st.st_mtime,
+      "/report (conflicted copy).txt", "rev-a", "");
+    pump(watch, engine);
+    sprintf(path, "%s/report (conflicted copy).txt", root);
+    renamed = access(path, F_OK) == 0;
+  }
+
+  //what the downloads will have
+  char hash[CONTENT_HASH_LENGTH + 1] = "";
+  sprintf(path, "%s/../hashed", root);
+  write_file(path, "downloaded");
+  content_hash_file(path, hash);
+  unlink(path);
+
+  engine->StartDelta();
+  bool asked = sent->count == 1 && strncmp(sent->requests[0], "delta_page ", 11) == 0;
+  DeltaItem items[4] = {
+    {"FOLDER", {"/Shared/Music", NULL, NULL}, 1},
+    {"FILE", {"/Shared/Music/song.mp3", "rev-b", hash}, 3},
+    {"REMOVE", {"/Old", NULL, NULL}, 1},
+    {"FILE", {"/Shared/readme.txt", "rev-c", hash}, 3}
+  };
+  engine->DeltaPageDone(items, 4, "cursor-1", false);
+  //the worker fetches them, the one with the same contents
+  //as another is copied from it once it's here
+  int fetched = 0;
+  for(int i = 0; i < sent->count; i++)
+  {
+    if(strncmp(sent->requests[i], "get ", 4) != 0)
+      continue;
+    char db_path[1024], temp_path[1024], rev[256];
+    sscanf(sent->requests[i], "get %s %s %s", db_path, temp_path, rev);
+    write_file(temp_path, "downloaded");
+    engine->DownloadDone(SYNC_OK, false, db_path, temp_path, rev, hash);
+    fetched++;
+  }
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  sprintf(path, "%s/Shared/Music/song.mp3", root);
+  bool installed = fetched == 1 && access(path, F_OK) == 0;
+  sprintf(path, "%s/Shared/readme.txt", root);
+  installed = installed && access(path, F_OK) == 0;
+  sprintf(path, "%s/Old", root);
+  installed = installed && access(path, F_OK) != 0;
+  bool finished = sent->deltas == 1 && sent->delta_ok
+    && strcmp(engine->Cursor(), "cursor-1") == 0 && access(downloads, F_OK) == 0;
+  printf("a delta is applied and its cursor saved: %s\n",
+    asked && installed && finished ? "yes" : "NO");
+
+  //only the delta_page and the gets
+  bool quiet = sent->count == 1 + fetched && renamed;
+  printf("our own changes aren't sent back: %s\n", quiet ? "yes" : "NO");
+  if(!quiet)
+    sent->Print();
+  sent->Clear();
+
+  //already here, so copied rather than downloaded
+  engine->StartDelta();
+  DeltaItem again[1] = {
+    {"FILE", {"/Shared/song copy.mp3", "rev-d", hash}, 3}
+  };
+  engine->DeltaPageDone(again, 1, "cursor-2", false);
+  pump(watch, engine);
+  engine->UploadQuietFiles();
+  char contents[64] = "";
+  sprintf(path, "%s/Shared/song copy.mp3", root);
+  FILE *copy = fopen(path, "r");
+  if(copy != NULL)
+  {
+    fgets(contents, sizeof(contents), copy);
+    fclose(copy);
+  }
+  bool reused = sent->count == 1 && strcmp(contents, "downloaded") == 0
+    && engine->CountReused() == 2 && strcmp(engine->Cursor(), "cursor-2") == 0;
+  printf("files already here are copied, not downloaded: %s\n",
+    reused ? "yes" : "NO");
+  if(!reused)
+    sent->Print();
+  sent->Clear();
+  return asked && installed && finished && quiet && reused;
+}
+
+//changes made while it wasn't running
+static bool
+offline_changes(const char *root, const char *state_path, const char *downloads)
+{
+  char path[2048];
+  sprintf(path, "%s/report (conflicted copy).txt", root);
+  unlink(path);
+  sprintf(path, "%s/Shared/offline.txt", root);
+  write_file(path, "written offline");
+
+  InotifyWatch watch;
+  RecordingTransport *sent = new RecordingTransport();
+  SyncEngine engine(root, downloads, &watch, sent);
+  engine.SetQuietTime(0);
+  bool opened = engine.Open(state_path) == 0;
+  engine.Start();
+  bool found = opened && sent->Find("rm /report (conflicted copy).txt") >= 0
+    && sent->Find("put /Shared/offline.txt ") >= 0 && sent->count == 2;
+  printf("offline changes are found at startup: %s\n", found ? "yes" : "NO");
+  if(!found)
+    sent->Print();
+  delete sent;
+  return found;
+}
+
+//a file on Dropbox, for reset_reconciles()
+struct RemoteFile
+{
+  const char *path;
+  const char *rev;
+  const char *contents;
+  char hash[CONTENT_HASH_LENGTH + 1];
+};
+
+/*
+* Answer each get that was sent for one of the files, as
+* the worker would, returns how many there were.
+*/
+static int
+serve_gets(SyncEngine *engine, RecordingTransport *sent, const RemoteFile *files,
+  int count)
+{
+  int fetched = 0;
+  for(int i = 0; i < sent->count; i++)
+  {
+    if(strncmp(sent->requests[i], "get ", 4) != 0)
+      continue;
+    char db_path[1024], temp_path[1024], rev[256];
+    sscanf(sent->requests[i], "get %s %s %s", db_path, temp_path, rev);
+    for(int j = 0; j < count; j++)
+    {
+      if(strcmp(files[j].path, db_path) != 0 || strcmp(files[j].rev, rev) != 0)
+        continue;
+      write_file(temp_path, files[j].contents);
+      engine->DownloadDone(SYNC_OK, false, db_path, temp_path, rev, files[j].hash);
+      fetched++;
+    }
+  }
+  return fetched;
+}
+
+/*
+* A synced tree, then a RESET whose listing leaves out one
+* file and has a new rev of another: only the one is
+* removed and only the other fetched, and everything else
+* stays tracked and watched.
+*/
+static bool
+reset_reconciles(const char *scratch)
+{
+  char root[1024], downloads[1024], state_path[1024], path[2048];
+  sprintf(root, "%s/Reset", scratch);
+  sprintf(downloads, "%s/reset_downloads", scratch);
+  sprintf(state_path, "%s/reset_state", scratch);
+  mkdir(root, 0755);
+  RemoteFile files[5] = {
+    {"/Music/a.ogg", "rev-1", "first track"},
+    {"/Music/b.ogg", "rev-2", "second track"},
+    {"/Music/c.ogg", "rev-3", "third track"},
+    {"/Notes/todo.txt", "rev-4", "things to do"},
+    {"/Music/b.ogg", "rev-5", "second track, remastered"}
+  };
+  sprintf(path, "%s/hashed", scratch);
+  for(int i = 0; i < 5; i++)
+  {
+    write_file(path, files[i].contents);
+    content_hash_file(path, files[i].hash);
+  }
+  unlink(path);
+
+  InotifyWatch watch;
+  RecordingTransport *sent = new RecordingTransport();
+  SyncEngine engine(root, downloads, &watch, sent);
+  engine.SetQuietTime(0);
+  engine.Open(state_path);
+  engine.Start();
+
+  engine.StartDelta();
+  DeltaItem synced[6] = {
+    {"FOLDER", {"/Music", NULL, NULL}, 1},
+    {"FILE", {files[0].path, files[0].rev, files[0].hash}, 3},
+    {"FILE", {files[1].path, files[1].rev, files[1].hash}, 3},
+    {"FILE", {files[2].path, files[2].rev, files[2].hash}, 3},
+    {"FOLDER", {"/Notes", NULL, NULL}, 1},
+    {"FILE", {files[3].path, files[3].rev, files[3].hash}, 3}
+  };
+  engine.DeltaPageDone(synced, 6, "cursor-1", false);
+  serve_gets(&engine, sent, files, 4);
+  pump(&watch, &engine);
+  engine.UploadQuietFiles();
+  size_t tracked = engine.CountTracked();
+  size_t watched = watch.CountWatched();
+  sent->Clear();
+
+  engine.StartDelta();
+  DeltaItem listing[6] = {
+    {"RESET", {NULL, NULL, NULL}, 0},
+    {"FOLDER", {"/Music", NULL, NULL}, 1},
+    {"FILE", {files[0].path, files[0].rev, files[0].hash}, 3},
+    {"FILE", {files[4].path, files[4].rev, files[4].hash}, 3},
+    {"FOLDER", {"/Notes", NULL, NULL}, 1},
+    {"FILE", {files[3].path, files[3].rev, files[3].hash}, 3}
+  };
+  engine.DeltaPageDone(listing, 6, "cursor-2", false);
+  int fetched = serve_gets(&engine, sent, files, 5);
+  pump(&watch, &engine);
+  engine.UploadQuietFiles();
+
+  char contents[64] = "";
+  sprintf(path, "%s/Music/b.ogg", root);
+  FILE *file = fopen(path, "r");
+  if(file != NULL)
+  {
+    fgets(contents, sizeof(contents), file);
+    fclose(file);
+  }
+  bool kept = true;
+  for(int i = 0; i < 4; i++)
+  {
+    sprintf(path, "%s%s", root, files[i].path);
+    kept = kept && (access(path, F_OK) == 0) == (i != 2);
+  }
+  //the delta_page and the one get, nothing sent back
+  bool ok = fetched == 1 && sent->count == 2
+    && sent->CountStarting("get /Music/b.ogg ") == 1
+    && strcmp(contents, files[4].contents) == 0 && kept
+    && engine.CountTracked() == tracked - 1 && watch.CountWatched() == watched - 1
+    && strcmp(engine.Cursor(), "cursor-2") == 0;
+  printf("a RESET removes and fetches only what differs: %s\n", ok ? "yes" : "NO");
+  if(!ok)
+    sent->Print();
+  delete sent;
+  return ok;
+}
+
+//a burst of new files
+static bool
+burst(const char *root, const char *state_path, const char *downloads, long files)
+{
+  InotifyWatch watch;
+  RecordingTransport *sent = new RecordingTransport();
+  SyncEngine engine(root, downloads, &watch, sent);
+  engine.SetQuietTime(0);
+  engine.Open(state_path);
+  engine.Start();
+  char path[2048];
+  sprintf(path, "%s/Burst", root);
+  mkdir(path, 0755);
+  pump(&watch, &engine);
+  sent->Clear();
+
+  handling_time = 0;
+  double start = now();
+  long events = 0;
+  for(long i = 0; i < files; i++)
+  {
+    sprintf(path, "%s/Burst/file%06ld.txt", root, i);
+    write_file(path, "burst");
+    //keep up, rather than overflowing the queue
+    if(i % 100 == 99)
+      events += pump(&watch, &engine, 0);
+  }
+  events += pump(&watch, &engine);
+  double upload_start = now();
+  engine.UploadQuietFiles();
+  handling_time += now() - upload_start;
+  double took = now() - start;
+  bool all = sent->CountStarting("put /Burst/") == files;
+  printf("%ld new files: %ld events in %.3f s, %.0f events a second, "
+    "%ld watched, all uploads queued %.3f s after the first write\n",
+    files, events, handling_time, events / handling_time,
+    (long)watch.CountWatched(), took);
+  printf("every new file is uploaded: %s\n", all ? "yes" : "NO");
+  delete sent;
+  return all;
+}
+
+int
+main(int argc, char **argv)
+{
+  long files = 5000;
+  const char *scratch = "engine_test.tmp";
+  if(argc > 1)
+    files = atol(argv[1]);
+  if(argc > 2)
+    scratch = argv[2];
+
+  char root[1024], downloads[1024], state_path[1024], command[1100];
+  sprintf(command, "rm -rf %s", scratch);
+  system(command);
+  mkdir(scratch, 0755);
+  sprintf(root, "%s/Dropbox", scratch);
+  sprintf(downloads, "%s/downloads", scratch);
+  sprintf(state_path, "%s/sync_state", scratch);
+  mkdir(root, 0755);
+
+  bool ok;
+  {
+    InotifyWatch watch;
+    RecordingTransport *sent = new RecordingTransport();
+    SyncEngine engine(root, downloads, &watch, sent);
+    engine.SetQuietTime(0);
+    if(watch.InitCheck() != 0 || engine.Open(state_path) != 0)
+    {
+      printf("could not set up: %s\n", strerror(watch.InitCheck()));
+      return 1;
+    }
+    engine.Start();
+    ok = local_changes(root, &watch, &engine, sent);
+    ok = remote_changes(root, downloads, &watch, &engine, sent) && ok;
+    delete sent;
+  }
+  ok = offline_changes(root, state_path, downloads) && ok;
+  ok = burst(root, state_path, downloads, files) && ok;
+  ok = reset_reconciles(scratch) && ok;
+
+  system(command);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,621 @@
+import BaseHTTPServer
+import SocketServer
+import hashlib
+import json
+import random
+import socket
+import sys
+import threading
+import time
+
+# A local stand-in for the parts of the Dropbox API v2 that the client uses,
+# keeping everything in memory.  Point the client at it by setting
+# DBFORHAIKU_SERVER=http://127.0.0.1:<port> in the environment.
+#
+# Run it directly with "python fake_dropbox_server.py [port] [latency]", or
+# from another script with start_server().  The latency (in seconds) is
+# added to every request, to stand in for the round trip to Dropbox, and a
+# stream rate (in bytes per second) limits how fast each connection can send
+# a body either way, to stand in for what one transfer gets of a real link.
+# A drop rate (0 to 1) is the chance of any one request having its
+# connection cut, either before the server acts on it or part way through
+# sending the answer.  An error rate (0 to 1) is the chance of a request
+# being turned away instead, with a 503 or a 429 asking for a retry, as
+# Dropbox does when it's busy.
+
+def content_hash(data):
+    overall = hashlib.sha256()
+    for start in range(0, len(data), 4 * 1024 * 1024):
+        overall.update(hashlib.sha256(data[start:start + 4 * 1024 * 1024])
+            .digest())
+    return overall.hexdigest()
+
+class FakeDropbox(object):
+    """The stored files and folders, plus a log of changed paths that
+    list_folder cursors index into."""
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.entries = {} # Lower case path to metadata, files have 'data'.
+        self.changes = [] # Lower case paths, in order of change.
+        self.change_times = {} # Lower case path to when it last changed.
+        self.next_rev = 1
+        self.snapshots = {} # Listings being paged through, by position.
+        self.requests = 0
+        self.connections = 0
+        self.uploads = 0
+        self.upload_bytes = 0
+        self.download_bytes = 0 # File bytes sent, even if cut off.
+        self.sent_bytes = 0 # Every response body byte sent.
+        self.received_bytes = 0 # Every request body byte, as it comes in.
+        self.sessions = {} # Upload session id to the bytes so far.
+        self.next_session = 1
+        self.dropped = 0
+        self.errors = 0 # Requests turned away by the error rate.
+        self.longpolls = 0
+        self.change_signal = threading.Condition(self.lock)
+        self.batch_jobs = {} # Async job id to the finished job's result.
+        self.next_job = 1
+        self.cursor_prefix = '' # In front of every cursor given out.
+        self.expirations = 0
+
+    def expire_cursors(self):
+        """Forget every cursor given out so far, as Dropbox does now and
+        then, so the next list_folder/continue or long poll with one is
+        turned away with a reset.  Hold the lock."""
+        self.expirations += 1
+        self.cursor_prefix = 'g%d:' % self.expirations
+        self.change_signal.notify_all()
+
+    def new_rev(self):
+        rev = '%09x' % self.next_rev
+        self.next_rev += 1
+        return rev
+
+    def changed(self, lower):
+        self.changes.append(lower)
+        self.change_times[lower] = time.time()
+        self.change_signal.notify_all()
+
+    def add_parents(self, path):
+        parts = path.split('/')
+        for i in range(2, len(parts)):
+            parent = '/'.join(parts[:i])
+            if parent.lower() not in self.entries:
+                self.entries[parent.lower()] = {'.tag': 'folder',
+                    'name': parts[i - 1], 'path_display': parent,
+                    'path_lower': parent.lower(), 'id': 'id:' + parent.lower()}
+                self.changed(parent.lower())
+
+    def put_file(self, path, data, mode, autorename):
+        lower = path.lower()
+        old = self.entries.get(lower)
+        if old is not None and old.get('data') == data:
+            return old # Dropbox doesn't make a new rev for the same bytes.
+        if old is not None and \
+                old.get('rev') != mode.get('update'):
+            # A new file where one exists, or an edit of an old version.
+            if not autorename:
+                return None
+            dot = path.rfind('.')
+            if dot <= path.rfind('/'):
+                dot = len(path)
+            copy = 1
+            while (path[:dot] + ' (%d)' % copy + path[dot:]).lower() in \
+                    self.entries:
+                copy += 1
+            path = path[:dot] + ' (%d)' % copy + path[dot:]
+            lower = path.lower()
+        self.add_parents(path)
+        entry = {'.tag': 'file', 'name': path.split('/')[-1],
+            'path_display': path, 'path_lower': lower, 'id': 'id:' + lower,
+            'rev': self.new_rev(), 'size': len(data),
+            'server_modified': time.strftime('%Y-%m-%dT%H:%M:%SZ',
+                time.gmtime()),
+            'content_hash': content_hash(data), 'data': data}
+        self.entries[lower] = entry
+        self.changed(lower)
+        return entry
+
+    def remove(self, path):
+        lower = path.lower()
+        if lower not in self.entries:
+            return None
+        entry = self.entries.pop(lower)
+        if entry['.tag'] == 'file':
+            self.changed(lower)
+            return entry
+        for other in self.entries.keys():
+            if other.startswith(lower + '/'):
+                del self.entries[other]
+                self.changed(other)
+        self.changed(lower)
+        return entry
+
+    def move(self, from_path, to_path):
+        from_lower = from_path.lower()
+        if from_lower not in self.entries:
+            return None
+        self.add_parents(to_path)
+        if self.entries[from_lower]['.tag'] == 'file':
+            moving = [(from_lower, self.entries.pop(from_lower))]
+        else:
+            moving = [(key, self.entries.pop(key))
+                for key in self.entries.keys()
+                if key == from_lower or key.startswith(from_lower + '/')]
+        result = None
+        for key, entry in moving:
+            display = to_path + entry['path_display'][len(from_path):]
+            entry = dict(entry)
+            entry['path_display'] = display
+            entry['path_lower'] = display.lower()
+            entry['name'] = display.split('/')[-1]
+            self.entries[display.lower()] = entry
+            self.changed(key)
+            self.changed(display.lower())
+            if key == from_lower:
+                result = entry
+        return result
+
+    def listing(self, lower):
+        """The metadata of a path as list_folder reports it."""
+        entry = self.entries.get(lower)
+        if entry is None:
+            return {'.tag': 'deleted', 'name': lower.split('/')[-1],
+                'path_display': lower, 'path_lower': lower}
+        return dict((k, v) for k, v in entry.items() if k != 'data')
+
+class Handler(BaseHTTPServer.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1' # Keep connections alive.
+    wbufsize = -1 # Send each response in one piece, flushed per request.
+    disable_nagle_algorithm = True
+
+    def setup(self):
+        BaseHTTPServer.BaseHTTPRequestHandler.setup(self)
+        with self.server.db.lock:
+            self.server.db.connections += 1
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_body(self, status, body, headers={}):
+        """Sent once the handler is done, without the lock held."""
+        self.response = (status, body, headers)
+
+    def stream_time(self, size):
+        if self.server.stream_rate > 0:
+            time.sleep(float(size) / self.server.stream_rate)
+
+    def send_json(self, value):
+        self.send_body(200, json.dumps(value),
+            {'Content-Type': 'application/json'})
+
+    def send_error_tag(self, tag):
+        self.send_body(409, json.dumps({'error_summary': tag + '/',
+            'error': {'.tag': tag}}), {'Content-Type': 'application/json'})
+
+    def bad_path(self, route, arg):
+        """The first path in arg that Dropbox would turn away, None if
+        there isn't one.  Paths start with "/" (or are "rev:<rev>" to
+        download); "" is the root, which only listing takes."""
+        paths = []
+        if isinstance(arg, dict):
+            for item in [arg, arg.get('commit') or {}] + \
+                    list(arg.get('entries') or []):
+                paths += [item[key] for key in ('path', 'from_path',
+                    'to_path') if key in item]
+            paths += arg.get('paths') or []
+        for path in paths:
+            if path.startswith('/') or path.startswith('rev:'):
+                continue
+            if path == '' and route == 'files/list_folder':
+                continue
+            return path
+        return None
+
+    def drop(self):
+        """Cut the connection without answering."""
+        with self.server.db.lock:
+            self.server.db.dropped += 1
+        self.close_connection = 1
+        try:
+            self.connection.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+
+    def do_POST(self):
+        length = int(self.headers.getheader('content-length', '0'))
+        drop = random.random() < self.server.drop_rate
+        if drop and random.random() < 0.5:
+            # Part way through the body, the request never arrives.
+            self.rfile.read(random.randint(0, length))
+            self.drop()
+            return
+        db = self.server.db
+        pieces = []
+        while length > 0:
+            pieces.append(self.rfile.read(min(length, 64 * 1024)))
+            if not pieces[-1]:
+                break
+            length -= len(pieces[-1])
+            with db.lock:
+                db.received_bytes += len(pieces[-1])
+        body = ''.join(pieces)
+        if self.server.latency > 0:
+            time.sleep(self.server.latency)
+        route = self.path[len('/2/'):]
+        if self.headers.getheader('dropbox-api-arg') is not None:
+            arg = json.loads(self.headers.getheader('dropbox-api-arg'))
+        elif len(body) > 0:
+            arg = json.loads(body)
+        else:
+            arg = None
+        handler = getattr(self, 'route_' + route.replace('/', '_'), None)
+        bad_path = self.bad_path(route, arg)
+        if handler is None:
+            self.send_body(404, 'Unknown route ' + route)
+        elif bad_path is not None:
+            self.send_body(400, 'Error in call to API function "%s": path: '
+                '%r did not match pattern \'/(.|[\\r\\n])*\'' %
+                (route, bad_path))
+        elif random.random() < self.server.error_rate and \
+                route != 'files/list_folder/longpoll':
+            with db.lock:
+                db.errors += 1
+            if random.random() < 0.5:
+                self.send_body(429, 'too_many_requests', {'Retry-After': '0'})
+            else:
+                self.send_body(503, 'Service Unavailable')
+        else:
+            self.stream_time(len(body))
+            with db.lock:
+                db.requests += 1
+                handler(db, arg, body)
+        status, body, headers = self.response
+        sending = body
+        if drop:
+            # Done, but only some of the answer gets back.
+            sending = body[:random.randint(0, len(body))]
+        self.send_response(status)
+        for name, value in headers.items():
+            self.send_header(name, value)
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        piece = max(len(sending), 1)
+        if self.server.stream_rate > 0:
+            piece = 64 * 1024 # Trickled out, so it can be cut off midway.
+        for start in range(0, len(sending), piece) or [0]:
+            self.stream_time(len(sending[start:start + piece]))
+            self.wfile.write(sending[start:start + piece])
+            self.wfile.flush()
+            with db.lock:
+                db.sent_bytes += len(sending[start:start + piece])
+                if route == 'files/download':
+                    db.download_bytes += len(sending[start:start + piece])
+        if drop:
+            self.drop()
+
+    def route_files_upload(self, db, arg, body):
+        db.uploads += 1
+        db.upload_bytes += len(body)
+        entry = db.put_file(arg['path'], body, arg.get('mode', {}),
+            arg.get('autorename', False))
+        if entry is None:
+            self.send_error_tag('path')
+        else:
+            self.send_json(db.listing(entry['path_lower']))
+
+    # Session ids are kept after finishing (as None) so a finish that is
+    # repeated gets "closed" rather than "not_found", like Dropbox.  Finish
+    # wraps lookup errors in lookup_failed, append doesn't.
+
+    def session_lookup(self, db, cursor, wrap):
+        """The bytes so far of the session, or None having sent the error."""
+        data = db.sessions.get(cursor['session_id'], False)
+        if data is False:
+            error = {'.tag': 'not_found'}
+        elif data is None:
+            error = {'.tag': 'closed'}
+        elif cursor['offset'] != len(data):
+            error = {'.tag': 'incorrect_offset', 'correct_offset': len(data)}
+        else:
+            return data
+        summary = error['.tag'] + '/'
+        if wrap:
+            error = {'.tag': 'lookup_failed', 'lookup_failed': error}
+            summary = 'lookup_failed/' + summary
+        self.send_body(409, json.dumps({'error_summary': summary,
+            'error': error}), {'Content-Type': 'application/json'})
+        return None
+
+    def route_files_upload_session_start(self, db, arg, body):
+        db.upload_bytes += len(body)
+        session_id = 'session:%d' % db.next_session
+        db.next_session += 1
+        db.sessions[session_id] = body
+        self.send_json({'session_id': session_id})
+
+    def route_files_upload_session_append_v2(self, db, arg, body):
+        db.upload_bytes += len(body)
+        data = self.session_lookup(db, arg['cursor'], False)
+        if data is not None:
+            db.sessions[arg['cursor']['session_id']] = data + body
+            self.send_body(200, 'null', {'Content-Type': 'application/json'})
+
+    def route_files_upload_session_finish(self, db, arg, body):
+        db.upload_bytes += len(body)
+        data = self.session_lookup(db, arg['cursor'], True)
+        if data is None:
+            return
+        db.sessions[arg['cursor']['session_id']] = None
+        db.uploads += 1
+        commit = arg['commit']
+        entry = db.put_file(commit['path'], data + body,
+            commit.get('mode', {}), commit.get('autorename', False))
+        if entry is None:
+            self.send_error_tag('path')
+        else:
+            self.send_json(db.listing(entry['path_lower']))
+
+    def lookup(self, db, path):
+        """The entry at a path or "rev:<rev>", None if there isn't one."""
+        if path.startswith('rev:'):
+            for candidate in db.entries.values():
+                if candidate.get('rev') == path[4:]:
+                    return candidate
+            return None
+        return db.entries.get(path.lower())
+
+    def route_files_get_metadata(self, db, arg, body):
+        entry = self.lookup(db, arg['path'])
+        if entry is None:
+            self.send_error_tag('path')
+        else:
+            self.send_json(db.listing(entry['path_lower']))
+
+    def route_files_download(self, db, arg, body):
+        entry = self.lookup(db, arg['path'])
+        if entry is None or entry['.tag'] != 'file':
+            self.send_error_tag('path')
+            return
+        headers = {'Content-Type': 'application/octet-stream',
+            'Dropbox-API-Result': json.dumps(db.listing(entry['path_lower']))}
+        data = entry['data']
+        asked = self.headers.getheader('range', '')
+        if not asked.startswith('bytes=') or not asked.endswith('-'):
+            self.send_body(200, data, headers)
+            return
+        start = int(asked[len('bytes='):-1])
+        if start >= len(data):
+            self.send_body(416, '', {'Content-Range':
+                'bytes */%d' % len(data)})
+            return
+        headers['Content-Range'] = 'bytes %d-%d/%d' % (start, len(data) - 1,
+            len(data))
+        self.send_body(206, data[start:], headers)
+
+    def route_files_delete_v2(self, db, arg, body):
+        entry = db.remove(arg['path'])
+        if entry is None:
+            self.send_error_tag('path_lookup')
+        else:
+            self.send_json({'metadata': db.listing(entry['path_lower'])})
+
+    def route_files_move_v2(self, db, arg, body):
+        entry = db.move(arg['from_path'], arg['to_path'])
+        if entry is None:
+            self.send_error_tag('from_lookup')
+        else:
+            self.send_json({'metadata': db.listing(entry['path_lower'])})
+
+    def route_files_create_folder_v2(self, db, arg, body):
+        path = arg['path']
+        if path.lower() in db.entries:
+            self.send_error_tag('path')
+            return
+        db.add_parents(path + '/x')
+        self.send_json({'metadata': db.listing(path.lower())})
+
+    # Batch jobs are done straight away, but (like Dropbox) answered with a
+    # job id that has to be checked for the results.
+
+    def start_job(self, db, results):
+        job = 'job%d' % db.next_job
+        db.next_job += 1
+        db.batch_jobs[job] = {'.tag': 'complete', 'entries': results}
+        self.send_json({'.tag': 'async_job_id', 'async_job_id': job})
+
+    def check_job(self, db, arg):
+        result = db.batch_jobs.get(arg.get('async_job_id'))
+        if result is None:
+            self.send_error_tag('invalid_async_job_id')
+        else:
+            self.send_json(result)
+
+    def batch_result(self, db, entry, failure):
+        if entry is None:
+            return {'.tag': 'failure', 'failure': failure}
+        return {'.tag': 'success',
+            'metadata': db.listing(entry['path_lower'])}
+
+    def route_files_delete_batch(self, db, arg, body):
+        self.start_job(db, [self.batch_result(db, db.remove(item['path']),
+            {'.tag': 'path_lookup', 'path_lookup': {'.tag': 'not_found'}})
+            for item in arg['entries']])
+
+    def route_files_delete_batch_check(self, db, arg, body):
+        self.check_job(db, arg)
+
+    def route_files_move_batch_v2(self, db, arg, body):
+        results = []
+        for item in arg['entries']:
+            entry = db.move(item['from_path'], item['to_path'])
+            result = self.batch_result(db, entry, {'.tag': 'from_lookup',
+                'from_lookup': {'.tag': 'not_found'}})
+            if entry is not None:
+                result['success'] = result.pop('metadata')
+            results.append(result)
+        self.start_job(db, results)
+
+    def route_files_move_batch_check_v2(self, db, arg, body):
+        self.check_job(db, arg)
+
+    def route_files_create_folder_batch(self, db, arg, body):
+        results = []
+        for path in arg['paths']:
+            entry = None
+            if path.lower() not in db.entries:
+                db.add_parents(path + '/x')
+                entry = db.entries[path.lower()]
+            results.append(self.batch_result(db, entry, {'.tag': 'path',
+                'path': {'.tag': 'conflict'}}))
+        self.start_job(db, results)
+
+    def route_files_create_folder_batch_check(self, db, arg, body):
+        self.check_job(db, arg)
+
+    # Cursors are "<change log position>:<page size>" once caught up, or
+    # "list:<offset>:<page size>:<change log position>" part way through
+    # listing everything.
+
+    def list_changes(self, db, start, limit):
+        end = min(len(db.changes), start + limit)
+        seen = set()
+        entries = []
+        for lower in db.changes[start:end]:
+            if lower not in seen:
+                seen.add(lower)
+                entries.append(db.listing(lower))
+        self.send_json({'entries': entries,
+            'cursor': db.cursor_prefix + '%d:%d' % (end, limit),
+            'has_more': end < len(db.changes)})
+
+    def list_everything(self, db, offset, limit, position):
+        # The state as of the change log position, in the order things were
+        # last changed.  Made once per position, a big listing has many pages.
+        live = db.snapshots.get(position)
+        if live is None:
+            latest = {}
+            for i, lower in enumerate(db.changes[:position]):
+                latest[lower] = i
+            live = [lower for i, lower in sorted((i, lower) for lower, i in
+                latest.items() if lower in db.entries)]
+            db.snapshots = {position: live}
+        entries = [db.listing(lower) for lower in live[offset:offset + limit]]
+        if offset + limit < len(live):
+            cursor = 'list:%d:%d:%d' % (offset + limit, limit, position)
+            has_more = True
+        else:
+            cursor = '%d:%d' % (position, limit)
+            has_more = position < len(db.changes)
+        self.send_json({'entries': entries,
+            'cursor': db.cursor_prefix + cursor, 'has_more': has_more})
+
+    def route_files_list_folder(self, db, arg, body):
+        limit = arg.get('limit', self.server.page_size)
+        self.list_everything(db, 0, limit, len(db.changes))
+
+    def route_files_list_folder_continue(self, db, arg, body):
+        cursor = arg['cursor']
+        if not cursor.startswith(db.cursor_prefix):
+            self.send_error_tag('reset')
+            return
+        cursor = cursor[len(db.cursor_prefix):]
+        try:
+            parts = [int(part) for part in
+                cursor.replace('list:', '').split(':')]
+        except ValueError:
+            parts = [-1, 0]
+        if cursor.startswith('list:') and len(parts) == 3 and \
+                parts[2] <= len(db.changes):
+            self.list_everything(db, parts[0], parts[1], parts[2])
+        elif len(parts) == 2 and 0 <= parts[0] <= len(db.changes):
+            self.list_changes(db, parts[0], parts[1])
+        else:
+            self.send_error_tag('reset')
+
+    def route_files_list_folder_longpoll(self, db, arg, body):
+        # Waits with the lock let go, so changes can come in meanwhile.
+        if not self.server.longpoll:
+            self.send_body(404, 'Unknown route files/list_folder/longpoll')
+            return
+        db.longpolls += 1
+        cursor = arg.get('cursor', '')
+        prefix = db.cursor_prefix
+        if not cursor.startswith(prefix):
+            self.send_error_tag('reset')
+            return
+        cursor = cursor[len(prefix):]
+        try:
+            parts = [int(part) for part in
+                cursor.replace('list:', '').split(':')]
+        except ValueError:
+            parts = []
+        if cursor.startswith('list:') and len(parts) == 3:
+            position = -1 # Still listing, there's more to get now.
+        elif len(parts) == 2 and 0 <= parts[0] <= len(db.changes):
+            position = parts[0]
+        else:
+            self.send_error_tag('reset')
+            return
+        deadline = time.time() + arg.get('timeout', 30)
+        while len(db.changes) <= position and time.time() < deadline and \
+                db.cursor_prefix == prefix:
+            db.change_signal.wait(deadline - time.time())
+        if db.cursor_prefix != prefix:
+            self.send_error_tag('reset')
+            return
+        result = {'changes': len(db.changes) > position}
+        if self.server.longpoll_backoff > 0:
+            result['backoff'] = self.server.longpoll_backoff
+        self.send_json(result)
+
+class Server(SocketServer.ThreadingMixIn, BaseHTTPServer.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def handle_error(self, request, client_address):
+        # Cut connections are part of the tests, don't log them.  Nor a
+        # long poll still waiting as Python exits, when sys is gone.
+        if sys is None:
+            return
+        if not isinstance(sys.exc_info()[1], socket.error):
+            BaseHTTPServer.HTTPServer.handle_error(self, request,
+                client_address)
+
+def start_server(port=0, latency=0.0, page_size=2000, stream_rate=0,
+        drop_rate=0.0, longpoll=True, longpoll_backoff=0, error_rate=0.0):
+    """Start a stand-in server on a background thread and return it.  Its
+    url attribute is what to put in DBFORHAIKU_SERVER, its db attribute the
+    FakeDropbox holding the files.  Without longpoll it doesn't have that
+    endpoint, with a longpoll_backoff every longpoll asks for that many
+    seconds before the next.  The error_rate doesn't apply to longpolls,
+    which would otherwise fall back to polling."""
+    server = Server(('127.0.0.1', port), Handler)
+    server.db = FakeDropbox()
+    server.latency = latency
+    server.page_size = page_size
+    server.stream_rate = stream_rate
+    server.drop_rate = drop_rate
+    server.longpoll = longpoll
+    server.longpoll_backoff = longpoll_backoff
+    server.error_rate = error_rate
+    server.url = 'http://127.0.0.1:%d' % server.server_address[1]
+    thread = threading.Thread(target=server.serve_forever)
+    thread.daemon = True
+    thread.start()
+    return server
+
+if __name__ == '__main__':
+    port = 8765
+    latency = 0.0
+    if len(sys.argv) > 1:
+        port = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        latency = float(sys.argv[2])
+    server = start_server(port, latency)
+    print "Fake Dropbox server at", server.url
+    try:
+        while True:
+            time.sleep(3600)
+    except KeyboardInterrupt:
+        pass
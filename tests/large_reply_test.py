@@ -0,0 +1,116 @@
+import Queue
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from fake_dropbox_server import start_server
+
+# Makes db_worker.py send back a reply several megabytes long (one enormous
+# delta page) and reads it two ways.
+#
+# First the way the client used to run its scripts: wait for the child to
+# exit, then read its output.  The child fills the pipe and blocks, so it
+# never exits; here that gives up after a few seconds instead of hanging.
+#
+# Then the way TransferQueue does it: a separate thread reads every frame as
+# it arrives and posts the whole reply back when it's done, while the main
+# thread (standing in for the application looper) carries on handling its
+# own ticks.
+#
+# usage: python large_reply_test.py [file count]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+GIVE_UP = 5.0
+TICK = 0.01
+
+def wait_then_read(env, count):
+    """Returns whether the child exited before its output was read."""
+    child = subprocess.Popen(['python', WORKER, '--once', 'delta_page', '',
+        str(count)], env=env, stdout=subprocess.PIPE)
+    deadline = time.time() + GIVE_UP
+    while child.poll() is None and time.time() < deadline:
+        time.sleep(0.1)
+    exited = child.poll() is not None
+    child.stdout.read() # Unblock it so it can finish.
+    child.wait()
+    return exited
+
+def read_frames(worker, replies):
+    items = 0
+    size = 0
+    while True:
+        (length,) = struct.unpack('>I', worker.stdout.read(4))
+        frame = worker.stdout.read(length).split('\0')
+        size += 4 + length
+        if frame[0] in ('OK', 'ERROR'):
+            replies.put((frame[0], items, size))
+            return
+        items += 1
+
+def transfer_thread(env, count):
+    """Returns the reply, its size, how long it took and the ticks handled."""
+    worker = subprocess.Popen(['python', WORKER], env=env,
+        stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    payload = '\0'.join(['delta_page', '', str(count)])
+    worker.stdin.write(struct.pack('>I', len(payload)) + payload)
+    worker.stdin.flush()
+
+    replies = Queue.Queue()
+    reader = threading.Thread(target=read_frames, args=(worker, replies))
+    reader.daemon = True
+    start = time.time()
+    reader.start()
+    ticks = 0
+    reply = None
+    while reply is None and time.time() - start < 60:
+        try:
+            reply = replies.get(timeout=TICK)
+        except Queue.Empty:
+            ticks += 1
+    elapsed = time.time() - start
+    worker.stdin.close()
+    worker.wait()
+    return reply, elapsed, ticks
+
+def main(count):
+    server = start_server()
+    with server.db.lock:
+        for i in range(count):
+            server.db.put_file('/station/archive/2014/autumn/long playing '
+                'record side %06d.flac' % i, 'x', {}, False)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        env = dict(os.environ)
+        env['DBFORHAIKU_SERVER'] = server.url
+        os.chdir(directory)
+
+        exited = wait_then_read(env, count)
+        print "wait, then read: child %s" % (exited and "exited" or
+            "still blocked after %.0fs" % GIVE_UP)
+        reply, elapsed, ticks = transfer_thread(env, count)
+        print "read as it arrives: %s, %d items, %.1f MB in %.2fs, " \
+            "%d ticks handled meanwhile" % (reply[0], reply[1],
+            reply[2] / 1e6, elapsed, ticks)
+
+        print "Checking Assertions:"
+        print "reply bigger than a pipe:", reply[2] > 1024 * 1024
+        print "waiting first never finishes:", not exited
+        print "reading as it arrives finishes:", reply[0] == 'OK'
+        print "every item arrived:", reply[1] == count + 1 # and a RESET
+        print "looper kept ticking:", ticks >= elapsed / TICK / 2
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    count = 40000
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    main(count)
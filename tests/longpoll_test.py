@@ -0,0 +1,192 @@
+import os
+import random
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+from delta_paging_test import Worker
+from fake_dropbox_server import start_server
+
+# How often an idle client wakes up, and how long a change on Dropbox takes
+# to be applied, three ways: pulling the delta every 10 seconds (what
+# hdbclient.exe used to do), waiting on files/list_folder/longpoll (what it
+# does now), and the polling it falls back to when long polls don't work,
+# which waits twice as long each time nothing has changed.  The client's
+# side is played here with two db_worker.py processes (one for the delta,
+# one for the long poll) against the stand-in server, the same way the
+# client does it.
+#
+# The waits are scaled down (by 0.025 unless given, which makes the long
+# poll timeout a whole 3 seconds) so this runs in under a minute, and are
+# reported at full scale.  Long poll latency doesn't depend on any wait, so
+# that's as measured.  Also checks that a backoff from the server is honoured.
+#
+# usage: python longpoll_test.py [scale]
+
+POLL = 10.0 # The old fixed interval, and the first fallback one.
+MAX_POLL = 300.0
+LONGPOLL_TIMEOUT = 120.0
+IDLE = 600.0 # How long to sit idle for.
+CHANGES = 10
+
+class Client(threading.Thread):
+    def __init__(self, env, scale, longpoll, adaptive):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.delta = Worker(env)
+        self.notify = Worker(env)
+        self.scale = scale
+        self.longpoll = longpoll
+        self.adaptive = adaptive
+        self.cursor = ''
+        self.applied = {} # Path to when its FILE item was applied.
+        self.wakeups = 0
+        self.longpoll_times = []
+        self.stopping = threading.Event()
+        self.caught_up = threading.Event()
+
+    def pull(self):
+        """Apply every page of the delta, returns whether it had anything."""
+        changed = False
+        more = True
+        while more:
+            items, final = self.delta.request('delta_page', self.cursor,
+                '500')
+            assert final[0] == 'OK', final
+            for item in items:
+                if item[0] == 'FILE':
+                    self.applied.setdefault(item[1], time.time())
+                changed = True
+            self.cursor = final[1]
+            more = final[2] == '1'
+        return changed
+
+    def run(self):
+        interval = POLL
+        self.pull()
+        self.caught_up.set()
+        not_before = 0
+        while not self.stopping.is_set():
+            if self.longpoll:
+                self.stopping.wait(max(0, not_before - time.time()))
+                if self.stopping.is_set():
+                    break
+                self.longpoll_times.append(time.time())
+                items, final = self.notify.request('longpoll', self.cursor,
+                    str(max(1, int(round(LONGPOLL_TIMEOUT * self.scale)))))
+                self.wakeups += 1
+                if final[0] == 'OK':
+                    if int(final[2]) > 0:
+                        not_before = time.time() + int(final[2])
+                    if final[1] == '1' and self.pull():
+                        interval = POLL
+                    continue
+            self.stopping.wait(interval * self.scale)
+            self.wakeups += 1
+            if self.pull() or not self.adaptive:
+                interval = POLL
+            else:
+                interval = min(interval * 2, MAX_POLL)
+
+    def stop(self):
+        self.stopping.set()
+        self.join()
+        self.delta.stop()
+        self.notify.stop()
+
+def idle_wakeups(server, env, scale, longpoll, adaptive):
+    client = Client(env, scale, longpoll, adaptive)
+    client.start()
+    client.caught_up.wait()
+    time.sleep(IDLE * scale)
+    wakeups = client.wakeups
+    client.stop()
+    return wakeups * 3600.0 / IDLE
+
+def latency(server, env, scale, longpoll, adaptive):
+    """Mean and worst seconds from a change on Dropbox to the client
+    applying it."""
+    client = Client(env, scale, longpoll, adaptive)
+    client.start()
+    client.caught_up.wait()
+    changed = {}
+    for i in range(CHANGES):
+        time.sleep(random.uniform(0, POLL * scale))
+        path = '/Inbox/note %d %f.txt' % (i, time.time())
+        with server.db.lock:
+            server.db.put_file(path, 'changed', {}, False)
+        changed[path] = time.time()
+    deadline = time.time() + 2 * MAX_POLL * scale + 5
+    while time.time() < deadline and \
+            not all(path in client.applied for path in changed):
+        time.sleep(0.01)
+    client.stop()
+    delays = [client.applied.get(path, deadline) - changed[path]
+        for path in changed]
+    return sum(delays) / len(delays), max(delays)
+
+def main(scale):
+    random.seed(7)
+    server = start_server()
+    without_longpoll = start_server(longpoll=False)
+    backing_off = start_server(longpoll_backoff=1)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        os.chdir(directory)
+        env = dict(os.environ)
+
+        results = []
+        for name, running, longpoll, adaptive, unscaled in (
+                ('poll every 10 s', server, False, False, False),
+                ('long poll', server, True, True, True),
+                ('fallback polling', without_longpoll, True, True, False)):
+            env['DBFORHAIKU_SERVER'] = running.url
+            per_hour = idle_wakeups(running, env, scale, longpoll, adaptive)
+            mean, worst = latency(running, env, scale, longpoll, adaptive)
+            if not unscaled:
+                mean /= scale
+                worst /= scale
+            results.append((name, per_hour, mean, worst))
+            print "%-17s %6.1f idle wakeups an hour, change applied after" \
+                " %7.3f s on average, %7.3f s at worst" % \
+                (name, per_hour, mean, worst)
+
+        # Changes keep coming, but each long poll waits out the backoff.
+        env['DBFORHAIKU_SERVER'] = backing_off.url
+        client = Client(env, scale, True, True)
+        client.start()
+        client.caught_up.wait()
+        for i in range(4):
+            with backing_off.db.lock:
+                backing_off.db.put_file('/Inbox/busy %d.txt' % i, 'x', {},
+                    False)
+            time.sleep(0.6)
+        client.stop()
+        gaps = [b - a for a, b in zip(client.longpoll_times,
+            client.longpoll_times[1:])]
+        print "long polls with a 1 s backoff: %d, closest %.2f s apart" % \
+            (len(client.longpoll_times), min(gaps or [0]))
+
+        polled, long_polled, fallback = results
+        print "Checking Assertions:"
+        print "long poll wakes up less than polling:", \
+            long_polled[1] < polled[1] / 5
+        print "long poll applies changes sooner:", \
+            long_polled[3] < polled[2] / 10
+        print "fallback polling still applies every change:", \
+            fallback[3] < 2 * MAX_POLL
+        print "fallback polling wakes up less than polling:", \
+            fallback[1] < polled[1]
+        print "backoff honoured:", len(gaps) > 0 and min(gaps) >= 0.95
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    scale = 0.025
+    if len(sys.argv) > 1:
+        scale = float(sys.argv[1])
+    main(scale)
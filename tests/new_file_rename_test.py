@@ -1,38 +1,35 @@
-from subprocess import Popen
 import time
 import os
 
+from client_harness import start_client, stop_client
+from fake_dropbox_server import start_server
+
 #setup
 os.system("rm -rf /boot/home/Dropbox/*")
-os.system("rm log.txt lines_*")
-os.system("touch log.txt")
+server = start_server()
 
 # start dbclient
-p = Popen(["../objects.x86-gcc2-release/hdbclient.exe"])
+p, directory = start_client(server)
 time.sleep(2)
 
-#tell db_put what to say
-putlines = open("lines_db_put.txt",'w+')
-putlines.write("success AAAAA")
-putlines.close()
+#someone else uploads a foo first
+with server.db.lock:
+  server.db.put_file("/foo", "Other computer", {'.tag': 'add'}, True)
 
-#create file
+#create file, Dropbox should rename ours to "foo (1)"
 foo = open("/boot/home/Dropbox/foo",'w+')
 foo.write("Hello,World")
 foo.close()
 
-#tell db_delta what to say
-deltalines = open("lines_db_delta.txt",'w+')
-deltalines.write("FILE /foo")
-deltalines.close()
-
-#wait for pull-deltas to finish
-time.sleep(10)
+#wait for the upload and a pull-deltas to finish
+time.sleep(12)
 
 # kill dbclient
-p.kill()
+stop_client(p, directory)
 
 # produce result
 print "Checking Assertions:"
-os.system("cat log.txt")
-
+print "renamed on Dropbox:", "/foo (1)" in server.db.entries
+print "renamed locally:", os.path.exists("/boot/home/Dropbox/foo (1)")
+print "other foo downloaded:", \
+  open("/boot/home/Dropbox/foo").read() == "Other computer"
@@ -0,0 +1,123 @@
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from fake_dropbox_server import start_server
+
+# Downloads a big file with db_worker.py through a stand-in server that cuts
+# connections at random, once asking for the rev (which lets the worker
+# carry on from where each attempt got to) and once by path (which makes it
+# start over), and prints how many bytes were sent more than once each way.
+# Then downloads it over a slow link, kills the worker half way through as
+# if the client had been killed, and checks that a new worker only fetches
+# the rest.
+#
+# usage: python ranged_download_test.py [size in MB] [drop rate]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+
+class Worker(object):
+    def __init__(self, env):
+        self.process = subprocess.Popen(['python', WORKER], env=env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def send(self, *fields):
+        payload = '\0'.join(fields)
+        self.process.stdin.write(struct.pack('>I', len(payload)) + payload)
+        self.process.stdin.flush()
+
+    def reply(self):
+        (length,) = struct.unpack('>I', self.process.stdout.read(4))
+        return self.process.stdout.read(length).split('\0')
+
+    def stop(self):
+        self.process.stdin.close()
+        self.process.wait()
+
+    def kill(self):
+        self.process.kill()
+        self.process.wait()
+
+def get(env, *args):
+    worker = Worker(env)
+    worker.send('get', *args)
+    final = worker.reply()
+    worker.stop()
+    return final
+
+def contents_of(path):
+    with open(path, 'rb') as f:
+        return f.read()
+
+def main(megabytes, drop_rate):
+    size = megabytes * 1024 * 1024
+    contents = os.urandom(size)
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        os.chdir(directory)
+        env = dict(os.environ)
+        checks = []
+
+        for how in ('rev', 'path'):
+            random.seed(1)
+            server = start_server(drop_rate=drop_rate)
+            env['DBFORHAIKU_SERVER'] = server.url
+            with server.db.lock:
+                rev = server.db.put_file('/recording.wav', contents, {},
+                    False)['rev']
+            if how == 'rev':
+                final = get(env, '/recording.wav', 'rev-' + rev, rev)
+            else:
+                final = get(env, '/recording.wav', 'rev-' + rev)
+            sent = server.db.download_bytes
+            print "by %s, dropping %d%% of requests: %d dropped, " \
+                "%.1f MB sent again" % (how, drop_rate * 100,
+                server.db.dropped, (sent - size) / 1048576.0)
+            checks.append(("arrived intact by " + how, final[0] == 'OK' and
+                contents_of('rev-' + rev) == contents))
+            os.remove('rev-' + rev)
+
+        # About 4 seconds to send it all.
+        server = start_server(stream_rate=size / 4)
+        env['DBFORHAIKU_SERVER'] = server.url
+        with server.db.lock:
+            rev = server.db.put_file('/recording.wav', contents, {},
+                False)['rev']
+        worker = Worker(env)
+        worker.send('get', '/recording.wav', 'rev-' + rev, rev)
+        while not os.path.exists('rev-' + rev) or \
+                os.path.getsize('rev-' + rev) < size / 2:
+            time.sleep(0.05)
+        worker.kill()
+        kept = os.path.getsize('rev-' + rev)
+        final = get(env, '/recording.wav', 'rev-' + rev, rev)
+        sent = server.db.download_bytes
+        print "killed with %.1f MB kept, %.1f MB sent again" % \
+            (kept / 1048576.0, (sent - size) / 1048576.0)
+        checks.append(("arrived intact after being killed",
+            final[0] == 'OK' and contents_of('rev-' + rev) == contents))
+        checks.append(("resumed rather than started over",
+            sent - size < size / 4))
+
+        print "Checking Assertions:"
+        for name, result in checks:
+            print name + ":", result
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    megabytes = 32
+    drop_rate = 0.3
+    if len(sys.argv) > 1:
+        megabytes = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        drop_rate = float(sys.argv[2])
+    main(megabytes, drop_rate)
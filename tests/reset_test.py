@@ -0,0 +1,191 @@
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+from bench_suite import Daemon, SOURCE, counters, local_check, wait_for
+from fake_dropbox_server import start_server
+
+# What a RESET costs hdbsync (the engine as a Linux program, see
+# bench_suite.py) on a tree that's already in sync, done the way
+# hdbclient.exe used to (delete ~/Dropbox and download everything again)
+# and the way it does now: go through the full listing that follows the
+# RESET, download only the files whose rev isn't the one it has, and
+# remove only what isn't listed.  The RESET comes from the stand-in server
+# forgetting the cursors it gave out, as Dropbox does now and then.
+#
+# Then a few files are edited, added and deleted on Dropbox while hdbsync
+# isn't running, the cursors are forgotten again, and the tree hdbsync
+# reconciles when it starts has to match Dropbox exactly.
+#
+# usage: python reset_test.py [file count] [file size]
+
+def fill(server, count, size):
+    with server.db.lock:
+        for i in range(count):
+            data = ('%08d' % i) * (size / 8)
+            server.db.put_file('/Music/Album %03d/track %06d.ogg' %
+                (i / 100, i), data, {}, False)
+
+def dropbox_files(server, local):
+    """The size of each file on the server, by path under local."""
+    with server.db.lock:
+        return dict((local + entry['path_display'], len(entry['data']))
+            for entry in server.db.entries.values()
+            if entry['.tag'] == 'file')
+
+def local_nodes(local):
+    """The inode and mtime of each file in the folder, by path, which
+    change when it's fetched."""
+    nodes = {}
+    for directory, dirs, files in os.walk(local):
+        for name in files:
+            st = os.lstat(os.path.join(directory, name))
+            nodes[os.path.join(directory, name)] = (st.st_ino, st.st_mtime)
+    return nodes
+
+def log_count(daemon, text):
+    with open(daemon.log_path) as f:
+        return sum(1 for line in f if text in line)
+
+def expire(daemon, server):
+    """Have the server forget its cursors, returns how many RESETs and
+    deltas hdbsync had logged until then."""
+    with server.db.lock:
+        server.db.expire_cursors()
+    return (log_count(daemon, 'Dropbox sent a RESET'),
+        log_count(daemon, 'RAN DELTA'))
+
+def wait_reset(daemon, (resets, ran), timeout):
+    """Wait for hdbsync to have been sent a RESET since expire() and
+    finished the delta it came in.  Returns whether it did."""
+    deadline = time.time() + timeout
+    while time.time() < deadline and daemon.alive():
+        daemon.sample()
+        if log_count(daemon, 'Dropbox sent a RESET') > resets and \
+                log_count(daemon, 'RAN DELTA') > ran:
+            return True
+        time.sleep(0.05)
+    return False
+
+def wait_synced(daemon, server, timeout):
+    """Wait for every file on the server to be in the folder in full."""
+    sizes = dict((path[len(daemon.root) + 1:], size) for path, size in
+        dropbox_files(server, daemon.root).items())
+    done = wait_for(daemon, set(sizes), local_check(daemon, sizes), timeout)
+    return len(done) == len(sizes)
+
+class Measure(object):
+    """Time, server bytes, and the files fetched and removed, from when
+    it's made until done() is called."""
+    def __init__(self, daemon, server):
+        self.daemon = daemon
+        self.server = server
+        self.nodes = local_nodes(daemon.root)
+        self.counters = counters(server.db)
+        self.start = time.time()
+
+    def done(self):
+        took = time.time() - self.start
+        now = counters(self.server.db)
+        nodes = local_nodes(self.daemon.root)
+        fetched = sum(1 for path, node in nodes.items()
+            if self.nodes.get(path) != node)
+        removed = sum(1 for path in self.nodes if path not in nodes)
+        return (took, now['sent_bytes'] - self.counters['sent_bytes'],
+            now['download_bytes'] - self.counters['download_bytes'],
+            fetched, removed)
+
+def same_as_dropbox(server, local):
+    wanted = {}
+    with server.db.lock:
+        for entry in server.db.entries.values():
+            wanted[local + entry['path_display']] = entry.get('data')
+    found = {}
+    for directory, dirs, files in os.walk(local):
+        for name in dirs:
+            found[os.path.join(directory, name)] = None
+        for name in files:
+            path = os.path.join(directory, name)
+            with open(path, 'rb') as f:
+                found[path] = f.read()
+    return found == wanted
+
+def main(count, size):
+    subprocess.check_call(['make', '-s', '-C', SOURCE, 'core-daemon'])
+    server = start_server()
+    fill(server, count, size)
+    scratch = tempfile.mkdtemp()
+    daemon = Daemon(scratch, server, 4, 500)
+    timeout = 60 + count / 20.0
+    try:
+        local = daemon.root
+        daemon.start()
+        synced = wait_synced(daemon, server, timeout)
+
+        measure = Measure(daemon, server)
+        reset = wait_reset(daemon, expire(daemon, server), timeout)
+        new = measure.done()
+        unchanged_ok = synced and reset and new[3] == 0 and new[4] == 0 \
+            and same_as_dropbox(server, local)
+
+        # The old way: start over with nothing.
+        daemon.stop()
+        shutil.rmtree(local)
+        os.mkdir(local)
+        os.remove(os.path.join(daemon.work, 'sync_state'))
+        measure = Measure(daemon, server)
+        daemon.start()
+        redownloaded = wait_synced(daemon, server, timeout)
+        old = measure.done()
+
+        print "RESET of an unchanged tree of %d files of %d bytes:" % \
+            (count, size)
+        for name, (took, sent, downloaded, fetched, removed) in \
+                (('delete and download it all', old), ('reconcile', new)):
+            print "  %-27s %7.2f s  %9d bytes sent, %9d of them files" \
+                " (%d fetched, %d removed)" % (name, took, sent, downloaded,
+                fetched, removed)
+
+        daemon.stop()
+        with server.db.lock:
+            for i in range(0, count, count / 10):
+                path = '/Music/Album %03d/track %06d.ogg' % (i / 100, i)
+                rev = server.db.entries[path.lower()]['rev']
+                server.db.put_file(path, 'edited', {'update': rev}, False)
+                server.db.remove('/Music/Album %03d/track %06d.ogg' %
+                    (i / 100, i + 1))
+                server.db.put_file('/Music/Extras/bonus %06d.ogg' % i, 'new',
+                    {}, False)
+        measure = Measure(daemon, server)
+        logged = expire(daemon, server)
+        daemon.start()
+        reset_again = wait_reset(daemon, logged, timeout)
+        changed = measure.done()
+        print "  after 10 edits, 10 deletions and 10 additions, reconcile" \
+            " %.2f s, %d fetched, %d removed" % (changed[0], changed[3],
+            changed[4])
+
+        print "Checking Assertions:"
+        print "unchanged tree fetches and removes nothing:", unchanged_ok
+        print "reconciling sends less than redownloading:", \
+            redownloaded and new[1] < old[1]
+        print "only the changes are fetched and removed:", \
+            reset_again and changed[3] == 20 and changed[4] == 10
+        print "the tree matches Dropbox afterwards:", \
+            same_as_dropbox(server, local)
+    finally:
+        daemon.stop()
+        server.shutdown()
+        shutil.rmtree(scratch)
+
+if __name__ == '__main__':
+    count = 10000
+    size = 4096
+    if len(sys.argv) > 1:
+        count = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        size = int(sys.argv[2])
+    main(count, size)
@@ -0,0 +1,173 @@
+/*
+* Runs TransferSchedule with lanes that just write down
+* what they're handed, and checks the order transfers
+* start in: an upload and a download of the same file
+* (whatever case their paths are in) take turns, while
+* one of another file goes alongside, and an upload under
+* a pinned folder goes ahead of one queued before it.
+*
+* Doesn't need Haiku, "make core-check" builds and runs it,
+* or from the tests directory:
+*   g++ -O2 -I.. -o schedule_test schedule_test.cpp ../TransferSchedule.cpp
+*     ../TransferPriority.cpp ../Trace.cpp -lpthread
+*   ./schedule_test [scratch directory]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "TransferSchedule.h"
+
+const int MAX_STARTS = 100;
+
+/*
+* Writes down each transfer it's handed as its
+* arguments with spaces between.
+*/
+class RecordingLanes: public ScheduleLanes
+{
+public:
+  RecordingLanes(void) : count(0) {}
+
+  void StartTransfer(int lane, ScheduledTransfer *transfer)
+  {
+    if(this->count == MAX_STARTS)
+      return;
+    char *line = this->started[this->count++];
+    line[0] = '\0';
+    for(int i = 0; i < transfer->argc; i++)
+    {
+      if(i > 0)
+        strncat(line, " ", sizeof(this->started[0]) - strlen(line) - 1);
+      strncat(line, transfer->args[i], sizeof(this->started[0]) - strlen(line) - 1);
+    }
+  }
+
+  void PauseTransfer(int lane)
+  {
+  }
+
+  //where the first transfer starting with prefix was started, -1 if none was
+  int Find(const char *prefix) const
+  {
+    for(int i = 0; i < this->count; i++)
+    {
+      if(strncmp(this->started[i], prefix, strlen(prefix)) == 0)
+        return i;
+    }
+    return -1;
+  }
+
+  void Print(void) const
+  {
+    for(int i = 0; i < this->count; i++)
+      printf("  %s\n", this->started[i]);
+  }
+
+  char started[MAX_STARTS][512];
+  int count;
+};
+
+//lets every lane's transfer finish
+static void
+finish_all(TransferSchedule *schedule)
+{
+  for(int i = 0; i < schedule->CountLanes(); i++)
+  {
+    if(schedule->Running(i) != NULL)
+      free_transfer(schedule->Finish(i));
+  }
+}
+
+/*
+* An upload queued ahead of a download of the same file
+* (in another case, as Dropbox paths aren't told apart by
+* it) runs first and alone, and the download after it.
+*/
+static bool
+same_path_in_turn(void)
+{
+  RecordingLanes lanes;
+  TransferSchedule schedule(4, &lanes);
+  const char *put[3] = {"put", "/tmp/song.ogg", "/Music/Song.ogg"};
+  const char *get[4] = {"get", "/music/song.ogg", "/tmp/rev-2", "rev-2"};
+  const char *other[3] = {"put", "/tmp/other.ogg", "/Music/Other.ogg"};
+  schedule.Add(put, 3, 1000, 0, 0, NULL);
+  schedule.Add(get, 4, 1000, 0, 1, NULL);
+  schedule.Add(other, 3, 1000, 0, 2, NULL);
+  schedule.Dispatch(3);
+  bool waited = lanes.count == 2 && lanes.Find("put /tmp/song.ogg ") >= 0
+    && lanes.Find("put /tmp/other.ogg ") >= 0 && schedule.CountWaiting() == 1;
+  finish_all(&schedule);
+  schedule.Dispatch(4);
+  bool then = lanes.count == 3 && lanes.Find("get /music/song.ogg ") == 2;
+  finish_all(&schedule);
+
+  bool ok = waited && then;
+  printf("an upload and a download of one file go in turn: %s\n", ok ? "yes" : "NO");
+  if(!ok)
+    lanes.Print();
+  return ok;
+}
+
+/*
+* With the one lane busy, an upload of an unpinned file
+* then one under a folder in priority.conf: the pinned
+* one starts first once the lane is free.
+*/
+static bool
+pinned_upload_first(const char *pinned)
+{
+  FILE *file = fopen(pinned, "w");
+  if(file == NULL)
+    return false;
+  fprintf(file, "Music/Live\n");
+  fclose(file);
+
+  RecordingLanes lanes;
+  TransferSchedule schedule(1, &lanes);
+  const char *delta[2] = {"delta_page", ""};
+  const char *plain[3] = {"put", "/tmp/notes.txt", "/Notes/notes.txt"};
+  const char *live[3] = {"put", "/tmp/set.ogg", "/Music/Live/Set.ogg"};
+  schedule.Add(delta, 2, -1, 0, 0, NULL);
+  schedule.Dispatch(1);
+  schedule.Add(plain, 3, 1000, 0, 2, NULL);
+  schedule.Add(live, 3, 1000, 0, 3, NULL);
+  finish_all(&schedule);
+  schedule.Dispatch(4);
+  finish_all(&schedule);
+  schedule.Dispatch(5);
+
+  bool ok = lanes.count == 3 && lanes.Find("put /tmp/set.ogg ") == 1
+    && lanes.Find("put /tmp/notes.txt ") == 2;
+  printf("a pinned upload goes ahead of an unpinned one: %s\n", ok ? "yes" : "NO");
+  if(!ok)
+    lanes.Print();
+  remove(pinned);
+  return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *scratch = "schedule_test.tmp";
+  if(argc > 1)
+    scratch = argv[1];
+  mkdir(scratch, 0755);
+  //ranked by nothing but the test's own pins
+  char pinned[1024];
+  snprintf(pinned, sizeof(pinned), "%s/priority.conf", scratch);
+  remove(pinned);
+  setenv("DBFORHAIKU_PINNED", pinned, 1);
+  unsetenv("DBFORHAIKU_PRIORITY");
+
+  bool ok = same_path_in_turn();
+  ok = pinned_upload_first(pinned) && ok;
+
+  remove(pinned);
+  rmdir(scratch);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+import hashlib
+import math
+import os
+import random
+import sys
+
+# Makes up a folder tree to sync: how many files, how deep the folders go,
+# how many folders each one has, and how big the files are.  The same seed
+# always gives the same tree, names, sizes and contents alike, so runs of
+# the benchmarks can be compared.
+#
+# Sizes are given as one of
+#   fixed:<bytes>
+#   uniform:<smallest>:<biggest>
+#   lognormal:<median>:<sigma>  (most small, a long tail of big ones)
+#   audio                       (what a radio station's folder looks like:
+#                                mostly cue sheets and notes of a few KB,
+#                                some jingles of a few hundred KB and tracks
+#                                of 3 to 10 MB)
+#
+# usage: python tree_gen.py <folder> [file count] [depth] [fan out] [sizes]
+#            [seed]
+
+POOL_SIZE = 1024 * 1024
+
+def parse_sizes(spec):
+    """A function giving a file size from a random.Random."""
+    parts = spec.split(':')
+    kind = parts[0]
+    if kind == 'fixed' and len(parts) == 2:
+        size = int(parts[1])
+        return lambda rng: size
+    if kind == 'uniform' and len(parts) == 3:
+        low, high = int(parts[1]), int(parts[2])
+        return lambda rng: rng.randint(low, high)
+    if kind == 'lognormal' and len(parts) == 3:
+        mu, sigma = math.log(float(parts[1])), float(parts[2])
+        return lambda rng: max(0, int(rng.lognormvariate(mu, sigma)))
+    if kind == 'audio' and len(parts) == 1:
+        def audio(rng):
+            roll = rng.random()
+            if roll < 0.6:
+                return rng.randint(200, 8 * 1024)
+            if roll < 0.85:
+                return rng.randint(100 * 1024, 600 * 1024)
+            return rng.randint(3 * 1024 * 1024, 10 * 1024 * 1024)
+        return audio
+    raise ValueError('unknown size distribution ' + spec)
+
+def plan_tree(count, depth=3, fan_out=4, sizes='fixed:4096', seed=1,
+        prefix=''):
+    """A list of (path, size) for count files spread over a tree of folders
+    depth deep, with fan_out folders in each.  Paths are relative, with
+    prefix in front, and use / whatever the OS."""
+    rng = random.Random(seed)
+    size_of = parse_sizes(sizes)
+    folders = [prefix.rstrip('/')]
+    level = list(folders)
+    for d in range(depth):
+        below = []
+        for parent in level:
+            for i in range(fan_out):
+                name = 'folder %d-%02d' % (d, i)
+                below.append(parent + '/' + name if parent else name)
+        folders.extend(below)
+        level = below
+    plan = []
+    for i in range(count):
+        folder = folders[rng.randrange(len(folders))]
+        name = 'file %06d.dat' % i
+        plan.append((folder + '/' + name if folder else name, size_of(rng)))
+    return plan
+
+class Contents(object):
+    """Makes each file's bytes: its path, then bytes from a shared random
+    pool starting at a place the path picks, so no two files are alike but
+    making them costs nothing much."""
+    def __init__(self, seed=1):
+        rng = random.Random(seed)
+        self.pool = ''.join(chr(rng.getrandbits(8)) for i in
+            range(POOL_SIZE))
+
+    def data(self, path, size, version=0):
+        head = '%s %d\n' % (path, version)
+        start = int(hashlib.md5(head).hexdigest()[:8], 16) % POOL_SIZE
+        pieces = [head]
+        left = size - len(head)
+        while left > 0:
+            piece = self.pool[start:start + left]
+            pieces.append(piece)
+            left -= len(piece)
+            start = 0
+        return ''.join(pieces)[:size]
+
+def write_tree(root, plan, contents):
+    """Write the planned files under root, making folders as needed."""
+    for path, size in plan:
+        local = os.path.join(root, *path.split('/'))
+        parent = os.path.dirname(local)
+        if not os.path.isdir(parent):
+            os.makedirs(parent)
+        with open(local, 'wb') as f:
+            f.write(contents.data(path, size))
+
+def fill_server(db, plan, contents):
+    """Put the planned files on a FakeDropbox, all in one go."""
+    with db.lock:
+        for path, size in plan:
+            db.put_file('/' + path, contents.data(path, size), {}, False)
+
+def total_size(plan):
+    return sum(size for path, size in plan)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print 'usage: python tree_gen.py <folder> [file count] [depth] ' \
+            '[fan out] [sizes] [seed]'
+        sys.exit(1)
+    count = 1000
+    depth = 3
+    fan_out = 4
+    sizes = 'fixed:4096'
+    seed = 1
+    if len(sys.argv) > 2:
+        count = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        depth = int(sys.argv[3])
+    if len(sys.argv) > 4:
+        fan_out = int(sys.argv[4])
+    if len(sys.argv) > 5:
+        sizes = sys.argv[5]
+    if len(sys.argv) > 6:
+        seed = int(sys.argv[6])
+    plan = plan_tree(count, depth, fan_out, sizes, seed)
+    write_tree(sys.argv[1], plan, Contents(seed))
+    print '%d files, %.1f MB, in %s' % (len(plan), total_size(plan) / 1e6,
+        sys.argv[1])
@@ -0,0 +1,141 @@
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+from fake_dropbox_server import start_server
+
+# Uploads a big file with db_worker.py through a stand-in server that cuts
+# connections at random, and checks it arrives intact.  Then uploads one
+# over a slow link, kills the worker half way through as if the client had
+# been killed, and checks that a new worker carries on from where the first
+# got to rather than starting over.  Prints how many bytes were sent for
+# each, against the size of the file.
+#
+# usage: python upload_session_test.py [size in MB] [chunk size in KB]
+#                                      [drop rate]
+
+WORKER = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'db_worker.py')
+NATIVE = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..',
+    'object-core', 'hdbworker')
+
+class Worker(object):
+    def __init__(self, env, command=None):
+        self.process = subprocess.Popen(command or ['python', WORKER], env=env,
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def send(self, *fields):
+        payload = '\0'.join(fields)
+        self.process.stdin.write(struct.pack('>I', len(payload)) + payload)
+        self.process.stdin.flush()
+
+    def reply(self):
+        (length,) = struct.unpack('>I', self.process.stdout.read(4))
+        return self.process.stdout.read(length).split('\0')
+
+    def stop(self):
+        self.process.stdin.close()
+        self.process.wait()
+
+    def kill(self):
+        self.process.kill()
+        self.process.wait()
+
+def put(env, local_path, db_path, command=None):
+    worker = Worker(env, command)
+    worker.send('put', local_path, db_path)
+    final = worker.reply()
+    worker.stop()
+    return final
+
+def session_offset(db):
+    """How far the furthest unfinished upload session has got."""
+    with db.lock:
+        sizes = [len(data) for data in db.sessions.values() if data]
+    return max(sizes + [0])
+
+def main(megabytes, chunk_kb, drop_rate):
+    size = megabytes * 1024 * 1024
+    directory = tempfile.mkdtemp()
+    try:
+        with open(os.path.join(directory, 'login_token_store.txt'), 'w') as f:
+            f.write('stand-in-token')
+        os.chdir(directory)
+        contents = os.urandom(size)
+        with open('recording.wav', 'wb') as f:
+            f.write(contents)
+        env = dict(os.environ)
+        env['DBFORHAIKU_CHUNK_KB'] = str(chunk_kb)
+
+        server = start_server(drop_rate=drop_rate)
+        env['DBFORHAIKU_SERVER'] = server.url
+        start = time.time()
+        final = put(env, 'recording.wav', '/recording.wav')
+        entry = server.db.entries.get('/recording.wav', {})
+        sent = server.db.upload_bytes
+        print "dropping %d%% of requests: %d dropped, %.1f MB sent for " \
+            "%d MB in %.1f s" % (drop_rate * 100, server.db.dropped,
+            sent / 1048576.0, megabytes, time.time() - start)
+        dropped_ok = final[0] == 'OK' and entry.get('data') == contents
+
+        # About 4 seconds to send it all.
+        server = start_server(stream_rate=size / 4)
+        env['DBFORHAIKU_SERVER'] = server.url
+        worker = Worker(env)
+        worker.send('put', 'recording.wav', '/recording.wav')
+        while session_offset(server.db) < size / 2:
+            time.sleep(0.05)
+        worker.kill()
+        first = server.db.upload_bytes
+        final = put(env, 'recording.wav', '/recording.wav')
+        entry = server.db.entries.get('/recording.wav', {})
+        sent = server.db.upload_bytes
+        print "killed after %.1f MB, resumed and sent %.1f MB more, " \
+            "%.1f MB for %d MB" % (first / 1048576.0,
+            (sent - first) / 1048576.0, sent / 1048576.0, megabytes)
+        resumed_ok = final[0] == 'OK' and entry.get('data') == contents
+
+        # Started by one transport, carried on by the other (if hdbworker
+        # has been built, with "make core-daemon").
+        switched = []
+        if os.path.exists(NATIVE):
+            for first_command, then in ((None, [NATIVE]), ([NATIVE], None)):
+                server = start_server(stream_rate=size / 4)
+                env['DBFORHAIKU_SERVER'] = server.url
+                worker = Worker(env, first_command)
+                worker.send('put', 'recording.wav', '/switched.wav')
+                while session_offset(server.db) < size / 2:
+                    time.sleep(0.05)
+                worker.kill()
+                final = put(env, 'recording.wav', '/switched.wav', then)
+                entry = server.db.entries.get('/switched.wav', {})
+                switched.append(final[0] == 'OK' and
+                    entry.get('data') == contents and
+                    server.db.upload_bytes <= size + 2 * chunk_kb * 1024)
+
+        print "Checking Assertions:"
+        print "arrived intact through dropped connections:", dropped_ok
+        print "arrived intact after being killed:", resumed_ok
+        print "resumed rather than started over:", \
+            sent <= size + 2 * chunk_kb * 1024
+        if switched:
+            print "resumed after switching transports:", all(switched)
+        print "no sessions left saved:", os.listdir('upload_sessions') == []
+    finally:
+        shutil.rmtree(directory)
+
+if __name__ == '__main__':
+    megabytes = 32
+    chunk_kb = 1024
+    drop_rate = 0.2
+    if len(sys.argv) > 1:
+        megabytes = int(sys.argv[1])
+    if len(sys.argv) > 2:
+        chunk_kb = int(sys.argv[2])
+    if len(sys.argv) > 3:
+        drop_rate = float(sys.argv[3])
+    main(megabytes, chunk_kb, drop_rate)